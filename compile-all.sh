@@ -4,13 +4,16 @@
 
 # Compile all C files in the current directory with optimizations
 # Usage: ./compile-all.sh -o output_file
+# Build options are passed through CFLAGS, e.g. CFLAGS=-DNAN_BOXING ./compile-all.sh
+# (-DNO_JIT builds without the x86-64 JITs, see vm/jit.h and vm/trace.h)
+# (-DVM_PROFILE prints a per handler/pair/block profile of vm_run at HALT when MPL_PROFILE=1, see vm/profile.h)
 # Output: Compilation complete in <time> seconds. Output file: output_file
 
 set -e
 
 time_start=$(date +%s)
 output_file="main.out"
-OPT_FLAGS="-O3 -ffast-math -Wall -Wextra"
+OPT_FLAGS="-O3 -ffast-math -Wall -Wextra $CFLAGS"
 
 while getopts ":o:" opt; do
     case $opt in
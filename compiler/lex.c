@@ -0,0 +1,216 @@
+#include "lex.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+int source_open(const char *path, source_t *source) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (uint64_t)st.st_size > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    *source = (source_t){.data = "", .size = 0, .mapped = false};
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+        madvise(data, size, MADV_SEQUENTIAL);
+        close(fd);
+        *source = (source_t){.data = data, .size = size, .mapped = true};
+        return 0;
+    }
+
+    // not mappable (a pipe, a special file system), one read into one buffer
+    char *buffer = malloc(size);
+    size_t got = 0;
+    while (buffer && got < size) {
+        ssize_t n = read(fd, buffer + got, size - got);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fd);
+    if (!buffer || got != size) {
+        free(buffer);
+        return -1;
+    }
+    *source = (source_t){.data = buffer, .size = size, .mapped = false};
+    return 0;
+}
+
+void source_close(source_t *source) {
+    if (source->mapped) munmap((void*)source->data, source->size);
+    else if (source->size) free((void*)source->data);
+    *source = (source_t){.data = "", .size = 0, .mapped = false};
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+enum {
+    C_OTHER,
+    C_SPACE,        // blanks other than '\n'
+    C_NEWLINE,
+    C_IDENT,        // letters and _
+    C_DIGIT,
+    C_QUOTE,
+    C_OP,
+    C_SLASH,        // an operator, or a comment
+};
+
+#define CLASS_RANGE(lo, hi, c) [lo ... hi] = c
+
+static const uint8_t char_class[256] = {
+    [' '] = C_SPACE, ['\t'] = C_SPACE, ['\r'] = C_SPACE, ['\v'] = C_SPACE, ['\f'] = C_SPACE,
+    ['\n'] = C_NEWLINE,
+    CLASS_RANGE('a', 'z', C_IDENT), CLASS_RANGE('A', 'Z', C_IDENT), ['_'] = C_IDENT,
+    CLASS_RANGE('0', '9', C_DIGIT),
+    ['"'] = C_QUOTE,
+    ['+'] = C_OP, ['-'] = C_OP, ['*'] = C_OP, ['%'] = C_OP, ['<'] = C_OP, ['>'] = C_OP,
+    ['='] = C_OP, ['!'] = C_OP, ['('] = C_OP, [')'] = C_OP, ['{'] = C_OP, ['}'] = C_OP,
+    ['['] = C_OP, [']'] = C_OP, [','] = C_OP, [';'] = C_OP, [':'] = C_OP, ['.'] = C_OP,
+    ['&'] = C_OP, ['|'] = C_OP,
+    ['/'] = C_SLASH,
+};
+
+#define CLASS(c) char_class[(uint8_t)(c)]
+#define IS_IDENT_CHAR(c) (CLASS(c) == C_IDENT || CLASS(c) == C_DIGIT)
+
+void lexer_init(lexer_t *lexer, const char *src, size_t size) {
+    *lexer = (lexer_t){.src = src, .size = size, .pos = 0, .line = 1, .at_line_start = true};
+}
+
+static inline token_t make_token(lexer_t *lexer, uint8_t kind, size_t start) {
+    return (token_t){.offset = (uint32_t)start, .length = (uint32_t)(lexer->pos - start),
+                     .line = lexer->line, .kind = kind};
+}
+
+// skips blanks and comments, stops at a newline
+static inline void skip_blanks(lexer_t *lexer) {
+    const char *src = lexer->src;
+    size_t pos = lexer->pos, size = lexer->size;
+    for (;;) {
+        while (pos < size && CLASS(src[pos]) == C_SPACE) pos++;
+        if (pos + 1 < size && src[pos] == '/' && src[pos + 1] == '/') {
+            const char *end = memchr(src + pos, '\n', size - pos);
+            pos = end ? (size_t)(end - src) : size;
+            continue;
+        }
+        break;
+    }
+    lexer->pos = pos;
+}
+
+static token_t lex_number(lexer_t *lexer, size_t start) {
+    const char *src = lexer->src;
+    size_t pos = lexer->pos, size = lexer->size;
+    while (pos < size && CLASS(src[pos]) == C_DIGIT) pos++;
+    if (pos + 1 < size && src[pos] == '.' && CLASS(src[pos + 1]) == C_DIGIT) {
+        pos++;
+        while (pos < size && CLASS(src[pos]) == C_DIGIT) pos++;
+    }
+    if (pos < size && (src[pos] == 'e' || src[pos] == 'E')) {
+        size_t exp = pos + 1;
+        if (exp < size && (src[exp] == '+' || src[exp] == '-')) exp++;
+        if (exp < size && CLASS(src[exp]) == C_DIGIT) {
+            pos = exp;
+            while (pos < size && CLASS(src[pos]) == C_DIGIT) pos++;
+        }
+    }
+    lexer->pos = pos;
+    return make_token(lexer, TOK_NUMBER, start);
+}
+
+static token_t lex_string(lexer_t *lexer, size_t start) {
+    const char *src = lexer->src;
+    size_t pos = lexer->pos;
+    uint32_t line = lexer->line;
+    for (;;) {
+        const char *quote = memchr(src + pos, '"', lexer->size - pos);
+        if (!quote) {
+            lexer->pos = lexer->size;
+            return make_token(lexer, TOK_ERROR, start);
+        }
+        size_t end = (size_t)(quote - src);
+
+        // escaped if preceded by an odd number of backslashes
+        size_t backslashes = 0;
+        while (end - backslashes > pos && src[end - backslashes - 1] == '\\') backslashes++;
+        for (size_t i = pos; i < end; i++) line += src[i] == '\n';
+        pos = end + 1;
+        if (backslashes % 2 == 0) break;
+    }
+    lexer->pos = pos;
+    token_t token = make_token(lexer, TOK_STRING, start);
+    lexer->line = line;
+    return token;
+}
+
+static inline bool is_pair(char a, char b) {
+    switch (a) {
+        case '=': case '!': case '<': case '>': return b == '=';
+        case '&': return b == '&';
+        case '|': return b == '|';
+        default: return false;
+    }
+}
+
+token_t lex_next(lexer_t *lexer) {
+    for (;;) {
+        skip_blanks(lexer);
+        if (lexer->pos >= lexer->size) {
+            // the last statement is ended even without a final newline
+            if (!lexer->at_line_start) {
+                lexer->at_line_start = true;
+                return make_token(lexer, TOK_NEWLINE, lexer->pos);
+            }
+            return make_token(lexer, TOK_EOF, lexer->pos);
+        }
+
+        const char *src = lexer->src;
+        size_t start = lexer->pos;
+        char c = src[start];
+        lexer->pos++;
+
+        switch (CLASS(c)) {
+            case C_NEWLINE: {
+                token_t token = make_token(lexer, TOK_NEWLINE, start);
+                lexer->line++;
+                if (lexer->at_line_start) continue;
+                lexer->at_line_start = true;
+                return token;
+            }
+            case C_IDENT: {
+                size_t pos = lexer->pos, size = lexer->size;
+                while (pos < size && IS_IDENT_CHAR(src[pos])) pos++;
+                lexer->pos = pos;
+                lexer->at_line_start = false;
+                return make_token(lexer, TOK_IDENT, start);
+            }
+            case C_DIGIT:
+                lexer->at_line_start = false;
+                return lex_number(lexer, start);
+            case C_QUOTE:
+                lexer->at_line_start = false;
+                return lex_string(lexer, start);
+            case C_OP:
+            case C_SLASH:
+                if (lexer->pos < lexer->size && is_pair(c, src[lexer->pos])) lexer->pos++;
+                lexer->at_line_start = false;
+                return make_token(lexer, TOK_OP, start);
+            default:
+                lexer->at_line_start = false;
+                return make_token(lexer, TOK_ERROR, start);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef LEX_H
+#define LEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+    Source files and tokens
+
+    source_open maps the whole file (or reads it into one buffer when it cannot be mapped),
+    and the lexer hands out tokens as slices of it: nothing is copied, a token is its kind,
+    offset and length, and its text is source->data + offset. The scan is driven by one
+    character class table, comments and strings are skipped with memchr.
+
+        TOK_IDENT       [A-Za-z_][A-Za-z0-9_]*, keywords included (see token_is)
+        TOK_NUMBER      digits, with an optional .digits and exponent
+        TOK_STRING      "...", the quotes included, \ escapes the next character
+        TOK_OP          == != <= >= && || or one of + - * / % < > = ! ( ) { } [ ] , ; : .
+        TOK_NEWLINE     ends a statement, runs of blank lines and comments give one
+        TOK_EOF         length 0 at the end of the source
+        TOK_ERROR       a character that starts no token, or an unterminated string
+
+    Comments run from // to the end of the line.
+*/
+
+typedef struct /* source_t */ {
+    const char *data;
+    size_t size;
+    bool mapped;    // data is a mapping of the file, not a malloc'd copy
+} source_t;
+
+// 0 on success, -1 if the file cannot be opened or read
+int source_open(const char *path, source_t *source);
+void source_close(source_t *source);
+
+typedef enum {
+    TOK_EOF,
+    TOK_NEWLINE,
+    TOK_IDENT,
+    TOK_NUMBER,
+    TOK_STRING,
+    TOK_OP,
+    TOK_ERROR,
+} TokenKind;
+
+typedef struct /* token_t */ {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t line;      // 1 based
+    uint8_t kind;
+} token_t;
+
+typedef struct /* lexer_t */ {
+    const char *src;
+    size_t size;
+    size_t pos;
+    uint32_t line;
+    bool at_line_start;     // no token since the last TOK_NEWLINE (or the start)
+} lexer_t;
+
+void lexer_init(lexer_t *lexer, const char *src, size_t size);
+
+// the next token, TOK_EOF again and again once the source is exhausted
+token_t lex_next(lexer_t *lexer);
+
+// whether the token's text is exactly text (a keyword or an operator)
+static inline bool token_is(const lexer_t *lexer, token_t token, const char *text) {
+    const char *s = lexer->src + token.offset;
+    for (uint32_t i = 0; i < token.length; i++) {
+        if (s[i] != text[i]) return false;
+    }
+    return text[token.length] == '\0';
+}
+
+
+
+#endif // LEX_H
@@ -0,0 +1,1092 @@
+#include "opt.h"
+#include <string.h>
+
+
+// above this many words of liveness sets the block keeps its stores (copy propagation still runs)
+#define MAX_LIVENESS_WORDS (1 << 20)
+// above this many bytes of per basic block local types the block keeps its generic ops
+#define MAX_TYPE_STATES (1 << 24)
+#define MAX_CARRIED 8     // operand stack slots typed across a jump
+
+typedef struct /* insn_t */ {
+    size_t at;          // offset in the original code
+    bool leader;        // starts a basic block
+    bool removed;
+    bool to_pop;        // a dead STORE_LOCAL, becomes POP
+    bool dead_after;    // the local it reads is not live after it
+    size_t next;        // the next kept instruction of its basic block, SIZE_MAX if none
+} insn_t;
+
+static inline int32_t get_i32(const uint8_t *code) {
+    return BYTES4_TO_INT(code[0], code[1], code[2], code[3]);
+}
+
+static inline void put_i32(uint8_t *code, int32_t v) {
+    uint8_t bytes[] = {INT_TO_BYTES4(v)};
+    memcpy(code, bytes, 4);
+}
+
+// offset of the local an instruction reads (the callee of CALL_FUNC CF_LOCAL included), 0 if none
+static inline size_t read_operand(const uint8_t *code, size_t at) {
+    switch (code[at]) {
+        case PUSH_LOCAL: case INC_LOCAL: case DEC_LOCAL: return at + 1;
+        case CALL_FUNC: case TAIL_CALL: return code[at + 1] == CF_LOCAL ? at + 2 : 0;
+        default: return 0;
+    }
+}
+
+static inline bool is_call(uint8_t op) {
+    return op == CALL_FUNC || op == TAIL_CALL;
+}
+
+static inline bool ends_block(uint8_t op) {
+    return op == JUMP || op == JUMP_FALSE || op == RETURN || op == HALT;
+}
+
+#define BIT_TEST(set, i) (((set)[(i) >> 6] >> ((i) & 63)) & 1)
+#define BIT_SET(set, i) ((set)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define BIT_CLEAR(set, i) ((set)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
+// n items of size bytes from the scratch arena, NULL if it runs out
+static void* scratch_array(arena_chain_t *scratch, size_t n, size_t size) {
+    if (size && n > SIZE_MAX / size) return NULL;
+    size_t bytes = n * size;
+    return ac_get_memory(scratch, bytes ? bytes : 1);
+}
+
+static void* scratch_zeroed(arena_chain_t *scratch, size_t n, size_t size) {
+    void *memory = scratch_array(scratch, n, size);
+    if (memory) memset(memory, 0, n * size);
+    return memory;
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+typedef struct /* flow_t */ {
+    size_t n;               // instructions
+    insn_t *insns;
+    int32_t *index_at;      // per offset: the instruction starting there, -1 inside one, n at the end
+    size_t block_count;
+    size_t *first;          // per basic block: its first instruction, first[block_count] = n
+    int32_t (*succ)[2];     // per basic block: successors, -1 if none
+} flow_t;
+
+// instructions and basic blocks of code, false if it is not code the compiler emits
+// (a local out of range, a jump into an instruction, a superinstruction) or memory runs out
+static bool flow_build(arena_chain_t *scratch, const uint8_t *code, size_t size, size_t local_count, flow_t *f) {
+    *f = (flow_t){0};
+    for (size_t ip = 0; ip < size; f->n++) {
+        size_t len = bytecode_checked_length(code, ip, size);
+        if (!len) return false;
+        ip += len;
+    }
+    if (!f->n) return false;
+
+    size_t n = f->n;
+    f->insns = scratch_zeroed(scratch, n, sizeof(insn_t));
+    f->index_at = scratch_array(scratch, size + 1, sizeof(int32_t));
+    if (!f->insns || !f->index_at) return false;
+
+    for (size_t ip = 0; ip <= size; ip++) f->index_at[ip] = -1;
+    for (size_t ip = 0, i = 0; ip < size; ip += bytecode_length(code, ip), i++) {
+        f->insns[i].at = ip;
+        f->index_at[ip] = (int32_t)i;
+    }
+    f->index_at[size] = (int32_t)n;
+
+    f->insns[0].leader = true;
+    for (size_t i = 0; i < n; i++) {
+        size_t at = f->insns[i].at;
+        uint8_t op = code[at];
+        size_t operand = op == STORE_LOCAL ? at + 1 : read_operand(code, at);
+        if (operand && (get_i32(&code[operand]) < 0 || (size_t)get_i32(&code[operand]) >= local_count)) return false;
+
+        size_t jump = bytecode_jump_operand(code, at);
+        if (jump) {
+            int32_t target = get_i32(&code[jump]);
+            if (op != JUMP && op != JUMP_FALSE) return false;
+            if (target < 0 || (size_t)target > size || f->index_at[target] < 0) return false;
+            if ((size_t)target < size) f->insns[f->index_at[target]].leader = true;
+        }
+        if (ends_block(op) && i + 1 < n) f->insns[i + 1].leader = true;
+    }
+
+    for (size_t i = 0; i < n; i++) f->block_count += f->insns[i].leader;
+    f->first = scratch_array(scratch, f->block_count + 1, sizeof(size_t));
+    f->succ = scratch_array(scratch, f->block_count, sizeof(*f->succ));
+    if (!f->first || !f->succ) return false;
+
+    for (size_t i = 0, b = 0; i < n; i++) {
+        if (f->insns[i].leader) f->first[b++] = i;
+    }
+    f->first[f->block_count] = n;
+
+    // a jump to the end leaves the block like HALT
+    for (size_t b = 0; b < f->block_count; b++) {
+        size_t last = f->insns[f->first[b + 1] - 1].at;
+        uint8_t op = code[last];
+        f->succ[b][0] = f->succ[b][1] = -1;
+        if (op == JUMP || op == JUMP_FALSE) {
+            size_t target = (size_t)f->index_at[get_i32(&code[last + 1])];
+            if (target < n) {
+                size_t lo = 0, hi = f->block_count;
+                while (hi - lo > 1) {
+                    size_t mid = (lo + hi) / 2;
+                    if (f->first[mid] <= target) lo = mid;
+                    else hi = mid;
+                }
+                f->succ[b][0] = (int32_t)lo;
+            }
+        }
+        if (op != JUMP && op != RETURN && op != HALT && b + 1 < f->block_count) f->succ[b][1] = (int32_t)b + 1;
+    }
+    return true;
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+typedef struct /* copies_t */ {
+    int32_t *source;    // per local: the local it is a copy of
+    uint32_t *gen;      // per local: valid while equal to generation
+    int32_t *active;    // the locals copied in this generation
+    size_t active_count;
+    uint32_t generation;
+} copies_t;
+
+static inline void copies_reset(copies_t *c) {
+    c->generation++;
+    c->active_count = 0;
+}
+
+static inline bool copy_valid(const copies_t *c, int32_t local) {
+    return c->gen[local] == c->generation;
+}
+
+// local was written: it is no copy anymore, and no copy of it either
+static void copies_kill(copies_t *c, int32_t local) {
+    c->gen[local] = 0;
+    for (size_t i = 0; i < c->active_count; i++) {
+        int32_t copy = c->active[i];
+        if (copy_valid(c, copy) && c->source[copy] == local) c->gen[copy] = 0;
+    }
+}
+
+static void propagate_copies(uint8_t *code, const flow_t *f, copies_t *c, bool top_level) {
+    const insn_t *insns = f->insns;
+    for (size_t i = 0; i < f->n; i++) {
+        size_t at = insns[i].at;
+        uint8_t op = code[at];
+        if (insns[i].leader) copies_reset(c);
+
+        size_t operand = read_operand(code, at);
+        if (operand && op != INC_LOCAL && op != DEC_LOCAL) {
+            int32_t local = get_i32(&code[operand]);
+            if (copy_valid(c, local)) put_i32(&code[operand], c->source[local]);
+        }
+
+        if (op == STORE_LOCAL || op == INC_LOCAL || op == DEC_LOCAL) {
+            int32_t local = get_i32(&code[at + 1]);
+            copies_kill(c, local);
+
+            size_t prev = i ? insns[i - 1].at : 0;
+            if (op == STORE_LOCAL && i && !insns[i].leader && code[prev] == PUSH_LOCAL) {
+                int32_t source = get_i32(&code[prev + 1]);
+                if (source != local) {
+                    c->source[local] = source;
+                    c->gen[local] = c->generation;
+                    c->active[c->active_count++] = local;
+                }
+            }
+        }
+
+        // the callee may write any global
+        if (top_level && is_call(op)) copies_reset(c);
+    }
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+typedef struct /* liveness_t */ {
+    size_t words;           // per set
+    uint64_t *use, *def, *live_in, *live_out;
+} liveness_t;
+
+static inline uint64_t* set_of(const liveness_t *l, uint64_t *sets, size_t block) {
+    return &sets[block * l->words];
+}
+
+// use and def of every basic block, then live_in/live_out to a fixpoint
+static void compute_liveness(const uint8_t *code, const flow_t *f, liveness_t *l, bool top_level) {
+    for (size_t b = 0; b < f->block_count; b++) {
+        uint64_t *use = set_of(l, l->use, b), *def = set_of(l, l->def, b);
+        for (size_t i = f->first[b]; i < f->first[b + 1]; i++) {
+            size_t at = f->insns[i].at;
+            uint8_t op = code[at];
+            size_t operand = read_operand(code, at);
+            if (operand) {
+                int32_t local = get_i32(&code[operand]);
+                if (!BIT_TEST(def, local)) BIT_SET(use, local);
+            }
+            if (top_level && is_call(op)) {
+                for (size_t w = 0; w < l->words; w++) use[w] |= ~def[w];
+            }
+            if (op == STORE_LOCAL || op == INC_LOCAL || op == DEC_LOCAL) BIT_SET(def, get_i32(&code[at + 1]));
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t b = f->block_count; b-- > 0;) {
+            uint64_t *use = set_of(l, l->use, b), *def = set_of(l, l->def, b);
+            uint64_t *in = set_of(l, l->live_in, b), *out = set_of(l, l->live_out, b);
+            for (size_t w = 0; w < l->words; w++) {
+                uint64_t o = 0;
+                for (int s = 0; s < 2; s++) {
+                    if (f->succ[b][s] >= 0) o |= set_of(l, l->live_in, f->succ[b][s])[w];
+                }
+                uint64_t i = use[w] | (o & ~def[w]);
+                if (i != in[w]) changed = true;
+                out[w] = o;
+                in[w] = i;
+            }
+        }
+    }
+}
+
+// walks every basic block backwards from what is live at its end
+static void remove_dead_stores(const uint8_t *code, const flow_t *f, const liveness_t *l, uint64_t *live, bool top_level) {
+    insn_t *insns = f->insns;
+    for (size_t b = 0; b < f->block_count; b++) {
+        memcpy(live, set_of(l, l->live_out, b), l->words * sizeof(uint64_t));
+        size_t next = SIZE_MAX;     // the kept instruction after i in this basic block
+
+        for (size_t i = f->first[b + 1]; i-- > f->first[b];) {
+            size_t at = insns[i].at;
+            uint8_t op = code[at];
+
+            if (op == STORE_LOCAL) {
+                int32_t local = get_i32(&code[at + 1]);
+                if (!BIT_TEST(live, local)) {
+                    // the value pushed right before goes away with the store
+                    uint8_t prev = i > f->first[b] ? code[insns[i - 1].at] : HALT;
+                    if (prev == PUSH_LOCAL || prev == PUSH_CONST) {
+                        insns[i].removed = insns[i - 1].removed = true;
+                        i--;
+                        continue;
+                    }
+                    insns[i].to_pop = true;
+                } else if (next != SIZE_MAX && code[insns[next].at] == PUSH_LOCAL &&
+                           get_i32(&code[insns[next].at + 1]) == local && insns[next].dead_after) {
+                    // STORE_LOCAL x, PUSH_LOCAL x with x dead after: the value stays where it is
+                    insns[i].removed = insns[next].removed = true;
+                    next = insns[next].next;
+                    BIT_CLEAR(live, local);
+                    continue;
+                }
+                BIT_CLEAR(live, local);
+            } else if ((op == INC_LOCAL || op == DEC_LOCAL) && !BIT_TEST(live, get_i32(&code[at + 1]))) {
+                insns[i].removed = true;
+                continue;
+            } else {
+                size_t operand = read_operand(code, at);
+                if (operand) {
+                    int32_t local = get_i32(&code[operand]);
+                    insns[i].dead_after = !BIT_TEST(live, local);
+                    BIT_SET(live, local);
+                }
+                if (top_level && is_call(op)) {
+                    for (size_t w = 0; w < l->words; w++) live[w] = ~(uint64_t)0;
+                }
+            }
+
+            insns[i].next = next;
+            next = i;
+        }
+    }
+}
+
+size_t optimize_locals(arena_chain_t *scratch, uint8_t *code, size_t size, size_t local_count, bool top_level) {
+    if (!size || !local_count || local_count > INT32_MAX) return size;
+
+    flow_t f;
+    if (!flow_build(scratch, code, size, local_count, &f)) return size;
+
+    size_t n = f.n;
+    copies_t copies = {
+        .source = scratch_array(scratch, local_count, sizeof(int32_t)),
+        .gen = scratch_zeroed(scratch, local_count, sizeof(uint32_t)),
+        .active = scratch_array(scratch, n, sizeof(int32_t)),
+    };
+    liveness_t l = {.words = (local_count + 63) / 64};
+    if (!copies.source || !copies.gen || !copies.active) return size;
+
+    propagate_copies(code, &f, &copies, top_level);
+
+    if (f.block_count * l.words <= MAX_LIVENESS_WORDS) {
+        size_t sets = f.block_count * l.words;
+        l.use = scratch_zeroed(scratch, sets, sizeof(uint64_t));
+        l.def = scratch_zeroed(scratch, sets, sizeof(uint64_t));
+        l.live_in = scratch_zeroed(scratch, sets, sizeof(uint64_t));
+        l.live_out = scratch_zeroed(scratch, sets, sizeof(uint64_t));
+        uint64_t *live = scratch_array(scratch, l.words, sizeof(uint64_t));
+        if (!l.use || !l.def || !l.live_in || !l.live_out || !live) return size;
+
+        compute_liveness(code, &f, &l, top_level);
+        remove_dead_stores(code, &f, &l, live, top_level);
+    }
+
+    // the new layout, a removed instruction's offset is the one of the next kept
+    uint8_t *out = scratch_array(scratch, size, 1);
+    int32_t *new_offset = scratch_array(scratch, n + 1, sizeof(int32_t));
+    if (!out || !new_offset) return size;
+
+    size_t o = 0;
+    for (size_t i = 0; i < n; i++) {
+        new_offset[i] = (int32_t)o;
+        if (f.insns[i].removed) continue;
+        if (f.insns[i].to_pop) {
+            out[o++] = POP;
+            continue;
+        }
+        size_t len = bytecode_length(code, f.insns[i].at);
+        memcpy(&out[o], &code[f.insns[i].at], len);
+        o += len;
+    }
+    new_offset[n] = (int32_t)o;
+
+    for (size_t ip = 0; ip < o; ip += bytecode_length(out, ip)) {
+        size_t jump = bytecode_jump_operand(out, ip);
+        if (jump) put_i32(&out[jump], new_offset[f.index_at[get_i32(&out[jump])]]);
+    }
+    memcpy(code, out, o);
+    return o;
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+// what the inference knows of a value: a Type, or
+#define T_ANY 0xFE          // any type
+#define T_UNREACHED 0xFF    // no value reaches here (yet)
+
+#define TYPED_ROW(OP, name, operator, make, int_make) [OP_##OP] = true,
+
+// binary ops that have a CALL_OP_INT/CALL_OP_NUMBER form
+static const bool has_typed_form[Op_unary] = {
+    NUM_ARITH_OPS(TYPED_ROW)
+    NUM_COMPARE_OPS(TYPED_ROW)
+};
+
+#undef TYPED_ROW
+
+static inline uint8_t join_type(uint8_t a, uint8_t b) {
+    if (a == T_UNREACHED) return b;
+    if (b == T_UNREACHED || a == b) return a;
+    return T_ANY;
+}
+
+// type of operation(op, l, r), see builtin.h
+static uint8_t binary_type(Op op, uint8_t l, uint8_t r) {
+    switch (op) {
+        case OP_EQ: case OP_NE: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+        case OP_AND: case OP_OR:
+            return BOOL;
+        case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR: case OP_BIT_SHL: case OP_BIT_SHR:
+            return INT;
+        default:
+            break;
+    }
+    if (l == T_ANY || r == T_ANY) return T_ANY;
+    if (l == INT && r == INT) return op == OP_DIV ? NUMBER : op == OP_POW ? T_ANY : INT;
+    return NUMBER;
+}
+
+typedef struct /* typing_t */ {
+    const type_t *constants;
+    size_t constant_count;
+    size_t local_count;
+    bool top_level;
+    uint8_t *locals;    // the types of the locals at the current instruction
+    uint8_t *stack;     // the types of the operand stack
+    size_t depth;
+} typing_t;
+
+// applies the instruction at code[at] to the types, false if it is not code the inference knows
+static bool step_types(typing_t *t, const uint8_t *code, size_t at) {
+    uint8_t op = code[at];
+    int32_t argc;
+
+    switch (op) {
+        case PUSH_CONST: {
+            int32_t index = get_i32(&code[at + 1]);
+            if (index < 0 || (size_t)index >= t->constant_count) return false;
+            t->stack[t->depth++] = type_of(t->constants[index]);
+            return true;
+        }
+        case PUSH_LOCAL:
+            t->stack[t->depth++] = t->locals[get_i32(&code[at + 1])];
+            return true;
+        case PUSH:
+            t->stack[t->depth++] = T_ANY;
+            return true;
+        case STORE_LOCAL:
+            if (!t->depth) return false;
+            t->locals[get_i32(&code[at + 1])] = t->stack[--t->depth];
+            return true;
+        case STORE: case POP: case JUMP_FALSE:
+            if (!t->depth) return false;
+            t->depth--;
+            return true;
+        case INC_LOCAL: case DEC_LOCAL: {
+            uint8_t *local = &t->locals[get_i32(&code[at + 1])];
+            if (*local != INT && *local != T_ANY) *local = NUMBER;   // increment keeps an INT
+            return true;
+        }
+        case CALL_OP: case CALL_OP_INT: case CALL_OP_NUMBER: {
+            Op bop = code[at + 1];
+            if (bop > Op_unary) {
+                if (!t->depth) return false;
+                t->stack[t->depth - 1] = bop == OP_NOT ? BOOL : INT;
+                return true;
+            }
+            if (t->depth < 2 || bop == Op_unary) return false;
+            t->depth--;
+            t->stack[t->depth - 1] = binary_type(bop, t->stack[t->depth - 1], t->stack[t->depth]);
+            return true;
+        }
+        case CALL_C_FUNC:
+            argc = get_i32(&code[at + 5]);
+            break;
+        case CALL_FUNC: case TAIL_CALL:
+            argc = get_i32(&code[at + (code[at + 1] == CF_GLOBAL ? 10 : 6)]);
+            // the callee may write any global
+            if (t->top_level) memset(t->locals, T_ANY, t->local_count);
+            break;
+        case JUMP: case RETURN: case HALT:
+            return true;
+        default:
+            return false;
+    }
+
+    // calls replace their arguments by the result
+    if (argc < 0 || (size_t)argc > t->depth) return false;
+    t->depth -= argc;
+    t->stack[t->depth++] = T_ANY;
+    return true;
+}
+
+void specialize_ops(arena_chain_t *scratch, uint8_t *code, size_t size, const type_t *constants, size_t constant_count,
+                    size_t local_count, bool top_level) {
+    if (!size || local_count > INT32_MAX) return;
+
+    flow_t f;
+    if (!flow_build(scratch, code, size, local_count, &f)) return;
+
+    // the types of the locals and of the operand stack where every basic block starts
+    size_t width = local_count + MAX_CARRIED, states = f.block_count * width;
+    if (states / width != f.block_count || states > MAX_TYPE_STATES) return;
+
+    uint8_t *entry = scratch_array(scratch, states, 1);
+    int32_t *entry_depth = scratch_array(scratch, f.block_count, sizeof(int32_t));   // -1 while unreached
+    uint8_t *locals = scratch_array(scratch, local_count, 1);
+    uint8_t *stack = scratch_array(scratch, f.n + MAX_CARRIED, 1);    // an instruction pushes at most one value
+    if (!entry || !entry_depth || !locals || !stack) return;
+
+    // nothing is known of the arguments, nor of the locals a call leaves as they were
+    memset(entry, T_UNREACHED, states);
+    memset(entry, T_ANY, local_count);
+    for (size_t b = 0; b < f.block_count; b++) entry_depth[b] = -1;
+    entry_depth[0] = 0;
+
+    typing_t t = {
+        .constants = constants,
+        .constant_count = constant_count,
+        .local_count = local_count,
+        .top_level = top_level,
+        .locals = locals,
+        .stack = stack,
+    };
+
+    // forward to a fixpoint, a slot only ever goes from T_UNREACHED to a Type to T_ANY
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t b = 0; b < f.block_count; b++) {
+            if (entry_depth[b] < 0) continue;
+            memcpy(locals, &entry[b * width], local_count);
+            memcpy(stack, &entry[b * width + local_count], MAX_CARRIED);
+            t.depth = (size_t)entry_depth[b];
+            for (size_t i = f.first[b]; i < f.first[b + 1]; i++) {
+                if (!step_types(&t, code, f.insns[i].at)) return;
+            }
+
+            // statements leave nothing on the stack across a jump, an inlined call (read.c)
+            // leaves the operands of the expression around it
+            for (int s = 0; s < 2; s++) {
+                int32_t succ = f.succ[b][s];
+                if (succ < 0) continue;
+                if (t.depth > MAX_CARRIED) return;
+                if (entry_depth[succ] < 0) {
+                    entry_depth[succ] = (int32_t)t.depth;
+                    changed = true;
+                } else if ((size_t)entry_depth[succ] != t.depth) {
+                    return;
+                }
+
+                uint8_t *into = &entry[succ * width];
+                for (size_t x = 0; x < width; x++) {
+                    uint8_t from = x < local_count ? locals[x] : x - local_count < t.depth ? stack[x - local_count] : T_UNREACHED;
+                    uint8_t joined = join_type(into[x], from);
+                    if (joined != into[x]) changed = true;
+                    into[x] = joined;
+                }
+            }
+        }
+    }
+
+    // a binary op of two INTs or of two NUMBERs needs no check
+    for (size_t b = 0; b < f.block_count; b++) {
+        if (entry_depth[b] < 0) continue;
+        memcpy(locals, &entry[b * width], local_count);
+        memcpy(stack, &entry[b * width + local_count], MAX_CARRIED);
+        t.depth = (size_t)entry_depth[b];
+        for (size_t i = f.first[b]; i < f.first[b + 1]; i++) {
+            size_t at = f.insns[i].at;
+            if (code[at] == CALL_OP && code[at + 1] < Op_unary && has_typed_form[code[at + 1]]) {
+                uint8_t l = stack[t.depth - 2], r = stack[t.depth - 1];
+                if (l == INT && r == INT) code[at] = CALL_OP_INT;
+                if (l == NUMBER && r == NUMBER) code[at] = CALL_OP_NUMBER;
+            }
+            step_types(&t, code, at);
+        }
+    }
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+#define MAX_LOOP_WORK (1 << 24)     // loops times jumps, checking that no jump enters a loop in the middle
+
+typedef struct /* loop_t */ {
+    size_t header, back;    // instructions: the first of the loop, its backward JUMP
+    bool valid;
+    size_t first_hoist, hoist_count;    // its hoists, sorted by loop
+} loop_t;
+
+// instructions [start, end) computing one value that does not change while the loop runs
+typedef struct /* hoist_t */ {
+    size_t start, end;
+    size_t loop;
+    int32_t local;          // holds the value, computed before the loop
+    bool first;             // the first hoist of its loop with this code, the one computed
+} hoist_t;
+
+// the candidates found so far, grown in the scratch arena
+typedef struct /* hoist_list_t */ {
+    arena_chain_t *scratch;
+    hoist_t *items;
+    size_t count, capacity;
+} hoist_list_t;
+
+// a value on the operand stack while looking for invariants
+typedef struct /* value_t */ {
+    size_t start, end;      // the instructions that computed it
+    bool invariant, has_op;
+    bool recorded;          // already a candidate
+} value_t;
+
+// 1 (-1) if the instructions from i are x = x + 1 (x - 1, 1 + x, x + -1 ...) on a CALL_OP_INT or
+// CALL_OP_NUMBER, which INC_LOCAL (DEC_LOCAL) computes the same. 0 otherwise
+static int induction_step(const uint8_t *code, const flow_t *f, size_t i, const type_t *constants, size_t constant_count) {
+    if (i + 4 > f->n) return 0;
+    const insn_t *in = &f->insns[i];
+    if (in[1].leader || in[2].leader || in[3].leader) return 0;
+
+    const uint8_t *local = &code[in[0].at], *constant = &code[in[1].at], *op = &code[in[2].at], *store = &code[in[3].at];
+    if ((op[0] != CALL_OP_INT && op[0] != CALL_OP_NUMBER) || (op[1] != OP_ADD && op[1] != OP_SUB) || store[0] != STORE_LOCAL) return 0;
+    if (local[0] == PUSH_CONST && op[1] == OP_ADD) {
+        const uint8_t *swap = local;
+        local = constant;
+        constant = swap;
+    }
+    if (local[0] != PUSH_LOCAL || constant[0] != PUSH_CONST || get_i32(&local[1]) != get_i32(&store[1])) return 0;
+
+    int32_t index = get_i32(&constant[1]);
+    if (index < 0 || (size_t)index >= constant_count) return 0;
+    type_t k = constants[index];
+    int step;
+    if (op[0] == CALL_OP_INT && type_of(k) == INT && (as_int(k) == 1 || as_int(k) == -1)) step = (int)as_int(k);
+    else if (op[0] == CALL_OP_NUMBER && type_of(k) == NUMBER && (as_number(k) == 1 || as_number(k) == -1)) step = as_number(k) > 0 ? 1 : -1;
+    else return 0;
+    return op[1] == OP_SUB ? -step : step;
+}
+
+// values the instruction at code[at] pops and pushes
+static void stack_effect(const uint8_t *code, size_t at, size_t *pops, size_t *pushes) {
+    int32_t argc;
+    *pops = *pushes = 0;
+    switch (code[at]) {
+        case PUSH_CONST: case PUSH_LOCAL: case PUSH:
+            *pushes = 1;
+            return;
+        case STORE_LOCAL: case STORE: case POP: case JUMP_FALSE: case RETURN:
+            *pops = 1;
+            return;
+        case CALL_OP: case CALL_OP_INT: case CALL_OP_NUMBER:
+            *pops = code[at + 1] < Op_unary ? 2 : 1;
+            *pushes = 1;
+            return;
+        case CALL_C_FUNC:
+            argc = get_i32(&code[at + 5]);
+            break;
+        case CALL_FUNC: case TAIL_CALL:
+            argc = get_i32(&code[at + (code[at + 1] == CF_GLOBAL ? 10 : 6)]);
+            break;
+        default:
+            return;
+    }
+    *pops = argc > 0 ? (size_t)argc : 0;
+    *pushes = 1;
+}
+
+// the loops of code, a backward JUMP and its target, valid if nothing outside jumps into the middle
+// and no other loop has the same header. NULL if memory runs out
+static loop_t* find_loops(arena_chain_t *scratch, const uint8_t *code, const flow_t *f, size_t *loop_count) {
+    size_t jumps = 0, count = 0;
+    for (size_t i = 0; i < f->n; i++) {
+        uint8_t op = code[f->insns[i].at];
+        jumps += op == JUMP || op == JUMP_FALSE;
+        count += op == JUMP && (size_t)f->index_at[get_i32(&code[f->insns[i].at + 1])] <= i;
+    }
+
+    loop_t *loops = scratch_array(scratch, count, sizeof(loop_t));
+    int32_t *loop_at = scratch_array(scratch, f->n, sizeof(int32_t));
+    if (!loops || !loop_at) return NULL;
+    for (size_t i = 0; i < f->n; i++) loop_at[i] = -1;
+
+    count = 0;
+    for (size_t i = 0; i < f->n; i++) {
+        size_t at = f->insns[i].at;
+        if (code[at] != JUMP || (size_t)f->index_at[get_i32(&code[at + 1])] > i) continue;
+        size_t header = (size_t)f->index_at[get_i32(&code[at + 1])];
+        loops[count] = (loop_t){.header = header, .back = i, .valid = count * jumps <= MAX_LOOP_WORK};
+        if (loop_at[header] >= 0) loops[loop_at[header]].valid = loops[count].valid = false;
+        loop_at[header] = (int32_t)count++;
+    }
+
+    for (size_t i = 0; i < f->n; i++) {
+        size_t at = f->insns[i].at;
+        if (code[at] != JUMP && code[at] != JUMP_FALSE) continue;
+        size_t target = (size_t)f->index_at[get_i32(&code[at + 1])];
+        for (size_t l = 0; l < count; l++) {
+            loop_t *loop = &loops[l];
+            bool outside = i < loop->header || i > loop->back;
+            if (loop->valid && outside && target > loop->header && target <= loop->back) loop->valid = false;
+        }
+    }
+
+    *loop_count = count;
+    return loops;
+}
+
+static bool add_hoist(hoist_list_t *hoists, const value_t *v, size_t loop) {
+    if (!v->invariant || !v->has_op || v->recorded) return true;
+    if (hoists->count == hoists->capacity) {
+        size_t grown = hoists->capacity ? hoists->capacity * 2 : 16;
+        hoist_t *items = scratch_array(hoists->scratch, grown, sizeof(hoist_t));
+        if (!items) return false;
+        if (hoists->count) memcpy(items, hoists->items, hoists->count * sizeof(hoist_t));
+        hoists->items = items;
+        hoists->capacity = grown;
+    }
+    hoists->items[hoists->count++] = (hoist_t){.start = v->start, .end = v->end, .loop = loop};
+    return true;
+}
+
+// whether the typed op at code[at] cannot fail on its operands, computed before the loop it may run
+// where the loop would not have: only an INT % by zero does, allowed by a non-zero constant
+static bool cannot_fail(const uint8_t *code, const flow_t *f, size_t at, const value_t *right,
+                        const type_t *constants, size_t constant_count) {
+    if (code[at] != CALL_OP_INT || code[at + 1] != OP_MOD) return true;
+    const uint8_t *divisor = &code[f->insns[right->start].at];
+    if (right->end != right->start + 1 || divisor[0] != PUSH_CONST) return false;
+    int32_t index = get_i32(&divisor[1]);
+    return index >= 0 && (size_t)index < constant_count && type_of(constants[index]) == INT && as_int(constants[index]) != 0;
+}
+
+// the largest straight line pieces of the loop that only combine constants and locals it does not
+// write with CALL_OP_INT/CALL_OP_NUMBER that cannot fail (every piece, the smaller ones inside the
+// larger included, if every), false if memory runs out
+static bool find_invariants(const uint8_t *code, const flow_t *f, size_t l, const loop_t *loop, const uint64_t *written,
+                            const type_t *constants, size_t constant_count, bool every,
+                            value_t *values, hoist_list_t *hoists) {
+    size_t depth = 0;
+    for (size_t i = loop->header; i <= loop->back; i++) {
+        size_t at = f->insns[i].at;
+        uint8_t op = code[at];
+
+        // what a basic block leaves on the stack is kept as it is
+        if (f->insns[i].leader) {
+            while (depth) {
+                if (!add_hoist(hoists, &values[--depth], l)) return false;
+            }
+        }
+
+        if (op == PUSH_CONST || (op == PUSH_LOCAL && !BIT_TEST(written, get_i32(&code[at + 1])))) {
+            values[depth++] = (value_t){.start = i, .end = i + 1, .invariant = true};
+            continue;
+        }
+        if ((op == CALL_OP_INT || op == CALL_OP_NUMBER) && depth >= 2) {
+            value_t *left = &values[depth - 2], *right = &values[depth - 1];
+            if (left->invariant && right->invariant && left->end == right->start && right->end == i &&
+                cannot_fail(code, f, at, right, constants, constant_count)) {
+                *left = (value_t){.start = left->start, .end = i + 1, .invariant = true, .has_op = true};
+                if (every) {
+                    if (!add_hoist(hoists, left, l)) return false;
+                    left->recorded = true;
+                }
+                depth--;
+                continue;
+            }
+        }
+
+        size_t pops, pushes;
+        stack_effect(code, at, &pops, &pushes);
+        if (pops > depth) pops = depth;
+        while (pops--) {
+            if (!add_hoist(hoists, &values[--depth], l)) return false;
+        }
+        while (pushes--) values[depth++] = (value_t){.start = i, .end = i + 1};
+    }
+    while (depth) {
+        if (!add_hoist(hoists, &values[--depth], l)) return false;
+    }
+    return true;
+}
+
+// by start, the longest first, then the outermost loop (its header comes first)
+static int compare_hoists_by_start(const void *a, const void *b) {
+    const hoist_t *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    if (x->end != y->end) return x->end > y->end ? -1 : 1;
+    return (x->loop > y->loop) - (x->loop < y->loop);
+}
+
+static int compare_hoists_by_loop(const void *a, const void *b) {
+    const hoist_t *x = a, *y = b;
+    if (x->loop != y->loop) return x->loop < y->loop ? -1 : 1;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static inline size_t hoist_bytes(const flow_t *f, const hoist_t *h) {
+    return f->insns[h->end].at - f->insns[h->start].at;
+}
+
+uint8_t* optimize_loops(arena_chain_t *scratch, const uint8_t *code, size_t size, const type_t *constants,
+                        size_t constant_count, size_t *local_count, bool top_level, size_t *out_size) {
+    if (!size || !*local_count || *local_count > INT32_MAX) return NULL;
+
+    flow_t f;
+    if (!flow_build(scratch, code, size, *local_count, &f)) return NULL;
+
+    size_t n = f.n, loop_count = 0;
+    loop_t *loops = find_loops(scratch, code, &f, &loop_count);
+    int8_t *steps = scratch_zeroed(scratch, n, sizeof(int8_t));
+    uint64_t *written = scratch_zeroed(scratch, (*local_count + 63) / 64, sizeof(uint64_t));
+    value_t *values = scratch_array(scratch, n, sizeof(value_t));
+    int32_t *hoist_at = scratch_array(scratch, n, sizeof(int32_t));
+    int32_t *loop_at = scratch_array(scratch, n, sizeof(int32_t));
+    hoist_list_t candidates = {.scratch = scratch};
+    bool changed = false;
+    if (!loops || !steps || !written || !values || !hoist_at || !loop_at) return NULL;
+
+    for (size_t i = 0; i < n; i++) {
+        steps[i] = (int8_t)induction_step(code, &f, i, constants, constant_count);
+        if (steps[i]) {
+            changed = true;
+            i += 3;
+        }
+    }
+
+    for (size_t l = 0; l < loop_count; l++) {
+        loop_t *loop = &loops[l];
+        if (!loop->valid) continue;
+
+        // at the top level a callee may write any global, nothing is invariant in a loop that calls
+        bool calls = false;
+        for (size_t i = loop->header; i <= loop->back; i++) {
+            size_t at = f.insns[i].at;
+            uint8_t op = code[at];
+            if (op == STORE_LOCAL || op == INC_LOCAL || op == DEC_LOCAL) BIT_SET(written, get_i32(&code[at + 1]));
+            calls = calls || (top_level && is_call(op));
+        }
+        if (!calls && !find_invariants(code, &f, l, loop, written, constants, constant_count, false, values, &candidates)) return NULL;
+        for (size_t i = loop->header; i <= loop->back; i++) {
+            size_t at = f.insns[i].at;
+            uint8_t op = code[at];
+            if (op == STORE_LOCAL || op == INC_LOCAL || op == DEC_LOCAL) BIT_CLEAR(written, get_i32(&code[at + 1]));
+        }
+    }
+
+    // an expression invariant in an inner loop only contains the ones invariant in the outer loop,
+    // the first of overlapping candidates (the longest, then the outermost) is hoisted
+    hoist_t *hoists = candidates.items;
+    size_t hoist_count = candidates.count;
+    if (hoist_count) qsort(hoists, hoist_count, sizeof(hoist_t), compare_hoists_by_start);
+    size_t kept = 0;
+    for (size_t h = 0; h < hoist_count; h++) {
+        if (kept && hoists[h].start < hoists[kept - 1].end) continue;
+        hoists[kept++] = hoists[h];
+    }
+    hoist_count = kept;
+    if (!hoist_count && !changed) return NULL;
+
+    // one new local per different expression of a loop
+    if (hoist_count) qsort(hoists, hoist_count, sizeof(hoist_t), compare_hoists_by_loop);
+    size_t extra = 0;
+    int32_t next_local = (int32_t)*local_count;
+    for (size_t i = 0; i < n; i++) hoist_at[i] = loop_at[i] = -1;
+    for (size_t h = 0; h < hoist_count; h++) {
+        hoist_t *hoist = &hoists[h];
+        loop_t *loop = &loops[hoist->loop];
+        if (!loop->hoist_count) loop->first_hoist = h;
+        loop->hoist_count++;
+        loop_at[loop->header] = (int32_t)hoist->loop;
+        hoist_at[hoist->start] = (int32_t)h;
+
+        size_t bytes = hoist_bytes(&f, hoist);
+        hoist->first = true;
+        hoist->local = next_local;
+        for (size_t k = loop->first_hoist; k < h; k++) {
+            if (hoists[k].first && hoist_bytes(&f, &hoists[k]) == bytes &&
+                memcmp(&code[f.insns[hoists[k].start].at], &code[f.insns[hoist->start].at], bytes) == 0) {
+                hoist->first = false;
+                hoist->local = hoists[k].local;
+                break;
+            }
+        }
+        if (hoist->first) {
+            if (next_local == INT32_MAX) return NULL;
+            next_local++;
+            extra += bytes + 5;
+        }
+    }
+
+    uint8_t *out = scratch_array(scratch, size + extra, 1);
+    size_t *new_offset = scratch_array(scratch, n + 1, sizeof(size_t));
+    size_t *preheader = scratch_array(scratch, loop_count, sizeof(size_t));
+    if (!out || !new_offset || !preheader) return NULL;
+
+    size_t o = 0;
+    for (size_t i = 0; i < n;) {
+        // the hoisted values are computed once, right before the loop header
+        if (loop_at[i] >= 0) {
+            const loop_t *loop = &loops[loop_at[i]];
+            preheader[loop_at[i]] = o;
+            for (size_t h = loop->first_hoist; h < loop->first_hoist + loop->hoist_count; h++) {
+                if (!hoists[h].first) continue;
+                size_t bytes = hoist_bytes(&f, &hoists[h]);
+                memcpy(&out[o], &code[f.insns[hoists[h].start].at], bytes);
+                o += bytes;
+                out[o] = STORE_LOCAL;
+                put_i32(&out[o + 1], hoists[h].local);
+                o += 5;
+            }
+        }
+
+        new_offset[i] = o;
+        size_t at = f.insns[i].at;
+        if (hoist_at[i] >= 0) {
+            const hoist_t *hoist = &hoists[hoist_at[i]];
+            out[o] = PUSH_LOCAL;
+            put_i32(&out[o + 1], hoist->local);
+            o += 5;
+            for (i++; i < hoist->end; i++) new_offset[i] = o;
+        } else if (steps[i]) {
+            out[o] = steps[i] > 0 ? INC_LOCAL : DEC_LOCAL;
+            memcpy(&out[o + 1], &code[at + 1], 4);
+            o += 5;
+            for (size_t end = i + 4; ++i < end;) new_offset[i] = o;
+        } else {
+            size_t len = bytecode_length(code, at);
+            memcpy(&out[o], &code[at], len);
+            o += len;
+            i++;
+        }
+    }
+    new_offset[n] = o;
+
+    // a jump into a loop from outside runs its hoisted code first
+    for (size_t i = 0; i < n; i++) {
+        size_t at = f.insns[i].at;
+        if (code[at] != JUMP && code[at] != JUMP_FALSE) continue;
+        size_t target = (size_t)f.index_at[get_i32(&code[at + 1])], to = new_offset[target];
+        if (target < n && loop_at[target] >= 0) {
+            const loop_t *loop = &loops[loop_at[target]];
+            if (i < loop->header || i > loop->back) to = preheader[loop_at[target]];
+        }
+        put_i32(&out[new_offset[i] + 1], (int32_t)to);
+    }
+
+    *local_count = (size_t)next_local;
+    *out_size = o;
+    return out;
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+#define MAX_COMMON_LOOKBACK 64  // earlier pieces compared with each one
+
+// whether the value of piece h computed at after is still the one computed at before: both in the
+// same basic block, and none of the locals h reads written in between (at the top level by a call either)
+static bool unchanged_between(const uint8_t *code, const flow_t *f, const hoist_t *h, size_t after, size_t before, bool top_level) {
+    for (size_t i = after; i <= before; i++) {
+        if (f->insns[i].leader) return false;
+        if (i == before) break;
+
+        size_t at = f->insns[i].at;
+        uint8_t op = code[at];
+        if (top_level && is_call(op)) return false;
+        if (op != STORE_LOCAL && op != INC_LOCAL && op != DEC_LOCAL) continue;
+        int32_t written = get_i32(&code[at + 1]);
+        for (size_t k = h->start; k < h->end; k++) {
+            size_t read = f->insns[k].at;
+            if (code[read] == PUSH_LOCAL && get_i32(&code[read + 1]) == written) return false;
+        }
+    }
+    return true;
+}
+
+static inline bool same_code(const uint8_t *code, const flow_t *f, const hoist_t *a, const hoist_t *b) {
+    size_t bytes = hoist_bytes(f, a);
+    return bytes == hoist_bytes(f, b) && memcmp(&code[f->insns[a->start].at], &code[f->insns[b->start].at], bytes) == 0;
+}
+
+// the larger pieces are chosen first
+static int compare_classes(const void *a, const void *b) {
+    const hoist_t *x = a, *y = b;
+    size_t lx = x->end - x->start, ly = y->end - y->start;
+    if (lx != ly) return lx > ly ? -1 : 1;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+uint8_t* eliminate_common(arena_chain_t *scratch, const uint8_t *code, size_t size, const type_t *constants,
+                          size_t constant_count, size_t *local_count, bool top_level, size_t *out_size) {
+    if (!size || !*local_count || *local_count > INT32_MAX) return NULL;
+
+    flow_t f;
+    if (!flow_build(scratch, code, size, *local_count, &f)) return NULL;
+
+    // every typed piece of every basic block, the way find_invariants sees them when nothing is written
+    size_t n = f.n;
+    loop_t whole = {.header = 0, .back = n - 1, .valid = true};
+    uint64_t *written = scratch_zeroed(scratch, (*local_count + 63) / 64, sizeof(uint64_t));
+    value_t *values = scratch_array(scratch, n, sizeof(value_t));
+    size_t *repeats = scratch_array(scratch, n, sizeof(size_t));
+    int32_t *hoist_at = scratch_array(scratch, n, sizeof(int32_t));
+    bool *taken = scratch_zeroed(scratch, n, sizeof(bool));
+    hoist_list_t candidates = {.scratch = scratch};
+    if (!written || !values || !repeats || !hoist_at || !taken) return NULL;
+    if (!find_invariants(code, &f, 0, &whole, written, constants, constant_count, true, values, &candidates)) return NULL;
+
+    hoist_t *hoists = candidates.items;
+    size_t hoist_count = candidates.count;
+    if (!hoist_count) return NULL;
+    qsort(hoists, hoist_count, sizeof(hoist_t), compare_hoists_by_start);
+
+    // a piece repeats the latest earlier one with the same code if its value did not change since,
+    // hoist.loop is the first piece of its class and repeats[] counts a class's pieces
+    for (size_t h = 0; h < hoist_count; h++) {
+        hoists[h].loop = h;
+        repeats[h] = 1;
+        size_t stop = h > MAX_COMMON_LOOKBACK ? h - MAX_COMMON_LOOKBACK : 0;
+        for (size_t k = h; k-- > stop;) {
+            if (hoists[k].end > hoists[h].start || !same_code(code, &f, &hoists[k], &hoists[h])) continue;
+            if (unchanged_between(code, &f, &hoists[h], hoists[k].end, hoists[h].start, top_level)) {
+                hoists[h].loop = hoists[k].loop;
+                repeats[hoists[k].loop]++;
+            }
+            break;
+        }
+    }
+
+    // the first piece computes the value into a new local (2 more instructions), the others read
+    // it: worth it once the instructions saved are more. Larger pieces first, none overlapping
+    hoist_t *classes = scratch_array(scratch, hoist_count, sizeof(hoist_t));
+    if (!classes) return NULL;
+    size_t class_count = 0;
+    for (size_t h = 0; h < hoist_count; h++) {
+        size_t length = hoists[h].end - hoists[h].start;
+        if (hoists[h].loop == h && (repeats[h] - 1) * (length - 1) > 2) classes[class_count++] = hoists[h];
+    }
+    qsort(classes, class_count, sizeof(hoist_t), compare_classes);
+
+    for (size_t i = 0; i < n; i++) hoist_at[i] = -1;
+    int32_t next_local = (int32_t)*local_count;
+    size_t extra = 0;
+    for (size_t c = 0; c < class_count; c++) {
+        size_t first = classes[c].loop;
+        bool fits = true;
+        for (size_t h = first; h < hoist_count && fits; h++) {
+            if (hoists[h].loop != first) continue;
+            for (size_t i = hoists[h].start; i < hoists[h].end && fits; i++) fits = !taken[i];
+        }
+        if (!fits || next_local == INT32_MAX) continue;
+
+        for (size_t h = first; h < hoist_count; h++) {
+            if (hoists[h].loop != first) continue;
+            for (size_t i = hoists[h].start; i < hoists[h].end; i++) taken[i] = true;
+            hoists[h].local = next_local;
+            hoists[h].first = h == first;
+            hoist_at[hoists[h].start] = (int32_t)h;
+        }
+        next_local++;
+        extra += 10;
+    }
+    if (!extra) return NULL;
+
+    uint8_t *out = scratch_array(scratch, size + extra, 1);
+    size_t *new_offset = scratch_array(scratch, n + 1, sizeof(size_t));
+    if (!out || !new_offset) return NULL;
+
+    size_t o = 0;
+    for (size_t i = 0; i < n;) {
+        new_offset[i] = o;
+        size_t at = f.insns[i].at;
+        if (hoist_at[i] < 0) {
+            size_t len = bytecode_length(code, at);
+            memcpy(&out[o], &code[at], len);
+            o += len;
+            i++;
+            continue;
+        }
+
+        const hoist_t *hoist = &hoists[hoist_at[i]];
+        if (hoist->first) {
+            size_t bytes = hoist_bytes(&f, hoist);
+            memcpy(&out[o], &code[at], bytes);
+            o += bytes;
+            out[o] = STORE_LOCAL;
+            put_i32(&out[o + 1], hoist->local);
+            o += 5;
+        }
+        out[o] = PUSH_LOCAL;
+        put_i32(&out[o + 1], hoist->local);
+        o += 5;
+        for (i++; i < hoist->end; i++) new_offset[i] = o;
+    }
+    new_offset[n] = o;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t at = f.insns[i].at;
+        if (code[at] != JUMP && code[at] != JUMP_FALSE) continue;
+        put_i32(&out[new_offset[i] + 1], (int32_t)new_offset[f.index_at[get_i32(&code[at + 1])]]);
+    }
+
+    *local_count = (size_t)next_local;
+    *out_size = o;
+    return out;
+}
@@ -0,0 +1,77 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include "../vm/vm.h"
+#include "../data-structures/arena/arena_chain.h"
+
+
+/*
+    Block optimizer
+
+    Passes over the bytecode of one compiled block, split into basic blocks (a jump target,
+    or the instruction after a jump, RETURN or HALT, starts one). optimize_locals:
+
+        copy propagation    after PUSH_LOCAL a, STORE_LOCAL b the reads of b in the same
+                            basic block read a, until a or b is written again
+        dead stores         a STORE_LOCAL whose value is never read on any path (liveness
+                            over the basic blocks) drops its value instead, and together
+                            with a PUSH_LOCAL/PUSH_CONST right before it goes away. Same for
+                            an INC_LOCAL/DEC_LOCAL of a dead local
+        store and reload    STORE_LOCAL x, PUSH_LOCAL x leaves the value on the stack when x
+                            is dead after the reload
+
+    Locals of the top level are the globals functions read and write through frame 0, so
+    there a call reads all of them and ends every copy. Jumps are relocated to the new layout.
+
+    specialize_ops infers the type of every local and operand stack slot, forward over the
+    basic blocks to a fixpoint (types meet at joins, what differs is unknown), starting from
+    unknown locals. A PUSH_CONST has the constant's type and CALL_OP the type operation()
+    gives its operands (builtin.h), a call result or a global read through PUSH is unknown.
+    A CALL_OP whose operands are always two INTs or two NUMBERs becomes CALL_OP_INT or
+    CALL_OP_NUMBER (vm.h), which run without checking them.
+
+    optimize_loops runs last, on typed code:
+
+        induction steps     x = x + 1 and x = x - 1 on a CALL_OP_INT/CALL_OP_NUMBER become
+                            INC_LOCAL x and DEC_LOCAL x, which the VM's peephole pass fuses
+                            with the loop's condition into one counted back edge
+        invariant code      in a loop (a backward JUMP to a header nothing else jumps past),
+                            the largest pieces combining constants and locals the loop never
+                            writes with CALL_OP_INT/CALL_OP_NUMBER are computed once into a new
+                            local, right before the header, and the loop reads that local.
+                            The same piece twice in a loop shares one local
+
+    Jumps from outside a loop to its header run the hoisted code, its back edges skip it. At
+    the top level a loop with a call hoists nothing, the callee may write any global.
+
+    eliminate_common finds the same typed pieces (as optimize_loops, the smaller ones inside
+    larger ones included) again in a basic block while none of the locals they read is written
+    (or, at the top level, a call made). The first one stores its value into a new local as
+    well, the others read that local instead, when that saves instructions. Larger pieces win.
+
+    Every pass takes what it needs, the new code of optimize_loops and eliminate_common
+    included, from the caller's scratch arena and frees nothing: it all goes with the arena.
+    A pass that runs out of it leaves the code as it is.
+*/
+
+// optimizes code (well formed, from the compiler) in place and returns its new size.
+// top_level is true for the main block, whose locals the functions it calls may use.
+size_t optimize_locals(arena_chain_t *scratch, uint8_t *code, size_t size, size_t local_count, bool top_level);
+
+// rewrites the CALL_OPs of code (well formed, from the compiler) in place, constants are the block's
+void specialize_ops(arena_chain_t *scratch, uint8_t *code, size_t size, const type_t *constants, size_t constant_count,
+                    size_t local_count, bool top_level);
+
+// the loop optimized code (in scratch, its size in *out_size), or NULL if nothing changed. Adds the
+// locals it hoists into to *local_count
+uint8_t* optimize_loops(arena_chain_t *scratch, const uint8_t *code, size_t size, const type_t *constants,
+                        size_t constant_count, size_t *local_count, bool top_level, size_t *out_size);
+
+// the code with common pieces computed once (in scratch, its size in *out_size), or NULL if nothing
+// changed. Adds the locals they are kept in to *local_count
+uint8_t* eliminate_common(arena_chain_t *scratch, const uint8_t *code, size_t size, const type_t *constants,
+                          size_t constant_count, size_t *local_count, bool top_level, size_t *out_size);
+
+
+
+#endif // OPT_H
@@ -49,141 +49,1328 @@ bool is_blank_line(const line_t *line) {
  ///////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////
 
+#include <errno.h>
+#include <stdarg.h>
 #include <string.h>
-#include "../data-structures/map.h"
-
-#define TOKEN_IN(str, token) (strstr(str, token) != NULL)
-
-bool is_word_char(char c) {
-    return isalnum((unsigned char)c) || c == '_';
-}
-
-// Extract variable name after "let" keyword
-// Returns pointer to start of variable name and sets *out_len to its length
-// Returns NULL if no valid variable found
-const char* find_let_variable(const char *str, size_t len, size_t *out_len) {
-    bool in_string = false;
-    
-    for (size_t i = 0; i <= len - 3; i++) {
-        char c = str[i];
-        
-        // Toggle in_string if " found
-        if (c == '"') in_string = !in_string;
-        if (in_string) continue;
-        
-        // Check for "let"
-        if (strncmp(&str[i], "let", 3) == 0) {
-            // Check word boundaries
-            if ((i == 0 || !is_word_char(str[i - 1])) &&
-                (i + 3 == len || !is_word_char(str[i + 3]))) {
-                
-                // Found "let", now find variable name
-                size_t j = i + 3;
-                
-                // Skip whitespace after "let"
-                while (j < len && isspace((unsigned char)str[j])) {
-                    j++;
-                }
-                
-                // Find variable name length
-                size_t var_start = j;
-                while (j < len && is_word_char(str[j])) {
-                    j++;
-                }
-                
-                size_t var_len = j - var_start;
-                if (var_len > 0) {
-                    *out_len = var_len;
-                    return &str[var_start];
-                }
+#include "../data-structures/arena/arena_chain.h"
+#include "lex.h"
+#include "opt.h"
+
+#define READ_ARENA_CAPACITY (1 << 16)
+
+/*
+    Everything that only lives while a file compiles (symbol tables, the function table, the
+    code and constants of unfinished blocks and what the passes of opt.h work in) comes from the
+    scratch arena, freed at once with ac_destroy when compile_src returns. Growing one of them
+    takes a new piece of the arena and leaves the old one there. Names are never copied, a
+    symbol is a slice of the source, which outlives the compile.
+*/
+
+typedef struct {
+    const char *name;       // NULL for a free slot
+    uint32_t length;
+    int index;
+} symbol_t;
+
+typedef struct {
+    symbol_t *slots;        // open addressing, capacity a power of 2
+    size_t count, capacity;
+} symtab_t;
+
+// the code and constants of the block being compiled, copied into the program arena once it is done
+typedef struct {
+    block_t *block;
+    uint8_t *code;
+    size_t size, capacity;
+    type_t *constants;
+    size_t constant_count, constant_capacity;
+    uint32_t *constant_slots;   // open addressing over constants (index + 1, 0 is free), capacity a power of 2
+    size_t constant_slot_capacity;
+    symtab_t locals;        // name -> local index
+    size_t local_count;
+
+    // constant propagation: the value local i holds here, if facts[i].generation == generation
+    struct { type_t value; uint32_t generation; } *facts;
+    size_t fact_capacity;
+    uint32_t generation;
+} emitter_t;
+
+// a function known by name, its block exists from the first call on (calls may come first)
+typedef struct {
+    block_t *block;
+    token_t name;           // of the first use, for the error if it is never defined
+    int arity;              // -1 while unknown
+    bool defined;
+
+    // finished once the whole file is parsed, see Inlining
+    emitter_t *body;        // NULL until defined
+    uint8_t state;          // FN_PARSED, FN_FINISHING or FN_FINISHED
+    bool inlinable;
+    const emitter_t *inlined_into; // the caller inline_base belongs to
+    size_t inline_base;
+} function_t;
+
+// a block and its function, functions sorted by block
+typedef struct {
+    const block_t *block;
+    size_t index;
+} block_ref_t;
+
+typedef struct {
+    const char *filename;
+    lexer_t lexer;
+    token_t current, next;
+    bool failed;
+
+    arena_chain_t *arena;   // blocks, code, constants and strings of the program
+    arena_chain_t *scratch; // the rest, see above
+    emitter_t main;
+    emitter_t *fn;          // the function being compiled, NULL at the top level
+
+    symtab_t function_names; // name -> index in functions
+    function_t *functions;
+    size_t function_count, function_capacity;
+    block_ref_t *by_block;
+} parser_t;
+
+// the token for an error message, `'text'` or what it stands for
+static const char* describe(const parser_t *p, token_t token, char out[64]) {
+    if (token.kind == TOK_NEWLINE) return "the end of the line";
+    if (token.kind == TOK_EOF) return "the end of the file";
+    if (token.kind == TOK_ERROR && p->lexer.src[token.offset] == '"') return "an unterminated string";
+    snprintf(out, 64, "'%.*s'", token.length > 40 ? 40 : (int)token.length, p->lexer.src + token.offset);
+    return out;
+}
+
+static void parse_error(parser_t *p, token_t at, const char *format, ...) {
+    if (p->failed) return;
+    p->failed = true;
+
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s:%u: ", p->filename, at.line);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+
+    // nothing after the first error, every loop of the parser stops at TOK_EOF
+    p->lexer.pos = p->lexer.size;
+    p->current = p->next = (token_t){.offset = (uint32_t)p->lexer.size, .line = at.line, .kind = TOK_EOF};
+}
+
+static void advance(parser_t *p) {
+    p->current = p->next;
+    if (!p->failed) p->next = lex_next(&p->lexer);
+    if (p->current.kind == TOK_ERROR) {
+        char buffer[64];
+        const char *what = describe(p, p->current, buffer);
+        if (p->lexer.src[p->current.offset] == '"') parse_error(p, p->current, "%s", what);
+        else parse_error(p, p->current, "unexpected %s", what);
+    }
+}
+
+static inline bool check(parser_t *p, const char *text) {
+    return (p->current.kind == TOK_OP || p->current.kind == TOK_IDENT) && token_is(&p->lexer, p->current, text);
+}
+
+static bool match(parser_t *p, const char *text) {
+    if (!check(p, text)) return false;
+    advance(p);
+    return true;
+}
+
+static void expect(parser_t *p, const char *text) {
+    if (!match(p, text)) {
+        char buffer[64];
+        parse_error(p, p->current, "expected '%s' before %s", text, describe(p, p->current, buffer));
+    }
+}
+
+static void skip_newlines(parser_t *p) {
+    while (p->current.kind == TOK_NEWLINE) advance(p);
+}
+
+static bool is_keyword(const lexer_t *lexer, token_t token) {
+    static const char *const keywords[] = {
+        "let", "fn", "return", "if", "else", "while", "true", "false", "none",
+    };
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if (token_is(lexer, token, keywords[i])) return true;
+    }
+    return false;
+}
+
+// printf arguments of a token's text, for "%.*s"
+#define TOKEN_TEXT(p, token) (int)(token).length, (p)->lexer.src + (token).offset
+
+// expects a name that is not a keyword
+static bool expect_name(parser_t *p, token_t *name) {
+    token_t token = p->current;
+    if (token.kind != TOK_IDENT || is_keyword(&p->lexer, token)) {
+        char buffer[64];
+        parse_error(p, token, "expected a name before %s", describe(p, token, buffer));
+        return false;
+    }
+    advance(p);
+    *name = token;
+    return true;
+}
+
+static void* arena_alloc(parser_t *p, arena_chain_t *arena, size_t size) {
+    void *memory = ac_get_memory(arena, size ? size : 1);
+    if (!memory) parse_error(p, p->current, "out of memory");
+    return memory;
+}
+
+// a scratch array of n items of size bytes grown to hold at least needed, *capacity is updated
+static void* scratch_grow(parser_t *p, void *items, size_t n, size_t *capacity, size_t needed, size_t size) {
+    if (needed <= *capacity) return items;
+    size_t grown = *capacity ? *capacity * 2 : 16;
+    while (grown < needed) grown *= 2;
+    void *memory = arena_alloc(p, p->scratch, grown * size);
+    if (!memory) return NULL;
+    if (n) memcpy(memory, items, n * size);
+    *capacity = grown;
+    return memory;
+}
+
+static inline uint64_t name_hash(const char *name, uint32_t length) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < length; i++) h = (h ^ (uint8_t)name[i]) * 0x100000001b3ull;
+    return h ^ (h >> 32);
+}
+
+static symbol_t* symtab_slot(symtab_t *t, const char *name, uint32_t length) {
+    for (size_t i = name_hash(name, length) & (t->capacity - 1);; i = (i + 1) & (t->capacity - 1)) {
+        symbol_t *s = &t->slots[i];
+        if (!s->name || (s->length == length && memcmp(s->name, name, length) == 0)) return s;
+    }
+}
+
+// the index of the name, -1 if it is not in the table
+static int symtab_get(const parser_t *p, symtab_t *t, token_t name) {
+    if (!t->count) return -1;
+    symbol_t *s = symtab_slot(t, p->lexer.src + name.offset, name.length);
+    return s->name ? s->index : -1;
+}
+
+// adds a name that is not in the table yet
+static bool symtab_add(parser_t *p, symtab_t *t, token_t name, int index) {
+    if ((t->count + 1) * 2 > t->capacity) {
+        symtab_t grown = {.capacity = t->capacity ? t->capacity * 2 : 16};
+        grown.slots = arena_alloc(p, p->scratch, grown.capacity * sizeof(symbol_t));
+        if (!grown.slots) return false;
+        memset(grown.slots, 0, grown.capacity * sizeof(symbol_t));
+        for (size_t i = 0; i < t->capacity; i++) {
+            symbol_t s = t->slots[i];
+            if (s.name) *symtab_slot(&grown, s.name, s.length) = s;
+        }
+        grown.count = t->count;
+        *t = grown;
+    }
+    const char *text = p->lexer.src + name.offset;
+    *symtab_slot(t, text, name.length) = (symbol_t){.name = text, .length = name.length, .index = index};
+    t->count++;
+    return true;
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+static inline emitter_t* emitter(parser_t *p) {
+    return p->fn ? p->fn : &p->main;
+}
+
+static void emitter_init(emitter_t *e, block_t *block) {
+    *e = (emitter_t){.block = block, .generation = 1};
+}
+
+// the code of a pass that returns new code (in the scratch arena, NULL if it changed nothing)
+// becomes the emitter's: a function's code stays in its emitter, callers inline it from there
+static void emitter_replace(emitter_t *e, uint8_t *code, size_t size) {
+    if (!code) return;
+    e->code = code;
+    e->size = e->capacity = size;
+}
+
+// copies the code and constants into the program arena and gives them to the block
+static void emitter_finish(parser_t *p, emitter_t *e) {
+    if (!p->failed) {
+        bool top_level = e == &p->main;
+        e->size = optimize_locals(p->scratch, e->code, e->size, e->local_count, top_level);
+        specialize_ops(p->scratch, e->code, e->size, e->constants, e->constant_count, e->local_count, top_level);
+
+        size_t size = 0;
+        uint8_t *code = optimize_loops(p->scratch, e->code, e->size, e->constants, e->constant_count,
+                                       &e->local_count, top_level, &size);
+        emitter_replace(e, code, size);
+        code = eliminate_common(p->scratch, e->code, e->size, e->constants, e->constant_count,
+                                &e->local_count, top_level, &size);
+        emitter_replace(e, code, size);
+    }
+
+    uint8_t *code = arena_alloc(p, p->arena, e->size);
+    type_t *constants = arena_alloc(p, p->arena, e->constant_count * sizeof(type_t));
+    if (p->failed) return;
+
+    memcpy(code, e->code, e->size);
+    if (e->constant_count) memcpy(constants, e->constants, e->constant_count * sizeof(type_t));
+    *e->block = (block_t){
+        .instructions = code,
+        .instruction_size = e->size,
+        .constants = constants,
+        .constant_count = e->constant_count,
+        .local_count = e->local_count,
+    };
+}
+
+static void emit_bytes(parser_t *p, const uint8_t *bytes, size_t n) {
+    emitter_t *e = emitter(p);
+    if (p->failed) return;
+    if (e->size + n > e->capacity) {
+        e->code = scratch_grow(p, e->code, e->size, &e->capacity, e->size + n, 1);
+        if (!e->code) return;
+    }
+    memcpy(&e->code[e->size], bytes, n);
+    e->size += n;
+}
+
+static inline void emit_op(parser_t *p, uint8_t op) {
+    emit_bytes(p, &op, 1);
+}
+
+static inline void emit_i32(parser_t *p, uint8_t op, int32_t operand) {
+    uint8_t bytes[] = {op, INT_TO_BYTES4(operand)};
+    emit_bytes(p, bytes, sizeof(bytes));
+}
+
+static inline void emit_call_op(parser_t *p, Op op) {
+    uint8_t bytes[] = {CALL_OP, BYTE(op)};
+    emit_bytes(p, bytes, sizeof(bytes));
+}
+
+// a jump to be patched, returns where its offset is
+static size_t emit_jump(parser_t *p, uint8_t op, int32_t target) {
+    emit_i32(p, op, target);
+    return emitter(p)->size - 4;
+}
+
+// makes the jump whose offset is at `at` land here
+static void patch_jump(parser_t *p, size_t at) {
+    emitter_t *e = emitter(p);
+    if (p->failed) return;
+    uint8_t bytes[] = {INT_TO_BYTES4(e->size)};
+    memcpy(&e->code[at], bytes, 4);
+}
+
+// the payload of a constant, two constants are the same if their types and bits are
+static uint64_t constant_bits(type_t v) {
+    switch (type_of(v)) {
+        case NUMBER: {
+            // bitwise, so 0.0 and -0.0 stay apart
+            double d = as_number(v);
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            return bits;
+        }
+        case INT: return (uint64_t)as_int(v);
+        case BOOL: return as_bool(v);
+        case NONE: return 0;
+        default: return (uintptr_t)as_ptr(v);
+    }
+}
+
+static uint32_t* constant_slot(emitter_t *e, type_t value) {
+    uint64_t bits = constant_bits(value), h = (bits ^ type_of(value)) * 0x9e3779b97f4a7c15ull;
+    size_t mask = e->constant_slot_capacity - 1;
+    for (size_t i = (h >> 32) & mask;; i = (i + 1) & mask) {
+        uint32_t slot = e->constant_slots[i];
+        if (!slot) return &e->constant_slots[i];
+        type_t c = e->constants[slot - 1];
+        if (type_of(c) == type_of(value) && constant_bits(c) == bits) return &e->constant_slots[i];
+    }
+}
+
+// the index of value in the constants of the current block, added if it is not there yet
+static int32_t add_constant(parser_t *p, type_t value) {
+    emitter_t *e = emitter(p);
+    if ((e->constant_count + 1) * 2 > e->constant_slot_capacity) {
+        size_t capacity = e->constant_slot_capacity ? e->constant_slot_capacity * 2 : 32;
+        uint32_t *slots = arena_alloc(p, p->scratch, capacity * sizeof(uint32_t));
+        if (!slots) return 0;
+        memset(slots, 0, capacity * sizeof(uint32_t));
+        e->constant_slots = slots;
+        e->constant_slot_capacity = capacity;
+        for (size_t i = 0; i < e->constant_count; i++) *constant_slot(e, e->constants[i]) = (uint32_t)i + 1;
+    }
+
+    uint32_t *slot = constant_slot(e, value);
+    if (*slot) return (int32_t)*slot - 1;
+
+    if (e->constant_count == e->constant_capacity) {
+        e->constants = scratch_grow(p, e->constants, e->constant_count, &e->constant_capacity,
+                                    e->constant_count + 1, sizeof(type_t));
+        if (!e->constants) return 0;
+    }
+    e->constants[e->constant_count] = value;
+    *slot = (uint32_t)++e->constant_count;
+    return (int32_t)e->constant_count - 1;
+}
+
+static int declare_local(parser_t *p, token_t name) {
+    emitter_t *e = emitter(p);
+    int index = symtab_get(p, &e->locals, name);
+    if (index >= 0) return index;
+    if (!symtab_add(p, &e->locals, name, (int)e->local_count)) return 0;
+    return (int)e->local_count++;
+}
+
+// where a variable lives: a local of the current block, or a global (a local of the top level)
+typedef enum { VAR_NONE, VAR_LOCAL, VAR_GLOBAL } VarKind;
+
+static VarKind resolve_var(parser_t *p, token_t name, int *index) {
+    if ((*index = symtab_get(p, &emitter(p)->locals, name)) >= 0) return VAR_LOCAL;
+    if (p->fn && (*index = symtab_get(p, &p->main.locals, name)) >= 0) return VAR_GLOBAL;
+    return VAR_NONE;
+}
+
+
+static void emit_store(parser_t *p, VarKind kind, int index) {
+    if (kind == VAR_LOCAL) {
+        emit_i32(p, STORE_LOCAL, index);
+    } else {
+        uint8_t bytes[] = {STORE, INT_TO_BYTES4(0), INT_TO_BYTES4(index)};
+        emit_bytes(p, bytes, sizeof(bytes));
+    }
+}
+
+/*
+    Constant folding and propagation
+
+    An expression whose value is known while compiling is an expr_t with constant set and no
+    code emitted: it is pushed (PUSH_CONST) only where a value has to be on the stack, so an
+    operator on two constants becomes the constant of its result, computed by operation() like
+    the vm would. Ops that can fail at run time (INT % 0) and operands other than NUMBER/INT
+    (BOOL for && || !) are left to the vm.
+
+    A local assigned a constant is that constant until the code can be reached some other way:
+    the facts are dropped at the head of a loop, after it, at an else and where the branches
+    of an if meet, and (top level only) after calling a function, which may store globals.
+    Globals are never propagated into functions.
+*/
+
+typedef struct {
+    bool constant;          // nothing emitted, value is the whole expression
+    type_t value;
+} expr_t;
+
+#define CODE_EXPR ((expr_t){.constant = false})
+
+static inline expr_t constant_expr(type_t value) {
+    return (expr_t){.constant = true, .value = value};
+}
+
+// puts the expression's value on the stack
+static void materialize(parser_t *p, expr_t x) {
+    if (x.constant) emit_i32(p, PUSH_CONST, add_constant(p, x.value));
+}
+
+// puts a constant on the stack before the code emitted since offset at
+static void materialize_at(parser_t *p, expr_t x, size_t at) {
+    emitter_t *e = emitter(p);
+    if (!x.constant || p->failed) return;
+    if (at == e->size) {
+        materialize(p, x);
+        return;
+    }
+
+    // expressions have no jumps, the code after at can move
+    uint8_t bytes[] = {PUSH_CONST, INT_TO_BYTES4(add_constant(p, x.value))};
+    size_t tail = e->size - at;
+    emit_bytes(p, bytes, sizeof(bytes));
+    if (p->failed) return;
+    memmove(&e->code[at + sizeof(bytes)], &e->code[at], tail);
+    memcpy(&e->code[at], bytes, sizeof(bytes));
+}
+
+static inline bool is_numeric(type_t v) {
+    return type_of(v) == NUMBER || type_of(v) == INT;
+}
+
+// *result = l op r if it can be computed now
+static bool fold_binary(Op op, type_t l, type_t r, type_t *result) {
+    if (op == OP_AND || op == OP_OR) {
+        if (type_of(l) != BOOL || type_of(r) != BOOL) return false;
+    } else {
+        if (!is_numeric(l) || !is_numeric(r)) return false;
+        if (op == OP_MOD && type_of(l) == INT && type_of(r) == INT && as_int(r) == 0) return false;
+    }
+    *result = operation(op, l, r);
+    return true;
+}
+
+static bool fold_unary(Op op, type_t v, type_t *result) {
+    if (op == OP_NOT ? type_of(v) != BOOL : !is_numeric(v)) return false;
+    *result = operation_unary(op, v);
+    return true;
+}
+
+// what local index holds from here on
+static void set_fact(parser_t *p, int index, expr_t x) {
+    emitter_t *e = emitter(p);
+    if ((size_t)index >= e->fact_capacity) {
+        size_t old = e->fact_capacity;
+        e->facts = scratch_grow(p, e->facts, old, &e->fact_capacity, (size_t)index + 1, sizeof(*e->facts));
+        if (!e->facts) return;
+        memset(&e->facts[old], 0, (e->fact_capacity - old) * sizeof(*e->facts));
+    }
+    e->facts[index].value = x.value;
+    e->facts[index].generation = x.constant ? e->generation : 0;
+}
+
+static inline void forget_facts(parser_t *p) {
+    emitter(p)->generation++;
+}
+
+static expr_t emit_load(parser_t *p, VarKind kind, int index) {
+    emitter_t *e = emitter(p);
+    if (kind == VAR_LOCAL) {
+        if ((size_t)index < e->fact_capacity && e->facts[index].generation == e->generation) {
+            return constant_expr(e->facts[index].value);
+        }
+        emit_i32(p, PUSH_LOCAL, index);
+    } else {
+        uint8_t bytes[] = {PUSH, INT_TO_BYTES4(0), INT_TO_BYTES4(index)};
+        emit_bytes(p, bytes, sizeof(bytes));
+    }
+    return CODE_EXPR;
+}
+
+// stores the value of x (on the stack unless it is a constant) into the variable
+static void store_var(parser_t *p, VarKind kind, int index, expr_t x) {
+    materialize(p, x);
+    emit_store(p, kind, index);
+    if (kind == VAR_LOCAL) set_fact(p, index, x);
+}
+
+// the function called name, declared by this first use if it is not known yet
+static function_t* function_ref(parser_t *p, token_t name) {
+    int index = symtab_get(p, &p->function_names, name);
+    if (index >= 0) return &p->functions[index];
+
+    p->functions = scratch_grow(p, p->functions, p->function_count, &p->function_capacity,
+                                p->function_count + 1, sizeof(function_t));
+    block_t *block = arena_alloc(p, p->arena, sizeof(block_t));
+    if (!p->functions || !block || !symtab_add(p, &p->function_names, name, (int)p->function_count)) return NULL;
+
+    *block = (block_t){0};
+    p->functions[p->function_count] = (function_t){.block = block, .name = name, .arity = -1};
+    return &p->functions[p->function_count++];
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+/*
+    Expressions, by precedence climbing over the binary operators (all left associative).
+    && and || evaluate both sides.
+*/
+
+static const struct {
+    const char *text;
+    Op op;
+    int precedence;
+} binary_ops[] = {
+    {"||", OP_OR, 1},
+    {"&&", OP_AND, 2},
+    {"==", OP_EQ, 3}, {"!=", OP_NE, 3},
+    {"<", OP_LT, 4}, {">", OP_GT, 4}, {"<=", OP_LE, 4}, {">=", OP_GE, 4},
+    {"|", OP_BIT_OR, 5},
+    {"&", OP_BIT_AND, 6},
+    {"+", OP_ADD, 7}, {"-", OP_SUB, 7},
+    {"*", OP_MUL, 8}, {"/", OP_DIV, 8}, {"%", OP_MOD, 8},
+};
+
+#define UNARY_PRECEDENCE 9
+
+static expr_t parse_expression(parser_t *p, int min_precedence);
+
+// an expression whose value is needed on the stack
+static void parse_value(parser_t *p) {
+    materialize(p, parse_expression(p, 1));
+}
+
+// the argument list after '(', returns the number of arguments
+static int parse_arguments(parser_t *p) {
+    int argc = 0;
+    skip_newlines(p);
+    if (!check(p, ")")) {
+        do {
+            skip_newlines(p);
+            parse_value(p);
+            argc++;
+            skip_newlines(p);
+        } while (match(p, ","));
+    }
+    expect(p, ")");
+    return argc;
+}
+
+static expr_t parse_call(parser_t *p, token_t callee) {
+    int index;
+    VarKind kind = resolve_var(p, callee, &index);
+    bool print = kind == VAR_NONE && token_is(&p->lexer, callee, "print");
+    function_t *function = kind == VAR_NONE && !print ? function_ref(p, callee) : NULL;
+    if (p->failed) return CODE_EXPR;
+    size_t function_index = function ? (size_t)(function - p->functions) : 0;
+
+    int argc = parse_arguments(p);
+    if (print) {
+        uint8_t bytes[] = {CALL_C_FUNC, INT_TO_BYTES4(BF_PRINT), INT_TO_BYTES4(argc)};
+        emit_bytes(p, bytes, sizeof(bytes));
+    } else if (kind == VAR_GLOBAL) {
+        uint8_t bytes[] = {CALL_FUNC, BYTE(CF_GLOBAL), INT_TO_BYTES4(0), INT_TO_BYTES4(index), INT_TO_BYTES4(argc)};
+        emit_bytes(p, bytes, sizeof(bytes));
+    } else {
+        // a function called by name is a constant of the caller, a variable is called through its local
+        if (function) {
+            // the arguments may have declared more functions and moved the array
+            function = &p->functions[function_index];
+            if (function->arity < 0) function->arity = argc;
+            else if (function->arity != argc) {
+                parse_error(p, callee, "%.*s takes %d arguments, not %d", TOKEN_TEXT(p, callee), function->arity, argc);
+                return CODE_EXPR;
             }
+            index = add_constant(p, make_ptr(FUNCTION, function->block));
         }
+        uint8_t bytes[] = {CALL_FUNC, BYTE(function ? CF_CONSTANT : CF_LOCAL), INT_TO_BYTES4(index), INT_TO_BYTES4(argc)};
+        emit_bytes(p, bytes, sizeof(bytes));
     }
-    return NULL;
+    if (!print && !p->fn) forget_facts(p);
+    return CODE_EXPR;
 }
 
-bool is_let_declaration(const line_t *line) {
-    if (!line || !line->str) return false;
-    
-    size_t var_len;
-    return find_let_variable(line->str, line->len, &var_len) != NULL;
+// a string literal without its quotes and with its escapes resolved, in the arena
+static const char* string_value(parser_t *p, token_t token) {
+    const char *s = p->lexer.src + token.offset + 1;
+    size_t len = token.length - 2;
+    char *out = arena_alloc(p, p->arena, len + 1);
+    if (!out) return "";
+
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\\' && i + 1 < len) {
+            switch (s[++i]) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                default: c = s[i]; break;
+            }
+        }
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    return out;
 }
 
-int read_src_file(const char *filename, block_t *out_block) {
-    FILE *f = fopen(filename, "r");
-    if (!f) return -1;
-    
-    line_t line;
-    line_init(&line);
-    
-    map_t *var_map = map_init();
-    if (!var_map) {
-        fclose(f);
-        line_free(&line);
-        return -1;
+static type_t number_value(parser_t *p, token_t token, bool negative) {
+    char text[64];
+    if (token.length >= sizeof(text)) {
+        parse_error(p, token, "number too long");
+        return make_none();
     }
-    
-    size_t local_count = 0, constant_count = 0, instruction_size = 0;
-    
-    while (line_read(f, &line) == 0) {
-        if (is_blank_line(&line)) continue;
-        
-        // Try to find variable from let declaration
-        size_t var_len;
-        const char *var_start = find_let_variable(line.str, line.len, &var_len);
-        
-        if (var_start) {
-            // Allocate and copy variable name (null-terminated)
-            char *var_name = malloc(var_len + 1);
-            if (!var_name) {
-                map_free(var_map);
-                fclose(f);
-                line_free(&line);
-                return -1;
+    memcpy(text, p->lexer.src + token.offset, token.length);
+    text[token.length] = '\0';
+
+    // the source may end right after the number, it is parsed from the copy
+    if (strpbrk(text, ".eE")) return make_number(negative ? -strtod(text, NULL) : strtod(text, NULL));
+    errno = 0;
+    uint64_t magnitude = strtoull(text, NULL, 10);
+    // an INT holds one more negative value than positive ones (INT_VALUE_MIN, type.h)
+    if (errno == ERANGE || magnitude > (uint64_t)INT_VALUE_MAX + negative) {
+        parse_error(p, token, "number too large");
+        return make_none();
+    }
+    if (!negative || !magnitude) return make_int((int64_t)magnitude);
+    return make_int(-(int64_t)(magnitude - 1) - 1);
+}
+
+static expr_t parse_primary(parser_t *p) {
+    token_t token = p->current;
+    switch (token.kind) {
+        case TOK_NUMBER:
+            advance(p);
+            return constant_expr(number_value(p, token, false));
+        case TOK_STRING:
+            advance(p);
+            return constant_expr(make_str_literal(string_value(p, token)));
+        case TOK_IDENT:
+            break;
+        default:
+            if (match(p, "(")) {
+                skip_newlines(p);
+                expr_t x = parse_expression(p, 1);
+                skip_newlines(p);
+                expect(p, ")");
+                return x;
+            }
+            char buffer[64];
+            parse_error(p, token, "expected an expression before %s", describe(p, token, buffer));
+            return CODE_EXPR;
+    }
+
+    advance(p);
+    if (token_is(&p->lexer, token, "true")) return constant_expr(make_bool(true));
+    if (token_is(&p->lexer, token, "false")) return constant_expr(make_bool(false));
+    if (token_is(&p->lexer, token, "none")) return constant_expr(make_none());
+    if (is_keyword(&p->lexer, token)) {
+        char buffer[64];
+        parse_error(p, token, "expected an expression before %s", describe(p, token, buffer));
+        return CODE_EXPR;
+    }
+    if (match(p, "(")) return parse_call(p, token);
+
+    int index;
+    VarKind kind = resolve_var(p, token, &index);
+    if (kind != VAR_NONE) return emit_load(p, kind, index);
+
+    int function = symtab_get(p, &p->function_names, token);
+    if (function >= 0) return constant_expr(make_ptr(FUNCTION, p->functions[function].block));
+    parse_error(p, token, "'%.*s' is not declared", TOKEN_TEXT(p, token));
+    return CODE_EXPR;
+}
+
+static expr_t parse_unary(parser_t *p) {
+    type_t result;
+    if (match(p, "!")) {
+        expr_t x = parse_unary(p);
+        if (x.constant && fold_unary(OP_NOT, x.value, &result)) return constant_expr(result);
+        materialize(p, x);
+        emit_call_op(p, OP_NOT);
+        return CODE_EXPR;
+    }
+    if (match(p, "-")) {
+        if (p->current.kind == TOK_NUMBER) {
+            token_t token = p->current;
+            advance(p);
+            return constant_expr(number_value(p, token, true));
+        }
+
+        // 0 - x
+        size_t start = emitter(p)->size;
+        expr_t zero = constant_expr(make_int(0)), x = parse_unary(p);
+        if (x.constant && fold_binary(OP_SUB, zero.value, x.value, &result)) return constant_expr(result);
+        materialize_at(p, zero, start);
+        materialize(p, x);
+        emit_call_op(p, OP_SUB);
+        return CODE_EXPR;
+    }
+    return parse_primary(p);
+}
+
+static expr_t parse_expression(parser_t *p, int min_precedence) {
+    expr_t left = parse_unary(p);
+    for (;;) {
+        if (p->current.kind != TOK_OP) return left;
+
+        size_t i = 0, count = sizeof(binary_ops) / sizeof(binary_ops[0]);
+        while (i < count && !token_is(&p->lexer, p->current, binary_ops[i].text)) i++;
+        if (i == count || binary_ops[i].precedence < min_precedence) return left;
+
+        advance(p);
+        skip_newlines(p);
+        size_t right_start = emitter(p)->size;
+        expr_t right = parse_expression(p, binary_ops[i].precedence + 1);
+
+        type_t result;
+        if (left.constant && right.constant && fold_binary(binary_ops[i].op, left.value, right.value, &result)) {
+            left = constant_expr(result);
+            continue;
+        }
+        // the left operand goes first, if it is a constant it was not pushed yet
+        materialize_at(p, left, right_start);
+        materialize(p, right);
+        emit_call_op(p, binary_ops[i].op);
+        left = CODE_EXPR;
+    }
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+static void parse_statement(parser_t *p);
+
+// { statements }
+static void parse_body(parser_t *p) {
+    expect(p, "{");
+    skip_newlines(p);
+    while (!check(p, "}") && p->current.kind != TOK_EOF) {
+        parse_statement(p);
+        skip_newlines(p);
+    }
+    expect(p, "}");
+}
+
+// a simple statement ends at a newline, a ';', or the '}' of its block
+static void end_statement(parser_t *p) {
+    if (p->current.kind == TOK_NEWLINE || p->current.kind == TOK_EOF || check(p, "}")) return;
+    if (match(p, ";")) return;
+    char buffer[64];
+    parse_error(p, p->current, "unexpected %s after a statement", describe(p, p->current, buffer));
+}
+
+static void parse_let(parser_t *p) {
+    token_t name;
+    if (!expect_name(p, &name)) return;
+
+    // the value is compiled before the name exists, `let x = x` reads an outer x
+    expr_t value = constant_expr(make_none());
+    if (match(p, "=")) {
+        skip_newlines(p);
+        value = parse_expression(p, 1);
+    }
+    store_var(p, VAR_LOCAL, declare_local(p, name), value);
+}
+
+static void parse_fn(parser_t *p, token_t at) {
+    if (p->fn) {
+        parse_error(p, at, "functions can only be defined at the top level");
+        return;
+    }
+    token_t name;
+    if (!expect_name(p, &name)) return;
+
+    function_t *function = function_ref(p, name);
+    if (!function) return;
+    if (function->defined) {
+        parse_error(p, name, "%.*s is already defined", TOKEN_TEXT(p, name));
+        return;
+    }
+    function->defined = true;
+    size_t function_index = function - p->functions;
+
+    emitter_t e;
+    emitter_init(&e, function->block);
+    p->fn = &e;
+
+    int arity = 0;
+    expect(p, "(");
+    if (!check(p, ")")) {
+        do {
+            token_t param;
+            if (!expect_name(p, &param)) break;
+            if (symtab_get(p, &e.locals, param) >= 0) {
+                parse_error(p, param, "%.*s is already a parameter", TOKEN_TEXT(p, param));
             }
-            
-            memcpy(var_name, var_start, var_len);
-            var_name[var_len] = '\0';
-            
-            // Check if variable already exists
-            int existing_index = map_get(var_map, var_name);
-            if (existing_index < 0) {
-                // New variable, add to map
-                if (map_add(var_map, var_name, (int)local_count)) {
-                    local_count++;
+            declare_local(p, param);
+            arity++;
+        } while (match(p, ","));
+    }
+    expect(p, ")");
+
+    // functions may be reallocated by calls in the body
+    function = &p->functions[function_index];
+    if (function->arity >= 0 && function->arity != arity) {
+        parse_error(p, name, "%.*s takes %d arguments but is called with %d", TOKEN_TEXT(p, name), arity,
+                    function->arity);
+    }
+    function->arity = arity;
+
+    parse_body(p);
+
+    // falling off the end returns none
+    materialize(p, constant_expr(make_none()));
+    emit_op(p, RETURN);
+    p->fn = NULL;
+
+    // finished with its callees, once they are all known
+    emitter_t *body = arena_alloc(p, p->scratch, sizeof(emitter_t));
+    if (body) {
+        *body = e;
+        p->functions[function_index].body = body;
+    }
+}
+
+static void parse_if(parser_t *p) {
+    parse_value(p);
+    size_t else_jump = emit_jump(p, JUMP_FALSE, 0);
+    parse_body(p);
+
+    // `else` may start the next line
+    if (p->current.kind == TOK_NEWLINE && p->next.kind == TOK_IDENT && token_is(&p->lexer, p->next, "else")) {
+        advance(p);
+    }
+    if (!match(p, "else")) {
+        patch_jump(p, else_jump);
+        forget_facts(p);
+        return;
+    }
+
+    size_t end_jump = emit_jump(p, JUMP, 0);
+    patch_jump(p, else_jump);
+    forget_facts(p);
+    if (match(p, "if")) parse_if(p);
+    else parse_body(p);
+    patch_jump(p, end_jump);
+    forget_facts(p);
+}
+
+static void parse_while(parser_t *p) {
+    int32_t loop = (int32_t)emitter(p)->size;
+    forget_facts(p);
+    parse_value(p);
+    size_t exit_jump = emit_jump(p, JUMP_FALSE, 0);
+    parse_body(p);
+    emit_i32(p, JUMP, loop);
+    patch_jump(p, exit_jump);
+    forget_facts(p);
+}
+
+static void parse_statement(parser_t *p) {
+    token_t token = p->current;
+
+    if (match(p, "let")) {
+        parse_let(p);
+    } else if (match(p, "fn")) {
+        parse_fn(p, token);
+        return;
+    } else if (match(p, "if")) {
+        parse_if(p);
+        return;
+    } else if (match(p, "while")) {
+        parse_while(p);
+        return;
+    } else if (match(p, "return")) {
+        if (!p->fn) {
+            parse_error(p, token, "return outside of a function");
+            return;
+        }
+        if (p->current.kind == TOK_NEWLINE || p->current.kind == TOK_EOF || check(p, "}") || check(p, ";")) {
+            materialize(p, constant_expr(make_none()));
+        } else {
+            parse_value(p);
+        }
+        emit_op(p, RETURN);
+    } else if (token.kind == TOK_IDENT && p->next.kind == TOK_OP && token_is(&p->lexer, p->next, "=")) {
+        token_t name;
+        if (!expect_name(p, &name)) return;
+        advance(p); // =
+        skip_newlines(p);
+
+        int index;
+        VarKind kind = resolve_var(p, name, &index);
+        if (kind == VAR_NONE) {
+            parse_error(p, token, "'%.*s' is not declared", TOKEN_TEXT(p, token));
+            return;
+        }
+        store_var(p, kind, index, parse_expression(p, 1));
+    } else {
+        // an expression for its effects (a call), its value is dropped
+        if (!parse_expression(p, 1).constant) emit_op(p, POP);
+    }
+    end_statement(p);
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+/*
+    Inlining
+
+    Blocks are finished (inlined into, optimized, copied into the program arena) once the whole
+    file is parsed, every function after the functions it calls by name. A call by name whose
+    callee is finished, at most INLINE_MAX_SIZE bytes, not recursive and writes its locals
+    before it reads them, is replaced by the body:
+
+        STORE_LOCAL base+argc-1 .. STORE_LOCAL base     the arguments, into its parameters
+        the callee's code                               its locals moved up by base, its constants
+                                                        the caller's, RETURN a JUMP past its end
+                                                        (the last one falls through)
+
+    base is a range of new locals of the caller, shared by all the calls of one callee there
+    (an inlined body never runs within itself). In the main block, frame 0 is the block
+    itself, so the callee's globals become locals. A block grows by at most INLINE_MAX_GROWTH.
+*/
+
+#define INLINE_MAX_SIZE 64              // bytes of finished code
+#define INLINE_MAX_GROWTH (1 << 16)     // bytes inlining may add to a block
+
+enum { FN_PARSED, FN_FINISHING, FN_FINISHED };
+
+static inline int32_t read_i32(const uint8_t *code) {
+    return BYTES4_TO_INT(code[0], code[1], code[2], code[3]);
+}
+
+static inline void write_i32(uint8_t *code, int32_t v) {
+    uint8_t bytes[] = {INT_TO_BYTES4(v)};
+    memcpy(code, bytes, 4);
+}
+
+static int compare_block_refs(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const block_ref_t*)a)->block, y = (uintptr_t)((const block_ref_t*)b)->block;
+    return (x > y) - (x < y);
+}
+
+// the function the CALL_FUNC at code[ip] of e calls by name, NULL for any other instruction
+static function_t* called_function(parser_t *p, const emitter_t *e, size_t ip) {
+    if (e->code[ip] != CALL_FUNC || e->code[ip + 1] != CF_CONSTANT) return NULL;
+    type_t callee = e->constants[read_i32(&e->code[ip + 2])];
+    if (type_of(callee) != FUNCTION) return NULL;
+
+    uintptr_t block = (uintptr_t)as_ptr(callee);
+    size_t lo = 0, hi = p->function_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)p->by_block[mid].block < block) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == p->function_count || (uintptr_t)p->by_block[lo].block != block) return NULL;
+    return &p->functions[p->by_block[lo].index];
+}
+
+// the callee of the CALL_FUNC at code[ip] of e if its body can replace the call
+static function_t* inline_candidate(parser_t *p, const emitter_t *e, size_t ip) {
+    function_t *callee = called_function(p, e, ip);
+    if (!callee || !callee->inlinable || read_i32(&e->code[ip + 6]) != callee->arity) return NULL;
+    return callee;
+}
+
+// where the inlined code of c ends: without the PUSH_CONST none, RETURN after a RETURN no jump reaches
+static size_t inlined_end(const emitter_t *c) {
+    const uint8_t *code = c->code;
+    size_t size = c->size, last = SIZE_MAX, tail = SIZE_MAX, before = SIZE_MAX;
+    for (size_t ip = 0; ip < size; ip += bytecode_length(code, ip)) {
+        before = tail;
+        tail = last;
+        last = ip;
+    }
+    // tail is the PUSH_CONST, before the instruction ahead of it (not the last byte of one)
+    if (before == SIZE_MAX || code[last] != RETURN || code[tail] != PUSH_CONST || code[before] != RETURN) return size;
+    for (size_t ip = 0; ip < tail; ip += bytecode_length(code, ip)) {
+        if ((code[ip] == JUMP || code[ip] == JUMP_FALSE) && (size_t)read_i32(&code[ip + 1]) >= tail) return size;
+    }
+    return tail;
+}
+
+// length of the callee's instruction at code[ip] once inlined, size is where its inlined code ends
+static size_t inlined_length(const uint8_t *code, size_t ip, size_t size, bool top_level) {
+    switch (code[ip]) {
+        case RETURN:
+            return ip + 1 == size ? 0 : 5;
+        case PUSH: case STORE:
+            return top_level && read_i32(&code[ip + 1]) == 0 ? 5 : 9;
+        case CALL_FUNC:
+            if (top_level && code[ip + 1] == CF_GLOBAL && read_i32(&code[ip + 2]) == 0) return 10;
+            return bytecode_length(code, ip);
+        default:
+            return bytecode_length(code, ip);
+    }
+}
+
+// bytes the call of callee at code[ip] becomes
+static size_t inlined_size(const function_t *callee, bool top_level) {
+    const emitter_t *c = callee->body;
+    size_t size = (size_t)callee->arity * 5, end = inlined_end(c);
+    for (size_t ip = 0; ip < end; ip += bytecode_length(c->code, ip)) {
+        size += inlined_length(c->code, ip, end, top_level);
+    }
+    return size;
+}
+
+// writes the body of c at out[at] (out is the new code of the current block), returns where it ends
+static size_t emit_inlined(parser_t *p, const emitter_t *c, int32_t base, uint8_t *out, size_t at, bool top_level) {
+    const uint8_t *code = c->code;
+    size_t end = inlined_end(c), offset[INLINE_MAX_SIZE + 1];
+    for (size_t ip = 0; ip < end; ip += bytecode_length(code, ip)) {
+        offset[ip] = at;
+        at += inlined_length(code, ip, end, top_level);
+    }
+    offset[end] = at;
+
+    for (size_t ip = 0; ip < end; ip += bytecode_length(code, ip)) {
+        uint8_t op = code[ip], *w = &out[offset[ip]];
+        switch (op) {
+            case PUSH_LOCAL: case STORE_LOCAL: case INC_LOCAL: case DEC_LOCAL:
+                w[0] = op;
+                write_i32(&w[1], base + read_i32(&code[ip + 1]));
+                break;
+            case PUSH_CONST:
+                w[0] = op;
+                write_i32(&w[1], add_constant(p, c->constants[read_i32(&code[ip + 1])]));
+                break;
+            case PUSH: case STORE:
+                if (top_level && read_i32(&code[ip + 1]) == 0) {
+                    w[0] = op == PUSH ? PUSH_LOCAL : STORE_LOCAL;
+                    write_i32(&w[1], read_i32(&code[ip + 5]));
                 } else {
-                    // Map add failed
-                    free(var_name);
-                    map_free(var_map);
-                    fclose(f);
-                    line_free(&line);
-                    return -1;
+                    memcpy(w, &code[ip], 9);
+                }
+                break;
+            case JUMP: case JUMP_FALSE:
+                w[0] = op;
+                write_i32(&w[1], (int32_t)offset[read_i32(&code[ip + 1])]);
+                break;
+            case RETURN:
+                if (ip + 1 < end) {
+                    w[0] = JUMP;
+                    write_i32(&w[1], (int32_t)offset[end]);
+                }
+                break;
+            case CALL_FUNC:
+                memcpy(w, &code[ip], bytecode_length(code, ip));
+                if (code[ip + 1] == CF_CONSTANT) {
+                    write_i32(&w[2], add_constant(p, c->constants[read_i32(&code[ip + 2])]));
+                } else if (code[ip + 1] == CF_LOCAL) {
+                    write_i32(&w[2], base + read_i32(&code[ip + 2]));
+                } else if (top_level && read_i32(&code[ip + 2]) == 0) {
+                    w[1] = CF_LOCAL;
+                    write_i32(&w[2], read_i32(&code[ip + 6]));
+                    write_i32(&w[6], read_i32(&code[ip + 10]));
                 }
+                break;
+            default:
+                memcpy(w, &code[ip], bytecode_length(code, ip));
+        }
+    }
+    return at;
+}
+
+// replaces the calls of the current block (p->fn, or main) that can be inlined by their bodies
+static void inline_calls(parser_t *p) {
+    emitter_t *e = emitter(p);
+    bool top_level = e == &p->main;
+    const uint8_t *code = e->code;
+    size_t size = e->size;
+
+    // the calls to replace (the same ones in both passes), and the new size
+    size_t new_size = 0, grown = 0, jumps = 0;
+    for (size_t ip = 0; ip < size; ip += bytecode_length(code, ip)) {
+        size_t length = bytecode_length(code, ip);
+        function_t *callee = inline_candidate(p, e, ip);
+        if (callee) {
+            size_t inlined = inlined_size(callee, top_level);
+            if (grown + inlined <= INLINE_MAX_GROWTH) {
+                grown += inlined;
+                new_size += inlined;
+                continue;
+            }
+        }
+        jumps += code[ip] == JUMP || code[ip] == JUMP_FALSE;
+        new_size += length;
+    }
+    if (!grown) return;
+
+    uint8_t *out = arena_alloc(p, p->scratch, new_size);
+    size_t *new_offset = arena_alloc(p, p->scratch, (size + 1) * sizeof(size_t));
+    size_t *own_jumps = arena_alloc(p, p->scratch, (jumps ? jumps : 1) * sizeof(size_t));
+    if (!out || !new_offset || !own_jumps || new_size > INT32_MAX) return;
+
+    size_t at = 0, jump_count = 0;
+    grown = 0;
+    for (size_t ip = 0; ip < size; ip += bytecode_length(code, ip)) {
+        new_offset[ip] = at;
+        function_t *callee = inline_candidate(p, e, ip);
+        if (callee) {
+            size_t inlined = inlined_size(callee, top_level);
+            if (grown + inlined <= INLINE_MAX_GROWTH) {
+                grown += inlined;
+                if (callee->inlined_into != e) {
+                    callee->inlined_into = e;
+                    callee->inline_base = e->local_count;
+                    e->local_count += callee->body->local_count;
+                }
+                int32_t base = (int32_t)callee->inline_base;
+                for (int a = callee->arity - 1; a >= 0; a--) {
+                    out[at] = STORE_LOCAL;
+                    write_i32(&out[at + 1], base + a);
+                    at += 5;
+                }
+                at = emit_inlined(p, callee->body, base, out, at, top_level);
+                continue;
+            }
+        }
+        if (code[ip] == JUMP || code[ip] == JUMP_FALSE) own_jumps[jump_count++] = at;
+        memcpy(&out[at], &code[ip], bytecode_length(code, ip));
+        at += bytecode_length(code, ip);
+    }
+    new_offset[size] = at;
+
+    // the block's own jumps go to the same instructions in the new layout
+    for (size_t j = 0; j < jump_count; j++) {
+        write_i32(&out[own_jumps[j] + 1], (int32_t)new_offset[read_i32(&out[own_jumps[j] + 1])]);
+    }
+    if (p->failed) return;
+    e->code = out;
+    e->size = e->capacity = at;
+}
+
+// whether every local past the parameters is written before it is read (so a call can leave them as they were)
+static bool locals_written_first(const block_t *block, int arity) {
+    block_t probe = *block;
+    block_analyze_locals(&probe);
+    return probe.zero_locals <= (size_t)arity;
+}
+
+static void finish_function(parser_t *p, function_t *f, bool recursive) {
+    p->fn = f->body;
+    inline_calls(p);
+    p->fn = NULL;
+    emitter_finish(p, f->body);
+    f->state = FN_FINISHED;
+    f->inlinable = !p->failed && !recursive && f->body->size <= INLINE_MAX_SIZE &&
+                   locals_written_first(f->block, f->arity);
+}
+
+// a function on the way down to its callees
+typedef struct {
+    size_t index;
+    size_t ip;          // of the next call to look at
+    bool recursive;
+} pending_t;
+
+// finishes the functions, each after its callees (depth first, without recursion in C), then main
+static void finish_blocks(parser_t *p) {
+    size_t n = p->function_count;
+    p->by_block = arena_alloc(p, p->scratch, n * sizeof(block_ref_t));
+    pending_t *stack = arena_alloc(p, p->scratch, n * sizeof(pending_t));
+    if (p->failed) return;
+
+    for (size_t i = 0; i < n; i++) p->by_block[i] = (block_ref_t){.block = p->functions[i].block, .index = i};
+    if (n) qsort(p->by_block, n, sizeof(block_ref_t), compare_block_refs);
+
+    for (size_t i = 0; i < n && !p->failed; i++) {
+        if (p->functions[i].state != FN_PARSED) continue;
+        size_t depth = 0;
+        p->functions[i].state = FN_FINISHING;
+        stack[depth++] = (pending_t){.index = i};
+
+        while (depth) {
+            function_t *f = &p->functions[stack[depth - 1].index];
+            const emitter_t *e = f->body;
+            function_t *next = NULL;
+            size_t ip = stack[depth - 1].ip;
+            while (ip < e->size && !next) {
+                function_t *callee = called_function(p, e, ip);
+                ip += bytecode_length(e->code, ip);
+                if (!callee) continue;
+                if (callee->state == FN_PARSED) next = callee;
+                else if (callee->state == FN_FINISHING) stack[depth - 1].recursive = true; // itself, or a caller
+            }
+            stack[depth - 1].ip = ip;
+
+            if (next) {
+                next->state = FN_FINISHING;
+                stack[depth++] = (pending_t){.index = (size_t)(next - p->functions)};
+            } else {
+                depth--;
+                finish_function(p, f, stack[depth].recursive);
             }
-            // If variable exists, we could handle redeclaration here
-            
-            free(var_name);
         }
     }
-    
-    fclose(f);
-    line_free(&line);
-    
-    out_block->local_count = local_count;
-    out_block->constant_count = constant_count;
-    out_block->instruction_size = instruction_size;
-    out_block->instructions = NULL;
-    out_block->constants = NULL;
-    
-    printf("variable count: %zu\n", local_count);
-    printf("variable indices:\n");
-
-    MAP_ITERATE(var_map, i, key, index, {
-        printf("%s -> %d\n", key, index);
-    })
-
-    map_free(var_map);
-    
+
+    inline_calls(p);
+    emitter_finish(p, &p->main);
+}
+
+static int compile_src(const char *filename, const char *src, size_t size, block_t *out_block) {
+    parser_t p = {.filename = filename};
+    p.arena = ac_init(READ_ARENA_CAPACITY);
+    p.scratch = ac_init(READ_ARENA_CAPACITY + size);
+    if (!p.arena || !p.scratch) {
+        if (p.arena) ac_destroy(p.arena);
+        if (p.scratch) ac_destroy(p.scratch);
+        return -1;
+    }
+
+    block_t main_block = {0};
+    emitter_init(&p.main, &main_block);
+
+    lexer_init(&p.lexer, src, size);
+    p.next = lex_next(&p.lexer);
+    advance(&p);
+
+    skip_newlines(&p);
+    while (p.current.kind != TOK_EOF) {
+        parse_statement(&p);
+        skip_newlines(&p);
+    }
+    emit_op(&p, HALT);
+
+    for (size_t i = 0; i < p.function_count; i++) {
+        token_t name = p.functions[i].name;
+        if (!p.functions[i].defined) parse_error(&p, name, "%.*s is called but never defined", TOKEN_TEXT(&p, name));
+    }
+    finish_blocks(&p);
+    ac_destroy(p.scratch);
+
+    // the arena is the program now, it lives as long as the process (see read.h)
+    if (p.failed) {
+        ac_destroy(p.arena);
+        return -1;
+    }
+    *out_block = main_block;
     return 0;
 }
 
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../vm/image.h"
+
+#define CACHE_PATH_MAX 4096
+
+// FNV-1a of the compiler version, the value layout (constants are folded with its INT width) and the source
+static uint64_t hash_src(const source_t *source) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const char *v = READ_COMPILER_VERSION; *v; v++) h = (h ^ (uint8_t)*v) * 0x100000001b3ull;
+    h = (h ^ sizeof(type_t)) * 0x100000001b3ull;
+    for (size_t i = 0; i < source->size; i++) h = (h ^ (uint8_t)source->data[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// the cache entry of a source with that hash, false if the cache is off
+static bool cache_path(uint64_t hash, char *path) {
+    const char *dir = getenv("MPL_CACHE_DIR");
+    if (!dir) dir = READ_DEFAULT_CACHE_DIR;
+    if (!*dir) return false;
+    int n = snprintf(path, CACHE_PATH_MAX, "%s/%016llx.mplb", dir, (unsigned long long)hash);
+    return n > 0 && n < CACHE_PATH_MAX;
+}
+
+static bool cache_load(const char *path, block_t *out_block) {
+    if (access(path, R_OK) != 0) return false; // a miss, image_load would complain about it
+    image_t *image = image_load(path);
+    if (!image) return false;
+
+    // never freed, see "Compiled module cache" in read.h
+    *out_block = *image->entry;
+    return true;
+}
+
+static void cache_store(const char *path, block_t *block) {
+    char dir[CACHE_PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return;
+    image_write(path, block, true);
+}
+
+int read_src_file(const char *filename, block_t *out_block) {
+    source_t source;
+    if (source_open(filename, &source) != 0) return -1;
+
+    char path[CACHE_PATH_MAX];
+    bool cached = cache_path(hash_src(&source), path);
+    if (cached && cache_load(path, out_block)) {
+        source_close(&source);
+        return 0;
+    }
+
+    int result = compile_src(filename, source.data, source.size, out_block);
+    source_close(&source);
+    if (result == 0 && cached) cache_store(path, out_block);
+    return result;
+}
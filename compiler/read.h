@@ -23,6 +23,59 @@ bool is_blank_line(const line_t *line);
 
 #include "../vm/vm.h"
 
+/*
+    MPL source
+
+    read_src_file compiles a source file in one pass, straight from the tokens (lex.h) to the
+    bytecode of the blocks, without a tree in between. The top level is the main block (ends
+    with HALT), every fn is a block of its own and a FUNCTION constant of its callers.
+
+        let x = expr            declares x (none without a value), a later let x reuses it
+        x = expr                assigns a declared variable
+        fn f(a, b) { ... }      top level only, may be called above its definition
+        return expr             return alone returns none, so does the end of a function
+        if expr { ... } else if expr { ... } else { ... }
+        while expr { ... }
+        expr                    a call, its value is dropped
+
+    Statements end at a newline or a ';'. Operators from the loosest: || && (both sides are always
+    evaluated), == !=, < > <= >=, |, &, + -, * / %, then the unary ! and -. Literals are 12 (INT,
+    too large past INT_VALUE_MAX of type.h), 1.5 and 1e3 (NUMBER), "text" (\n \t \" \\ escapes,
+    equal to the same text), true, false and none. print(...) is the builtin. Operators on
+    constants, and on locals known to hold one, are computed while compiling (constant folding and
+    propagation, see read.c). Once the file is parsed, calls by name of small non-recursive
+    functions are replaced by their bodies (inlining, see read.c), and every block goes through
+    optimize_locals, specialize_ops, optimize_loops and eliminate_common (opt.h) before it is
+    kept: ops on values known to be INTs or NUMBERs do not check their types, loops compute what
+    does not change in them once, before they start, and a value computed twice in a row is
+    computed once.
+
+    Variables of the top level are globals: a function reads and writes them through frame 0
+    (PUSH/STORE) unless it has a local of the same name. A variable holding a function is
+    called through its local (CALL_FUNC CF_LOCAL/CF_GLOBAL).
+
+    The first error is reported on stderr as file:line: message and read_src_file returns -1.
+    The code, constants and strings of a compiled program live in one arena that is kept
+    until the process exits.
+*/
+
+/*
+    Compiled module cache
+
+    read_src_file hashes the source together with READ_COMPILER_VERSION and looks for
+    <cache dir>/<hash>.mplb, a bytecode image (see vm/image.h). If there is one it is loaded
+    instead of compiling the source, otherwise the compiled block is written there for the
+    next process. The cache dir is $MPL_CACHE_DIR, READ_DEFAULT_CACHE_DIR if that is not set,
+    and an empty MPL_CACHE_DIR turns the cache off. A cache that cannot be read or written
+    only costs a compile.
+
+    A loaded image stays mapped until the process exits, out_block and the blocks it calls
+    point into it.
+*/
+
+#define READ_COMPILER_VERSION "mpl-0.8" // change with anything that changes the compiled code
+#define READ_DEFAULT_CACHE_DIR ".mplcache"
+
 int read_src_file(const char *filename, block_t *out_block);
 
 
@@ -1,6 +1,689 @@
+#define _XOPEN_SOURCE 700
 #include "../read.h"
 #include "../../data-structures/map.h"
+#include <dirent.h>
+#include <ftw.h>
+#include <string.h>
+#include <unistd.h>
 
+#define TEST_PASS printf("✅ PASS: %s\n", __func__)
+#define TEST_FAIL printf("❌ FAIL: %s - line %d\n", __func__, __LINE__)
+
+#define OUTPUT_CAPACITY 4096
+#define PATH_CAPACITY 512     // a test dir path and a file name
+
+static char test_dir[] = "/tmp/mpl_test_XXXXXX";
+
+static void write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fputs(text, f);
+    fclose(f);
+}
+
+// runs block with stdout captured into out (NUL-terminated)
+static void run_captured(block_t *block, char *out) {
+    fflush(stdout);
+    FILE *capture = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    if (!capture || saved < 0) {
+        perror("capture");
+        exit(EXIT_FAILURE);
+    }
+    dup2(fileno(capture), STDOUT_FILENO);
+
+    vm_t vm;
+    vm_init(&vm, 0, 0);
+    vm_run(&vm, block);
+    vm_free(&vm);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    rewind(capture);
+    size_t n = fread(out, 1, OUTPUT_CAPACITY - 1, capture);
+    out[n] = '\0';
+    fclose(capture);
+}
+
+// compiles and runs the source file path with the module cache in cache_dir ("" for none),
+// -1 if it does not compile
+static int run_file(const char *path, const char *cache_dir, char *out) {
+    setenv("MPL_CACHE_DIR", cache_dir, 1);
+    block_t block;
+    if (read_src_file(path, &block) != 0) return -1;
+    run_captured(&block, out);
+    return 0;
+}
+
+// writes src to a file of the test dir and compiles it without a cache
+static int compile_text(const char *src, block_t *block) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/test.mpl", test_dir);
+    write_file(path, src);
+    setenv("MPL_CACHE_DIR", "", 1);
+    return read_src_file(path, block);
+}
+
+// compiles and runs src, -1 if it does not compile
+static int run_src(const char *src, char *out) {
+    block_t block;
+    if (compile_text(src, &block) != 0) return -1;
+    run_captured(&block, out);
+    return 0;
+}
+
+// instructions op of block (with that op byte after it, for CALL_OP and friends, unless arg < 0)
+static size_t count_ops(const block_t *block, uint8_t op, int arg) {
+    size_t n = 0;
+    for (size_t at = 0; at < block->instruction_size; at += bytecode_length(block->instructions, at)) {
+        n += block->instructions[at] == op && (arg < 0 || block->instructions[at + 1] == arg);
+    }
+    return n;
+}
+
+// instructions op of block inside a loop, between a backward JUMP and its target
+static size_t count_in_loops(const block_t *block, uint8_t op, int arg) {
+    size_t n = 0;
+    const uint8_t *code = block->instructions;
+    for (size_t back = 0; back < block->instruction_size; back += bytecode_length(code, back)) {
+        if (code[back] != JUMP) continue;
+        size_t header = (size_t)BYTES4_TO_INT(code[back + 1], code[back + 2], code[back + 3], code[back + 4]);
+        for (size_t at = header; at < back; at += bytecode_length(code, at)) {
+            n += code[at] == op && (arg < 0 || code[at + 1] == arg);
+        }
+    }
+    return n;
+}
+
+// the nth FUNCTION constant of block, NULL if there is none
+static block_t* function_of(const block_t *block, size_t nth) {
+    for (size_t i = 0; i < block->constant_count; i++) {
+        if (type_of(block->constants[i]) == FUNCTION && !nth--) return as_ptr(block->constants[i]);
+    }
+    return NULL;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+// the path of the one cached image in dir, false if there is not exactly one
+static bool only_image(const char *dir, char *path, size_t size) {
+    DIR *d = opendir(dir);
+    if (!d) return false;
+    int found = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (!strstr(entry->d_name, ".mplb")) continue;
+        snprintf(path, size, "%s/%s", dir, entry->d_name);
+        found++;
+    }
+    closedir(d);
+    return found == 1;
+}
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+/* Test 1: test_read.mpl compiled from source, never from a cached image */
+int test_read_mpl() {
+    char out[OUTPUT_CAPACITY];
+    if (run_file("test_read.mpl", "", out) != 0 ||
+        strcmp(out, "10\nfib(20) = 6765\nzero\none\nmany: 5.000000\nhayy 5 15 -15 false\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 2: a second load of the same source is the cached image */
+int test_cache_hit() {
+    char dir[64], other_dir[64], src[64], other[64], image[PATH_CAPACITY], other_image[PATH_CAPACITY], out[OUTPUT_CAPACITY];
+    snprintf(dir, sizeof(dir), "%s/hit", test_dir);
+    snprintf(other_dir, sizeof(other_dir), "%s/hit_other", test_dir);
+    snprintf(src, sizeof(src), "%s/hit.mpl", test_dir);
+    snprintf(other, sizeof(other), "%s/hit_other.mpl", test_dir);
+    write_file(src, "print(1)\n");
+    write_file(other, "print(2)\n");
+
+    // the entry of src replaced by the image of another program: only a hit prints 2
+    bool ok = run_file(src, dir, out) == 0 && strcmp(out, "1\n") == 0 &&
+              run_file(other, other_dir, out) == 0 && strcmp(out, "2\n") == 0 &&
+              only_image(dir, image, sizeof(image)) && only_image(other_dir, other_image, sizeof(other_image)) &&
+              rename(other_image, image) == 0 &&
+              run_file(src, dir, out) == 0 && strcmp(out, "2\n") == 0;
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 3: an edited source misses and gets an image of its own */
+int test_cache_edit_misses() {
+    char dir[64], src[64], image[PATH_CAPACITY], out[OUTPUT_CAPACITY];
+    snprintf(dir, sizeof(dir), "%s/edit", test_dir);
+    snprintf(src, sizeof(src), "%s/edit.mpl", test_dir);
+    write_file(src, "print(1)\n");
+    bool ok = run_file(src, dir, out) == 0 && strcmp(out, "1\n") == 0 && only_image(dir, image, sizeof(image));
+
+    write_file(src, "print(3)\n");
+    ok = ok && run_file(src, dir, out) == 0 && strcmp(out, "3\n") == 0 && !only_image(dir, image, sizeof(image));
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 4: a truncated or corrupt image is compiled again instead */
+int test_cache_corrupt() {
+    char dir[64], src[64], image[PATH_CAPACITY], out[OUTPUT_CAPACITY];
+    snprintf(dir, sizeof(dir), "%s/corrupt", test_dir);
+    snprintf(src, sizeof(src), "%s/corrupt.mpl", test_dir);
+    write_file(src, "let i = 0\nwhile i < 3 { i = i + 1 }\nprint(i)\n");
+    bool ok = run_file(src, dir, out) == 0 && strcmp(out, "3\n") == 0 && only_image(dir, image, sizeof(image));
+
+    ok = ok && truncate(image, 12) == 0 && run_file(src, dir, out) == 0 && strcmp(out, "3\n") == 0;
+    write_file(image, "not an image, not at all an image");
+    ok = ok && run_file(src, dir, out) == 0 && strcmp(out, "3\n") == 0;
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 5: a call may store the global a constant was propagated from */
+int test_facts_call() {
+    char out[OUTPUT_CAPACITY];
+    if (run_src("let x = 5\nfn set() { x = 7 }\nset()\nprint(x)\n", out) != 0 || strcmp(out, "7\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 6: what an if body stores is not known after it, with or without an else */
+int test_facts_if() {
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn pick(c) {\n"
+        "    let y = 1\n"
+        "    if c { y = 2 }\n"
+        "    let z = 1\n"
+        "    if c { z = 3 } else { z = 4 }\n"
+        "    return y * 10 + z\n"
+        "}\n"
+        "print(pick(true))\n"
+        "print(pick(false))\n";
+    if (run_src(src, out) != 0 || strcmp(out, "23\n14\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 7: a constant stored in a loop body is not known on the way round (i is never known) */
+int test_facts_while() {
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn zero() { return 0 }\n"
+        "let i = zero()\n"
+        "let k = 1\n"
+        "let s = 0\n"
+        "while i < 3 {\n"
+        "    s = s + k\n"
+        "    k = 5\n"
+        "    i = i + 1\n"
+        "}\n"
+        "print(s)\n";
+    if (run_src(src, out) != 0 || strcmp(out, "11\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 8: 1 % 0 is not folded, the VM reports it when it runs */
+int test_fold_modulo_zero() {
+    block_t block;
+    if (compile_text("let a = 1 % 0\nprint(a)\n", &block) != 0 ||
+        count_ops(&block, CALL_OP, OP_MOD) + count_ops(&block, CALL_OP_INT, OP_MOD) != 1) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 9: a store nothing reads is gone, its value is dropped */
+int test_dead_store() {
+    block_t block, *f;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn f(a) {\n"
+        "    let unused = a * 2\n"
+        "    return a\n"
+        "}\n"
+        "print(f(3))\n";
+    if (compile_text(src, &block) != 0 || !(f = function_of(&block, 0)) || count_ops(f, STORE_LOCAL, -1) != 0 ||
+        run_src(src, out) != 0 || strcmp(out, "3\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 10: at the top level a call may read any global, a store before it stays */
+int test_store_before_call() {
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let g = 1\n"
+        "fn show(n) {\n"
+        "    if n > 0 { return show(n - 1) }\n"
+        "    print(g)\n"
+        "}\n"
+        "g = 2\n"
+        "show(1)\n"
+        "g = 3\n";
+    if (run_src(src, out) != 0 || strcmp(out, "2\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 11: a typed piece computed twice in a basic block is computed once, not across a write */
+int test_common_pieces() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let s = 0\n"
+        "let i = 0\n"
+        "while i < 10 {\n"
+        "    s = s + (i * i + 1) * (i * i + 1)\n"
+        "    i = i + 1\n"
+        "}\n"
+        "let t = 0\n"
+        "let j = 0\n"
+        "while j < 10 {\n"
+        "    t = t + (j * j + 1)\n"
+        "    j = j + 1\n"
+        "    t = t + (j * j + 1)\n"
+        "}\n"
+        "print(s)\n"
+        "print(t)\n";
+    // i * i, their product and both j * j
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_OP_INT, OP_MUL) != 4 ||
+        run_src(src, out) != 0 || strcmp(out, "15913\n690\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 12: + on INTs is CALL_OP_INT, / on INTs gives a NUMBER that the next + knows */
+int test_typed_emitted() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let i = 0\n"
+        "let q = 0.0\n"
+        "while i < 6 {\n"
+        "    q = q + i / 2\n"
+        "    i = i + 2\n"
+        "}\n"
+        "print(q)\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_OP, -1) != 0 ||
+        count_ops(&block, CALL_OP_INT, OP_ADD) != 1 || count_ops(&block, CALL_OP_INT, OP_DIV) != 1 ||
+        count_ops(&block, CALL_OP_NUMBER, OP_ADD) != 1 ||
+        run_src(src, out) != 0 || strcmp(out, "3.000000\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 13: a local that is an INT on one branch and a NUMBER on the other is not typed after them */
+int test_join_generic() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let i = 0\n"
+        "let x = 0\n"
+        "let y = 0\n"
+        "while i < 4 {\n"
+        "    if i < 2 { x = 1 } else { x = 1.5 }\n"
+        "    y = y + x * 2\n"
+        "    i = i + 1\n"
+        "}\n"
+        "print(y)\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_OP, OP_MUL) != 1 ||
+        count_ops(&block, CALL_OP_INT, OP_MUL) + count_ops(&block, CALL_OP_NUMBER, OP_MUL) != 0 ||
+        run_src(src, out) != 0 || strcmp(out, "10.000000\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 14: a parameter, and a global after a call at the top level, may hold anything */
+int test_unknown_generic() {
+    block_t block, *g;
+    char out[OUTPUT_CAPACITY];
+    const char *param = "fn g(a) { return a + 1 }\nprint(g(1))\n";
+    bool ok = compile_text(param, &block) == 0 && (g = function_of(&block, 0)) &&
+              count_ops(g, CALL_OP, OP_ADD) == 1 && count_ops(g, CALL_OP_INT, -1) == 0;
+
+    const char *call =
+        "fn h(n) {\n"
+        "    if n > 0 { return h(n - 1) }\n"
+        "    return 0\n"
+        "}\n"
+        "let k = 0\n"
+        "while k < 3 {\n"
+        "    h(1)\n"
+        "    k = k + 1\n"
+        "}\n"
+        "print(k)\n";
+    ok = ok && compile_text(call, &block) == 0 && count_ops(&block, CALL_OP, OP_ADD) == 1 &&
+         count_ops(&block, CALL_OP_INT, -1) == 0 && run_src(call, out) == 0 && strcmp(out, "3\n") == 0;
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 15: an inlined callee returning early from inside an if */
+int test_inline_early_return() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn clamp0(x) {\n"
+        "    if x < 0 { return 0 }\n"
+        "    return x\n"
+        "}\n"
+        "print(clamp0(-3))\n"
+        "print(clamp0(4))\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_FUNC, -1) != 0 ||
+        run_src(src, out) != 0 || strcmp(out, "0\n4\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 16: a callee with a loop inlined in the middle of an expression, in a loop: the operands
+   waiting on the stack are typed across the inlined loop's jumps */
+int test_inline_loop_in_expression() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn parity(n) {\n"
+        "    while n > 1 { n = n - 2 }\n"
+        "    return n\n"
+        "}\n"
+        "let t = 0\n"
+        "let k = 0\n"
+        "while k < 6 {\n"
+        "    t = t + 100 * parity(k) + 1\n"
+        "    k = k + 1\n"
+        "}\n"
+        "print(t)\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_FUNC, -1) != 0 || count_ops(&block, CALL_OP, -1) != 0 ||
+        run_src(src, out) != 0 || strcmp(out, "306\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 17: a callee writing a global, inlined into main, writes main's local */
+int test_inline_global_store() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let g = 0\n"
+        "fn bump() { g = g + 5 }\n"
+        "bump()\n"
+        "bump()\n"
+        "print(g)\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_FUNC, -1) != 0 ||
+        count_ops(&block, STORE, -1) != 0 || count_ops(&block, PUSH, -1) != 0 || count_ops(&block, STORE_LOCAL, -1) == 0 ||
+        run_src(src, out) != 0 || strcmp(out, "10\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 18: mutually recursive functions stay calls */
+int test_inline_recursion() {
+    block_t block, *even, *odd;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn even(n) {\n"
+        "    if n == 0 { return true }\n"
+        "    return odd(n - 1)\n"
+        "}\n"
+        "fn odd(n) {\n"
+        "    if n == 0 { return false }\n"
+        "    return even(n - 1)\n"
+        "}\n"
+        "print(even(10))\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_FUNC, -1) != 1 ||
+        !(even = function_of(&block, 0)) || !(odd = function_of(even, 0)) ||
+        count_ops(even, CALL_FUNC, -1) + count_ops(even, TAIL_CALL, -1) != 1 ||
+        count_ops(odd, CALL_FUNC, -1) + count_ops(odd, TAIL_CALL, -1) != 1 ||
+        run_src(src, out) != 0 || strcmp(out, "true\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 19: a callee of 64 bytes is inlined, one of 65 is not */
+int test_inline_size_limit() {
+    block_t block, *big, *fits;
+    const char *src =
+        "fn big(a) { return !!(a + 1 + 1 + 1 + 1 + 1 + 1 + 1) }\n"
+        "fn fits(a) { return !!!!!(a + 1 + 1 + 1 + 1 + 1 + 1) }\n"
+        "print(big(1))\n"
+        "print(fits(1))\n";
+    if (compile_text(src, &block) != 0 || !(big = function_of(&block, 0)) || !(fits = function_of(&block, 1)) ||
+        big->instruction_size != 65 || fits->instruction_size != 64 || count_ops(&block, CALL_FUNC, -1) != 1) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 20: an invariant k * 3 is computed before the loop, right when the loop never runs */
+int test_hoist_invariant() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let k = 4\n"
+        "if k > 10 { k = 5 }\n"
+        "let n = 0\n"
+        "if n > 10 { n = 1 }\n"
+        "let s = 0\n"
+        "let i = 0\n"
+        "while i < n {\n"
+        "    s = s + k * 3\n"
+        "    i = i + 1\n"
+        "}\n"
+        "print(s)\n"
+        "let j = 0\n"
+        "while j < 2 {\n"
+        "    s = s + k * 3\n"
+        "    j = j + 1\n"
+        "}\n"
+        "print(s)\n";
+    if (compile_text(src, &block) != 0 || count_ops(&block, CALL_OP_INT, OP_MUL) != 2 ||
+        count_in_loops(&block, CALL_OP_INT, OP_MUL) != 0 ||
+        run_src(src, out) != 0 || strcmp(out, "0\n24\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 21: 7 % d can fail, it stays in the loop body and a loop that never runs never computes it */
+int test_hoist_not_failing() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "fn modz(n, d) {\n"
+        "    let s = 0\n"
+        "    let i = 0\n"
+        "    while i < n {\n"
+        "        s = s + 7 % d\n"
+        "        i = i + 1\n"
+        "    }\n"
+        "    return s\n"
+        "}\n"
+        "print(modz(0, 0))\n"
+        "let d = 0\n"
+        "if d > 10 { d = 1 }\n"
+        "let s = 0\n"
+        "let i = 0\n"
+        "while i < d {\n"
+        "    s = s + 7 % d\n"
+        "    i = i + 1\n"
+        "}\n"
+        "print(s)\n";
+    if (compile_text(src, &block) != 0 || count_in_loops(&block, CALL_OP, OP_MOD) != 1 ||
+        run_src(src, out) != 0 || strcmp(out, "0\n0\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 22: a call in a top-level loop may write any global, nothing of the loop is hoisted */
+int test_hoist_not_across_call() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let k = 4\n"
+        "fn bump(n) {\n"
+        "    if n > 0 { return bump(n - 1) }\n"
+        "    k = k + 1\n"
+        "}\n"
+        "if k > 10 { k = 5 }\n"
+        "let s = 0\n"
+        "let j = 0\n"
+        "while j < 3 {\n"
+        "    s = s + k * 3\n"
+        "    bump(1)\n"
+        "    j = j + 1\n"
+        "}\n"
+        "print(s)\n";
+    if (compile_text(src, &block) != 0 || block.local_count != 3 ||
+        count_in_loops(&block, CALL_OP, OP_MUL) != 1 ||
+        run_src(src, out) != 0 || strcmp(out, "45\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 23: an if skipping its body jumps to the header of the loop after it, through its preheader */
+int test_hoist_jump_to_header() {
+    block_t block;
+    char out[OUTPUT_CAPACITY];
+    const char *src =
+        "let k = 4\n"
+        "if k > 10 { k = 5 }\n"
+        "let s = 0\n"
+        "let j = 0\n"
+        "if k > 100 { s = 100 }\n"
+        "while j < 2 {\n"
+        "    s = s + k * 3\n"
+        "    j = j + 1\n"
+        "}\n"
+        "print(s)\n";
+    if (compile_text(src, &block) != 0 || count_in_loops(&block, CALL_OP_INT, OP_MUL) != 0 ||
+        run_src(src, out) != 0 || strcmp(out, "24\n") != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 24: the largest and smallest INT literals, one past them does not compile */
+int test_int_literal_range() {
+    char src[128], expected[64], out[OUTPUT_CAPACITY];
+    unsigned long long max = (unsigned long long)INT_VALUE_MAX;
+    snprintf(src, sizeof(src), "print(%llu)\nprint(-%llu)\n", max, max + 1);
+    snprintf(expected, sizeof(expected), "%lld\n%lld\n", (long long)INT_VALUE_MAX, (long long)INT_VALUE_MIN);
+    bool ok = run_src(src, out) == 0 && strcmp(out, expected) == 0;
+
+    snprintf(src, sizeof(src), "print(%llu)\n", max + 1);
+    ok = ok && run_src(src, out) != 0;
+    snprintf(src, sizeof(src), "print(-%llu)\n", max + 2);
+    ok = ok && run_src(src, out) != 0 && run_src("print(99999999999999999999)\n", out) != 0;
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 25: string literals with the same text are equal, in one block, across blocks and from an image */
+int test_string_literal_equality() {
+    char dir[64], src[64], out[OUTPUT_CAPACITY];
+    snprintf(dir, sizeof(dir), "%s/strings", test_dir);
+    snprintf(src, sizeof(src), "%s/strings.mpl", test_dir);
+    write_file(src,
+        "fn a() { return \"a\" }\n"
+        "fn other() { if 1 > 0 { return \"a\" } return other() }\n"
+        "print(\"a\" == \"a\")\n"
+        "print(a() == \"a\")\n"
+        "print(other() == \"a\")\n"
+        "print(\"a\" != \"b\")\n");
+    bool ok = true;
+    for (int run = 0; run < 2; run++) {
+        ok = ok && run_file(src, dir, out) == 0 && strcmp(out, "true\ntrue\ntrue\ntrue\n") == 0;
+    }
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
 
 int main() {
     line_t line;
@@ -20,6 +703,9 @@ int main() {
     // line_free(&line);
     // fclose(f);
 
+    // the compiler, never the cache in the working directory
+    setenv("MPL_CACHE_DIR", "", 1);
+
     block_t block;
 
     if (read_src_file("test_read.mpl", &block) != 0) {
@@ -32,6 +718,11 @@ int main() {
            block.constant_count,
            block.local_count);
 
+    vm_t vm;
+    vm_init(&vm, 0, 0);
+    vm_run(&vm, &block);
+    vm_free(&vm);
+
 
     map_t *m = map_init();
 
@@ -45,6 +736,42 @@ int main() {
         if (idx % 100) printf("%s -> %d\n", key, index);
     })
 
-    return 0;
-}
+    if (!mkdtemp(test_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
 
+    int passed = 0, total = 0;
+    printf("\n=== compiler ===\n");
+
+    total++; passed += test_read_mpl();
+    total++; passed += test_cache_hit();
+    total++; passed += test_cache_edit_misses();
+    total++; passed += test_cache_corrupt();
+    total++; passed += test_facts_call();
+    total++; passed += test_facts_if();
+    total++; passed += test_facts_while();
+    total++; passed += test_fold_modulo_zero();
+    total++; passed += test_dead_store();
+    total++; passed += test_store_before_call();
+    total++; passed += test_common_pieces();
+    total++; passed += test_typed_emitted();
+    total++; passed += test_join_generic();
+    total++; passed += test_unknown_generic();
+    total++; passed += test_inline_early_return();
+    total++; passed += test_inline_loop_in_expression();
+    total++; passed += test_inline_global_store();
+    total++; passed += test_inline_recursion();
+    total++; passed += test_inline_size_limit();
+    total++; passed += test_hoist_invariant();
+    total++; passed += test_hoist_not_failing();
+    total++; passed += test_hoist_not_across_call();
+    total++; passed += test_hoist_jump_to_header();
+    total++; passed += test_int_literal_range();
+    total++; passed += test_string_literal_equality();
+
+    nftw(test_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("\n%d/%d tests passed\n", passed, total);
+    return passed == total ? 0 : 1;
+}
@@ -1,16 +1,21 @@
 #include <stdio.h>
+#include <string.h>
 #include "vm/vm.h"
+#include "vm/reg.h"
+#include "vm/sample.h"
+#include "vm/image.h"
+#include "compiler/read.h"
 
-int main() {
+int main(int argc, char **argv) {
 
-    double fib_max = 40.0;
+    int fib_max = 40;
 
     // Fibonacci function
     // fib(n) ->
     //     if n <= 1 -> return n
     //     else -> return fib(n-1) + fib(n-2)
     
-    block_t fib_block;
+    block_t fib_block = {0};
     uint8_t fib_code[] = {
         // if n <= 1
         PUSH_LOCAL, INT_TO_BYTES4(0),
@@ -43,17 +48,12 @@ int main() {
         RETURN,
     };
 
-    type_t fib_block_type = {
-        .type = FUNCTION,
-        .value = {
-            .ptr_u = &fib_block
-        }
-    };
+    type_t fib_block_type = make_ptr(FUNCTION, &fib_block);
     
     type_t fib_consts[] = {
-        (type_t){.type = NUMBER, .value = {.float_u = 1}},     // 0
+        make_int(1),                                            // 0
         fib_block_type,                                         // 1 (self-reference for recursion)
-        (type_t){.type = NUMBER, .value = {.float_u = 2}},     // 2
+        make_int(2),                                            // 2
     };
     
     fib_block.local_count = 2;
@@ -74,7 +74,7 @@ int main() {
         PUSH_LOCAL, INT_TO_BYTES4(0),
         PUSH_CONST, INT_TO_BYTES4(3),
         CALL_OP, BYTE(OP_LT),
-        JUMP_FALSE, INT_TO_BYTES4(86/*offset*/),
+        JUMP_FALSE, INT_TO_BYTES4(87/*offset*/),
 
         PUSH_LOCAL, INT_TO_BYTES4(0),
         CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
@@ -84,20 +84,21 @@ int main() {
         PUSH_CONST, INT_TO_BYTES4(4),
         PUSH_LOCAL, INT_TO_BYTES4(1),
         CALL_C_FUNC, INT_TO_BYTES4(BF_PRINT), INT_TO_BYTES4(4),
+        POP,                                    // discard print's result
 
         INC_LOCAL, INT_TO_BYTES4(0),
         JUMP, INT_TO_BYTES4(10/*offset*/),
     
-        // offset 86
+        // offset 87
         HALT,
     };
     
     type_t consts[] = {
         fib_block_type,                                                         // 0
-        (type_t){.type = STRING_LITERAL, .value = {.str_literal_u = "fib("}},   // 1
-        (type_t){.type = NUMBER, .value = {.float_u = 0}},                           // 2
-        (type_t){.type = NUMBER, .value = {.float_u = fib_max+1}},              // 3
-        (type_t){.type = STRING_LITERAL, .value = {.str_literal_u = ") = "}},   // 4
+        make_str_literal("fib("),                                              // 1
+        make_int(0),                                                            // 2
+        make_int(fib_max+1),                                                    // 3
+        make_str_literal(") = "),                                              // 4
     };
 
     size_t code_size = sizeof(code);
@@ -112,16 +113,55 @@ int main() {
         .local_count = local_count
     };
 
-    int capacity = 1024;
-    type_t buff[capacity];
-    stack_slice_t stack;
-    stack_init(&stack, capacity, buff);
-
-    vm_t vm = {
-        .stack = stack,
-    };
-
-    vm_run(&vm, &block);
+    // --reg runs the same program on the register VM,
+    // --sample FILE writes the folded stacks of a sampling profile to FILE (see vm/sample.h),
+    // --write-image FILE saves the program as a bytecode image and --image FILE runs one (see vm/image.h),
+    // --src FILE compiles and runs an MPL source file instead (see compiler/read.h)
+    bool reg = false;
+    const char *sample_file = NULL, *write_image = NULL, *image_file = NULL, *src_file = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reg") == 0) reg = true;
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) sample_file = argv[++i];
+        else if (strcmp(argv[i], "--write-image") == 0 && i + 1 < argc) write_image = argv[++i];
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) image_file = argv[++i];
+        else if (strcmp(argv[i], "--src") == 0 && i + 1 < argc) src_file = argv[++i];
+    }
+
+    block_t src_block;
+    if (src_file && read_src_file(src_file, &src_block) != 0) exit(EXIT_FAILURE);
+
+    if (write_image) exit(image_write(write_image, src_file ? &src_block : &block, true) == 0 ? 0 : EXIT_FAILURE);
+
+    image_t *image = NULL;
+    if (image_file && !(image = image_load(image_file))) exit(EXIT_FAILURE);
+    block_t *program = image ? image->entry : src_file ? &src_block : &block;
+
+    vm_t vm;
+    vm_init(&vm, 0, 0);
+    if (sample_file) sampler_start(&vm, 0);
+
+    if (reg) vm_run_reg(&vm, program);
+    else vm_run(&vm, program);
+
+    if (sample_file) {
+        sampler_stop();
+        sampler_drain();
+        FILE *out = fopen(sample_file, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open %s\n", sample_file);
+            exit(EXIT_FAILURE);
+        }
+        sampler_dump_folded(out, false);
+        fclose(out);
+        sampler_dump_flat(stderr);
+        sampler_free();
+    }
+
+    block_free_code(&block);
+    block_free_code(&fib_block);
+    if (src_file) block_free_code(&src_block);
+    image_free(image);
+    vm_free(&vm);
 
     exit(0);
 }
@@ -130,9 +170,9 @@ int main() {
 ```
 Expected output:
 ```
-fib(0) = 0.000000
-fib(1) = 1.000000
-fib(5) = 5.000000
-fib(10) = 55.000000
+fib(0) = 0
+fib(1) = 1
+fib(5) = 5
+fib(10) = 55
 */
 
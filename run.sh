@@ -8,7 +8,7 @@ set -e
 
 COMP_TIME_START=$(date +%s)
 
-OPT_FLAGS="-O3 -ffast-math -Wall -Wextra"
+OPT_FLAGS="-O3 -ffast-math -Wall -Wextra $CFLAGS"
 CFILES=$(find . -path "*/test" -prune -o -type f -name "*.c" -print)
 OUTPUT="temp.out"
 
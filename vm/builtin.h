@@ -4,6 +4,8 @@
 #include "type.h"
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 /**
@@ -55,6 +57,40 @@ typedef enum /* Op */ {
 } Op;
 
 
+// binary ops the interpreters give NUMBER/INT specialized handlers: X(OP, name, operator, make, int_make)
+// make builds the result of two NUMBERs, int_make(a, operator, b) the result of two INTs
+#define NUM_ARITH_OPS(X)                        \
+    X(ADD, add, +, make_number, INT_ARITH)      \
+    X(SUB, sub, -, make_number, INT_ARITH)      \
+    X(MUL, mul, *, make_number, INT_ARITH)      \
+    X(DIV, div, /, make_number, INT_DIVIDE)
+
+#define NUM_COMPARE_OPS(X)                      \
+    X(EQ, eq, ==, make_bool, INT_COMPARE)       \
+    X(NE, ne, !=, make_bool, INT_COMPARE)       \
+    X(LT, lt, <, make_bool, INT_COMPARE)        \
+    X(GT, gt, >, make_bool, INT_COMPARE)        \
+    X(LE, le, <=, make_bool, INT_COMPARE)       \
+    X(GE, ge, >=, make_bool, INT_COMPARE)
+
+// INT arithmetic wraps around (at 47 bits with NAN_BOXING), / always divides as NUMBERs
+#define INT_ARITH(a, operator, b) make_int((int64_t)((uint64_t)(a) operator (uint64_t)(b)))
+#define INT_DIVIDE(a, operator, b) make_number((double)(a) operator (double)(b))
+#define INT_COMPARE(a, operator, b) make_bool((a) operator (b))
+
+// fast path of the specialized handlers: dst = l operator r if both are NUMBER or both INT, else goto miss
+#define NUM_FAST_PATH(dst, l, r, operator, make, int_make, miss)                                        \
+    if (type_of(l) == NUMBER && type_of(r) == NUMBER) dst = make(as_number(l) operator as_number(r));   \
+    else if (type_of(l) == INT && type_of(r) == INT) dst = int_make(as_int(l), operator, as_int(r));    \
+    else goto miss
+
+// same for compare and jump, cond is a plain bool
+#define NUM_FAST_CONDITION(cond, l, r, operator, miss)                                                  \
+    if (type_of(l) == NUMBER && type_of(r) == NUMBER) cond = as_number(l) operator as_number(r);        \
+    else if (type_of(l) == INT && type_of(r) == INT) cond = as_int(l) operator as_int(r);               \
+    else goto miss
+
+
 typedef enum /* BuiltinFunction */ {
     BF_PRINT,
 } BuiltinFunc;
@@ -105,29 +141,93 @@ typedef enum /* BuiltinFunction */ {
     end:
 */
 
+// NUMBER value of a numeric operand, INT is converted
+static inline double to_number(type_t v) {
+    return type_of(v) == INT ? (double)as_int(v) : as_number(v);
+}
+
+// INT value of a numeric operand, NUMBER is truncated
+static inline int64_t to_int(type_t v) {
+    return type_of(v) == NUMBER ? (int64_t)as_number(v) : as_int(v);
+}
+
+// == on any two values: a number by its value, a string literal by its text (each literal of a
+// block or image is a copy of its own), anything else by its type and payload (a function by
+// identity), never through the NUMBER bits of a payload
+static inline bool values_equal(type_t left, type_t right) {
+    Type l = type_of(left), r = type_of(right);
+    if ((l == NUMBER || l == INT) && (r == NUMBER || r == INT)) return to_number(left) == to_number(right);
+    if (l != r) return false;
+    switch (l) {
+        case BOOL: return as_bool(left) == as_bool(right);
+        case NONE: return true;
+        case STRING_LITERAL:
+            return as_ptr(left) == as_ptr(right) || strcmp(as_str_literal(left), as_str_literal(right)) == 0;
+        default: return as_ptr(left) == as_ptr(right);
+    }
+}
+
+static inline int64_t int_pow(int64_t base, int64_t exponent) {
+    uint64_t result = 1, b = (uint64_t)base;
+    for (; exponent; exponent >>= 1, b *= b) {
+        if (exponent & 1) result *= b;
+    }
+    return (int64_t)result;
+}
+
+static inline type_t int_modulo(int64_t l, int64_t r) {
+    if (r == 0) {
+        fprintf(stderr, "Integer modulo by zero\n");
+        exit(EXIT_FAILURE);
+    }
+    return make_int(r == -1 ? 0 : l % r);
+}
+
+// INT op INT stays INT (except /, and ** with a negative exponent), any other mix of
+// NUMBER and INT is computed on NUMBERs. Bitwise ops always work on INTs, == and != on
+// anything else compare type and payload (values_equal).
 static inline __attribute__((always_inline)) type_t operation(Op op, type_t left, type_t right) {
-    type_t result = {.type = NONE, .value = {0}};
+    if (type_of(left) == INT && type_of(right) == INT) {
+        int64_t l = as_int(left), r = as_int(right);
+        switch (op) {
+            case OP_ADD: return INT_ARITH(l, +, r);
+            case OP_SUB: return INT_ARITH(l, -, r);
+            case OP_MUL: return INT_ARITH(l, *, r);
+            case OP_DIV: return INT_DIVIDE(l, /, r);
+            case OP_POW: return r >= 0 ? make_int(int_pow(l, r)) : make_number(pow(l, r));
+            case OP_MOD: return int_modulo(l, r);
+            case OP_EQ: return INT_COMPARE(l, ==, r);
+            case OP_NE: return INT_COMPARE(l, !=, r);
+            case OP_LT: return INT_COMPARE(l, <, r);
+            case OP_GT: return INT_COMPARE(l, >, r);
+            case OP_LE: return INT_COMPARE(l, <=, r);
+            case OP_GE: return INT_COMPARE(l, >=, r);
+            default: break;
+        }
+    }
+
+    type_t result = make_none();
 
     switch (op) {
-        case OP_ADD: result.type = NUMBER; result.value.float_u = left.value.float_u + right.value.float_u; break;
-        case OP_SUB: result.type = NUMBER; result.value.float_u = left.value.float_u - right.value.float_u; break;
-        case OP_MUL: result.type = NUMBER; result.value.float_u = left.value.float_u * right.value.float_u; break;
-        case OP_POW: result.type = NUMBER; result.value.float_u = pow(left.value.float_u, right.value.float_u); break;
-        case OP_DIV: result.type = NUMBER; result.value.float_u = left.value.float_u / right.value.float_u; break;
-        case OP_MOD: result.type = NUMBER; result.value.int_u = left.value.int_u % right.value.int_u; break;
-        case OP_EQ: result.type = BOOL; result.value.bool_u = left.value.float_u == right.value.float_u; break;
-        case OP_NE: result.type = BOOL; result.value.bool_u = left.value.float_u != right.value.float_u; break;
-        case OP_LT: result.type = BOOL; result.value.bool_u = left.value.float_u < right.value.float_u; break;
-        case OP_GT: result.type = BOOL; result.value.bool_u = left.value.float_u > right.value.float_u; break;
-        case OP_LE: result.type = BOOL; result.value.bool_u = left.value.float_u <= right.value.float_u; break;
-        case OP_GE: result.type = BOOL; result.value.bool_u = left.value.float_u >= right.value.float_u; break;
-        case OP_AND: result.type = BOOL; result.value.bool_u = left.value.bool_u && right.value.bool_u; break;
-        case OP_OR: result.type = BOOL; result.value.bool_u = left.value.bool_u || right.value.bool_u; break;
-        case OP_BIT_AND: result.type = NUMBER; result.value.int_u = left.value.int_u & right.value.int_u; break;
-        case OP_BIT_OR: result.type = NUMBER; result.value.int_u = left.value.int_u | right.value.int_u; break;
-        case OP_BIT_XOR: result.type = NUMBER; result.value.int_u = left.value.int_u ^ right.value.int_u; break;
-        case OP_BIT_SHL: result.type = NUMBER; result.value.int_u = left.value.int_u << right.value.int_u; break;
-        case OP_BIT_SHR: result.type = NUMBER; result.value.int_u = left.value.int_u >> right.value.int_u; break;
+        case OP_ADD: result = make_number(to_number(left) + to_number(right)); break;
+        case OP_SUB: result = make_number(to_number(left) - to_number(right)); break;
+        case OP_MUL: result = make_number(to_number(left) * to_number(right)); break;
+        case OP_POW: result = make_number(pow(to_number(left), to_number(right))); break;
+        case OP_DIV: result = make_number(to_number(left) / to_number(right)); break;
+        case OP_MOD: result = make_number(fmod(to_number(left), to_number(right))); break;
+        case OP_EQ: result = make_bool(values_equal(left, right)); break;
+        case OP_NE: result = make_bool(!values_equal(left, right)); break;
+        case OP_LT: result = make_bool(to_number(left) < to_number(right)); break;
+        case OP_GT: result = make_bool(to_number(left) > to_number(right)); break;
+        case OP_LE: result = make_bool(to_number(left) <= to_number(right)); break;
+        case OP_GE: result = make_bool(to_number(left) >= to_number(right)); break;
+        case OP_AND: result = make_bool(as_bool(left) && as_bool(right)); break;
+        case OP_OR: result = make_bool(as_bool(left) || as_bool(right)); break;
+        case OP_BIT_AND: result = make_int(to_int(left) & to_int(right)); break;
+        case OP_BIT_OR: result = make_int(to_int(left) | to_int(right)); break;
+        case OP_BIT_XOR: result = make_int(to_int(left) ^ to_int(right)); break;
+        case OP_BIT_SHL: result = make_int((int64_t)((uint64_t)to_int(left) << (to_int(right) & 63))); break;
+        case OP_BIT_SHR: result = make_int(to_int(left) >> (to_int(right) & 63)); break;
         default: break;
     }
 
@@ -135,31 +235,37 @@ static inline __attribute__((always_inline)) type_t operation(Op op, type_t left
 }
 
 static inline type_t operation_unary(Op op, type_t right) {
-    type_t result = {.type = NONE, .value = {0}};
+    type_t result = make_none();
 
     switch (op) {
-        case OP_NOT: result.type = BOOL; result.value.bool_u = !right.value.bool_u; break;
-        case OP_BIT_NOT: result.type = NUMBER; result.value.int_u = ~right.value.int_u; break;
+        case OP_NOT: result = make_bool(!as_bool(right)); break;
+        case OP_BIT_NOT: result = make_int(~to_int(right)); break;
         default: break;
     }
 
     return result;
 }
 
+// INC_LOCAL/DEC_LOCAL, an INT stays an INT
+static inline type_t increment(type_t v, int delta) {
+    if (type_of(v) == INT) return make_int((int64_t)((uint64_t)as_int(v) + (uint64_t)(int64_t)delta));
+    return make_number(as_number(v) + delta);
+}
+
 static inline type_t builtin_print(int argc, type_t *argv) {
     for (int i = 0; i < argc; i++) {
-        switch (argv[i].type) {
+        switch (type_of(argv[i])) {
             case STRING_LITERAL:
-                printf("%s", argv[i].value.str_literal_u);
+                printf("%s", as_str_literal(argv[i]));
                 break;
             case NUMBER:
-                printf("%f", argv[i].value.float_u);
+                printf("%f", as_number(argv[i]));
                 break;
             case INT:
-                printf("%ld", argv[i].value.int_u);
+                printf("%ld", as_int(argv[i]));
                 break;
             case BOOL:
-                printf("%s", argv[i].value.bool_u ? "true" : "false");
+                printf("%s", as_bool(argv[i]) ? "true" : "false");
                 break;
             case NONE:
                 printf("none");
@@ -171,15 +277,15 @@ static inline type_t builtin_print(int argc, type_t *argv) {
         // if (i < argc - 1) printf(" ");
     }
     printf("\n");
-    return (type_t){.type = NONE, .value = {0}};
+    return make_none();
 }
 
 static inline type_t builtin_func(BuiltinFunc func, int argc, type_t *argv) {
-    type_t result = {.type = NONE, .value = {0}};
+    type_t result = make_none();
 
     switch (func) {
         case BF_PRINT: result = builtin_print(argc, argv); break;
-        default: return (type_t){.type = NONE, .value = {0}};
+        default: return make_none();
     }
 
     return result;
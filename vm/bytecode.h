@@ -33,8 +33,27 @@ typedef enum {
     INC_LOCAL,
     DEC_LOCAL,
 
+    TAIL_CALL,
+
+    // superinstructions, produced by the peephole pass (see peephole.h)
+    CALL_OP_LOCAL,
+    CALL_OP_CONST,
+    CALL_OP_LOCAL_CONST,
+    CMP_JUMP_FALSE,
+    CMP_LOCAL_CONST_JUMP_FALSE,
+
+    // CALL_OP on operands the compiler proved to be INT/NUMBER (see read.h)
+    CALL_OP_INT,
+    CALL_OP_NUMBER,
+
+    // counted loop back edges, produced by the peephole pass (see peephole.h)
+    INC_LOCAL_CMP_JUMP,
+    DEC_LOCAL_CMP_JUMP,
+
     // might be implemented in the future
     START_WORKER,
+
+    BYTECODE_COUNT,
 } Bytecode;
 
 enum {
@@ -0,0 +1,278 @@
+#include "compact.h"
+
+
+/*
+    Operand layouts, one letter per operand in order:
+        i   i32 index or count      narrow unless WIDE
+        o   i32 jump offset         narrow unless WIDE
+        b   u8
+        c   CALL_FUNC location (u8), followed by "ii" or by "iii" for CF_GLOBAL
+*/
+static const char *const operand_layout[BYTECODE_COUNT] = {
+    [HALT] = "",
+    [PUSH_CONST] = "i",
+    [PUSH_LOCAL] = "i",
+    [STORE_LOCAL] = "i",
+    [PUSH] = "ii",
+    [STORE] = "ii",
+    [POP] = "",
+    [CALL_OP] = "b",
+    [JUMP] = "o",
+    [JUMP_FALSE] = "o",
+    [CALL_C_FUNC] = "ii",
+    [CALL_FUNC] = "c",
+    [RETURN] = "",
+    [INC_LOCAL] = "i",
+    [DEC_LOCAL] = "i",
+    [TAIL_CALL] = "c",
+    [CALL_OP_LOCAL] = "ib",
+    [CALL_OP_CONST] = "ib",
+    [CALL_OP_LOCAL_CONST] = "iib",
+    [CMP_JUMP_FALSE] = "bo",
+    [CMP_LOCAL_CONST_JUMP_FALSE] = "iibo",
+    [CALL_OP_INT] = "b",
+    [CALL_OP_NUMBER] = "b",
+    [INC_LOCAL_CMP_JUMP] = "iibo",
+    [DEC_LOCAL_CMP_JUMP] = "iibo",
+};
+
+#define MAX_OPERANDS 4
+
+// one instruction with its operands decoded, whatever the encoding
+typedef struct {
+    uint8_t op;
+    int n;
+    char kind[MAX_OPERANDS];
+    int32_t value[MAX_OPERANDS];
+} insn_t;
+
+static inline int32_t get_i32(const uint8_t *code) {
+    return BYTES4_TO_INT(code[0], code[1], code[2], code[3]);
+}
+
+static inline void put_i32(uint8_t *code, int32_t v) {
+    uint8_t bytes[] = {INT_TO_BYTES4(v)};
+    memcpy(code, bytes, 4);
+}
+
+// the operand kinds of op with location byte loc, NULL for an unknown op
+static const char* layout_of(uint8_t op, uint8_t loc) {
+    if (op >= BYTECODE_COUNT || !operand_layout[op]) return NULL;
+    if (operand_layout[op][0] == 'c') return loc == CF_GLOBAL ? "biii" : "bii";
+    return operand_layout[op];
+}
+
+// decodes the instruction at code[ip] of either encoding, returns its length (0 if malformed)
+static size_t decode(const uint8_t *code, size_t size, size_t ip, bool compact, insn_t *insn) {
+    size_t at = ip;
+    bool wide = !compact;
+    if (compact && code[at] == WIDE) {
+        wide = true;
+        if (++at >= size) return 0;
+    }
+
+    uint8_t op = code[at++];
+    if (compact && op >= PUSH_LOCAL_0 && op <= PUSH_CONST_3) {
+        bool local = op <= PUSH_LOCAL_3;
+        *insn = (insn_t){.op = local ? PUSH_LOCAL : PUSH_CONST, .n = 1, .kind = {'i'},
+                         .value = {op - (local ? PUSH_LOCAL_0 : PUSH_CONST_0)}};
+        return wide ? 0 : at - ip;
+    }
+
+    const char *layout = layout_of(op, at < size ? code[at] : 0);
+    if (!layout) return 0;
+
+    insn->op = op;
+    insn->n = (int)strlen(layout);
+    for (int i = 0; i < insn->n; i++) {
+        char kind = layout[i];
+        size_t width = kind == 'b' || !wide ? 1 : 4;
+        if (at + width > size) return 0;
+        insn->kind[i] = kind;
+        insn->value[i] = width == 4 ? get_i32(&code[at]) : code[at];
+        at += width;
+    }
+    return at - ip;
+}
+
+static inline bool fits_narrow(int32_t v) {
+    return v >= 0 && v <= 255;
+}
+
+// PUSH_LOCAL_n/PUSH_CONST_n
+static inline bool has_short_form(const insn_t *insn) {
+    return (insn->op == PUSH_LOCAL || insn->op == PUSH_CONST) && insn->value[0] >= 0 && insn->value[0] <= 3;
+}
+
+// length of the compact encoding of insn, with its i32 operands wide or not
+static size_t compact_length(const insn_t *insn, bool wide) {
+    if (!wide && has_short_form(insn)) return 1;
+    size_t len = 1 + wide;
+    for (int i = 0; i < insn->n; i++) len += insn->kind[i] == 'b' || !wide ? 1 : 4;
+    return len;
+}
+
+static size_t write_insn(uint8_t *out, const insn_t *insn, bool compact, bool wide) {
+    uint8_t *start = out;
+    if (compact && !wide && has_short_form(insn)) {
+        *out++ = (insn->op == PUSH_LOCAL ? PUSH_LOCAL_0 : PUSH_CONST_0) + insn->value[0];
+        return 1;
+    }
+
+    if (compact && wide) *out++ = WIDE;
+    *out++ = insn->op;
+    for (int i = 0; i < insn->n; i++) {
+        if (insn->kind[i] == 'b' || (compact && !wide)) {
+            *out++ = (uint8_t)insn->value[i];
+        } else {
+            put_i32(out, insn->value[i]);
+            out += 4;
+        }
+    }
+    return out - start;
+}
+
+// splits code into instructions, *starts[i] is where instruction i starts ([count] is size)
+static insn_t* decode_all(const uint8_t *code, size_t size, bool compact, size_t **starts, size_t *count) {
+    insn_t *insns = malloc((size + 1) * sizeof(insn_t));
+    *starts = malloc((size + 1) * sizeof(size_t));
+    if (!insns || !*starts) {
+        fprintf(stderr, "Failed to allocate memory for bytecode\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t n = 0;
+    for (size_t ip = 0; ip < size; n++) {
+        size_t len = decode(code, size, ip, compact, &insns[n]);
+        if (!len) {
+            free(insns);
+            free(*starts);
+            return NULL;
+        }
+        (*starts)[n] = ip;
+        ip += len;
+    }
+    (*starts)[n] = size;
+    *count = n;
+    return insns;
+}
+
+// index of the instruction starting at offset, -1 if none does
+static int64_t find_start(const size_t *starts, size_t count, int32_t offset) {
+    if (offset < 0) return -1;
+    size_t lo = 0, hi = count + 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (starts[mid] < (size_t)offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo <= count && starts[lo] == (size_t)offset ? (int64_t)lo : -1;
+}
+
+// re-encodes the instructions, with jump offsets turned into instruction indices beforehand
+static uint8_t* encode_all(insn_t *insns, size_t count, const bool *wide, const size_t *new_starts,
+                           bool compact, size_t *out_size) {
+    uint8_t *out = malloc(new_starts[count] ? new_starts[count] : 1);
+    if (!out) {
+        fprintf(stderr, "Failed to allocate memory for bytecode\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        insn_t insn = insns[i];
+        for (int k = 0; k < insn.n; k++) {
+            if (insn.kind[k] == 'o') insn.value[k] = (int32_t)new_starts[insn.value[k]];
+        }
+        write_insn(&out[new_starts[i]], &insn, compact, compact && wide[i]);
+    }
+    *out_size = new_starts[count];
+    return out;
+}
+
+// replaces every jump offset by the index of its target, false if one is not an instruction start
+static bool index_targets(insn_t *insns, size_t count, const size_t *starts) {
+    for (size_t i = 0; i < count; i++) {
+        for (int k = 0; k < insns[i].n; k++) {
+            if (insns[i].kind[k] != 'o') continue;
+            int64_t target = find_start(starts, count, insns[i].value[k]);
+            if (target < 0) return false;
+            insns[i].value[k] = (int32_t)target;
+        }
+    }
+    return true;
+}
+
+uint8_t* bytecode_compact(const uint8_t *code, size_t size, size_t *out_size) {
+    size_t count, *starts;
+    insn_t *insns = decode_all(code, size, false, &starts, &count);
+    if (!insns) return NULL;
+
+    bool *wide = calloc(count + 1, sizeof(bool));
+    size_t *new_starts = malloc((count + 1) * sizeof(size_t));
+    if (!wide || !new_starts) {
+        fprintf(stderr, "Failed to allocate memory for bytecode\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bool ok = index_targets(insns, count, starts);
+    for (size_t i = 0; ok && i < count; i++) {
+        for (int k = 0; k < insns[i].n; k++) {
+            if (insns[i].kind[k] == 'i' && !fits_narrow(insns[i].value[k])) wide[i] = true;
+        }
+    }
+
+    // a jump only gets wide once a target ends up past 255, so this stops
+    for (bool changed = ok; changed;) {
+        new_starts[0] = 0;
+        for (size_t i = 0; i < count; i++) new_starts[i + 1] = new_starts[i] + compact_length(&insns[i], wide[i]);
+
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            for (int k = 0; k < insns[i].n && !wide[i]; k++) {
+                if (insns[i].kind[k] == 'o' && !fits_narrow((int32_t)new_starts[insns[i].value[k]])) {
+                    wide[i] = changed = true;
+                }
+            }
+        }
+    }
+
+    uint8_t *out = ok ? encode_all(insns, count, wide, new_starts, true, out_size) : NULL;
+    free(insns);
+    free(starts);
+    free(wide);
+    free(new_starts);
+    return out;
+}
+
+uint8_t* bytecode_expand(const uint8_t *compact, size_t size, size_t *out_size) {
+    size_t count, *starts;
+    insn_t *insns = decode_all(compact, size, true, &starts, &count);
+    if (!insns) return NULL;
+
+    size_t *new_starts = malloc((count + 1) * sizeof(size_t));
+    if (!new_starts) {
+        fprintf(stderr, "Failed to allocate memory for bytecode\n");
+        exit(EXIT_FAILURE);
+    }
+    new_starts[0] = 0;
+    uint8_t scratch[1 + 4 * MAX_OPERANDS];
+    for (size_t i = 0; i < count; i++) new_starts[i + 1] = new_starts[i] + write_insn(scratch, &insns[i], false, true);
+
+    uint8_t *out = index_targets(insns, count, starts) ? encode_all(insns, count, NULL, new_starts, false, out_size) : NULL;
+    free(insns);
+    free(starts);
+    free(new_starts);
+    return out;
+}
+
+void block_expand_compact(block_t *block) {
+    if (block->instructions || !block->compact) return;
+
+    size_t size;
+    uint8_t *instructions = bytecode_expand(block->compact, block->compact_size, &size);
+    if (!instructions) {
+        fprintf(stderr, "Malformed compact bytecode in block %p\n", (void*)block);
+        exit(EXIT_FAILURE);
+    }
+    block->instructions = instructions;
+    block->instruction_size = size;
+}
@@ -0,0 +1,47 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "vm.h"
+
+
+/*
+    Compact bytecode encoding
+
+    The same instructions as the formats in vm.h with narrow operands: every i32 operand
+    (indices, counts, jump offsets) takes one unsigned byte, u8 operands (the op of CALL_OP,
+    the location of CALL_FUNC) are unchanged. An instruction with an i32 operand outside
+    0..255 is prefixed by WIDE, which gives all of its i32 operands their 4 bytes back.
+    Jump offsets are compact offsets (of the WIDE prefix when there is one).
+
+    The most common instructions also have forms without operand:
+
+        PUSH_LOCAL_0..3     [PUSH_LOCAL_n]      PUSH_LOCAL n
+        PUSH_CONST_0..3     [PUSH_CONST_n]      PUSH_CONST n
+
+    so `PUSH_LOCAL 0` is 1 byte instead of 5. A block can be given its compact encoding
+    (block->compact) instead of its instructions; the translators expand it once, the first
+    time the block runs, and everything after that works on the usual encoding.
+*/
+
+// compact encoding only, never found in block->instructions
+typedef enum {
+    WIDE = BYTECODE_COUNT,
+    PUSH_LOCAL_0, PUSH_LOCAL_1, PUSH_LOCAL_2, PUSH_LOCAL_3,
+    PUSH_CONST_0, PUSH_CONST_1, PUSH_CONST_2, PUSH_CONST_3,
+
+    COMPACT_BYTECODE_COUNT,
+} CompactBytecode;
+
+// the compact encoding of code (malloc'd, length in *out_size), NULL if code is not well formed
+uint8_t* bytecode_compact(const uint8_t *code, size_t size, size_t *out_size);
+
+// the usual encoding of compact code (malloc'd, length in *out_size), NULL if it is not well formed
+uint8_t* bytecode_expand(const uint8_t *compact, size_t size, size_t *out_size);
+
+// gives a block that only has compact code its instructions, owned by the block until
+// block_free_code. Does nothing if the block already has instructions.
+void block_expand_compact(block_t *block);
+
+
+
+#endif // COMPACT_H
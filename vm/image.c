@@ -0,0 +1,347 @@
+#include "image.h"
+#include "compact.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static inline uint64_t align8(uint64_t n) {
+    return (n + 7) & ~(uint64_t)7;
+}
+
+static void image_out_of_memory(void) {
+    fprintf(stderr, "Failed to allocate memory for the image\n");
+    exit(EXIT_FAILURE);
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t size, capacity;
+} image_buffer_t;
+
+// appends n bytes (zeros if bytes is NULL) at the next multiple of 8, returns where they start
+static size_t append(image_buffer_t *b, const void *bytes, size_t n) {
+    size_t at = align8(b->size), end = at + n;
+    if (end > b->capacity) {
+        b->capacity = end * 2;
+        b->data = realloc(b->data, b->capacity);
+        if (!b->data) image_out_of_memory();
+    }
+    memset(&b->data[b->size], 0, at - b->size);
+    if (bytes) memcpy(&b->data[at], bytes, n);
+    else memset(&b->data[at], 0, n);
+    b->size = end;
+    return at;
+}
+
+// the blocks of the image in index order, with a set to find the index of a block
+typedef struct {
+    block_t **blocks;
+    size_t count, capacity;
+
+    block_t **keys;
+    uint32_t *indices;
+    size_t set_capacity; // power of 2, at most half full
+} block_list_t;
+
+static size_t block_slot(const block_list_t *l, const block_t *block) {
+    size_t i = (size_t)(((uintptr_t)block >> 4) * 0x9E3779B97F4A7C15ull >> 32) & (l->set_capacity - 1);
+    while (l->keys[i] && l->keys[i] != block) i = (i + 1) & (l->set_capacity - 1);
+    return i;
+}
+
+// index of block in the image, added at the end if it is not in it yet
+static uint32_t block_index(block_list_t *l, block_t *block) {
+    if ((l->count + 1) * 2 > l->set_capacity) {
+        block_list_t grown = *l;
+        grown.set_capacity = l->set_capacity ? l->set_capacity * 2 : 64;
+        grown.keys = calloc(grown.set_capacity, sizeof(block_t*));
+        grown.indices = malloc(grown.set_capacity * sizeof(uint32_t));
+        if (!grown.keys || !grown.indices) image_out_of_memory();
+        for (size_t i = 0; i < l->set_capacity; i++) {
+            if (!l->keys[i]) continue;
+            size_t slot = block_slot(&grown, l->keys[i]);
+            grown.keys[slot] = l->keys[i];
+            grown.indices[slot] = l->indices[i];
+        }
+        free(l->keys);
+        free(l->indices);
+        *l = grown;
+    }
+
+    size_t slot = block_slot(l, block);
+    if (l->keys[slot]) return l->indices[slot];
+
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 16;
+        l->blocks = realloc(l->blocks, l->capacity * sizeof(block_t*));
+        if (!l->blocks) image_out_of_memory();
+    }
+    l->keys[slot] = block;
+    l->indices[slot] = (uint32_t)l->count;
+    l->blocks[l->count] = block;
+    return (uint32_t)l->count++;
+}
+
+// the instructions of block in the encoding asked for (malloc'd), NULL if they are malformed
+static uint8_t* encode_block(const block_t *block, bool compact, size_t *size) {
+    if (block->instructions) {
+        if (compact) return bytecode_compact(block->instructions, block->instruction_size, size);
+        uint8_t *copy = malloc(block->instruction_size ? block->instruction_size : 1);
+        if (!copy) image_out_of_memory();
+        memcpy(copy, block->instructions, block->instruction_size);
+        *size = block->instruction_size;
+        return copy;
+    }
+    if (!block->compact) {
+        // nothing to run yet (e.g. a front end that only declared the locals)
+        *size = 0;
+        uint8_t *empty = malloc(1);
+        if (!empty) image_out_of_memory();
+        return empty;
+    }
+    if (!compact) return bytecode_expand(block->compact, block->compact_size, size);
+
+    uint8_t *copy = malloc(block->compact_size ? block->compact_size : 1);
+    if (!copy) image_out_of_memory();
+    memcpy(copy, block->compact, block->compact_size);
+    *size = block->compact_size;
+    return copy;
+}
+
+// the record of a constant, false if the type cannot be stored
+static bool encode_constant(type_t v, block_list_t *blocks, image_buffer_t *strings, image_constant_t *out) {
+    *out = (image_constant_t){.type = type_of(v)};
+    switch (type_of(v)) {
+        case NUMBER: {
+            double d = as_number(v);
+            memcpy(&out->value, &d, sizeof(d));
+            return true;
+        }
+        case INT: out->value = (uint64_t)as_int(v); return true;
+        case BOOL: out->value = as_bool(v); return true;
+        case NONE: return true;
+        case STRING_LITERAL: {
+            const char *s = as_str_literal(v);
+            size_t len = strlen(s) + 1, at = strings->size;
+            if (at + len > strings->capacity) {
+                strings->capacity = (at + len) * 2;
+                strings->data = realloc(strings->data, strings->capacity);
+                if (!strings->data) image_out_of_memory();
+            }
+            memcpy(&strings->data[at], s, len);
+            strings->size += len;
+            out->value = at;
+            return true;
+        }
+        case FUNCTION: out->value = block_index(blocks, as_ptr(v)); return true;
+        default: return false;
+    }
+}
+
+int image_write(const char *path, block_t *entry, bool compact) {
+    block_list_t blocks = {0};
+    image_buffer_t out = {0}, strings = {0};
+    int result = -1;
+
+    block_index(&blocks, entry);
+    append(&out, NULL, sizeof(image_header_t));
+
+    // the block table is written once every block reachable from entry is known
+    image_block_t *table = NULL;
+    size_t table_capacity = 0;
+
+    for (size_t i = 0; i < blocks.count; i++) {
+        block_t *block = blocks.blocks[i];
+        image_block_t record = {.local_count = block->local_count};
+
+        size_t size;
+        uint8_t *code = encode_block(block, compact, &size);
+        if (!code) {
+            fprintf(stderr, "Block %p has malformed instructions\n", (void*)block);
+            goto done;
+        }
+        record.instructions_offset = append(&out, code, size);
+        record.instruction_size = size;
+        record.compact = compact;
+        free(code);
+
+        record.constant_count = block->constant_count;
+        record.constants_offset = append(&out, NULL, block->constant_count * sizeof(image_constant_t));
+        for (size_t k = 0; k < block->constant_count; k++) {
+            image_constant_t c;
+            if (!encode_constant(block->constants[k], &blocks, &strings, &c)) {
+                fprintf(stderr, "Constant %zu of block %p has type %d, which an image cannot hold\n",
+                        k, (void*)block, type_of(block->constants[k]));
+                goto done;
+            }
+            memcpy(&out.data[record.constants_offset + k * sizeof(image_constant_t)], &c, sizeof(c));
+        }
+
+        if (i == table_capacity) {
+            table_capacity = table_capacity ? table_capacity * 2 : 16;
+            table = realloc(table, table_capacity * sizeof(image_block_t));
+            if (!table) image_out_of_memory();
+        }
+        table[i] = record;
+    }
+
+    image_header_t header = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .block_count = (uint32_t)blocks.count,
+        .entry = 0,
+    };
+    header.blocks_offset = append(&out, table, blocks.count * sizeof(image_block_t));
+    header.strings_offset = append(&out, strings.data, strings.size);
+    header.strings_size = strings.size;
+    header.size = out.size;
+    memcpy(out.data, &header, sizeof(header));
+
+    // written next to path and renamed over it, a reader never sees half an image
+    size_t path_len = strlen(path);
+    char *tmp = malloc(path_len + 32);
+    if (!tmp) image_out_of_memory();
+    snprintf(tmp, path_len + 32, "%s.tmp.%ld", path, (long)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    bool written = f && fwrite(out.data, 1, out.size, f) == out.size;
+    if (f && fclose(f) != 0) written = false;
+    if (!written || rename(tmp, path) != 0) {
+        fprintf(stderr, "Cannot write image %s\n", path);
+        remove(tmp);
+    } else {
+        result = 0;
+    }
+    free(tmp);
+
+done:
+    free(table);
+    free(out.data);
+    free(strings.data);
+    free(blocks.blocks);
+    free(blocks.keys);
+    free(blocks.indices);
+    return result;
+}
+
+// [offset, offset + length) lies in the image
+static inline bool in_image(uint64_t size, uint64_t offset, uint64_t length) {
+    return offset <= size && length <= size - offset;
+}
+
+// turns the constant records of block into type_t values, in place
+static bool fix_constants(image_t *image, const image_header_t *header, type_t *constants, size_t count) {
+    const image_constant_t *records = (const image_constant_t*)constants;
+    for (size_t i = 0; i < count; i++) {
+        image_constant_t c = records[i]; // type_t i never overlaps a record after i
+        type_t v;
+        switch (c.type) {
+            case NUMBER: {
+                double d;
+                memcpy(&d, &c.value, sizeof(d));
+                v = make_number(d);
+                break;
+            }
+            case INT: v = make_int((int64_t)c.value); break;
+            case BOOL: v = make_bool(c.value != 0); break;
+            case NONE: v = make_none(); break;
+            case STRING_LITERAL:
+                if (c.value >= header->strings_size) return false;
+                v = make_str_literal((const char*)&image->data[header->strings_offset + c.value]);
+                break;
+            case FUNCTION:
+                if (c.value >= image->block_count) return false;
+                v = make_ptr(FUNCTION, &image->blocks[c.value]);
+                break;
+            default:
+                return false;
+        }
+        constants[i] = v;
+    }
+    return true;
+}
+
+image_t* image_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open image %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(image_header_t)) {
+        fprintf(stderr, "%s is not an image\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map image %s\n", path);
+        return NULL;
+    }
+
+    image_t *image = calloc(1, sizeof(image_t));
+    if (!image) image_out_of_memory();
+    image->data = data;
+    image->size = size;
+
+    image_header_t header;
+    memcpy(&header, data, sizeof(header));
+    bool ok = memcmp(header.magic, IMAGE_MAGIC, 4) == 0 && header.version == IMAGE_VERSION &&
+              header.size == size && header.entry < header.block_count &&
+              header.blocks_offset % 8 == 0 &&
+              in_image(size, header.blocks_offset, (uint64_t)header.block_count * sizeof(image_block_t)) &&
+              in_image(size, header.strings_offset, header.strings_size) &&
+              (header.strings_size == 0 || data[header.strings_offset + header.strings_size - 1] == 0);
+
+    if (ok) {
+        image->block_count = header.block_count;
+        image->blocks = calloc(header.block_count, sizeof(block_t));
+        if (!image->blocks) image_out_of_memory();
+    }
+
+    const image_block_t *records = (const image_block_t*)&data[header.blocks_offset];
+    for (size_t i = 0; ok && i < image->block_count; i++) {
+        image_block_t r = records[i];
+        ok = in_image(size, r.instructions_offset, r.instruction_size) &&
+             r.constants_offset % 8 == 0 && r.constant_count <= size / sizeof(image_constant_t) &&
+             in_image(size, r.constants_offset, r.constant_count * sizeof(image_constant_t));
+        if (!ok) break;
+
+        block_t *block = &image->blocks[i];
+        if (r.compact) {
+            block->compact = &data[r.instructions_offset];
+            block->compact_size = r.instruction_size;
+        } else {
+            block->instructions = &data[r.instructions_offset];
+            block->instruction_size = r.instruction_size;
+        }
+        block->constants = (type_t*)&data[r.constants_offset];
+        block->constant_count = r.constant_count;
+        block->local_count = r.local_count;
+        ok = fix_constants(image, &header, block->constants, block->constant_count);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s is not a valid image\n", path);
+        free(image->blocks);
+        munmap(data, size);
+        free(image);
+        return NULL;
+    }
+    image->entry = &image->blocks[header.entry];
+    return image;
+}
+
+void image_free(image_t *image) {
+    if (!image) return;
+    for (size_t i = 0; i < image->block_count; i++) block_free_code(&image->blocks[i]);
+    free(image->blocks);
+    munmap(image->data, image->size);
+    free(image);
+}
@@ -0,0 +1,90 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "vm.h"
+
+
+/*
+    Bytecode images
+
+    A compiled program on disk: every block reachable from the entry block through FUNCTION
+    constants, with its instructions and constants, and the string literals they use.
+    image_load maps the file and runs it in place, the instructions are used straight from
+    the mapping and the only work is turning the constants into values (indices into pointers).
+
+        header          image_header_t
+        blocks          image_block_t[block_count]
+        per block       instructions (usual or compact encoding), then image_constant_t[constant_count]
+        strings         the string literals, each ended by a 0
+
+    Every section starts at a multiple of 8. All fields are native endian and the version
+    changes with the layout and the opcodes: an image is a cache for the machine and the VM
+    that wrote it, not a portable format. The mapping is private, so fixing up the constants copies only the
+    pages they are on.
+
+    Constants are stored as 16 byte records, replaced in place by type_t values:
+
+        NUMBER          bits of the double
+        INT             the int64
+        BOOL, NONE      0/1, 0
+        STRING_LITERAL  offset in the strings section
+        FUNCTION        index of the block
+*/
+
+#define IMAGE_MAGIC "MPLB"
+// the layout of the file and the numbering of the opcodes: bump IMAGE_FORMAT when either changes,
+// an opcode added at the end of Bytecode changes the version by itself
+#define IMAGE_FORMAT 2
+#define IMAGE_VERSION ((uint32_t)(IMAGE_FORMAT << 8 | BYTECODE_COUNT))
+
+typedef struct /* image_header_t */ {
+    char magic[4];
+    uint32_t version;
+    uint32_t block_count;
+    uint32_t entry;             // index of the block to run
+    uint64_t blocks_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t size;              // of the whole file
+} image_header_t;
+
+typedef struct /* image_block_t */ {
+    uint64_t instructions_offset;
+    uint64_t instruction_size;
+    uint64_t constants_offset;
+    uint64_t constant_count;
+    uint64_t local_count;
+    uint32_t compact;           // 1 if the instructions use the compact encoding (see compact.h)
+    uint32_t reserved;
+} image_block_t;
+
+typedef struct /* image_constant_t */ {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t value;
+} image_constant_t;
+
+_Static_assert(sizeof(image_constant_t) >= sizeof(type_t), "constants are fixed up in place");
+
+typedef struct /* image_t */ {
+    uint8_t *data;
+    size_t size;
+
+    block_t *blocks;
+    size_t block_count;
+    block_t *entry;
+} image_t;
+
+// writes entry and every block it reaches to path (replaced atomically), compact stores the
+// instructions in the compact encoding. Returns 0, or -1 with a message on stderr.
+int image_write(const char *path, block_t *entry, bool compact);
+
+// maps an image written by image_write, NULL with a message on stderr if it is not one
+image_t* image_load(const char *path);
+
+// releases the threaded code of its blocks and the mapping
+void image_free(image_t *image);
+
+
+
+#endif // IMAGE_H
@@ -0,0 +1,561 @@
+#include "jit_emit.h"
+#include "peephole.h"
+
+#ifdef VM_JIT
+
+// the templates below hardcode these
+_Static_assert(sizeof(type_t) == 16 && offsetof(type_t, value) == 8, "the jit needs 16 byte values");
+_Static_assert(NUMBER == 0 && INT == 1 && BOOL == 4, "the jit templates hardcode the Type values");
+_Static_assert(offsetof(vm_stack_t, data) == 0 && offsetof(vm_stack_t, size) == 8 &&
+               offsetof(vm_stack_t, capacity) == 16, "jit_enter hardcodes the vm_stack_t layout");
+
+
+// goes to 1f if both operands are NUMBER, falls through if both are INT, else exits
+#define GUARD_NUMBER_OR_INT(name)           \
+    "    mov (%rsi), %eax\n"                \
+    "    or (%rdi), %eax\n"                 \
+    "    jz 1f\n"                           \
+    "    mov (%rsi), %eax\n"                \
+    "    mov (%rdi), %ecx\n"                \
+    "    xor $1, %eax\n"                    \
+    "    xor $1, %ecx\n"                    \
+    "    or %ecx, %eax\n"                   \
+    JNE_REL32 T_HOLE(name, exit)
+
+#define ARITH_TEMPLATE(name, number_op, int_op)     \
+    T_BEGIN(name)                                   \
+    GUARD_NUMBER_OR_INT(name)                       \
+    "    mov 8(%rsi), %rax\n"                       \
+    "    " int_op " 8(%rdi), %rax\n"                \
+    "    mov %rax, 8(%rdx)\n"                       \
+    "    movq $1, (%rdx)\n"                         \
+    "    jmp 2f\n"                                  \
+    "1:  movsd 8(%rsi), %xmm0\n"                    \
+    "    " number_op " 8(%rdi), %xmm0\n"            \
+    "    movsd %xmm0, 8(%rdx)\n"                    \
+    "    movq $0, (%rdx)\n"                         \
+    "2:\n"                                          \
+    T_END(name)
+
+// number compares follow IEEE (false on NaN except !=), the operands are swapped for < and <=
+#define COMPARE_TEMPLATE(name, int_set, number_left, number_right, number_set)  \
+    T_BEGIN(name)                                                               \
+    GUARD_NUMBER_OR_INT(name)                                                   \
+    "    mov 8(%rsi), %rax\n"                                                   \
+    "    cmp 8(%rdi), %rax\n"                                                   \
+    "    " int_set " %al\n"                                                     \
+    "    jmp 2f\n"                                                              \
+    "1:  movsd " number_left ", %xmm0\n"                                        \
+    "    ucomisd " number_right ", %xmm0\n"                                     \
+    number_set                                                                  \
+    "2:\n"                                                                      \
+    T_END(name)
+
+#define STEP_TEMPLATE(name, number_op, int_op)      \
+    T_BEGIN(name)                                   \
+    "    lea 0x7fffffff(%rbx), %rcx\n"              \
+    T_HOLE(name, disp)                              \
+    "    cmpl $0, (%rcx)\n"                         \
+    "    jne 1f\n"                                  \
+    "    mov $0x3ff0000000000000, %rax\n"           \
+    "    movq %rax, %xmm1\n"                        \
+    "    movsd 8(%rcx), %xmm0\n"                    \
+    "    " number_op " %xmm1, %xmm0\n"              \
+    "    movsd %xmm0, 8(%rcx)\n"                    \
+    "    jmp 2f\n"                                  \
+    "1:  cmpl $1, (%rcx)\n"                         \
+    JNE_REL32 T_HOLE(name, exit)                    \
+    "    " int_op " $1, 8(%rcx)\n"                  \
+    "2:\n"                                          \
+    T_END(name)
+
+__asm__(
+    ".pushsection .text\n"
+    ".globl jit_enter\n"
+    ".type jit_enter, @function\n"
+    "jit_enter:\n"
+    "    push %rbx\n"
+    "    push %r12\n"
+    "    push %r13\n"
+    "    push %r14\n"
+    "    push %r15\n"
+    "    mov %rdi, %rbx\n"
+    "    mov %rsi, %r13\n"
+    "    mov (%r13), %rax\n"
+    "    mov 8(%r13), %rcx\n"
+    "    shl $4, %rcx\n"
+    "    lea (%rax,%rcx), %r12\n"
+    "    mov 16(%r13), %rcx\n"
+    "    shl $4, %rcx\n"
+    "    lea (%rax,%rcx), %r14\n"
+    "    lea jit_exit(%rip), %r15\n"
+    "    jmp *%rdx\n"
+    // eax is the slot to resume at
+    "jit_exit:\n"
+    "    sub (%r13), %r12\n"
+    "    shr $4, %r12\n"
+    "    mov %r12, 8(%r13)\n"
+    "    pop %r15\n"
+    "    pop %r14\n"
+    "    pop %r13\n"
+    "    pop %r12\n"
+    "    pop %rbx\n"
+    "    ret\n"
+    ".size jit_enter, .-jit_enter\n"
+    ".popsection\n"
+
+    ".pushsection .rodata\n"
+
+    T_BEGIN(exit)
+    "    mov $0x7fffffff, %eax\n"
+    T_HOLE(exit, slot)
+    "    jmp *%r15\n"
+    T_END(exit)
+
+    T_BEGIN(check_push)
+    "    cmp %r14, %r12\n"
+    JAE_REL32 T_HOLE(check_push, exit)
+    T_END(check_push)
+
+    T_BEGIN(push_local)
+    "    lea 0x7fffffff(%rbx), %rcx\n"
+    T_HOLE(push_local, disp)
+    COPY_VALUE("(%rcx)", "8(%rcx)", "(%r12)", "8(%r12)")
+    "    add $16, %r12\n"
+    T_END(push_local)
+
+    T_BEGIN(push_const)
+    "    movabs $0x7fffffffffffffff, %rcx\n"
+    T_HOLE(push_const, ptr)
+    COPY_VALUE("(%rcx)", "8(%rcx)", "(%r12)", "8(%r12)")
+    "    add $16, %r12\n"
+    T_END(push_const)
+
+    T_BEGIN(store_local)
+    "    lea 0x7fffffff(%rbx), %rcx\n"
+    T_HOLE(store_local, disp)
+    "    sub $16, %r12\n"
+    COPY_VALUE("(%r12)", "8(%r12)", "(%rcx)", "8(%rcx)")
+    T_END(store_local)
+
+    T_BEGIN(pop)
+    "    sub $16, %r12\n"
+    T_END(pop)
+
+    T_BEGIN(pop2)
+    "    sub $32, %r12\n"
+    T_END(pop2)
+
+    T_BEGIN(grow)
+    "    add $16, %r12\n"
+    T_END(grow)
+
+    T_BEGIN(jump)
+    JMP_REL32 T_HOLE(jump, target)
+    T_END(jump)
+
+    T_BEGIN(jump_false)
+    "    sub $16, %r12\n"
+    "    cmpb $0, 8(%r12)\n"
+    JE_REL32 T_HOLE(jump_false, target)
+    T_END(jump_false)
+
+    STEP_TEMPLATE(inc_local, "addsd", "addq")
+    STEP_TEMPLATE(dec_local, "subsd", "subq")
+
+    T_BEGIN(operands_stack)
+    "    lea -32(%r12), %rsi\n"
+    "    lea -16(%r12), %rdi\n"
+    "    mov %rsi, %rdx\n"
+    T_END(operands_stack)
+
+    T_BEGIN(operands_local)
+    "    lea -16(%r12), %rsi\n"
+    "    lea 0x7fffffff(%rbx), %rdi\n"
+    T_HOLE(operands_local, disp)
+    "    mov %rsi, %rdx\n"
+    T_END(operands_local)
+
+    T_BEGIN(operands_const)
+    "    lea -16(%r12), %rsi\n"
+    "    movabs $0x7fffffffffffffff, %rdi\n"
+    T_HOLE(operands_const, ptr)
+    "    mov %rsi, %rdx\n"
+    T_END(operands_const)
+
+    T_BEGIN(operands_local_const)
+    "    lea 0x7fffffff(%rbx), %rsi\n"
+    T_HOLE(operands_local_const, disp)
+    "    movabs $0x7fffffffffffffff, %rdi\n"
+    T_HOLE(operands_local_const, ptr)
+    "    mov %r12, %rdx\n"
+    T_END(operands_local_const)
+
+    ARITH_TEMPLATE(add, "addsd", "add")
+    ARITH_TEMPLATE(sub, "subsd", "sub")
+    ARITH_TEMPLATE(mul, "mulsd", "imul")
+
+    // INT / INT is a NUMBER
+    T_BEGIN(div)
+    GUARD_NUMBER_OR_INT(div)
+    "    cvtsi2sdq 8(%rsi), %xmm0\n"
+    "    cvtsi2sdq 8(%rdi), %xmm1\n"
+    "    divsd %xmm1, %xmm0\n"
+    "    jmp 2f\n"
+    "1:  movsd 8(%rsi), %xmm0\n"
+    "    divsd 8(%rdi), %xmm0\n"
+    "2:  movsd %xmm0, 8(%rdx)\n"
+    "    movq $0, (%rdx)\n"
+    T_END(div)
+
+    COMPARE_TEMPLATE(eq, "sete", "8(%rsi)", "8(%rdi)", "    sete %al\n    setnp %cl\n    and %cl, %al\n")
+    COMPARE_TEMPLATE(ne, "setne", "8(%rsi)", "8(%rdi)", "    setne %al\n    setp %cl\n    or %cl, %al\n")
+    COMPARE_TEMPLATE(lt, "setl", "8(%rdi)", "8(%rsi)", "    seta %al\n")
+    COMPARE_TEMPLATE(gt, "setg", "8(%rsi)", "8(%rdi)", "    seta %al\n")
+    COMPARE_TEMPLATE(le, "setle", "8(%rdi)", "8(%rsi)", "    setae %al\n")
+    COMPARE_TEMPLATE(ge, "setge", "8(%rsi)", "8(%rdi)", "    setae %al\n")
+
+    T_BEGIN(store_bool)
+    "    movzbl %al, %eax\n"
+    "    mov %rax, 8(%rdx)\n"
+    "    movq $4, (%rdx)\n"
+    T_END(store_bool)
+
+    T_BEGIN(branch_false)
+    "    test %al, %al\n"
+    JE_REL32 T_HOLE(branch_false, target)
+    T_END(branch_false)
+
+    ".popsection\n"
+);
+
+#undef GUARD_NUMBER_OR_INT
+#undef ARITH_TEMPLATE
+#undef COMPARE_TEMPLATE
+#undef STEP_TEMPLATE
+
+DECLARE_TEMPLATE(inc_local);            DECLARE_HOLE(inc_local, disp);  DECLARE_HOLE(inc_local, exit);
+DECLARE_TEMPLATE(dec_local);            DECLARE_HOLE(dec_local, disp);  DECLARE_HOLE(dec_local, exit);
+
+#define DECLARE_OP_TEMPLATE(OP, name, operator, make, int_make) \
+    DECLARE_TEMPLATE(name); DECLARE_HOLE(name, exit);
+NUM_ARITH_OPS(DECLARE_OP_TEMPLATE)
+NUM_COMPARE_OPS(DECLARE_OP_TEMPLATE)
+
+typedef struct /* jit_template_t */ {
+    const uint8_t *start, *end, *exit;
+} jit_template_t;
+
+#define OP_TEMPLATE_ROW(OP, name, operator, make, int_make) \
+    [OP_##OP] = {jit_tpl_##name, jit_tpl_##name##_end, jit_tpl_##name##_exit},
+
+// binary op bodies, a NULL start means the op always runs in vm_run
+static const jit_template_t op_templates[Op_unary] = {
+    NUM_ARITH_OPS(OP_TEMPLATE_ROW)
+    NUM_COMPARE_OPS(OP_TEMPLATE_ROW)
+};
+
+#undef DECLARE_OP_TEMPLATE
+#undef OP_TEMPLATE_ROW
+
+
+// emits the body of a binary op, compares store a BOOL unless a branch uses al instead
+static void emit_op(jit_buffer_t *b, Op op, int32_t slot, bool store_bool) {
+    const jit_template_t *t = &op_templates[op];
+    size_t at = emit(b, t->start, t->end);
+    EXIT_TO(b, at + (size_t)(t->exit - t->start), slot);
+    if (store_bool && op >= OP_EQ) EMIT(b, store_bool);
+}
+
+// the CMP_LOCAL_CONST_JUMP_FALSE a counted loop back edge at code[ip] does the compare of (peephole.h)
+static inline size_t counted_loop_header(const uint8_t *code, size_t ip) {
+    return (size_t)operand_i32(code, ip + 10) - 14;
+}
+
+static bool has_template(const block_t *block, const uint8_t *code, size_t ip) {
+    bool has_local = false;
+    int op = -1;
+    switch (code[ip]) {
+        case PUSH_CONST: case POP: case JUMP: case JUMP_FALSE:
+            return true;
+        case PUSH_LOCAL: case STORE_LOCAL: case INC_LOCAL: case DEC_LOCAL:
+            has_local = true;
+            break;
+        case CALL_OP: case CALL_OP_INT: case CALL_OP_NUMBER: case CMP_JUMP_FALSE:
+            op = code[ip + 1];
+            break;
+        case CALL_OP_LOCAL: case CALL_OP_LOCAL_CONST: case CMP_LOCAL_CONST_JUMP_FALSE:
+            has_local = true;
+            op = code[ip + (code[ip] == CALL_OP_LOCAL ? 5 : 9)];
+            break;
+        case CALL_OP_CONST:
+            op = code[ip + 5];
+            break;
+        case INC_LOCAL_CMP_JUMP: case DEC_LOCAL_CMP_JUMP:
+            // compiled as the step and a jump back to the header (see compile_instruction)
+            if (operand_i32(code, ip + 10) < 14 || code[counted_loop_header(code, ip)] != CMP_LOCAL_CONST_JUMP_FALSE) return false;
+            has_local = true;
+            break;
+        default:
+            return false;
+    }
+    // a local out of range is left to vm_run, like any malformed code
+    if (has_local) {
+        int32_t local = operand_i32(code, ip + 1);
+        if (local < 0 || (size_t)local >= block->local_count) return false;
+    }
+    return op < 0 || (op < Op_unary && op_templates[op].start);
+}
+
+static void compile_instruction(jit_buffer_t *b, const block_t *block, const uint8_t *code, size_t ip, int32_t slot) {
+    size_t at;
+    switch (code[ip]) {
+        case PUSH_CONST:
+            at = EMIT(b, check_push);
+            EXIT_TO(b, HOLE(at, check_push, exit), slot);
+            at = EMIT(b, push_const);
+            patch_ptr(b, HOLE(at, push_const, ptr), &block->constants[operand_i32(code, ip + 1)]);
+            break;
+        case PUSH_LOCAL:
+            at = EMIT(b, check_push);
+            EXIT_TO(b, HOLE(at, check_push, exit), slot);
+            at = EMIT(b, push_local);
+            patch_i32(b, HOLE(at, push_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+            break;
+        case STORE_LOCAL:
+            at = EMIT(b, store_local);
+            patch_i32(b, HOLE(at, store_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+            break;
+        case POP:
+            EMIT(b, pop);
+            break;
+        case JUMP:
+            at = EMIT(b, jump);
+            JUMP_TO(b, HOLE(at, jump, target), operand_i32(code, ip + 1));
+            break;
+        case JUMP_FALSE:
+            at = EMIT(b, jump_false);
+            JUMP_TO(b, HOLE(at, jump_false, target), operand_i32(code, ip + 1));
+            break;
+        case INC_LOCAL:
+            at = EMIT(b, inc_local);
+            patch_i32(b, HOLE(at, inc_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+            EXIT_TO(b, HOLE(at, inc_local, exit), slot);
+            break;
+        case DEC_LOCAL:
+            at = EMIT(b, dec_local);
+            patch_i32(b, HOLE(at, dec_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+            EXIT_TO(b, HOLE(at, dec_local, exit), slot);
+            break;
+        case CALL_OP:
+        case CALL_OP_INT:
+        case CALL_OP_NUMBER:
+            EMIT(b, operands_stack);
+            emit_op(b, code[ip + 1], slot, true);
+            EMIT(b, pop);
+            break;
+        case CALL_OP_LOCAL:
+            at = EMIT(b, operands_local);
+            patch_i32(b, HOLE(at, operands_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+            emit_op(b, code[ip + 5], slot, true);
+            break;
+        case CALL_OP_CONST:
+            at = EMIT(b, operands_const);
+            patch_ptr(b, HOLE(at, operands_const, ptr), &block->constants[operand_i32(code, ip + 1)]);
+            emit_op(b, code[ip + 5], slot, true);
+            break;
+        case CALL_OP_LOCAL_CONST:
+        case CMP_LOCAL_CONST_JUMP_FALSE: {
+            bool jump = code[ip] == CMP_LOCAL_CONST_JUMP_FALSE;
+            if (!jump) {
+                at = EMIT(b, check_push);
+                EXIT_TO(b, HOLE(at, check_push, exit), slot);
+            }
+            at = EMIT(b, operands_local_const);
+            patch_i32(b, HOLE(at, operands_local_const, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+            patch_ptr(b, HOLE(at, operands_local_const, ptr), &block->constants[operand_i32(code, ip + 5)]);
+            emit_op(b, code[ip + 9], slot, !jump);
+            if (jump) {
+                at = EMIT(b, branch_false);
+                JUMP_TO(b, HOLE(at, branch_false, target), operand_i32(code, ip + 10));
+            } else {
+                EMIT(b, grow);
+            }
+            break;
+        }
+        case CMP_JUMP_FALSE:
+            EMIT(b, operands_stack);
+            emit_op(b, code[ip + 1], slot, false);
+            EMIT(b, pop2);
+            at = EMIT(b, branch_false);
+            JUMP_TO(b, HOLE(at, branch_false, target), operand_i32(code, ip + 2));
+            break;
+        case INC_LOCAL_CMP_JUMP:
+        case DEC_LOCAL_CMP_JUMP:
+            // the header's guards exit to the header, after the step, where vm_run does the compare again
+            if (code[ip] == INC_LOCAL_CMP_JUMP) {
+                at = EMIT(b, inc_local);
+                patch_i32(b, HOLE(at, inc_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+                EXIT_TO(b, HOLE(at, inc_local, exit), slot);
+            } else {
+                at = EMIT(b, dec_local);
+                patch_i32(b, HOLE(at, dec_local, disp), operand_i32(code, ip + 1) * (int32_t)sizeof(type_t));
+                EXIT_TO(b, HOLE(at, dec_local, exit), slot);
+            }
+            at = EMIT(b, jump);
+            JUMP_TO(b, HOLE(at, jump, target), counted_loop_header(code, ip));
+            break;
+    }
+}
+
+/*
+    Entering and leaving native code costs about as much as a few threaded instructions, so
+    only loops pay off: vm_run enters native code only at instructions from which it runs on
+    into a loop with a template for every instruction. Other instructions with a template are
+    still compiled (a native jump may reach them) but keep their vm_run handler.
+*/
+static bool* find_entries(const block_t *block, const uint8_t *code, size_t size) {
+    bool *native = calloc(size + 1, sizeof(bool));
+    bool *in_loop = calloc(size + 1, sizeof(bool));
+    bool *entry = calloc(size + 1, sizeof(bool));
+    size_t *starts = malloc((size + 1) * sizeof(size_t));
+    if (!native || !in_loop || !entry || !starts) jit_out_of_memory();
+
+    size_t count = 0;
+    for (size_t ip = 0; ip < size; ip += bytecode_length(code, ip)) {
+        starts[count++] = ip;
+        native[ip] = has_template(block, code, ip);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t ip = starts[i], operand = bytecode_jump_operand(code, ip);
+        size_t target = operand ? (size_t)operand_i32(code, operand) : size;
+        if (target > ip) continue;
+
+        // a backward jump closes the loop [target, ip]
+        bool all_native = true;
+        for (size_t j = 0; j <= i; j++) {
+            if (starts[j] >= target) all_native = all_native && native[starts[j]];
+        }
+        for (size_t j = 0; all_native && j <= i; j++) {
+            if (starts[j] >= target) in_loop[starts[j]] = true;
+        }
+    }
+
+    for (size_t i = count; i-- > 0;) {
+        size_t ip = starts[i];
+        size_t next = ip + bytecode_length(code, ip);
+        if (!native[ip]) continue;
+        if (code[ip] == JUMP) {
+            size_t target = operand_i32(code, ip + 1);
+            entry[ip] = in_loop[ip] || (target > ip && entry[target]);
+        } else {
+            entry[ip] = in_loop[ip] || entry[next];
+        }
+    }
+
+    free(native);
+    free(in_loop);
+    free(starts);
+    return entry;
+}
+
+void jit_compile(block_t *block, void *enter_handler) {
+    if (block->jit || !block->code) return;
+
+    // the same instructions translate_block laid out in block->code
+    size_t size;
+    uint8_t *optimized = peephole_optimize(block->instructions, block->instruction_size, &size);
+    uint8_t *instructions = optimized ? optimized : block->instructions;
+    if (!optimized) size = block->instruction_size;
+
+    size_t *native_at = malloc((size + 1) * sizeof(size_t));
+    int32_t *slot_at = malloc((size + 1) * sizeof(int32_t));
+    void **native = calloc(block->code_size, sizeof(void*));
+    void **handlers = calloc(block->code_size, sizeof(void*));
+    bool *entry = find_entries(block, instructions, size);
+    if (!native_at || !slot_at || !native || !handlers) jit_out_of_memory();
+
+    jit_buffer_t b = {0};
+    bool any = false;
+
+    int32_t slot = 0;
+    for (size_t ip = 0; ip < size; ip += bytecode_length(instructions, ip)) {
+        native_at[ip] = b.size;
+        slot_at[ip] = slot;
+        if (has_template(block, instructions, ip)) {
+            compile_instruction(&b, block, instructions, ip, slot);
+            if (entry[ip]) {
+                native[slot] = (void*)1; // real address once the code is mapped
+                any = true;
+            }
+        } else {
+            emit_exit(&b, slot);
+        }
+        slot += slot_count(instructions, ip);
+    }
+    native_at[size] = b.size;
+    slot_at[size] = slot;
+    emit_exit(&b, slot); // trailing HALT
+
+    if (!any || (size_t)slot + 1 != block->code_size) goto not_compiled;
+
+    // guard misses resume at their own slot
+    emit_exit_stubs(&b, block->code_size);
+    for (size_t i = 0; i < b.fixup_count; i++) {
+        if (b.fixups[i].slot < 0) patch_rel32(&b, b.fixups[i].at, native_at[b.fixups[i].target]);
+    }
+
+    size_t mapped_size;
+    uint8_t *code = jit_map(&b, &mapped_size);
+    if (!code) goto not_compiled;
+
+    jit_code_t *jit = malloc(sizeof(jit_code_t));
+    if (!jit) jit_out_of_memory();
+    *jit = (jit_code_t){.code = code, .mapped_size = mapped_size, .native = native, .handlers = handlers,
+                        .enter = enter_handler};
+
+    for (size_t ip = 0; ip <= size; ip += ip < size ? bytecode_length(instructions, ip) : 1) {
+        int32_t s = slot_at[ip];
+        handlers[s] = block->code[s].handler;
+        if (native[s]) {
+            native[s] = code + native_at[ip];
+            block->code[s].handler = enter_handler;
+        }
+    }
+    block->jit = jit;
+
+    free(native_at);
+    free(slot_at);
+    free(entry);
+    jit_buffer_free(&b);
+    free(optimized);
+    return;
+
+not_compiled:
+    free(native_at);
+    free(slot_at);
+    free(entry);
+    free(native);
+    free(handlers);
+    jit_buffer_free(&b);
+    free(optimized);
+}
+
+#endif // VM_JIT
+
+void block_free_jit(block_t *block) {
+    jit_code_t *jit = block->jit;
+    if (!jit) return;
+
+    // hand the compiled instructions back to vm_run, unless it rewrote their handlers since
+    for (size_t i = 0; i < block->code_size; i++) {
+        if (jit->native[i] && block->code[i].handler == jit->enter) block->code[i].handler = jit->handlers[i];
+    }
+
+    munmap(jit->code, jit->mapped_size);
+    free(jit->native);
+    free(jit->handlers);
+    free(jit);
+    block->jit = NULL;
+}
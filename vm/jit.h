@@ -0,0 +1,62 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+
+
+/*
+    Baseline JIT (x86-64 Linux, 16 byte values only, -DNO_JIT turns it off)
+
+    A block called jit_threshold times (see vm_t) is compiled to machine code by copying one
+    pre-assembled template per instruction into an executable mapping and patching the
+    operands in (local offsets, constant pointers, jump targets). There is no register
+    allocation: the native code works on the same vm stack and locals as vm_run.
+
+        rbx locals      r12 vm stack top      r13 &vm->stack
+        r14 stack end   r15 exit routine
+
+    Templates exist for PUSH_CONST, PUSH_LOCAL, STORE_LOCAL, POP, JUMP, JUMP_FALSE,
+    INC_LOCAL/DEC_LOCAL and the NUMBER/INT arithmetic (ADD SUB MUL DIV) and compares,
+    including their superinstructions. They guard the operand types and the stack capacity.
+    A counted loop back edge (INC_LOCAL_CMP_JUMP) is its step and a jump to its header, in
+    native code a dispatch saves nothing.
+
+    Every other instruction (calls, RETURN, PUSH/STORE, ...) and every guard miss exits to
+    vm_run at that instruction's slot, so the values keep the exact same semantics. Only
+    blocks with a loop that is native all the way round are compiled; the handler slot of
+    every instruction that runs on into such a loop is replaced by vm_run's jit entry
+    handler, so vm_run enters the native code again wherever it dispatches one of them,
+    e.g. right after a call returns.
+*/
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(NAN_BOXING) && !defined(NO_JIT)
+#define VM_JIT 1
+#endif
+
+#define JIT_DEFAULT_THRESHOLD 1000 // calls before a block is compiled
+
+typedef struct jit_code_s {
+    uint8_t *code;
+    size_t mapped_size;
+
+    void **native;   // native address of the instruction at each slot, NULL if vm_run runs it
+    void **handlers; // handler each instruction slot had before it was compiled
+    void *enter;     // the entry handler compiled slots have until vm_run rewrites one
+} jit_code_t;
+
+#ifdef VM_JIT
+
+// compiles block->code, enter_handler is the handler that calls jit_enter for the current slot
+void jit_compile(block_t *block, void *enter_handler);
+
+// runs native code from native until it exits, returns the slot vm_run resumes at
+size_t jit_enter(type_t *locals, vm_stack_t *stack, void *native);
+
+#endif // VM_JIT
+
+// releases the native code of the block (does nothing if there is none)
+void block_free_jit(block_t *block);
+
+
+
+#endif // JIT_H
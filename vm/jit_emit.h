@@ -0,0 +1,191 @@
+#ifndef JIT_EMIT_H
+#define JIT_EMIT_H
+
+#include "jit.h"
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef VM_JIT
+
+
+/*
+    Machine code templates and buffers shared by the baseline JIT (jit.c) and the trace
+    compiler (trace.c)
+
+    Every template is a labelled piece of machine code assembled into .rodata with the rest
+    of its file and never executed in place. A hole is an operand the compiler patches after
+    copying, its label sits right after the instruction, so the hole is the last 4 (disp32,
+    imm32, rel32) or 8 (imm64) bytes before it. rel32 holes are the exit of a guard or a jump
+    target, recorded as fixups until every offset is known.
+
+    The binary op templates take the left operand in rsi, the right one in rdi and write
+    the result to rdx (compares leave it in al instead).
+*/
+
+#define T_LABEL(label)  ".globl " label "\n.hidden " label "\n" label ":\n"
+#define T_BEGIN(name)   T_LABEL("jit_tpl_" #name)
+#define T_HOLE(name, hole) T_LABEL("jit_tpl_" #name "_" #hole)
+#define T_END(name)     T_LABEL("jit_tpl_" #name "_end")
+
+// jumps with a 4 byte displacement whatever the target ends up being
+#define JMP_REL32       "    .byte 0xe9\n    .long 0\n"
+#define JA_REL32        "    .byte 0x0f, 0x87\n    .long 0\n"
+#define JAE_REL32       "    .byte 0x0f, 0x83\n    .long 0\n"
+#define JE_REL32        "    .byte 0x0f, 0x84\n    .long 0\n"
+#define JNE_REL32       "    .byte 0x0f, 0x85\n    .long 0\n"
+
+/*
+    Values are always moved as two 8 byte halves and a type is written together with its
+    padding: a load that spans two smaller stores (or half of a 16 byte store) cannot be
+    forwarded from the store buffer and stalls for a dozen cycles.
+*/
+#define COPY_VALUE(src_type, src_value, dst_type, dst_value) \
+    "    mov " src_type ", %rax\n"                           \
+    "    mov " src_value ", %rdx\n"                          \
+    "    mov %rax, " dst_type "\n"                           \
+    "    mov %rdx, " dst_value "\n"
+
+#define DECLARE_TEMPLATE(name) \
+    extern const uint8_t jit_tpl_##name[] __attribute__((visibility("hidden"))), \
+                         jit_tpl_##name##_end[] __attribute__((visibility("hidden")))
+#define DECLARE_HOLE(name, hole) \
+    extern const uint8_t jit_tpl_##name##_##hole[] __attribute__((visibility("hidden")))
+
+// defined in jit.c
+DECLARE_TEMPLATE(exit);                 DECLARE_HOLE(exit, slot);
+DECLARE_TEMPLATE(check_push);           DECLARE_HOLE(check_push, exit);
+DECLARE_TEMPLATE(push_local);           DECLARE_HOLE(push_local, disp);
+DECLARE_TEMPLATE(push_const);           DECLARE_HOLE(push_const, ptr);
+DECLARE_TEMPLATE(store_local);          DECLARE_HOLE(store_local, disp);
+DECLARE_TEMPLATE(pop);
+DECLARE_TEMPLATE(pop2);
+DECLARE_TEMPLATE(grow);
+DECLARE_TEMPLATE(jump);                 DECLARE_HOLE(jump, target);
+DECLARE_TEMPLATE(jump_false);           DECLARE_HOLE(jump_false, target);
+DECLARE_TEMPLATE(operands_stack);
+DECLARE_TEMPLATE(operands_local);       DECLARE_HOLE(operands_local, disp);
+DECLARE_TEMPLATE(operands_const);       DECLARE_HOLE(operands_const, ptr);
+DECLARE_TEMPLATE(operands_local_const); DECLARE_HOLE(operands_local_const, disp);
+                                        DECLARE_HOLE(operands_local_const, ptr);
+DECLARE_TEMPLATE(store_bool);
+DECLARE_TEMPLATE(branch_false);         DECLARE_HOLE(branch_false, target);
+
+
+// a rel32 to patch once every offset is known, to the exit of slot or to the instruction at target
+typedef struct /* jit_fixup_t */ {
+    size_t at;  // offset right after the rel32
+    int32_t slot;
+    int32_t target;
+} jit_fixup_t;
+
+typedef struct /* jit_buffer_t */ {
+    uint8_t *data;
+    size_t size, capacity;
+
+    jit_fixup_t *fixups;
+    size_t fixup_count, fixup_capacity;
+} jit_buffer_t;
+
+static inline void jit_out_of_memory(void) {
+    fprintf(stderr, "Failed to allocate memory for native code\n");
+    exit(EXIT_FAILURE);
+}
+
+// copies the template [start, end) to the end of the buffer and returns where it starts
+static inline size_t emit(jit_buffer_t *b, const uint8_t *start, const uint8_t *end) {
+    size_t n = end - start;
+    if (b->size + n > b->capacity) {
+        b->capacity = (b->size + n) * 2;
+        b->data = realloc(b->data, b->capacity);
+        if (!b->data) jit_out_of_memory();
+    }
+    memcpy(&b->data[b->size], start, n);
+    b->size += n;
+    return b->size - n;
+}
+
+#define EMIT(b, name) emit(b, jit_tpl_##name, jit_tpl_##name##_end)
+
+// offset in the buffer right after the hole of a template copied at `at`
+#define HOLE(at, name, hole) ((at) + (size_t)(jit_tpl_##name##_##hole - jit_tpl_##name))
+
+static inline void patch_i32(jit_buffer_t *b, size_t after, int32_t v) {
+    memcpy(&b->data[after - 4], &v, 4);
+}
+
+static inline void patch_ptr(jit_buffer_t *b, size_t after, const void *p) {
+    memcpy(&b->data[after - 8], &p, 8);
+}
+
+// points the rel32 ending at `after` to the offset `to` of the same buffer
+static inline void patch_rel32(jit_buffer_t *b, size_t after, size_t to) {
+    patch_i32(b, after, (int32_t)((ptrdiff_t)to - (ptrdiff_t)after));
+}
+
+static inline void add_fixup(jit_buffer_t *b, size_t at, int32_t slot, int32_t target) {
+    if (b->fixup_count == b->fixup_capacity) {
+        b->fixup_capacity = b->fixup_capacity ? b->fixup_capacity * 2 : 16;
+        b->fixups = realloc(b->fixups, b->fixup_capacity * sizeof(jit_fixup_t));
+        if (!b->fixups) jit_out_of_memory();
+    }
+    b->fixups[b->fixup_count++] = (jit_fixup_t){.at = at, .slot = slot, .target = target};
+}
+
+#define EXIT_TO(b, after, slot) add_fixup(b, after, slot, -1)
+#define JUMP_TO(b, after, target) add_fixup(b, after, -1, target)
+
+static inline int32_t operand_i32(const uint8_t *code, size_t at) {
+    return BYTES4_TO_INT(code[at], code[at + 1], code[at + 2], code[at + 3]);
+}
+
+// leaves the native code, vm_run resumes at slot
+static inline void emit_exit(jit_buffer_t *b, int32_t slot) {
+    size_t at = EMIT(b, exit);
+    patch_i32(b, HOLE(at, exit, slot), slot);
+}
+
+// appends one exit per slot some guard leaves to and patches those fixups, jump fixups are left alone
+static inline void emit_exit_stubs(jit_buffer_t *b, size_t slots) {
+    size_t *stub_at = malloc(slots * sizeof(size_t));
+    if (!stub_at) jit_out_of_memory();
+    for (size_t i = 0; i < slots; i++) stub_at[i] = SIZE_MAX;
+
+    for (size_t i = 0; i < b->fixup_count; i++) {
+        jit_fixup_t f = b->fixups[i];
+        if (f.slot < 0) continue;
+        if (stub_at[f.slot] == SIZE_MAX) {
+            stub_at[f.slot] = b->size;
+            emit_exit(b, f.slot);
+        }
+        patch_rel32(b, f.at, stub_at[f.slot]);
+    }
+    free(stub_at);
+}
+
+// copies the buffer into a new executable mapping, NULL if the system refuses one
+static inline uint8_t* jit_map(const jit_buffer_t *b, size_t *mapped_size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *mapped_size = (b->size + page - 1) / page * page;
+
+    uint8_t *code = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+    memcpy(code, b->data, b->size);
+    if (mprotect(code, *mapped_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, *mapped_size);
+        return NULL;
+    }
+    return code;
+}
+
+static inline void jit_buffer_free(jit_buffer_t *b) {
+    free(b->data);
+    free(b->fixups);
+    *b = (jit_buffer_t){0};
+}
+
+
+
+#endif // VM_JIT
+
+#endif // JIT_EMIT_H
@@ -0,0 +1,218 @@
+#include "peephole.h"
+#include <string.h>
+
+
+#define MAX_FUSED 4
+
+static inline int32_t get_i32(const uint8_t *code) {
+    return BYTES4_TO_INT(code[0], code[1], code[2], code[3]);
+}
+
+static inline void put_i32(uint8_t *code, int32_t v) {
+    uint8_t bytes[] = {INT_TO_BYTES4(v)};
+    memcpy(code, bytes, 4);
+}
+
+static inline bool is_binary_op(uint8_t op) {
+    return op < Op_unary;
+}
+
+static inline bool is_compare_op(uint8_t op) {
+    return op >= OP_EQ && op <= OP_GE;
+}
+
+// writes the fused form of the instructions starting at at[0..n) into out.
+// returns the number of bytes written, *consumed is the number of instructions fused (0 if none)
+static size_t fuse(const uint8_t *code, const size_t *at, int n, uint8_t *out, int *consumed) {
+    // a typed CALL_OP fuses like CALL_OP, the superinstructions check the types themselves
+    int opcode[MAX_FUSED];
+    for (int i = 0; i < MAX_FUSED; i++) opcode[i] = i < n ? code[at[i]] : -1;
+    for (int i = 0; i < n; i++) {
+        if (opcode[i] == CALL_OP_INT || opcode[i] == CALL_OP_NUMBER) opcode[i] = CALL_OP;
+    }
+
+    if (opcode[0] == PUSH_LOCAL && opcode[1] == PUSH_CONST) {
+        const uint8_t *local = &code[at[0] + 1], *constant = &code[at[1] + 1];
+
+        if (opcode[2] == CALL_OP && is_compare_op(code[at[2] + 1]) && opcode[3] == JUMP_FALSE) {
+            out[0] = CMP_LOCAL_CONST_JUMP_FALSE;
+            memcpy(&out[1], local, 4);
+            memcpy(&out[5], constant, 4);
+            out[9] = code[at[2] + 1];
+            memcpy(&out[10], &code[at[3] + 1], 4);
+            *consumed = 4;
+            return 14;
+        }
+
+        if (opcode[2] == CMP_JUMP_FALSE) {
+            out[0] = CMP_LOCAL_CONST_JUMP_FALSE;
+            memcpy(&out[1], local, 4);
+            memcpy(&out[5], constant, 4);
+            memcpy(&out[9], &code[at[2] + 1], 5);
+            *consumed = 3;
+            return 14;
+        }
+
+        if (opcode[2] == CALL_OP && is_binary_op(code[at[2] + 1])) {
+            out[0] = CALL_OP_LOCAL_CONST;
+            memcpy(&out[1], local, 4);
+            memcpy(&out[5], constant, 4);
+            out[9] = code[at[2] + 1];
+            *consumed = 3;
+            return 10;
+        }
+    }
+
+    if ((opcode[0] == PUSH_LOCAL || opcode[0] == PUSH_CONST) && opcode[1] == CALL_OP && is_binary_op(code[at[1] + 1])) {
+        out[0] = opcode[0] == PUSH_LOCAL ? CALL_OP_LOCAL : CALL_OP_CONST;
+        memcpy(&out[1], &code[at[0] + 1], 4);
+        out[5] = code[at[1] + 1];
+        *consumed = 2;
+        return 6;
+    }
+
+    if (opcode[0] == CALL_OP && is_compare_op(code[at[0] + 1]) && opcode[1] == JUMP_FALSE) {
+        out[0] = CMP_JUMP_FALSE;
+        out[1] = code[at[0] + 1];
+        memcpy(&out[2], &code[at[1] + 1], 4);
+        *consumed = 2;
+        return 6;
+    }
+
+    if (opcode[0] == CALL_FUNC && opcode[1] == RETURN) {
+        size_t len = bytecode_length(code, at[0]);
+        memcpy(out, &code[at[0]], len);
+        out[0] = TAIL_CALL;
+        *consumed = 2;
+        return len;
+    }
+
+    *consumed = 0;
+    return 0;
+}
+
+// the loop body if INC_LOCAL/DEC_LOCAL x at `inc`, JUMP at `jump` close a while loop counting x:
+// the JUMP goes back to PUSH_LOCAL x, PUSH_CONST, CALL_OP cmp, JUMP_FALSE past the JUMP (a header
+// that fuses into CMP_LOCAL_CONST_JUMP_FALSE), and the body follows the header. 0 otherwise.
+static size_t counted_loop_body(const uint8_t *code, size_t inc, size_t jump, const bool *is_start, const bool *is_target) {
+    if ((code[inc] != INC_LOCAL && code[inc] != DEC_LOCAL) || code[jump] != JUMP || is_target[jump]) return 0;
+
+    size_t header = (size_t)get_i32(&code[jump + 1]);
+    size_t constant = header + 5, op = constant + 5, exit_jump = op + 2, body = exit_jump + 5;
+    if (body > inc || !is_start[header] || !is_start[constant] || !is_start[op] || !is_start[exit_jump] ||
+        is_target[constant] || is_target[op] || is_target[exit_jump]) {
+        return 0;
+    }
+
+    int cmp = code[op];
+    bool counted = code[header] == PUSH_LOCAL && get_i32(&code[header + 1]) == get_i32(&code[inc + 1]) &&
+                   code[constant] == PUSH_CONST &&
+                   (cmp == CALL_OP || cmp == CALL_OP_INT || cmp == CALL_OP_NUMBER) && is_compare_op(code[op + 1]) &&
+                   code[exit_jump] == JUMP_FALSE && (size_t)get_i32(&code[exit_jump + 1]) == jump + 5;
+    return counted ? body : 0;
+}
+
+uint8_t* peephole_optimize(const uint8_t *code, size_t size, size_t *out_size) {
+    // instruction starts and jump targets, bail out on anything malformed
+    bool *is_start = calloc(size + 1, sizeof(bool));
+    bool *is_target = calloc(size + 1, sizeof(bool));
+    int32_t *new_offset = malloc((size + 1) * sizeof(int32_t));
+    uint8_t *out = NULL;
+    if (!is_start || !is_target || !new_offset) goto not_optimized;
+
+    for (size_t ip = 0; ip < size;) {
+        size_t len = bytecode_checked_length(code, ip, size);
+        if (!len) goto not_optimized;
+
+        size_t operand = bytecode_jump_operand(code, ip);
+        if (operand) {
+            int32_t target = get_i32(&code[operand]);
+            if (target < 0 || (size_t)target > size) goto not_optimized;
+            is_target[target] = true;
+        }
+
+        is_start[ip] = true;
+        ip += len;
+    }
+    is_start[size] = true;
+
+    for (size_t i = 0; i <= size; i++) {
+        if (is_target[i] && !is_start[i]) goto not_optimized;
+    }
+
+    // the body of a counted loop is where its back edge goes, it must start an instruction once fused.
+    // Everything else only shrinks, a back edge is 4 bytes longer than INC_LOCAL, JUMP.
+    size_t counted = 0;
+    for (size_t ip = 0, prev = SIZE_MAX; ip < size; prev = ip, ip += bytecode_length(code, ip)) {
+        size_t body = prev == SIZE_MAX ? 0 : counted_loop_body(code, prev, ip, is_start, is_target);
+        if (body) {
+            is_target[body] = true;
+            counted++;
+        }
+    }
+    out = malloc(size + counted * 4 + 1);
+    if (!out) goto not_optimized;
+
+    size_t o = 0;
+    bool fused = false;
+    for (size_t ip = 0; ip < size;) {
+        // the instructions a superinstruction may cover: only the first one can be a jump target
+        size_t at[MAX_FUSED];
+        int n = 0;
+        for (size_t p = ip; n < MAX_FUSED && p < size && (n == 0 || !is_target[p]); p += bytecode_length(code, p)) {
+            at[n++] = p;
+        }
+
+        new_offset[ip] = (int32_t)o;
+
+        size_t body = n >= 2 ? counted_loop_body(code, at[0], at[1], is_start, is_target) : 0;
+        if (body) {
+            // the header's local, constant and compare, with the body as the target
+            size_t header = (size_t)get_i32(&code[at[1] + 1]);
+            out[o] = code[at[0]] == INC_LOCAL ? INC_LOCAL_CMP_JUMP : DEC_LOCAL_CMP_JUMP;
+            memcpy(&out[o + 1], &code[header + 1], 4);
+            memcpy(&out[o + 5], &code[header + 6], 4);
+            out[o + 9] = code[header + 11];
+            put_i32(&out[o + 10], (int32_t)body);
+            fused = true;
+            o += 14;
+            ip = at[1] + 5;
+            continue;
+        }
+
+        int consumed;
+        size_t written = fuse(code, at, n, &out[o], &consumed);
+        if (consumed) {
+            fused = true;
+            o += written;
+            ip = at[consumed - 1] + bytecode_length(code, at[consumed - 1]);
+        } else {
+            size_t len = bytecode_length(code, ip);
+            memcpy(&out[o], &code[ip], len);
+            o += len;
+            ip += len;
+        }
+    }
+    new_offset[size] = (int32_t)o;
+
+    if (!fused) goto not_optimized;
+
+    // jump offsets still point into the original layout
+    for (size_t ip = 0; ip < o; ip += bytecode_length(out, ip)) {
+        size_t operand = bytecode_jump_operand(out, ip);
+        if (operand) put_i32(&out[operand], new_offset[get_i32(&out[operand])]);
+    }
+
+    free(is_start);
+    free(is_target);
+    free(new_offset);
+    *out_size = o;
+    return out;
+
+not_optimized:
+    free(is_start);
+    free(is_target);
+    free(new_offset);
+    free(out);
+    return NULL;
+}
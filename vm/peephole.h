@@ -0,0 +1,37 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "vm.h"
+
+
+/*
+    Peephole pass
+
+    Fuses the most common instruction sequences into superinstructions (formats in vm.h):
+
+        PUSH_LOCAL, PUSH_CONST, CALL_OP cmp, JUMP_FALSE   ->  CMP_LOCAL_CONST_JUMP_FALSE
+        PUSH_LOCAL, PUSH_CONST, CMP_JUMP_FALSE            ->  CMP_LOCAL_CONST_JUMP_FALSE
+        PUSH_LOCAL, PUSH_CONST, CALL_OP                   ->  CALL_OP_LOCAL_CONST
+        PUSH_LOCAL, CALL_OP                               ->  CALL_OP_LOCAL
+        PUSH_CONST, CALL_OP                               ->  CALL_OP_CONST
+        CALL_OP cmp, JUMP_FALSE                           ->  CMP_JUMP_FALSE
+        CALL_FUNC, RETURN                                 ->  TAIL_CALL
+        INC_LOCAL x, JUMP to a header on x (below)        ->  INC_LOCAL_CMP_JUMP
+        DEC_LOCAL x, JUMP to a header on x                ->  DEC_LOCAL_CMP_JUMP
+
+    where CALL_OP is a binary op (CALL_OP_INT/CALL_OP_NUMBER included) and cmp one of OP_EQ..OP_GE. A sequence is never fused
+    across a jump target, and every jump offset is relocated to the new layout.
+
+    The last two close a counted while loop: the JUMP goes back to the header PUSH_LOCAL x,
+    PUSH_CONST, CALL_OP cmp, JUMP_FALSE whose exit is right after the JUMP. The fused back edge
+    does the header's compare itself and jumps straight to the body, so an iteration runs one
+    dispatch instead of three; the header still runs once, on the way in.
+*/
+
+// returns the optimized copy of code (malloc'd, length in *out_size), or NULL if nothing
+// was fused or the code is not well formed, in which case the original should be used.
+uint8_t* peephole_optimize(const uint8_t *code, size_t size, size_t *out_size);
+
+
+
+#endif // PEEPHOLE_H
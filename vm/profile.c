@@ -0,0 +1,177 @@
+#include "profile.h"
+
+#ifdef VM_PROFILE
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define REPORT_PAIRS 20
+#define REPORT_BLOCKS 20
+
+static void profile_out_of_memory(void) {
+    fprintf(stderr, "Failed to allocate memory for the profile\n");
+    exit(EXIT_FAILURE);
+}
+
+bool profile_enabled(void) {
+    static int enabled = -1;
+    if (enabled < 0) {
+        const char *value = getenv("MPL_PROFILE");
+        enabled = value && *value && strcmp(value, "0") != 0;
+    }
+    return enabled;
+}
+
+void profile_init(vm_profile_t *p) {
+    memset(p, 0, sizeof(*p));
+    p->pairs = calloc(PROFILE_MAX_HANDLERS * PROFILE_MAX_HANDLERS, sizeof(uint64_t));
+    if (!p->pairs) profile_out_of_memory();
+
+    p->names[0] = "(vm_run)";
+    p->names[PROFILE_MAX_HANDLERS - 1] = "(other)";
+    p->handler_count = 1;
+
+    p->last_id = 0;
+    p->last_block = &p->outside;
+    p->last_clock = PROFILE_CLOCK();
+}
+
+void profile_free(vm_profile_t *p) {
+    free(p->pairs);
+    free(p->blocks);
+    p->pairs = NULL;
+    p->blocks = NULL;
+}
+
+void profile_handler(vm_profile_t *p, void *handler, const char *name) {
+    if (!handler || p->handler_count == PROFILE_MAX_HANDLERS - 1) return;
+
+    size_t i = profile_hash(handler, PROFILE_HANDLER_SLOTS);
+    while (p->lookup_handler[i]) {
+        if (p->lookup_handler[i] == handler) return;
+        i = (i + 1) & (PROFILE_HANDLER_SLOTS - 1);
+    }
+    p->lookup_handler[i] = handler;
+    p->lookup_id[i] = (uint8_t)p->handler_count;
+    p->names[p->handler_count++] = name;
+}
+
+static profile_block_t* find_block(profile_block_t *blocks, size_t capacity, const block_t *block) {
+    size_t i = profile_hash(block, capacity);
+    while (blocks[i].block && blocks[i].block != block) i = (i + 1) & (capacity - 1);
+    return &blocks[i];
+}
+
+profile_block_t* profile_block(vm_profile_t *p, const block_t *block) {
+    if (p->block_capacity) {
+        profile_block_t *entry = find_block(p->blocks, p->block_capacity, block);
+        if (entry->block) return entry;
+    }
+
+    if ((p->block_count + 1) * 2 > p->block_capacity) {
+        size_t capacity = p->block_capacity ? p->block_capacity * 2 : 64;
+        profile_block_t *blocks = calloc(capacity, sizeof(profile_block_t));
+        if (!blocks) profile_out_of_memory();
+        for (size_t i = 0; i < p->block_capacity; i++) {
+            if (p->blocks[i].block) *find_block(blocks, capacity, p->blocks[i].block) = p->blocks[i];
+        }
+        free(p->blocks);
+        p->blocks = blocks;
+        p->block_capacity = capacity;
+    }
+
+    profile_block_t *entry = find_block(p->blocks, p->block_capacity, block);
+    entry->block = block;
+    p->block_count++;
+    return entry;
+}
+
+typedef struct {
+    size_t first, second;
+    uint64_t count;
+} pair_t;
+
+static const uint64_t *sort_cycles; // for compare_handlers, qsort takes no context
+
+static int compare_handlers(const void *a, const void *b) {
+    uint64_t x = sort_cycles[*(const size_t*)a], y = sort_cycles[*(const size_t*)b];
+    return (x < y) - (x > y);
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    uint64_t x = ((const pair_t*)a)->count, y = ((const pair_t*)b)->count;
+    return (x < y) - (x > y);
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    uint64_t x = ((const profile_block_t*)a)->cycles, y = ((const profile_block_t*)b)->cycles;
+    return (x < y) - (x > y);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+void profile_report(const vm_profile_t *p, FILE *out) {
+    uint64_t total_count = 0, total_cycles = 0;
+    size_t ids[PROFILE_MAX_HANDLERS], id_count = 0;
+    for (size_t id = 0; id < PROFILE_MAX_HANDLERS; id++) {
+        total_count += p->counts[id];
+        total_cycles += p->cycles[id];
+        if (p->counts[id] || p->cycles[id]) ids[id_count++] = id;
+    }
+
+    sort_cycles = p->cycles;
+    qsort(ids, id_count, sizeof(size_t), compare_handlers);
+
+    fprintf(out, "\n== profile: %llu dispatches, %llu cycles ==\n",
+            (unsigned long long)total_count, (unsigned long long)total_cycles);
+    fprintf(out, "%-28s %14s %7s %16s %7s %10s\n", "handler", "count", "%", "cycles", "%", "cycles/op");
+    for (size_t i = 0; i < id_count; i++) {
+        size_t id = ids[i];
+        fprintf(out, "%-28s %14llu %6.2f%% %16llu %6.2f%% %10.1f\n", p->names[id],
+                (unsigned long long)p->counts[id], percent(p->counts[id], total_count),
+                (unsigned long long)p->cycles[id], percent(p->cycles[id], total_cycles),
+                p->counts[id] ? (double)p->cycles[id] / (double)p->counts[id] : 0.0);
+    }
+
+    // the pairs that never happened are skipped, and so is the first dispatch of vm_run
+    pair_t *pairs = malloc(PROFILE_MAX_HANDLERS * PROFILE_MAX_HANDLERS * sizeof(pair_t));
+    if (!pairs) profile_out_of_memory();
+    size_t pair_count = 0;
+    for (size_t first = 1; first < PROFILE_MAX_HANDLERS; first++) {
+        for (size_t second = 0; second < PROFILE_MAX_HANDLERS; second++) {
+            uint64_t count = p->pairs[first * PROFILE_MAX_HANDLERS + second];
+            if (count) pairs[pair_count++] = (pair_t){.first = first, .second = second, .count = count};
+        }
+    }
+    qsort(pairs, pair_count, sizeof(pair_t), compare_pairs);
+
+    fprintf(out, "\n== pairs (first -> second) ==\n");
+    for (size_t i = 0; i < pair_count && i < REPORT_PAIRS; i++) {
+        fprintf(out, "%-28s -> %-28s %14llu %6.2f%%\n", p->names[pairs[i].first], p->names[pairs[i].second],
+                (unsigned long long)pairs[i].count, percent(pairs[i].count, total_count));
+    }
+    free(pairs);
+
+    profile_block_t *blocks = malloc((p->block_count + 1) * sizeof(profile_block_t));
+    if (!blocks) profile_out_of_memory();
+    size_t block_count = 0;
+    for (size_t i = 0; i < p->block_capacity; i++) {
+        if (p->blocks[i].block) blocks[block_count++] = p->blocks[i];
+    }
+    qsort(blocks, block_count, sizeof(profile_block_t), compare_blocks);
+
+    fprintf(out, "\n== blocks ==\n");
+    fprintf(out, "%-18s %10s %14s %7s %16s %7s\n", "block", "bytes", "count", "%", "cycles", "%");
+    for (size_t i = 0; i < block_count && i < REPORT_BLOCKS; i++) {
+        const profile_block_t *b = &blocks[i];
+        fprintf(out, "%-18p %10zu %14llu %6.2f%% %16llu %6.2f%%\n", (const void*)b->block, b->block->instruction_size,
+                (unsigned long long)b->count, percent(b->count, total_count),
+                (unsigned long long)b->cycles, percent(b->cycles, total_cycles));
+    }
+    free(blocks);
+}
+
+#endif // VM_PROFILE
@@ -0,0 +1,118 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "vm.h"
+#include <stdio.h>
+
+
+/*
+    Hot path profiler (-DVM_PROFILE, off by default)
+
+    With VM_PROFILE every DISPATCH of vm_run goes through profile_dispatch before jumping
+    to the handler, without it DISPATCH is the plain threaded jump and none of this is built.
+    For each handler it counts the executions and the cycles until the next dispatch (rdtsc,
+    so the time of native code entered by the JIT handlers goes to those handlers), and it
+    counts every pair of handlers dispatched one after the other, the candidates for new
+    superinstructions. Executions and cycles are also summed per block_t.
+
+    A profile build only profiles a run with MPL_PROFILE set (to anything but "" or "0"), the
+    others dispatch as usual after one test of a flag. vm_run prints the report to stderr at
+    HALT. Jumps straight to another handler (quickening, JIT exits) are not dispatches, their
+    time goes to the handler that made them.
+*/
+
+#ifdef VM_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t profile_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#define PROFILE_CLOCK() profile_clock_ns()
+#endif
+
+// handler ids, 0 stands for vm_run itself before the first dispatch and the last one for unknown handlers
+#define PROFILE_MAX_HANDLERS 128
+#define PROFILE_HANDLER_SLOTS 512 // lookup table size, a power of 2 above PROFILE_MAX_HANDLERS
+
+typedef struct /* profile_block_t */ {
+    const block_t *block;
+    uint64_t count, cycles;
+} profile_block_t;
+
+typedef struct /* vm_profile_t */ {
+    // handler address -> id, open addressing
+    void *lookup_handler[PROFILE_HANDLER_SLOTS];
+    uint8_t lookup_id[PROFILE_HANDLER_SLOTS];
+
+    const char *names[PROFILE_MAX_HANDLERS];
+    size_t handler_count;
+
+    uint64_t counts[PROFILE_MAX_HANDLERS];
+    uint64_t cycles[PROFILE_MAX_HANDLERS];
+    uint64_t *pairs; // [previous id * PROFILE_MAX_HANDLERS + id]
+
+    // blocks by address, open addressing, grows at half full
+    profile_block_t *blocks;
+    size_t block_count, block_capacity;
+    profile_block_t outside; // time before the first dispatch
+
+    // what the running handler is, since when
+    size_t last_id;
+    profile_block_t *last_block;
+    uint64_t last_clock;
+} vm_profile_t;
+
+// true if MPL_PROFILE asks for a profile of every vm_run
+bool profile_enabled(void);
+
+void profile_init(vm_profile_t *p);
+void profile_free(vm_profile_t *p);
+
+// names a handler address, the first name given to an address is kept
+void profile_handler(vm_profile_t *p, void *handler, const char *name);
+
+// the entry for block, added on first use
+profile_block_t* profile_block(vm_profile_t *p, const block_t *block);
+
+// prints handlers by cycles, the most frequent pairs and blocks by cycles
+void profile_report(const vm_profile_t *p, FILE *out);
+
+static inline size_t profile_hash(const void *ptr, size_t slots) {
+    return (size_t)(((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15ull >> 32) & (slots - 1);
+}
+
+static inline size_t profile_handler_id(const vm_profile_t *p, void *handler) {
+    for (size_t i = profile_hash(handler, PROFILE_HANDLER_SLOTS);; i = (i + 1) & (PROFILE_HANDLER_SLOTS - 1)) {
+        if (p->lookup_handler[i] == handler) return p->lookup_id[i];
+        if (!p->lookup_handler[i]) return PROFILE_MAX_HANDLERS - 1;
+    }
+}
+
+// called right before vm_run jumps to handler, block is the block it runs in
+static inline void profile_dispatch(vm_profile_t *p, void *handler, const block_t *block) {
+    uint64_t now = PROFILE_CLOCK(), elapsed = now - p->last_clock;
+    size_t id = profile_handler_id(p, handler);
+
+    p->cycles[p->last_id] += elapsed;
+    p->last_block->cycles += elapsed;
+
+    p->counts[id]++;
+    p->pairs[p->last_id * PROFILE_MAX_HANDLERS + id]++;
+    if (p->last_block->block != block) p->last_block = profile_block(p, block);
+    p->last_block->count++;
+
+    p->last_id = id;
+    p->last_clock = PROFILE_CLOCK();
+}
+
+#endif // VM_PROFILE
+
+
+
+#endif // PROFILE_H
@@ -0,0 +1,892 @@
+#include "reg.h"
+#include "compact.h"
+#include "stdlib.h"
+
+
+#define R_NUM_BINARY(OP, name, operator, make, int_make) R_##OP, R_##OP##K,
+#define R_NUM_JUMP(OP, name, operator, make, int_make) R_J##OP, R_J##OP##K,
+
+typedef enum /* RegOp */ {
+    R_HALT,
+    R_MOVE,
+    R_LOADK,
+    R_GET_GLOBAL,
+    R_SET_GLOBAL,
+    R_BINOP,
+    R_BINOPK,
+    R_UNOP,
+    R_JUMP,
+    R_JUMP_FALSE,
+    R_JCMP,
+    R_JCMPK,
+    R_INC,
+    R_DEC,
+    R_CALL_C,
+    R_CALLK,
+    R_CALLR,
+    R_CALLG,
+    R_TAIL_CALLK,
+    R_TAIL_CALLR,
+    R_TAIL_CALLG,
+    R_RETURN,
+
+    NUM_ARITH_OPS(R_NUM_BINARY)
+    NUM_COMPARE_OPS(R_NUM_BINARY)
+    NUM_COMPARE_OPS(R_NUM_JUMP)
+
+    R_COUNT,
+} RegOp;
+
+enum { REG_FORM_RR, REG_FORM_RK, REG_FORM_JRR, REG_FORM_JRK, REG_FORMS };
+
+#define R_ARITH_ROW(OP, name, operator, make, int_make) [OP_##OP] = {R_##OP, R_##OP##K},
+#define R_COMPARE_ROW(OP, name, operator, make, int_make) [OP_##OP] = {R_##OP, R_##OP##K, R_J##OP, R_J##OP##K},
+
+// NUMBER/INT specialized instruction of an op in each form, 0 (R_HALT) if there is none
+static const RegOp reg_num_op[Op_unary][REG_FORMS] = {
+    NUM_ARITH_OPS(R_ARITH_ROW)
+    NUM_COMPARE_OPS(R_COMPARE_ROW)
+};
+
+static const RegOp reg_generic_op[REG_FORMS] = {R_BINOP, R_BINOPK, R_JCMP, R_JCMPK};
+
+#undef R_NUM_BINARY
+#undef R_NUM_JUMP
+#undef R_ARITH_ROW
+#undef R_COMPARE_ROW
+
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+
+typedef enum { E_TEMP, E_LOCAL, E_CONST } EntryKind;
+
+// what an operand stack slot holds during translation
+typedef struct /* entry_t */ {
+    EntryKind kind;
+    int32_t index; // local or constant index, unused for E_TEMP
+} entry_t;
+
+typedef struct /* reg_translator_t */ {
+    block_t *block;
+    void *const *handlers;
+
+    vm_slot_t *code;
+    size_t size;
+    size_t capacity;
+
+    entry_t *stack;
+    int depth;
+
+    size_t last_dst; // slot of the dst operand of the last instruction, SIZE_MAX if it has none
+
+    size_t *fixups; // slots holding the byte offset of a jump target
+    size_t fixup_count;
+} reg_translator_t;
+
+static void reg_translate_error(block_t *block, size_t ip, const char *msg) {
+    fprintf(stderr, "Cannot translate bytecode at offset %zu in block %p to registers: %s\n", ip, (void*)block, msg);
+    exit(EXIT_FAILURE);
+}
+
+static inline int32_t get_i32(const uint8_t *code, size_t ip) {
+    return BYTES4_TO_INT(code[ip], code[ip+1], code[ip+2], code[ip+3]);
+}
+
+static inline int32_t temp_reg(reg_translator_t *t, int position) {
+    return (int32_t)t->block->local_count + position;
+}
+
+static vm_slot_t* emit_slots(reg_translator_t *t, RegOp op, size_t operands) {
+    if (t->size + operands + 1 > t->capacity) {
+        size_t new_capacity = (t->capacity + operands + 1) * 2;
+        vm_slot_t *new_code = realloc(t->code, new_capacity * sizeof(vm_slot_t));
+        if (!new_code) {
+            fprintf(stderr, "Failed to allocate memory for register code\n");
+            exit(EXIT_FAILURE);
+        }
+        t->code = new_code;
+        t->capacity = new_capacity;
+    }
+
+    vm_slot_t *slots = &t->code[t->size];
+    slots[0].handler = t->handlers[op];
+    t->size += operands + 1;
+    t->last_dst = SIZE_MAX;
+    return slots + 1;
+}
+
+static void emit_fixup(reg_translator_t *t, vm_slot_t *slot, int32_t offset) {
+    slot->operand = offset;
+    t->fixups[t->fixup_count++] = slot - t->code;
+}
+
+static type_t* constant_ptr(reg_translator_t *t, size_t ip, int32_t index) {
+    if (index < 0 || (size_t)index >= t->block->constant_count)
+        reg_translate_error(t->block, ip, "constant index out of range");
+    return &t->block->constants[index];
+}
+
+static inline void push_entry(reg_translator_t *t, EntryKind kind, int32_t index) {
+    t->stack[t->depth++] = (entry_t){.kind = kind, .index = index};
+}
+
+// copies an aliased stack slot into its temporary
+static void materialize(reg_translator_t *t, size_t ip, int position) {
+    entry_t *e = &t->stack[position];
+    if (e->kind == E_LOCAL) {
+        vm_slot_t *s = emit_slots(t, R_MOVE, 2);
+        s[0].operand = temp_reg(t, position);
+        s[1].operand = e->index;
+    } else if (e->kind == E_CONST) {
+        vm_slot_t *s = emit_slots(t, R_LOADK, 2);
+        s[0].operand = temp_reg(t, position);
+        s[1].constant = constant_ptr(t, ip, e->index);
+    }
+    e->kind = E_TEMP;
+}
+
+static void flush_aliases(reg_translator_t *t, size_t ip) {
+    for (int i = 0; i < t->depth; i++) materialize(t, ip, i);
+}
+
+// before a write to a local, every slot still aliasing it must get the old value
+static void flush_local(reg_translator_t *t, size_t ip, int32_t local) {
+    for (int i = 0; i < t->depth; i++) {
+        if (t->stack[i].kind == E_LOCAL && t->stack[i].index == local) materialize(t, ip, i);
+    }
+}
+
+// register holding a stack slot, constants are loaded into the slot's temporary
+static int32_t operand_reg(reg_translator_t *t, size_t ip, int position) {
+    entry_t *e = &t->stack[position];
+    if (e->kind == E_CONST) materialize(t, ip, position);
+    return e->kind == E_LOCAL ? e->index : temp_reg(t, position);
+}
+
+// pops the operands of a binary op and emits it into the left operand's temporary,
+// or with jump_offset >= 0 a compare and branch taken when the result is false
+static void emit_binary(reg_translator_t *t, size_t ip, Op op, int32_t jump_offset) {
+    if (op >= Op_unary) reg_translate_error(t->block, ip, "expected a binary op");
+
+    int position = t->depth - 2;
+    entry_t right = t->stack[position + 1];
+    int32_t a = operand_reg(t, ip, position);
+    bool rk = right.kind == E_CONST;
+    int32_t b = rk ? right.index : operand_reg(t, ip, position + 1);
+    t->depth -= 2;
+
+    bool jump = jump_offset >= 0;
+    int form = jump ? (rk ? REG_FORM_JRK : REG_FORM_JRR) : (rk ? REG_FORM_RK : REG_FORM_RR);
+    RegOp specialized = reg_num_op[op][form];
+    RegOp rop = specialized ? specialized : reg_generic_op[form];
+
+    if (jump) {
+        flush_aliases(t, ip);
+        vm_slot_t *s = emit_slots(t, rop, 4);
+        s[0].operand = a;
+        if (rk) s[1].constant = constant_ptr(t, ip, b);
+        else s[1].operand = b;
+        s[2].operand = op;
+        emit_fixup(t, &s[3], jump_offset);
+        return;
+    }
+
+    vm_slot_t *s = emit_slots(t, rop, 4);
+    s[0].operand = temp_reg(t, position);
+    s[1].operand = a;
+    if (rk) s[2].constant = constant_ptr(t, ip, b);
+    else s[2].operand = b;
+    s[3].operand = op;
+    t->last_dst = &s[0] - t->code;
+    push_entry(t, E_TEMP, 0);
+}
+
+static void emit_store_local(reg_translator_t *t, size_t ip, int32_t local) {
+    if (local < 0 || (size_t)local >= t->block->local_count)
+        reg_translate_error(t->block, ip, "local index out of range");
+
+    entry_t e = t->stack[--t->depth];
+    int position = t->depth;
+    size_t last_dst = t->last_dst;
+
+    flush_local(t, ip, local);
+
+    if (e.kind == E_LOCAL) {
+        if (e.index == local) return;
+        vm_slot_t *s = emit_slots(t, R_MOVE, 2);
+        s[0].operand = local;
+        s[1].operand = e.index;
+    } else if (e.kind == E_CONST) {
+        vm_slot_t *s = emit_slots(t, R_LOADK, 2);
+        s[0].operand = local;
+        s[1].constant = constant_ptr(t, ip, e.index);
+    } else if (t->last_dst == last_dst && last_dst != SIZE_MAX && t->code[last_dst].operand == temp_reg(t, position)) {
+        // the value was just computed into the temporary, compute it into the local instead
+        t->code[last_dst].operand = local;
+        t->last_dst = SIZE_MAX;
+    } else {
+        vm_slot_t *s = emit_slots(t, R_MOVE, 2);
+        s[0].operand = local;
+        s[1].operand = temp_reg(t, position);
+    }
+}
+
+// net operand stack effect of the instruction at code[ip]
+static int stack_effect(const uint8_t *code, size_t ip) {
+    switch (code[ip]) {
+        case PUSH_CONST: case PUSH_LOCAL: case PUSH: case CALL_OP_LOCAL_CONST:
+            return 1;
+        case STORE_LOCAL: case STORE: case POP: case JUMP_FALSE:
+            return -1;
+        case CALL_OP: case CALL_OP_INT: case CALL_OP_NUMBER:
+            return code[ip + 1] < Op_unary ? -1 : 0;
+        case CMP_JUMP_FALSE:
+            return -2;
+        case CALL_C_FUNC:
+            return 1 - get_i32(code, ip + 5);
+        case CALL_FUNC: case TAIL_CALL:
+            return 1 - get_i32(code, ip + (code[ip + 1] == CF_GLOBAL ? 10 : 6));
+        default:
+            return 0;
+    }
+}
+
+// operand stack depth before every instruction (-1 if unreachable), returns the max depth
+static int compute_depths(block_t *block, const uint8_t *code, size_t size, int32_t *depth, bool *is_target) {
+    for (size_t i = 0; i <= size; i++) depth[i] = -1;
+
+    size_t *worklist = malloc((size + 1) * sizeof(size_t));
+    if (!worklist) {
+        fprintf(stderr, "Failed to allocate memory for register code\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t pending = 0;
+    int max_depth = 0;
+    depth[0] = 0;
+    worklist[pending++] = 0;
+
+    while (pending) {
+        size_t ip = worklist[--pending];
+        if (ip == size) continue;
+
+        size_t len = bytecode_checked_length(code, ip, size);
+        if (!len) reg_translate_error(block, ip, "invalid instruction");
+
+        int d = depth[ip] + stack_effect(code, ip);
+        if (d < 0) reg_translate_error(block, ip, "operand stack underflow");
+        if (d + 1 > max_depth) max_depth = d + 1;
+
+        size_t successors[2];
+        int count = 0;
+        uint8_t op = code[ip];
+        if (op != JUMP && op != RETURN && op != HALT) successors[count++] = ip + len;
+
+        size_t operand = bytecode_jump_operand(code, ip);
+        if (operand) {
+            int32_t target = get_i32(code, operand);
+            if (target < 0 || (size_t)target > size) reg_translate_error(block, ip, "jump target out of range");
+            successors[count++] = target;
+            is_target[target] = true;
+        }
+
+        for (int i = 0; i < count; i++) {
+            size_t next = successors[i];
+            if (depth[next] == -1) {
+                depth[next] = d;
+                worklist[pending++] = next;
+            } else if (depth[next] != d) {
+                reg_translate_error(block, next, "inconsistent operand stack depth");
+            }
+        }
+    }
+
+    free(worklist);
+    return max_depth + 1;
+}
+
+static void translate_reg_block(block_t *block, void *const *handlers) {
+    block_expand_compact(block);
+    const uint8_t *code = block->instructions;
+    size_t size = block->instruction_size;
+
+    int32_t *depth = malloc((size + 1) * sizeof(int32_t));
+    int32_t *slot_at = malloc((size + 1) * sizeof(int32_t));
+    bool *is_target = calloc(size + 1, sizeof(bool));
+    if (!depth || !slot_at || !is_target) {
+        fprintf(stderr, "Failed to allocate memory for register code\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int max_depth = compute_depths(block, code, size, depth, is_target);
+
+    reg_translator_t t = {
+        .block = block,
+        .handlers = handlers,
+        .stack = malloc(max_depth * sizeof(entry_t)),
+        .last_dst = SIZE_MAX,
+        .fixups = malloc((size + 1) * sizeof(size_t)),
+    };
+    if (!t.stack || !t.fixups) {
+        fprintf(stderr, "Failed to allocate memory for register code\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bool live = true; // control can fall through to the next instruction
+    for (size_t ip = 0; ip <= size;) {
+        if (depth[ip] < 0) {
+            live = false;
+            if (ip == size) break;
+            ip += bytecode_length(code, ip);
+            continue;
+        }
+
+        if (is_target[ip] || !live) {
+            // labels start with every slot in its temporary
+            if (live) flush_aliases(&t, ip);
+            t.depth = depth[ip];
+            for (int i = 0; i < t.depth; i++) t.stack[i].kind = E_TEMP;
+            t.last_dst = SIZE_MAX;
+        }
+        slot_at[ip] = (int32_t)t.size;
+        live = true;
+
+        if (ip == size) {
+            flush_aliases(&t, ip);
+            emit_slots(&t, R_HALT, 1)[0].operand = t.depth;
+            break;
+        }
+
+        uint8_t op = code[ip];
+        size_t len = bytecode_length(code, ip);
+
+        switch (op) {
+            case HALT:
+                flush_aliases(&t, ip);
+                emit_slots(&t, R_HALT, 1)[0].operand = t.depth;
+                live = false;
+                break;
+            case PUSH_CONST:
+                constant_ptr(&t, ip, get_i32(code, ip + 1));
+                push_entry(&t, E_CONST, get_i32(code, ip + 1));
+                break;
+            case PUSH_LOCAL: {
+                int32_t local = get_i32(code, ip + 1);
+                if (local < 0 || (size_t)local >= block->local_count)
+                    reg_translate_error(block, ip, "local index out of range");
+                push_entry(&t, E_LOCAL, local);
+                break;
+            }
+            case STORE_LOCAL:
+                emit_store_local(&t, ip, get_i32(code, ip + 1));
+                break;
+            case PUSH: {
+                vm_slot_t *s = emit_slots(&t, R_GET_GLOBAL, 3);
+                s[0].operand = temp_reg(&t, t.depth);
+                s[1].operand = get_i32(code, ip + 1);
+                s[2].operand = get_i32(code, ip + 5);
+                t.last_dst = &s[0] - t.code;
+                push_entry(&t, E_TEMP, 0);
+                break;
+            }
+            case STORE: {
+                int32_t src = operand_reg(&t, ip, t.depth - 1);
+                t.depth--;
+                flush_aliases(&t, ip); // the frame may be the current one
+                vm_slot_t *s = emit_slots(&t, R_SET_GLOBAL, 3);
+                s[0].operand = get_i32(code, ip + 1);
+                s[1].operand = get_i32(code, ip + 5);
+                s[2].operand = src;
+                break;
+            }
+            case POP:
+                t.depth--;
+                break;
+            case CALL_OP:
+            case CALL_OP_INT:
+            case CALL_OP_NUMBER: {
+                Op bop = code[ip + 1];
+                if (bop > Op_unary) {
+                    int position = t.depth - 1;
+                    int32_t a = operand_reg(&t, ip, position);
+                    vm_slot_t *s = emit_slots(&t, R_UNOP, 3);
+                    s[0].operand = temp_reg(&t, position);
+                    s[1].operand = a;
+                    s[2].operand = bop;
+                    t.last_dst = &s[0] - t.code;
+                    t.stack[position].kind = E_TEMP;
+                    break;
+                }
+
+                // CALL_OP cmp, JUMP_FALSE becomes one compare and branch
+                size_t next = ip + len;
+                if (bop >= OP_EQ && bop <= OP_GE && next < size && code[next] == JUMP_FALSE && !is_target[next]) {
+                    emit_binary(&t, ip, bop, get_i32(code, next + 1));
+                    len += bytecode_length(code, next);
+                    break;
+                }
+                emit_binary(&t, ip, bop, -1);
+                break;
+            }
+            case JUMP:
+                flush_aliases(&t, ip);
+                emit_fixup(&t, &emit_slots(&t, R_JUMP, 1)[0], get_i32(code, ip + 1));
+                live = false;
+                break;
+            case JUMP_FALSE: {
+                int32_t cond = operand_reg(&t, ip, t.depth - 1);
+                t.depth--;
+                flush_aliases(&t, ip);
+                vm_slot_t *s = emit_slots(&t, R_JUMP_FALSE, 2);
+                s[0].operand = cond;
+                emit_fixup(&t, &s[1], get_i32(code, ip + 1));
+                break;
+            }
+            case CALL_C_FUNC: {
+                int32_t argc = get_i32(code, ip + 5);
+                for (int i = t.depth - argc; i < t.depth; i++) materialize(&t, ip, i);
+                vm_slot_t *s = emit_slots(&t, R_CALL_C, 3);
+                s[0].operand = temp_reg(&t, t.depth - argc);
+                s[1].operand = get_i32(code, ip + 1);
+                s[2].operand = argc;
+                t.depth -= argc;
+                push_entry(&t, E_TEMP, 0);
+                break;
+            }
+            case CALL_FUNC:
+            case TAIL_CALL: {
+                uint8_t location = code[ip + 1];
+                int32_t argc = get_i32(code, ip + (location == CF_GLOBAL ? 10 : 6));
+                int32_t base = temp_reg(&t, t.depth - argc);
+
+                // CALL_FUNC, RETURN is a tail call too, the RETURN stays for the outermost frame
+                size_t next = ip + bytecode_length(code, ip);
+                bool tail = op == TAIL_CALL || (next < size && code[next] == RETURN);
+
+                // the callee may write to any frame through STORE
+                flush_aliases(&t, ip);
+
+                vm_slot_t *s;
+                switch (location) {
+                    case CF_CONSTANT:
+                        s = emit_slots(&t, tail ? R_TAIL_CALLK : R_CALLK, 5);
+                        s[1].constant = constant_ptr(&t, ip, get_i32(code, ip + 2));
+                        s[2].operand = argc;
+                        break;
+                    case CF_LOCAL:
+                        s = emit_slots(&t, tail ? R_TAIL_CALLR : R_CALLR, 5);
+                        s[1].operand = get_i32(code, ip + 2);
+                        s[2].operand = argc;
+                        break;
+                    case CF_GLOBAL:
+                        s = emit_slots(&t, tail ? R_TAIL_CALLG : R_CALLG, 6);
+                        s[1].operand = get_i32(code, ip + 2);
+                        s[2].operand = get_i32(code, ip + 6);
+                        s[3].operand = argc;
+                        break;
+                    default:
+                        reg_translate_error(block, ip, "unknown function location");
+                        return;
+                }
+                s[0].operand = base;
+
+                // inline cache after argc, filled by the first call
+                size_t cache = location == CF_GLOBAL ? 4 : 3;
+                s[cache].block = NULL;
+                s[cache + 1].operand = 0;
+
+                t.depth -= argc;
+                push_entry(&t, E_TEMP, 0);
+                break;
+            }
+            case RETURN: {
+                int32_t src = operand_reg(&t, ip, t.depth - 1);
+                emit_slots(&t, R_RETURN, 1)[0].operand = src;
+                live = false;
+                break;
+            }
+            case INC_LOCAL:
+            case DEC_LOCAL: {
+                int32_t local = get_i32(code, ip + 1);
+                flush_local(&t, ip, local);
+                emit_slots(&t, op == INC_LOCAL ? R_INC : R_DEC, 1)[0].operand = local;
+                break;
+            }
+            case CALL_OP_LOCAL:
+                push_entry(&t, E_LOCAL, get_i32(code, ip + 1));
+                emit_binary(&t, ip, code[ip + 5], -1);
+                break;
+            case CALL_OP_CONST:
+                push_entry(&t, E_CONST, get_i32(code, ip + 1));
+                emit_binary(&t, ip, code[ip + 5], -1);
+                break;
+            case CALL_OP_LOCAL_CONST:
+                push_entry(&t, E_LOCAL, get_i32(code, ip + 1));
+                push_entry(&t, E_CONST, get_i32(code, ip + 5));
+                emit_binary(&t, ip, code[ip + 9], -1);
+                break;
+            case CMP_JUMP_FALSE:
+                emit_binary(&t, ip, code[ip + 1], get_i32(code, ip + 2));
+                break;
+            case CMP_LOCAL_CONST_JUMP_FALSE:
+                push_entry(&t, E_LOCAL, get_i32(code, ip + 1));
+                push_entry(&t, E_CONST, get_i32(code, ip + 5));
+                emit_binary(&t, ip, code[ip + 9], get_i32(code, ip + 10));
+                break;
+            default:
+                reg_translate_error(block, ip, "unsupported opcode");
+        }
+
+        ip += len;
+    }
+
+    for (size_t i = 0; i < t.fixup_count; i++) {
+        vm_slot_t *slot = &t.code[t.fixups[i]];
+        slot->target = t.code + slot_at[slot->operand];
+    }
+
+    reg_code_t *reg_code = malloc(sizeof(reg_code_t));
+    if (!reg_code) {
+        fprintf(stderr, "Failed to allocate memory for register code\n");
+        exit(EXIT_FAILURE);
+    }
+    reg_code->code = t.code;
+    reg_code->code_size = t.size;
+    reg_code->reg_count = block->local_count + max_depth;
+    block->reg_code = reg_code;
+    block_analyze_locals(block);
+
+    free(t.stack);
+    free(t.fixups);
+    free(depth);
+    free(slot_at);
+    free(is_target);
+}
+
+void block_free_reg_code(block_t *block) {
+    if (!block->reg_code) return;
+    free(block->reg_code->code);
+    free(block->reg_code);
+    block->reg_code = NULL;
+}
+
+
+ ///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+
+
+#define R_NUM_BINARY_LABELS(OP, name, operator, make, int_make) \
+    [R_##OP] = &&r_##name, [R_##OP##K] = &&r_##name##k,
+#define R_NUM_JUMP_LABELS(OP, name, operator, make, int_make) \
+    [R_J##OP] = &&r_j##name, [R_J##OP##K] = &&r_j##name##k,
+
+// fills the inline cache of a register call site ([argc][block][locals to zero]) for callee
+static block_t* resolve_reg_call(vm_slot_t *cache, type_t callee, void *const *handlers) {
+    if (type_of(callee) != FUNCTION) {
+        fprintf(stderr, "Cannot call a value of type %d\n", type_of(callee));
+        exit(EXIT_FAILURE);
+    }
+
+    block_t *func = as_ptr(callee);
+    if (!func->reg_code) translate_reg_block(func, handlers);
+
+    int32_t argc = cache[0].operand;
+    if (argc < 0 || (size_t)argc > func->local_count) {
+        fprintf(stderr, "Block %p called with %d arguments but has %zu locals\n", (void*)func, argc, func->local_count);
+        exit(EXIT_FAILURE);
+    }
+
+    cache[1].block = func;
+    cache[2].operand = func->zero_locals > (size_t)argc ? (int32_t)(func->zero_locals - argc) : 0;
+    return func;
+}
+
+void vm_run_reg(vm_t *vm, block_t *main_block) {
+    static void *dispatch_table[R_COUNT] = {
+        [R_HALT] = &&r_halt,
+        [R_MOVE] = &&r_move,
+        [R_LOADK] = &&r_loadk,
+        [R_GET_GLOBAL] = &&r_get_global,
+        [R_SET_GLOBAL] = &&r_set_global,
+        [R_BINOP] = &&r_binop,
+        [R_BINOPK] = &&r_binopk,
+        [R_UNOP] = &&r_unop,
+        [R_JUMP] = &&r_jump,
+        [R_JUMP_FALSE] = &&r_jump_false,
+        [R_JCMP] = &&r_jcmp,
+        [R_JCMPK] = &&r_jcmpk,
+        [R_INC] = &&r_inc,
+        [R_DEC] = &&r_dec,
+        [R_CALL_C] = &&r_call_c,
+        [R_CALLK] = &&r_callk,
+        [R_CALLR] = &&r_callr,
+        [R_CALLG] = &&r_callg,
+        [R_TAIL_CALLK] = &&r_tail_callk,
+        [R_TAIL_CALLR] = &&r_tail_callr,
+        [R_TAIL_CALLG] = &&r_tail_callg,
+        [R_RETURN] = &&r_return,
+
+        NUM_ARITH_OPS(R_NUM_BINARY_LABELS)
+        NUM_COMPARE_OPS(R_NUM_BINARY_LABELS)
+        NUM_COMPARE_OPS(R_NUM_JUMP_LABELS)
+    };
+
+    block_t *block = main_block;
+    if (!block->reg_code) translate_reg_block(block, dispatch_table);
+
+    // the register window of the main block starts at the current top of vm->stack
+    size_t entry_base = vm->stack.size;
+    size_t base = entry_base;
+    vm_stack_push_n(&vm->stack, block->reg_code->reg_count);
+    type_t *regs = vm->stack.data + base;
+    memset(regs, 0, block->reg_code->reg_count * sizeof(type_t));
+
+    frame_t *frames = vm->frames, *frames_end = vm->frames + vm->frame_capacity;
+    frame_t *fp = frames; // current frame
+    *fp = (frame_t){.block = block, .locals = regs, .ip = 0, .stack_base = base};
+    vm_set_frame_top(vm, fp);
+
+    vm_slot_t *pc = block->reg_code->code;
+
+    // shared by the CALL handlers
+    type_t callee;
+    int32_t call_base;
+
+    #define OPERAND() ((pc++)->operand)
+    #define DISPATCH() goto *(pc++)->handler
+    #define GLOBAL(frame, index) frames[frame].locals[index]
+
+    DISPATCH();
+
+    r_halt: {
+        int32_t depth = OPERAND();
+        memmove(&vm->stack.data[entry_base], &regs[block->local_count], depth * sizeof(type_t));
+        vm->stack.size = entry_base + depth;
+        vm_set_frame_top(vm, NULL);
+        return;
+    }
+
+    r_move: {
+        int32_t dst = OPERAND();
+        regs[dst] = regs[OPERAND()];
+        DISPATCH();
+    }
+
+    r_loadk: {
+        int32_t dst = OPERAND();
+        regs[dst] = *(pc++)->constant;
+        DISPATCH();
+    }
+
+    r_get_global: {
+        int32_t dst = OPERAND();
+        int32_t frame = OPERAND();
+        regs[dst] = GLOBAL(frame, OPERAND());
+        DISPATCH();
+    }
+
+    r_set_global: {
+        int32_t frame = OPERAND();
+        int32_t index = OPERAND();
+        GLOBAL(frame, index) = regs[OPERAND()];
+        DISPATCH();
+    }
+
+    r_binop:
+        regs[pc[0].operand] = operation(pc[3].operand, regs[pc[1].operand], regs[pc[2].operand]);
+        pc += 4;
+        DISPATCH();
+
+    r_binopk:
+        regs[pc[0].operand] = operation(pc[3].operand, regs[pc[1].operand], *pc[2].constant);
+        pc += 4;
+        DISPATCH();
+
+    r_unop:
+        regs[pc[0].operand] = operation_unary(pc[2].operand, regs[pc[1].operand]);
+        pc += 3;
+        DISPATCH();
+
+    r_jump:
+        pc = pc->target;
+        DISPATCH();
+
+    r_jump_false:
+        pc = as_bool(regs[pc[0].operand]) ? pc + 2 : pc[1].target;
+        DISPATCH();
+
+    r_jcmp:
+        pc = as_bool(operation(pc[2].operand, regs[pc[0].operand], regs[pc[1].operand])) ? pc + 4 : pc[3].target;
+        DISPATCH();
+
+    r_jcmpk:
+        pc = as_bool(operation(pc[2].operand, regs[pc[0].operand], *pc[1].constant)) ? pc + 4 : pc[3].target;
+        DISPATCH();
+
+    #define R_NUM_BINARY_HANDLERS(OP, name, operator, make, int_make)                               \
+    r_##name: {                                                                                     \
+        type_t a = regs[pc[1].operand], b = regs[pc[2].operand];                                    \
+        NUM_FAST_PATH(regs[pc[0].operand], a, b, operator, make, int_make, r_binop);                \
+        pc += 4;                                                                                    \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    r_##name##k: {                                                                                  \
+        type_t a = regs[pc[1].operand], b = *pc[2].constant;                                        \
+        NUM_FAST_PATH(regs[pc[0].operand], a, b, operator, make, int_make, r_binopk);               \
+        pc += 4;                                                                                    \
+        DISPATCH();                                                                                 \
+    }
+
+    #define R_NUM_JUMP_HANDLERS(OP, name, operator, make, int_make)                                 \
+    r_j##name: {                                                                                    \
+        type_t a = regs[pc[0].operand], b = regs[pc[1].operand];                                    \
+        bool cond;                                                                                  \
+        NUM_FAST_CONDITION(cond, a, b, operator, r_jcmp);                                           \
+        pc = cond ? pc + 4 : pc[3].target;                                                          \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    r_j##name##k: {                                                                                 \
+        type_t a = regs[pc[0].operand], b = *pc[1].constant;                                        \
+        bool cond;                                                                                  \
+        NUM_FAST_CONDITION(cond, a, b, operator, r_jcmpk);                                          \
+        pc = cond ? pc + 4 : pc[3].target;                                                          \
+        DISPATCH();                                                                                 \
+    }
+
+    NUM_ARITH_OPS(R_NUM_BINARY_HANDLERS)
+    NUM_COMPARE_OPS(R_NUM_BINARY_HANDLERS)
+    NUM_COMPARE_OPS(R_NUM_JUMP_HANDLERS)
+
+    #undef R_NUM_BINARY_HANDLERS
+    #undef R_NUM_JUMP_HANDLERS
+
+    r_inc: {
+        type_t *r = &regs[OPERAND()];
+        *r = increment(*r, 1);
+        DISPATCH();
+    }
+
+    r_dec: {
+        type_t *r = &regs[OPERAND()];
+        *r = increment(*r, -1);
+        DISPATCH();
+    }
+
+    r_call_c: {
+        int32_t c_base = OPERAND();
+        BuiltinFunc builtin = OPERAND();
+        int32_t c_argc = OPERAND();
+        regs[c_base] = builtin_func(builtin, c_argc, &regs[c_base]);
+        DISPATCH();
+    }
+
+    r_callk:
+        call_base = OPERAND();
+        callee = *(pc++)->constant;
+        goto call;
+
+    r_callr:
+        call_base = OPERAND();
+        callee = regs[OPERAND()];
+        goto call;
+
+    r_callg: {
+        call_base = OPERAND();
+        int32_t frame = OPERAND();
+        callee = GLOBAL(frame, OPERAND());
+        goto call;
+    }
+
+    // pc is at the call site's inline cache: [argc][block][locals to zero]
+    #define CALL_SITE_RESOLVE()                                                                             \
+        block_t *func = pc[1].block;                                                                        \
+        if (__builtin_expect(type_of(callee) != FUNCTION || as_ptr(callee) != func || !func->reg_code, 0))  \
+            func = resolve_reg_call(pc, callee, dispatch_table);                                            \
+        int32_t argc = pc[0].operand, zero = pc[2].operand;                                                 \
+        pc += 3
+
+    call: {
+        CALL_SITE_RESOLVE();
+        if (__builtin_expect(fp + 1 == frames_end, 0)) vm_stack_overflow();
+        fp->ip = pc - block->reg_code->code;
+
+        // the callee's window starts at the arguments, everything above them is dead
+        base += call_base;
+        size_t top = base + func->reg_code->reg_count;
+        if (top > vm->stack.size) vm_stack_push_n(&vm->stack, top - vm->stack.size);
+        else vm->stack.size = top;
+
+        regs = vm->stack.data + base;
+        if (zero) memset(&regs[argc], 0, zero * sizeof(type_t));
+
+        *++fp = (frame_t){.block = func, .locals = regs, .ip = 0, .stack_base = base};
+        vm_set_frame_top(vm, fp);
+
+        block = func;
+        pc = func->reg_code->code;
+        DISPATCH();
+    }
+
+    r_tail_callk:
+        call_base = OPERAND();
+        callee = *(pc++)->constant;
+        goto tail_call;
+
+    r_tail_callr:
+        call_base = OPERAND();
+        callee = regs[OPERAND()];
+        goto tail_call;
+
+    r_tail_callg: {
+        call_base = OPERAND();
+        int32_t frame = OPERAND();
+        callee = GLOBAL(frame, OPERAND());
+        goto tail_call;
+    }
+
+    tail_call: {
+        // keep the outermost frame, vm_run treats it the same way
+        if (fp == frames) goto call;
+        CALL_SITE_RESOLVE();
+
+        // the arguments become r0.. of the current window, fp is reused in place
+        memmove(regs, &regs[call_base], argc * sizeof(type_t));
+        size_t top = base + func->reg_code->reg_count;
+        if (top > vm->stack.size) vm_stack_push_n(&vm->stack, top - vm->stack.size);
+        else vm->stack.size = top;
+
+        if (zero) memset(&regs[argc], 0, zero * sizeof(type_t));
+
+        fp->block = func;
+        block = func;
+        pc = func->reg_code->code;
+        DISPATCH();
+    }
+
+    #undef CALL_SITE_RESOLVE
+
+    r_return: {
+        regs[0] = regs[OPERAND()];
+        if (fp == frames) {
+            vm->stack.data[entry_base] = regs[0];
+            vm->stack.size = entry_base + 1;
+            vm_set_frame_top(vm, NULL);
+            return;
+        }
+
+        fp--;
+        vm_set_frame_top(vm, fp);
+        block = fp->block;
+        base = fp->stack_base;
+        vm->stack.size = base + block->reg_code->reg_count;
+        regs = fp->locals;
+        pc = block->reg_code->code + fp->ip;
+        DISPATCH();
+    }
+
+    #undef OPERAND
+    #undef DISPATCH
+    #undef GLOBAL
+}
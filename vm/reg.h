@@ -0,0 +1,54 @@
+#ifndef REG_H
+#define REG_H
+
+#include "vm.h"
+
+
+/*
+    Register VM
+
+    vm_run_reg executes the same block_t graphs as vm_run, but first translates each block's
+    stack bytecode into three-address register code. Registers are a window in vm->stack:
+
+        r0 .. r(local_count - 1)                the block's locals
+        r(local_count) .. r(reg_count - 1)      one temporary per operand stack depth
+
+    The translator tracks what every operand stack slot holds, so PUSH_LOCAL and PUSH_CONST
+    emit nothing and `a = b + c` becomes a single [ADD r_a, r_b, r_c]. Aliases are only
+    copied into their temporaries at jumps, labels and calls.
+
+    Instructions (pre-decoded slots like the threaded code, K = constant operand):
+
+        HALT depth                  MOVE dst, src               LOADK dst, K
+        GET_GLOBAL dst, frame, i    SET_GLOBAL frame, i, src
+        <op> dst, a, b, op          <op>K dst, a, K, op         UNOP dst, a, op
+        JUMP target                 JUMP_FALSE a, target
+        J<cmp> a, b, op, target     J<cmp>K a, K, op, target    (jump if !(a cmp b))
+        INC r                       DEC r                       RETURN src
+        CALL_C base, func, argc     CALL(K|R|G) base, <function>, cache
+                                    TAIL_CALL(K|R|G) base, <function>, cache
+
+    <op> is ADD, SUB, ... with a NUMBER/INT fast path, or the generic BINOP for any other op.
+    A call's arguments are the registers starting at base, which become the callee's r0..,
+    and RETURN writes the result to the callee's r0, i.e. the caller's base register.
+    cache is the call site's inline cache [argc][block_t *block][locals to zero], like the
+    one of vm_run's CALL_FUNC. TAIL_CALL moves the arguments down to r0 and runs the callee
+    in the current window, it is emitted for TAIL_CALL and for CALL_FUNC directly followed
+    by RETURN.
+    At HALT the operand stack is copied to vm->stack so both engines leave the same stack.
+*/
+
+typedef struct reg_code_s {
+    vm_slot_t *code;
+    size_t code_size;
+    size_t reg_count;
+} reg_code_t;
+
+void vm_run_reg(vm_t *vm, block_t *block);
+
+// releases the register code of the block (called by block_free_code)
+void block_free_reg_code(block_t *block);
+
+
+
+#endif // REG_H
@@ -0,0 +1,303 @@
+#include "sample.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+
+#define RING_MASK (SAMPLE_RING_WORDS - 1)
+#define SAMPLE_TRUNCATED (1ull << 32) // in the header word, frames were cut
+
+// distinct stacks with their sample count, frames of every stack are in one array
+typedef struct {
+    uint64_t hash;
+    size_t at, depth;
+    uint64_t count;
+} stack_entry_t;
+
+typedef struct {
+    sample_frame_t *frames;
+    size_t frame_count, frame_capacity;
+
+    stack_entry_t *entries;
+    size_t count, capacity; // open addressing over entries, capacity a power of 2
+    uint64_t samples;
+} stack_table_t;
+
+// shared with the signal handler, which only reads vm and writes ring, head and dropped
+static struct {
+    vm_t *vm;
+    uint64_t *ring;
+    uint64_t head, tail, dropped;
+
+    bool running;
+    struct sigaction old_action;
+    stack_table_t stacks;
+} sampler;
+
+
+static void sampler_out_of_memory(void) {
+    fprintf(stderr, "Failed to allocate memory for the sampling profiler\n");
+    exit(EXIT_FAILURE);
+}
+
+static void on_sigprof(int sig) {
+    (void)sig;
+    vm_t *vm = __atomic_load_n(&sampler.vm, __ATOMIC_ACQUIRE);
+    frame_t *top = vm ? vm->frame_top : NULL;
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+
+    size_t depth = top ? (size_t)(top - vm->frames) + 1 : 0;
+    size_t first = depth > SAMPLE_MAX_DEPTH ? depth - SAMPLE_MAX_DEPTH : 0;
+    uint64_t words = 1 + 2 * (depth - first);
+
+    uint64_t head = sampler.head, tail = __atomic_load_n(&sampler.tail, __ATOMIC_ACQUIRE);
+    if (head + words - tail > SAMPLE_RING_WORDS) {
+        sampler.dropped++;
+        return;
+    }
+
+    sampler.ring[head++ & RING_MASK] = (depth - first) | (first ? SAMPLE_TRUNCATED : 0);
+    for (size_t i = first; i < depth; i++) {
+        sampler.ring[head++ & RING_MASK] = (uintptr_t)vm->frames[i].block;
+        sampler.ring[head++ & RING_MASK] = vm->frames[i].ip;
+    }
+    __atomic_store_n(&sampler.head, head, __ATOMIC_RELEASE);
+}
+
+void sampler_start(vm_t *vm, unsigned hz) {
+    if (sampler.running) {
+        fprintf(stderr, "The sampling profiler is already running\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!hz) hz = SAMPLE_DEFAULT_HZ;
+
+    if (!sampler.ring) {
+        void *ring = mmap(NULL, SAMPLE_RING_WORDS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) sampler_out_of_memory();
+        sampler.ring = ring;
+    }
+    __atomic_store_n(&sampler.vm, vm, __ATOMIC_RELEASE);
+
+    struct sigaction action = {0};
+    action.sa_handler = on_sigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    long interval = 1000000 / hz > 0 ? 1000000 / hz : 1;
+    struct itimerval timer = {
+        .it_interval = {.tv_sec = interval / 1000000, .tv_usec = interval % 1000000},
+        .it_value = {.tv_sec = interval / 1000000, .tv_usec = interval % 1000000},
+    };
+    if (sigaction(SIGPROF, &action, &sampler.old_action) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        fprintf(stderr, "Failed to start the sampling profiler\n");
+        exit(EXIT_FAILURE);
+    }
+    sampler.running = true;
+}
+
+void sampler_stop(void) {
+    if (!sampler.running) return;
+    struct itimerval off = {0};
+    setitimer(ITIMER_PROF, &off, NULL);
+    sigaction(SIGPROF, &sampler.old_action, NULL);
+    __atomic_store_n(&sampler.vm, NULL, __ATOMIC_RELEASE);
+    sampler.running = false;
+}
+
+static uint64_t hash_frames(const sample_frame_t *frames, size_t depth) {
+    uint64_t h = 0xcbf29ce484222325ull ^ depth;
+    for (size_t i = 0; i < depth; i++) {
+        h = (h ^ (uintptr_t)frames[i].block) * 0x100000001b3ull;
+        h = (h ^ frames[i].ip) * 0x100000001b3ull;
+    }
+    return h ^ (h >> 29);
+}
+
+static stack_entry_t* find_stack(stack_table_t *t, uint64_t hash, const sample_frame_t *frames, size_t depth) {
+    for (size_t i = hash & (t->capacity - 1);; i = (i + 1) & (t->capacity - 1)) {
+        stack_entry_t *e = &t->entries[i];
+        if (!e->count) return e;
+        if (e->hash == hash && e->depth == depth &&
+            (!depth || memcmp(&t->frames[e->at], frames, depth * sizeof(sample_frame_t)) == 0)) return e;
+    }
+}
+
+static void add_stack(stack_table_t *t, const sample_frame_t *frames, size_t depth, uint64_t count) {
+    if ((t->count + 1) * 2 > t->capacity) {
+        stack_table_t grown = *t;
+        grown.capacity = t->capacity ? t->capacity * 2 : 256;
+        grown.entries = calloc(grown.capacity, sizeof(stack_entry_t));
+        if (!grown.entries) sampler_out_of_memory();
+        for (size_t i = 0; i < t->capacity; i++) {
+            stack_entry_t e = t->entries[i];
+            if (e.count) *find_stack(&grown, e.hash, &t->frames[e.at], e.depth) = e;
+        }
+        free(t->entries);
+        *t = grown;
+    }
+
+    uint64_t hash = hash_frames(frames, depth);
+    stack_entry_t *e = find_stack(t, hash, frames, depth);
+    t->samples += count;
+    if (e->count) {
+        e->count += count;
+        return;
+    }
+
+    if (t->frame_count + depth > t->frame_capacity) {
+        t->frame_capacity = (t->frame_count + depth) * 2;
+        t->frames = realloc(t->frames, t->frame_capacity * sizeof(sample_frame_t));
+        if (!t->frames) sampler_out_of_memory();
+    }
+    // a sample taken outside any block has no frames, and frames may still be NULL
+    if (depth) memcpy(&t->frames[t->frame_count], frames, depth * sizeof(sample_frame_t));
+    *e = (stack_entry_t){.hash = hash, .at = t->frame_count, .depth = depth, .count = count};
+    t->frame_count += depth;
+    t->count++;
+}
+
+static void free_stacks(stack_table_t *t) {
+    free(t->frames);
+    free(t->entries);
+    *t = (stack_table_t){0};
+}
+
+size_t sampler_drain(void) {
+    if (!sampler.ring) return 0;
+
+    sample_frame_t frames[SAMPLE_MAX_DEPTH + 1];
+    uint64_t tail = sampler.tail, head = __atomic_load_n(&sampler.head, __ATOMIC_ACQUIRE);
+    size_t drained = 0;
+    while (tail != head) {
+        uint64_t header = sampler.ring[tail++ & RING_MASK];
+        size_t depth = 0;
+        if (header & SAMPLE_TRUNCATED) frames[depth++] = (sample_frame_t){.block = NULL, .ip = 0};
+        for (size_t i = 0; i < (uint32_t)header; i++) {
+            frames[depth].block = (const block_t*)(uintptr_t)sampler.ring[tail++ & RING_MASK];
+            frames[depth++].ip = sampler.ring[tail++ & RING_MASK];
+        }
+        add_stack(&sampler.stacks, frames, depth, 1);
+        drained++;
+    }
+    __atomic_store_n(&sampler.tail, tail, __ATOMIC_RELEASE);
+    return drained;
+}
+
+uint64_t sampler_samples(void) {
+    return sampler.stacks.samples;
+}
+
+uint64_t sampler_dropped(void) {
+    return __atomic_load_n(&sampler.dropped, __ATOMIC_RELAXED);
+}
+
+static void print_frame(FILE *out, const sample_frame_t *f, bool call_site) {
+    if (!f->block) fputs("(truncated)", out);
+    else if (call_site) fprintf(out, "%p+%zu", (const void*)f->block, f->ip);
+    else fprintf(out, "%p", (const void*)f->block);
+}
+
+void sampler_dump_folded(FILE *out, bool call_sites) {
+    const stack_table_t *t = &sampler.stacks;
+
+    // without call sites, stacks that only differ in their ips become one line
+    stack_table_t merged = {0};
+    if (!call_sites) {
+        sample_frame_t frames[SAMPLE_MAX_DEPTH + 1];
+        for (size_t i = 0; i < t->capacity; i++) {
+            const stack_entry_t *e = &t->entries[i];
+            if (!e->count) continue;
+            for (size_t j = 0; j < e->depth; j++) {
+                frames[j] = (sample_frame_t){.block = t->frames[e->at + j].block, .ip = 0};
+            }
+            add_stack(&merged, frames, e->depth, e->count);
+        }
+        t = &merged;
+    }
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        const stack_entry_t *e = &t->entries[i];
+        if (!e->count) continue;
+        if (!e->depth) fputs("(outside vm)", out);
+        for (size_t j = 0; j < e->depth; j++) {
+            if (j) fputc(';', out);
+            // the innermost frame's ip is stale, it has no call site
+            print_frame(out, &t->frames[e->at + j], call_sites && j + 1 < e->depth);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)e->count);
+    }
+    free_stacks(&merged);
+}
+
+typedef struct {
+    const block_t *block;
+    uint64_t self, total;
+} flat_entry_t;
+
+static int compare_flat(const void *a, const void *b) {
+    const flat_entry_t *x = a, *y = b;
+    if (x->self != y->self) return (x->self < y->self) - (x->self > y->self);
+    return (x->total < y->total) - (x->total > y->total);
+}
+
+void sampler_dump_flat(FILE *out) {
+    const stack_table_t *t = &sampler.stacks;
+
+    // few blocks show up in a profile, a linear search is enough
+    flat_entry_t *blocks = NULL;
+    size_t block_count = 0, block_capacity = 0;
+    uint64_t outside = 0;
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        const stack_entry_t *e = &t->entries[i];
+        if (!e->count) continue;
+        if (!e->depth) {
+            outside += e->count;
+            continue;
+        }
+
+        for (size_t j = 0; j < e->depth; j++) {
+            const block_t *block = t->frames[e->at + j].block;
+            size_t k = 0;
+            while (k < block_count && blocks[k].block != block) k++;
+            if (k == block_count) {
+                if (block_count == block_capacity) {
+                    block_capacity = block_capacity ? block_capacity * 2 : 64;
+                    blocks = realloc(blocks, block_capacity * sizeof(flat_entry_t));
+                    if (!blocks) sampler_out_of_memory();
+                }
+                blocks[block_count++] = (flat_entry_t){.block = block};
+            }
+
+            // a recursive block counts once per sample
+            bool seen = false;
+            for (size_t m = 0; m < j && !seen; m++) seen = t->frames[e->at + m].block == block;
+            if (!seen) blocks[k].total += e->count;
+            if (j + 1 == e->depth) blocks[k].self += e->count;
+        }
+    }
+    qsort(blocks, block_count, sizeof(flat_entry_t), compare_flat);
+
+    uint64_t samples = t->samples;
+    fprintf(out, "%llu samples, %llu outside vm, %llu dropped\n", (unsigned long long)samples,
+            (unsigned long long)outside, (unsigned long long)sampler_dropped());
+    fprintf(out, "%10s %7s %10s %7s  %s\n", "self", "%", "total", "%", "block");
+    for (size_t i = 0; i < block_count; i++) {
+        fprintf(out, "%10llu %6.2f%% %10llu %6.2f%%  ", (unsigned long long)blocks[i].self,
+                samples ? 100.0 * blocks[i].self / samples : 0.0, (unsigned long long)blocks[i].total,
+                samples ? 100.0 * blocks[i].total / samples : 0.0);
+        print_frame(out, &(sample_frame_t){.block = blocks[i].block}, false);
+        fputc('\n', out);
+    }
+    free(blocks);
+}
+
+void sampler_free(void) {
+    sampler_stop();
+    if (sampler.ring) munmap(sampler.ring, SAMPLE_RING_WORDS * sizeof(uint64_t));
+    free_stacks(&sampler.stacks);
+    memset(&sampler, 0, sizeof(sampler));
+}
@@ -0,0 +1,57 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include "vm.h"
+#include <stdio.h>
+
+
+/*
+    Sampling profiler (Linux/POSIX, SIGPROF)
+
+    sampler_start arms ITIMER_PROF, so a SIGPROF arrives every 1/hz seconds of cpu time the
+    process uses. The handler copies the frames of the vm (frames[0] up to vm->frame_top,
+    the block and resume ip of each) into a ring buffer and returns, nothing is instrumented
+    and vm_run only pays for storing frame_top on calls and returns (see "Call frames" in vm.h).
+
+    The ring takes no lock: the handler is its only writer and advances head once a sample
+    is written, sampler_drain is its only reader and advances tail once a sample is merged.
+    A sample that does not fit is dropped and counted, long runs should drain now and then.
+    Stacks deeper than SAMPLE_MAX_DEPTH keep their innermost frames.
+
+    sampler_dump_folded prints the merged samples as "folded stacks", the input of
+    flamegraph.pl: one line per distinct stack, outermost frame first, frames separated by ';'
+    and followed by the sample count. sampler_dump_flat prints per block the samples it was
+    running in (self) and the samples it was anywhere on the stack in (total).
+    Blocks are named by address, "0x55d0c0+12" is the call at slot 12 of block 0x55d0c0.
+*/
+
+#define SAMPLE_DEFAULT_HZ 1000
+#define SAMPLE_MAX_DEPTH 128
+#define SAMPLE_RING_WORDS (1u << 20) // 8 bytes each, a sample takes 1 + 2 * depth
+
+typedef struct /* sample_frame_t */ {
+    const block_t *block;   // NULL stands for the frames cut from a deeper stack
+    size_t ip;
+} sample_frame_t;
+
+// starts sampling vm (only one vm at a time), hz 0 for SAMPLE_DEFAULT_HZ
+void sampler_start(vm_t *vm, unsigned hz);
+// stops the timer, the samples taken are kept
+void sampler_stop(void);
+
+// merges the samples in the ring buffer, returns how many
+size_t sampler_drain(void);
+// samples merged so far, and the ones dropped because the ring was full
+uint64_t sampler_samples(void);
+uint64_t sampler_dropped(void);
+
+// drain first, call_sites names callers by the slot they call from
+void sampler_dump_folded(FILE *out, bool call_sites);
+void sampler_dump_flat(FILE *out);
+
+// stops and forgets every sample
+void sampler_free(void);
+
+
+
+#endif // SAMPLE_H
@@ -0,0 +1,1262 @@
+#include <stdio.h>
+#include "../vm.h"
+#include "../peephole.h"
+#include "../reg.h"
+#include "../jit.h"
+#include "../trace.h"
+#include "../sample.h"
+#include "../compact.h"
+#include "../image.h"
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+
+#define TEST_PASS printf("✅ PASS: %s\n", __func__)
+#define TEST_FAIL printf("❌ FAIL: %s - line %d\n", __func__, __LINE__)
+
+#define STACK_CAPACITY 1024
+
+// every test runs once per engine
+static void (*engine)(vm_t *vm, block_t *block);
+
+#ifdef VM_JIT
+// vm_run with every block compiled the first time it is entered
+static void vm_run_jit(vm_t *vm, block_t *block) {
+    vm->jit_threshold = 1;
+    vm_run(vm, block);
+}
+
+// vm_run with every loop traced on its first backward jump
+static void vm_run_trace(vm_t *vm, block_t *block) {
+    vm->jit_threshold = 0;
+    vm->trace_threshold = 1;
+    vm_run(vm, block);
+}
+#endif
+
+static type_t run_block(block_t *block) {
+    vm_t vm;
+    vm_init(&vm, STACK_CAPACITY, 0);
+
+    engine(&vm, block);
+
+    type_t top = vm.stack.size ? vm.stack.data[vm.stack.size - 1] : make_none();
+    vm_free(&vm);
+    return top;
+}
+
+/* Test 1: constants and binary operations */
+int test_arithmetic() {
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_MUL),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_SUB),
+        HALT,
+    };
+    type_t consts[] = {
+        make_number(6),
+        make_number(7),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 36) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 2: backward JUMP loop with INC_LOCAL, falls off the end without HALT */
+int test_loop() {
+    // i = 0; sum = 0; while (i < 10) { sum = sum + i; i++ } push sum
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 20
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_LT),
+        JUMP_FALSE, INT_TO_BYTES4(64),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        INC_LOCAL, INT_TO_BYTES4(0),
+        JUMP, INT_TO_BYTES4(20),
+        // offset 64
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+    };
+    type_t consts[] = {
+        make_number(0),
+        make_number(10),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2, .local_count = 2};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 45) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 3: recursive CALL_FUNC through a constant and through a local */
+int test_recursive_call() {
+    block_t fib_block = {0};
+    uint8_t fib_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_LE),
+        JUMP_FALSE, INT_TO_BYTES4(23),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        RETURN,
+        // offset 23
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(1), INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(1), INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t fib_type = make_ptr(FUNCTION, &fib_block);
+    type_t fib_consts[] = {
+        make_number(1),
+        fib_type,
+        make_number(2),
+    };
+    fib_block.instructions = fib_code;
+    fib_block.instruction_size = sizeof(fib_code);
+    fib_block.constants = fib_consts;
+    fib_block.constant_count = 3;
+    fib_block.local_count = 2;
+
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_FUNC, BYTE(CF_LOCAL), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        HALT,
+    };
+    type_t consts[] = {
+        fib_type,
+        make_number(20),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2, .local_count = 1};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+    block_free_code(&fib_block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 6765) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 4: a quickened CALL_OP deopts when its operands become a NUMBER/INT mix */
+int test_quickening_deopt() {
+    block_t add_block = {0};
+    uint8_t add_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    add_block.instructions = add_code;
+    add_block.instruction_size = sizeof(add_code);
+    add_block.local_count = 2;
+
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(2),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(2),
+        HALT,
+    };
+    type_t consts[] = {
+        make_ptr(FUNCTION, &add_block),
+        make_number(1),
+        make_number(2),
+        make_int(3),
+        make_number(4),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 5};
+
+    vm_t vm;
+    vm_init(&vm, STACK_CAPACITY, 0);
+    engine(&vm, &block);
+
+    type_t first = vm.stack.data[0], second = vm.stack.data[1];
+    size_t size = vm.stack.size;
+    vm_free(&vm);
+    block_free_code(&block);
+    block_free_code(&add_block);
+
+    if (size != 2 || type_of(first) != NUMBER || as_number(first) != 3 ||
+        type_of(second) != NUMBER || as_number(second) != 7) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 5: the peephole pass never fuses across a jump target and relocates jumps */
+int test_peephole_jump_target() {
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        JUMP, INT_TO_BYTES4(25),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        // offset 25, jumped to from the middle of PUSH_LOCAL, PUSH_CONST, CALL_OP
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_OP, BYTE(OP_ADD),
+        HALT,
+    };
+    type_t consts[] = {
+        make_number(5),
+        make_number(0),
+        make_number(2),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 3, .local_count = 1};
+
+    size_t size;
+    uint8_t *optimized = peephole_optimize(code, sizeof(code), &size);
+    bool fused_as_expected = optimized && size == sizeof(code) - 1 &&
+                             optimized[20] == PUSH_LOCAL && optimized[25] == CALL_OP_CONST &&
+                             BYTES4_TO_INT(optimized[16], optimized[17], optimized[18], optimized[19]) == 25;
+    free(optimized);
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (!fused_as_expected || type_of(r) != NUMBER || as_number(r) != 2) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 6: PUSH/STORE reach the caller's locals, values pushed before a call are copies */
+int test_frame_locals() {
+    block_t f_block = {0};
+    uint8_t f_code[] = {
+        PUSH, INT_TO_BYTES4(0), INT_TO_BYTES4(0),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        STORE, INT_TO_BYTES4(0), INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        RETURN,
+    };
+    type_t f_consts[] = {make_number(100)};
+    f_block.instructions = f_code;
+    f_block.instruction_size = sizeof(f_code);
+    f_block.constants = f_consts;
+    f_block.constant_count = 1;
+    f_block.local_count = 1;
+
+    // x = 10; x + f(5) + x where f adds its argument to x
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        HALT,
+    };
+    type_t consts[] = {
+        make_ptr(FUNCTION, &f_block),
+        make_number(10),
+        make_number(5),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 3, .local_count = 1};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+    block_free_code(&f_block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 125) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 7: deep recursion runs in the reserved stack without moving it */
+int test_deep_recursion() {
+    // sum(n) -> if n <= 0 -> return 0 else -> return n + sum(n - 1)
+    block_t sum_block = {0};
+    uint8_t sum_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_LE),
+        JUMP_FALSE, INT_TO_BYTES4(23),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        RETURN,
+        // offset 23
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(2), INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t sum_consts[] = {
+        make_number(0),
+        make_number(1),
+        make_ptr(FUNCTION, &sum_block),
+    };
+    sum_block.instructions = sum_code;
+    sum_block.instruction_size = sizeof(sum_code);
+    sum_block.constants = sum_consts;
+    sum_block.constant_count = 3;
+    sum_block.local_count = 1;
+
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        HALT,
+    };
+    type_t consts[] = {
+        make_ptr(FUNCTION, &sum_block),
+        make_number(10000),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2};
+
+    vm_t vm;
+    vm_init(&vm, 1 << 16, 0);
+    type_t *data = vm.stack.data;
+    engine(&vm, &block);
+
+    bool same_region = vm.stack.data == data;
+    type_t r = vm.stack.data[vm.stack.size - 1];
+    vm_free(&vm);
+    block_free_code(&block);
+    block_free_code(&sum_block);
+
+    if (!same_region || type_of(r) != NUMBER || as_number(r) != 50005000) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 8: only locals that may be read before written are zeroed on a call */
+int test_analyze_locals() {
+    // local 2 is always stored first, local 1 only when local 0 is true
+    uint8_t code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        JUMP_FALSE, INT_TO_BYTES4(20),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 20
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(2),
+        PUSH_LOCAL, INT_TO_BYTES4(2),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        RETURN,
+    };
+    type_t consts[] = {make_number(1)};
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 1, .local_count = 3};
+
+    block_analyze_locals(&block);
+    size_t with_branch = block.zero_locals;
+
+    code[6] = 10; // JUMP_FALSE to the store of local 1, every path writes it now
+    block_analyze_locals(&block);
+    size_t without_branch = block.zero_locals;
+
+    if (with_branch != 2 || without_branch != 1) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 9: CALL_FUNC, RETURN runs as a tail call, 100000 calls fit in a few frames */
+int test_tail_call() {
+    // loop(n, acc) -> if n <= 0 -> return acc else -> return loop(n - 1, acc + n)
+    block_t loop_block = {0};
+    uint8_t loop_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_LE),
+        JUMP_FALSE, INT_TO_BYTES4(23),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        RETURN,
+        // offset 23
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_SUB),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(2), INT_TO_BYTES4(2),
+        RETURN,
+    };
+    type_t loop_consts[] = {
+        make_number(0),
+        make_number(1),
+        make_ptr(FUNCTION, &loop_block),
+    };
+    loop_block.instructions = loop_code;
+    loop_block.instruction_size = sizeof(loop_code);
+    loop_block.constants = loop_consts;
+    loop_block.constant_count = 3;
+    loop_block.local_count = 2;
+
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(2),
+        HALT,
+    };
+    type_t consts[] = {
+        make_ptr(FUNCTION, &loop_block),
+        make_number(100000),
+        make_number(0),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 3};
+
+    // without frame reuse this overflows both
+    vm_t vm;
+    vm_init(&vm, 64, 4);
+    engine(&vm, &block);
+
+    type_t r = vm.stack.data[vm.stack.size - 1];
+    vm_free(&vm);
+    block_free_code(&block);
+    block_free_code(&loop_block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 5000050000.0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 10: a call site whose callee changes misses its inline cache and picks up the new layout */
+int test_call_site_cache() {
+    // f(x) -> x + 1
+    block_t f_block = {0};
+    uint8_t f_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t f_consts[] = {make_number(1)};
+    f_block.instructions = f_code;
+    f_block.instruction_size = sizeof(f_code);
+    f_block.constants = f_consts;
+    f_block.constant_count = 1;
+    f_block.local_count = 1;
+
+    // g(x) -> x * 2 + y where y is a local never written (zeroed by the call)
+    block_t g_block = {0};
+    uint8_t g_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_MUL),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t g_consts[] = {make_number(2)};
+    g_block.instructions = g_code;
+    g_block.instruction_size = sizeof(g_code);
+    g_block.constants = g_consts;
+    g_block.constant_count = 1;
+    g_block.local_count = 2;
+
+    // fn = f; i = 0; sum = 0; while (i < 2) { sum = sum + fn(10); fn = g; i++ } push sum
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        STORE_LOCAL, INT_TO_BYTES4(2),
+        // offset 30
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_OP, BYTE(OP_LT),
+        JUMP_FALSE, INT_TO_BYTES4(94),
+        PUSH_LOCAL, INT_TO_BYTES4(2),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        CALL_FUNC, BYTE(CF_LOCAL), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(2),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        INC_LOCAL, INT_TO_BYTES4(1),
+        JUMP, INT_TO_BYTES4(30),
+        // offset 94
+        PUSH_LOCAL, INT_TO_BYTES4(2),
+        HALT,
+    };
+    type_t consts[] = {
+        make_ptr(FUNCTION, &f_block),
+        make_ptr(FUNCTION, &g_block),
+        make_number(2),
+        make_number(10),
+        make_number(0),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 5, .local_count = 3};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+    block_free_code(&f_block);
+    block_free_code(&g_block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 31) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 11: INT loop counters and sums stay INT, mixed operands are promoted to NUMBER */
+int test_int_arithmetic() {
+    // the loop of test_loop with INT constants
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 20
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_LT),
+        JUMP_FALSE, INT_TO_BYTES4(64),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        INC_LOCAL, INT_TO_BYTES4(0),
+        JUMP, INT_TO_BYTES4(20),
+        // offset 64
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+    };
+    type_t consts[] = {
+        make_int(0),
+        make_int(10),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2, .local_count = 2};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    type_t div = operation(OP_DIV, make_int(7), make_int(2));
+    type_t mod = operation(OP_MOD, make_int(-7), make_int(2));
+    type_t mixed = operation(OP_ADD, make_int(1), make_number(0.5));
+    type_t fmodulo = operation(OP_MOD, make_number(7.5), make_int(2));
+
+    if (type_of(r) != INT || as_int(r) != 45 ||
+        type_of(div) != NUMBER || as_number(div) != 3.5 ||
+        type_of(mod) != INT || as_int(mod) != -1 ||
+        type_of(mixed) != NUMBER || as_number(mixed) != 1.5 ||
+        type_of(fmodulo) != NUMBER || as_number(fmodulo) != 1.5) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 12: NUMBER and INT steps in compiled code, a mixed ADD exits to vm_run every iteration */
+int test_jit_fallback() {
+    // n = 10.0; k = 0; sum = 0.5; while (n > 0) { sum = sum + k; k++; n-- } push sum
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        STORE_LOCAL, INT_TO_BYTES4(2),
+        // offset 30
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        CALL_OP, BYTE(OP_GT),
+        JUMP_FALSE, INT_TO_BYTES4(79),
+        PUSH_LOCAL, INT_TO_BYTES4(2),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(2),
+        INC_LOCAL, INT_TO_BYTES4(1),
+        DEC_LOCAL, INT_TO_BYTES4(0),
+        JUMP, INT_TO_BYTES4(30),
+        // offset 79
+        PUSH_LOCAL, INT_TO_BYTES4(2),
+    };
+    type_t consts[] = {
+        make_number(10),
+        make_int(0),
+        make_number(0.5),
+        make_number(0),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 4, .local_count = 3};
+
+    type_t r = run_block(&block);
+    bool compiled = block.jit != NULL;
+    block_free_code(&block);
+
+#ifdef VM_JIT
+    if (engine == vm_run_jit && !compiled) {
+        TEST_FAIL;
+        return 0;
+    }
+#else
+    (void)compiled;
+#endif
+    if (type_of(r) != NUMBER || as_number(r) != 45.5) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 13: a traced loop whose recorded branch stops being taken half way */
+int test_trace_side_exit() {
+    // i = 0; sum = 0; while (i < 20) { if (i < 10) sum = sum + 1; else sum = sum + 2; i++ } push sum
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 20
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_LT),
+        JUMP_FALSE, INT_TO_BYTES4(103),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_OP, BYTE(OP_LT),
+        JUMP_FALSE, INT_TO_BYTES4(76),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        CALL_OP, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        JUMP, INT_TO_BYTES4(93),
+        // offset 76
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        CALL_OP, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 93
+        INC_LOCAL, INT_TO_BYTES4(0),
+        JUMP, INT_TO_BYTES4(20),
+        // offset 103
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+    };
+    type_t consts[] = {
+        make_int(0),
+        make_int(20),
+        make_int(10),
+        make_int(1),
+        make_int(2),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 5, .local_count = 2};
+
+    type_t r = run_block(&block);
+    bool traced = block.traces != NULL;
+    block_free_code(&block);
+
+#ifdef VM_JIT
+    if (engine == vm_run_trace && !traced) {
+        TEST_FAIL;
+        return 0;
+    }
+#else
+    (void)traced;
+#endif
+    if (type_of(r) != INT || as_int(r) != 30) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 14: SIGPROF samples of a recursive call show the caller below the callee */
+int test_sampler() {
+    // f(n) = n <= 0 ? 0 : f(n - 1) + 0 (not a tail call), called with 50 until enough samples are taken
+    block_t f_block = {0};
+    uint8_t f_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_LE),
+        JUMP_FALSE, INT_TO_BYTES4(23),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        RETURN,
+        // offset 23
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(2), INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t f_type = make_ptr(FUNCTION, &f_block);
+    type_t f_consts[] = {
+        make_int(0),
+        make_int(1),
+        f_type,
+    };
+    f_block.instructions = f_code;
+    f_block.instruction_size = sizeof(f_code);
+    f_block.constants = f_consts;
+    f_block.constant_count = 3;
+    f_block.local_count = 1;
+
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        HALT,
+    };
+    type_t consts[] = {
+        f_type,
+        make_int(50),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2};
+
+    vm_t vm;
+    vm_init(&vm, 8 * 1024, 0);
+    sampler_start(&vm, 2000);
+    for (int i = 0; i < 100000 && sampler_samples() < 10; i++) {
+        vm.stack.size = 0;
+        engine(&vm, &block);
+        sampler_drain();
+    }
+    sampler_stop();
+    vm_free(&vm);
+
+    // the main block calling f, then f calling itself
+    char expected[64], line[1024];
+    snprintf(expected, sizeof(expected), "%p;%p;%p", (void*)&block, (void*)&f_block, (void*)&f_block);
+    bool found = false;
+    FILE *out = tmpfile();
+    sampler_dump_folded(out, false);
+    rewind(out);
+    while (!found && fgets(line, sizeof(line), out)) found = strncmp(line, expected, strlen(expected)) == 0;
+    fclose(out);
+    sampler_free();
+
+    block_free_code(&block);
+    block_free_code(&f_block);
+
+    if (!found) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 15: blocks given only their compact encoding, including a jump that needs WIDE */
+int test_compact_encoding() {
+    block_t fib_block = {0};
+    uint8_t fib_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_LE),
+        JUMP_FALSE, INT_TO_BYTES4(23),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        RETURN,
+        // offset 23
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(1), INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(1), INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t fib_type = make_ptr(FUNCTION, &fib_block);
+    type_t fib_consts[] = {
+        make_int(1),
+        fib_type,
+        make_int(2),
+    };
+
+    // x = fib(15); jump over 150 INC_LOCAL x; push x
+    enum { SKIPPED = 150 };
+    uint8_t code[20 + 5 + SKIPPED * 5 + 5] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        JUMP, INT_TO_BYTES4(sizeof(code) - 5),
+    };
+    for (size_t i = 0; i < SKIPPED; i++) {
+        uint8_t inc[] = {INC_LOCAL, INT_TO_BYTES4(0)};
+        memcpy(&code[25 + i * 5], inc, 5);
+    }
+    uint8_t push[] = {PUSH_LOCAL, INT_TO_BYTES4(0)};
+    memcpy(&code[sizeof(code) - 5], push, 5);
+    type_t consts[] = {
+        fib_type,
+        make_int(15),
+    };
+
+    size_t fib_size, size, fib_expanded_size;
+    uint8_t *fib_compact = bytecode_compact(fib_code, sizeof(fib_code), &fib_size);
+    uint8_t *compact = bytecode_compact(code, sizeof(code), &size);
+    uint8_t *fib_expanded = bytecode_expand(fib_compact, fib_size, &fib_expanded_size);
+    bool round_trip = fib_expanded_size == sizeof(fib_code) && memcmp(fib_expanded, fib_code, sizeof(fib_code)) == 0;
+    bool wide_jump = compact[7] == WIDE && compact[8] == JUMP;
+    free(fib_expanded);
+
+    fib_block = (block_t){.compact = fib_compact, .compact_size = fib_size, .constants = fib_consts, .constant_count = 3, .local_count = 2};
+    block_t block = {.compact = compact, .compact_size = size, .constants = consts, .constant_count = 2, .local_count = 1};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+    block_free_code(&fib_block);
+    free(fib_compact);
+    free(compact);
+
+    if (!round_trip || !wide_jump || fib_size >= sizeof(fib_code) / 2 ||
+        type_of(r) != INT || as_int(r) != 610 || block.instructions || fib_block.instructions) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 16: a program written to an image and run from the mapping, in both encodings, an older version refused */
+int test_image() {
+    block_t fib_block = {0};
+    uint8_t fib_code[] = {
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_LE),
+        JUMP_FALSE, INT_TO_BYTES4(23),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        RETURN,
+        // offset 23
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(1), INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        CALL_OP, BYTE(OP_SUB),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(1), INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_ADD),
+        RETURN,
+    };
+    type_t fib_type = make_ptr(FUNCTION, &fib_block);
+    type_t fib_consts[] = {
+        make_number(1),
+        fib_type,
+        make_int(2),
+    };
+    fib_block.instructions = fib_code;
+    fib_block.instruction_size = sizeof(fib_code);
+    fib_block.constants = fib_consts;
+    fib_block.constant_count = 3;
+    fib_block.local_count = 2;
+
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(1),
+        HALT,
+    };
+    type_t consts[] = {
+        fib_type,
+        make_int(20),
+        make_str_literal("fib"),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 3};
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_vm_%ld.mplb", (long)getpid());
+
+    bool ok = true;
+    for (int compact = 0; compact < 2 && ok; compact++) {
+        image_t *image = image_write(path, &block, compact) == 0 ? image_load(path) : NULL;
+        if (!image) {
+            ok = false;
+            break;
+        }
+        type_t r = run_block(image->entry);
+        const block_t *fib = as_ptr(image->entry->constants[0]);
+        ok = image->block_count == 2 && fib == &image->blocks[1] &&
+             strcmp(as_str_literal(image->entry->constants[2]), "fib") == 0 &&
+             (compact ? fib->compact != NULL : fib->instructions != fib_code) &&
+             type_of(r) == NUMBER && as_number(r) == 6765;
+        image_free(image);
+    }
+
+    // an image written before the last opcode was added is not loaded
+    uint32_t stale = (uint32_t)(IMAGE_FORMAT << 8 | (BYTECODE_COUNT - 1));
+    FILE *f = ok && image_write(path, &block, false) == 0 ? fopen(path, "r+b") : NULL;
+    ok = f && fseek(f, offsetof(image_header_t, version), SEEK_SET) == 0 && fwrite(&stale, sizeof(stale), 1, f) == 1;
+    if (f) fclose(f);
+    ok = ok && !image_load(path);
+    remove(path);
+
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+
+/* Test 17: CALL_OP_INT/CALL_OP_NUMBER, the ones left unfused run unchecked, MOD runs generic */
+int test_typed_ops() {
+    // a = (7 * 5 - (3 + 2)) % (2 * 2); b = 1.5 / 0.5 - (0.5 + 0.5) == 0.5 + 1.5; push b ? a : none
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP_INT, BYTE(OP_MUL),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        CALL_OP_INT, BYTE(OP_ADD),
+        CALL_OP_INT, BYTE(OP_SUB),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        CALL_OP_INT, BYTE(OP_MUL),
+        CALL_OP_INT, BYTE(OP_MOD),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        // offset 45
+        PUSH_CONST, INT_TO_BYTES4(4),
+        PUSH_CONST, INT_TO_BYTES4(5),
+        CALL_OP_NUMBER, BYTE(OP_DIV),
+        PUSH_CONST, INT_TO_BYTES4(5),
+        PUSH_CONST, INT_TO_BYTES4(5),
+        CALL_OP_NUMBER, BYTE(OP_ADD),
+        CALL_OP_NUMBER, BYTE(OP_SUB),
+        PUSH_CONST, INT_TO_BYTES4(5),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        CALL_OP_NUMBER, BYTE(OP_ADD),
+        CALL_OP_NUMBER, BYTE(OP_EQ),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 90
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        JUMP_FALSE, INT_TO_BYTES4(106),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        HALT,
+        // offset 106
+        PUSH_CONST, INT_TO_BYTES4(6),
+        HALT,
+    };
+    type_t consts[] = {
+        make_int(7),
+        make_int(5),
+        make_int(3),
+        make_int(2),
+        make_number(1.5),
+        make_number(0.5),
+        make_none(),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 7, .local_count = 2};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (type_of(r) != INT || as_int(r) != 2) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 18: a counted loop's DEC_LOCAL and back edge fuse, and keep counting once the loop is hot */
+int test_counted_loop() {
+    // i = 5000; sum = 0; while (i > 0) { sum = sum + i; i-- } push sum
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        // offset 20
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP_INT, BYTE(OP_GT),
+        JUMP_FALSE, INT_TO_BYTES4(64),
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        CALL_OP_INT, BYTE(OP_ADD),
+        STORE_LOCAL, INT_TO_BYTES4(1),
+        DEC_LOCAL, INT_TO_BYTES4(0),
+        JUMP, INT_TO_BYTES4(20),
+        // offset 64
+        PUSH_LOCAL, INT_TO_BYTES4(1),
+    };
+    type_t consts[] = {
+        make_int(5000),
+        make_int(0),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2, .local_count = 2};
+
+    size_t size;
+    bool fused = false;
+    uint8_t *optimized = peephole_optimize(code, sizeof(code), &size);
+    for (size_t at = 0; optimized && at < size; at += bytecode_length(optimized, at)) {
+        fused = fused || optimized[at] == DEC_LOCAL_CMP_JUMP;
+    }
+    free(optimized);
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (!fused || type_of(r) != INT || as_int(r) != 12502500) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 19: BOOLs compare by value, in either value layout */
+int test_bool_equality() {
+    // push (true == true) && (true != false) && !(false == true)
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_EQ),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_NE),
+        CALL_OP, BYTE(OP_AND),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_EQ),
+        CALL_OP, BYTE(OP_NOT),
+        CALL_OP, BYTE(OP_AND),
+        HALT,
+    };
+    type_t consts[] = {
+        make_bool(true),
+        make_bool(false),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (type_of(r) != BOOL || !as_bool(r)) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 20: == and != on NONE, string literals (by their text) and mixed types never read a payload as a NUMBER */
+int test_mixed_equality() {
+    // push (none == none) && (none != false) && ("a" != "b") && ("a" == "a") && (1 == 1.0) && (1 != true),
+    // the second "a" a copy of its own
+    static char copy[] = "a";
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        CALL_OP, BYTE(OP_EQ),
+        PUSH_CONST, INT_TO_BYTES4(0),
+        PUSH_CONST, INT_TO_BYTES4(1),
+        CALL_OP, BYTE(OP_NE),
+        CALL_OP, BYTE(OP_AND),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        PUSH_CONST, INT_TO_BYTES4(3),
+        CALL_OP, BYTE(OP_NE),
+        CALL_OP, BYTE(OP_AND),
+        PUSH_CONST, INT_TO_BYTES4(2),
+        PUSH_CONST, INT_TO_BYTES4(7),
+        CALL_OP, BYTE(OP_EQ),
+        CALL_OP, BYTE(OP_AND),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        PUSH_CONST, INT_TO_BYTES4(5),
+        CALL_OP, BYTE(OP_EQ),
+        CALL_OP, BYTE(OP_AND),
+        PUSH_CONST, INT_TO_BYTES4(4),
+        PUSH_CONST, INT_TO_BYTES4(6),
+        CALL_OP, BYTE(OP_NE),
+        CALL_OP, BYTE(OP_AND),
+        HALT,
+    };
+    type_t consts[] = {
+        make_none(),
+        make_bool(false),
+        make_str_literal("a"),
+        make_str_literal("b"),
+        make_int(1),
+        make_number(1.0),
+        make_bool(true),
+        make_str_literal(copy),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 8};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+
+    if (type_of(r) != BOOL || !as_bool(r)) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 21: a callee reads a local of its suspended caller that is only written after the call, it is zeroed */
+int test_frame_read_unwritten() {
+    // g() -> PUSH frame 1 (f), local 0
+    block_t g_block = {0};
+    uint8_t g_code[] = {
+        PUSH, INT_TO_BYTES4(1), INT_TO_BYTES4(0),
+        RETURN,
+    };
+    g_block.instructions = g_code;
+    g_block.instruction_size = sizeof(g_code);
+
+    // f() -> x = g(); return x
+    block_t f_block = {0};
+    uint8_t f_code[] = {
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(0),
+        STORE_LOCAL, INT_TO_BYTES4(0),
+        PUSH_LOCAL, INT_TO_BYTES4(0),
+        RETURN,
+    };
+    type_t f_consts[] = {make_ptr(FUNCTION, &g_block)};
+    f_block.instructions = f_code;
+    f_block.instruction_size = sizeof(f_code);
+    f_block.constants = f_consts;
+    f_block.constant_count = 1;
+    f_block.local_count = 1;
+
+    // a 42 left on the stack where f's local goes, then f()
+    uint8_t code[] = {
+        PUSH_CONST, INT_TO_BYTES4(1),
+        POP,
+        CALL_FUNC, BYTE(CF_CONSTANT), INT_TO_BYTES4(0), INT_TO_BYTES4(0),
+        HALT,
+    };
+    type_t consts[] = {
+        make_ptr(FUNCTION, &f_block),
+        make_int(42),
+    };
+    block_t block = {.instructions = code, .instruction_size = sizeof(code), .constants = consts, .constant_count = 2};
+
+    type_t r = run_block(&block);
+    block_free_code(&block);
+    block_free_code(&f_block);
+    block_free_code(&g_block);
+
+    if (type_of(r) != NUMBER || as_number(r) != 0) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+/* Test 22: an instruction cut short by the end of the code, a call's kind byte included, is never read past it */
+int test_truncated_instruction() {
+    uint8_t call[] = {CALL_FUNC, BYTE(CF_GLOBAL), INT_TO_BYTES4(0), INT_TO_BYTES4(0), INT_TO_BYTES4(0)};
+    uint8_t *alone = malloc(1);     // the opcode alone, at the end of its allocation
+    if (!alone) return 0;
+    alone[0] = TAIL_CALL;
+
+    block_t block = {.instructions = alone, .instruction_size = 1, .local_count = 1};
+    block_analyze_locals(&block);
+    bool ok = block.zero_locals == 1 &&
+              bytecode_checked_length(call, 0, sizeof(call)) == sizeof(call) &&
+              bytecode_checked_length(call, 0, sizeof(call) - 1) == 0 &&
+              bytecode_checked_length(call, 0, 1) == 0;
+    free(alone);
+
+    if (!ok) {
+        TEST_FAIL;
+        return 0;
+    }
+    TEST_PASS;
+    return 1;
+}
+
+int main() {
+    int passed = 0, total = 0;
+
+#ifdef VM_JIT
+    void (*engines[])(vm_t*, block_t*) = {vm_run, vm_run_reg, vm_run_jit, vm_run_trace};
+    const char *names[] = {"stack vm", "register vm", "jit", "trace"};
+#else
+    void (*engines[])(vm_t*, block_t*) = {vm_run, vm_run_reg};
+    const char *names[] = {"stack vm", "register vm"};
+#endif
+
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        engine = engines[i];
+        printf("\n=== %s ===\n", names[i]);
+
+        total++; passed += test_arithmetic();
+        total++; passed += test_loop();
+        total++; passed += test_recursive_call();
+        total++; passed += test_quickening_deopt();
+        total++; passed += test_peephole_jump_target();
+        total++; passed += test_frame_locals();
+        total++; passed += test_deep_recursion();
+        total++; passed += test_analyze_locals();
+        total++; passed += test_tail_call();
+        total++; passed += test_call_site_cache();
+        total++; passed += test_int_arithmetic();
+        total++; passed += test_jit_fallback();
+        total++; passed += test_trace_side_exit();
+        total++; passed += test_sampler();
+        total++; passed += test_compact_encoding();
+        total++; passed += test_image();
+        total++; passed += test_typed_ops();
+        total++; passed += test_counted_loop();
+        total++; passed += test_bool_equality();
+        total++; passed += test_mixed_equality();
+        total++; passed += test_frame_read_unwritten();
+        total++; passed += test_truncated_instruction();
+    }
+
+    printf("\n%d/%d tests passed\n", passed, total);
+    return passed == total ? 0 : 1;
+}
@@ -0,0 +1,519 @@
+#include "trace.h"
+#include "jit_emit.h"
+#include "peephole.h"
+
+#ifdef VM_JIT
+
+#define INT_ARITH_TEMPLATE(name, int_op)            \
+    T_BEGIN(trace_##name##_int)                     \
+    "    mov 8(%rsi), %rax\n"                       \
+    "    " int_op " 8(%rdi), %rax\n"                \
+    "    mov %rax, 8(%rdx)\n"                       \
+    "    movq $1, (%rdx)\n"                         \
+    T_END(trace_##name##_int)
+
+#define NUMBER_ARITH_TEMPLATE(name, number_op)      \
+    T_BEGIN(trace_##name##_num)                     \
+    "    movsd 8(%rsi), %xmm0\n"                    \
+    "    " number_op " 8(%rdi), %xmm0\n"            \
+    "    movsd %xmm0, 8(%rdx)\n"                    \
+    "    movq $0, (%rdx)\n"                         \
+    T_END(trace_##name##_num)
+
+#define INT_COMPARE_TEMPLATE(name, int_set)         \
+    T_BEGIN(trace_##name##_int)                     \
+    "    mov 8(%rsi), %rax\n"                       \
+    "    cmp 8(%rdi), %rax\n"                       \
+    "    " int_set " %al\n"                         \
+    T_END(trace_##name##_int)
+
+// same flags as the baseline compares, see jit.c
+#define NUMBER_COMPARE_TEMPLATE(name, left, right, number_set)  \
+    T_BEGIN(trace_##name##_num)                                 \
+    "    movsd " left ", %xmm0\n"                               \
+    "    ucomisd " right ", %xmm0\n"                            \
+    number_set                                                  \
+    T_END(trace_##name##_num)
+
+#define STEP_TEMPLATE(name, number_op, int_op)      \
+    T_BEGIN(trace_##name##_int)                     \
+    "    " int_op " $1, 8(%rcx)\n"                  \
+    T_END(trace_##name##_int)                       \
+    T_BEGIN(trace_##name##_num)                     \
+    "    mov $0x3ff0000000000000, %rax\n"           \
+    "    movq %rax, %xmm1\n"                        \
+    "    movsd 8(%rcx), %xmm0\n"                    \
+    "    " number_op " %xmm1, %xmm0\n"              \
+    "    movsd %xmm0, 8(%rcx)\n"                    \
+    T_END(trace_##name##_num)
+
+__asm__(
+    ".pushsection .rodata\n"
+
+    // exits before the iteration if it could push past the end of the stack
+    T_BEGIN(trace_check_stack)
+    "    lea 0x7fffffff(%r12), %rax\n"
+    T_HOLE(trace_check_stack, disp)
+    "    cmp %r14, %rax\n"
+    JA_REL32 T_HOLE(trace_check_stack, exit)
+    T_END(trace_check_stack)
+
+    T_BEGIN(trace_guard_int)
+    "    mov (%rsi), %eax\n"
+    "    mov (%rdi), %ecx\n"
+    "    xor $1, %eax\n"
+    "    xor $1, %ecx\n"
+    "    or %ecx, %eax\n"
+    JNE_REL32 T_HOLE(trace_guard_int, exit)
+    T_END(trace_guard_int)
+
+    T_BEGIN(trace_guard_num)
+    "    mov (%rsi), %eax\n"
+    "    or (%rdi), %eax\n"
+    JNE_REL32 T_HOLE(trace_guard_num, exit)
+    T_END(trace_guard_num)
+
+    T_BEGIN(trace_local_address)
+    "    lea 0x7fffffff(%rbx), %rcx\n"
+    T_HOLE(trace_local_address, disp)
+    T_END(trace_local_address)
+
+    T_BEGIN(trace_guard_local_int)
+    "    cmpl $1, (%rcx)\n"
+    JNE_REL32 T_HOLE(trace_guard_local_int, exit)
+    T_END(trace_guard_local_int)
+
+    T_BEGIN(trace_guard_local_num)
+    "    cmpl $0, (%rcx)\n"
+    JNE_REL32 T_HOLE(trace_guard_local_num, exit)
+    T_END(trace_guard_local_num)
+
+    T_BEGIN(trace_jump_true)
+    "    sub $16, %r12\n"
+    "    cmpb $0, 8(%r12)\n"
+    JNE_REL32 T_HOLE(trace_jump_true, target)
+    T_END(trace_jump_true)
+
+    T_BEGIN(trace_branch_true)
+    "    test %al, %al\n"
+    JNE_REL32 T_HOLE(trace_branch_true, target)
+    T_END(trace_branch_true)
+
+    STEP_TEMPLATE(inc, "addsd", "addq")
+    STEP_TEMPLATE(dec, "subsd", "subq")
+
+    INT_ARITH_TEMPLATE(add, "add")
+    INT_ARITH_TEMPLATE(sub, "sub")
+    INT_ARITH_TEMPLATE(mul, "imul")
+    NUMBER_ARITH_TEMPLATE(add, "addsd")
+    NUMBER_ARITH_TEMPLATE(sub, "subsd")
+    NUMBER_ARITH_TEMPLATE(mul, "mulsd")
+    NUMBER_ARITH_TEMPLATE(div, "divsd")
+
+    // INT / INT is a NUMBER
+    T_BEGIN(trace_div_int)
+    "    cvtsi2sdq 8(%rsi), %xmm0\n"
+    "    cvtsi2sdq 8(%rdi), %xmm1\n"
+    "    divsd %xmm1, %xmm0\n"
+    "    movsd %xmm0, 8(%rdx)\n"
+    "    movq $0, (%rdx)\n"
+    T_END(trace_div_int)
+
+    INT_COMPARE_TEMPLATE(eq, "sete")
+    INT_COMPARE_TEMPLATE(ne, "setne")
+    INT_COMPARE_TEMPLATE(lt, "setl")
+    INT_COMPARE_TEMPLATE(gt, "setg")
+    INT_COMPARE_TEMPLATE(le, "setle")
+    INT_COMPARE_TEMPLATE(ge, "setge")
+    NUMBER_COMPARE_TEMPLATE(eq, "8(%rsi)", "8(%rdi)", "    sete %al\n    setnp %cl\n    and %cl, %al\n")
+    NUMBER_COMPARE_TEMPLATE(ne, "8(%rsi)", "8(%rdi)", "    setne %al\n    setp %cl\n    or %cl, %al\n")
+    NUMBER_COMPARE_TEMPLATE(lt, "8(%rdi)", "8(%rsi)", "    seta %al\n")
+    NUMBER_COMPARE_TEMPLATE(gt, "8(%rsi)", "8(%rdi)", "    seta %al\n")
+    NUMBER_COMPARE_TEMPLATE(le, "8(%rdi)", "8(%rsi)", "    setae %al\n")
+    NUMBER_COMPARE_TEMPLATE(ge, "8(%rsi)", "8(%rdi)", "    setae %al\n")
+
+    ".popsection\n"
+);
+
+#undef INT_ARITH_TEMPLATE
+#undef NUMBER_ARITH_TEMPLATE
+#undef INT_COMPARE_TEMPLATE
+#undef NUMBER_COMPARE_TEMPLATE
+#undef STEP_TEMPLATE
+
+DECLARE_TEMPLATE(trace_check_stack);        DECLARE_HOLE(trace_check_stack, disp);
+                                            DECLARE_HOLE(trace_check_stack, exit);
+DECLARE_TEMPLATE(trace_guard_int);          DECLARE_HOLE(trace_guard_int, exit);
+DECLARE_TEMPLATE(trace_guard_num);          DECLARE_HOLE(trace_guard_num, exit);
+DECLARE_TEMPLATE(trace_local_address);      DECLARE_HOLE(trace_local_address, disp);
+DECLARE_TEMPLATE(trace_guard_local_int);    DECLARE_HOLE(trace_guard_local_int, exit);
+DECLARE_TEMPLATE(trace_guard_local_num);    DECLARE_HOLE(trace_guard_local_num, exit);
+DECLARE_TEMPLATE(trace_jump_true);          DECLARE_HOLE(trace_jump_true, target);
+DECLARE_TEMPLATE(trace_branch_true);        DECLARE_HOLE(trace_branch_true, target);
+DECLARE_TEMPLATE(trace_inc_int);
+DECLARE_TEMPLATE(trace_inc_num);
+DECLARE_TEMPLATE(trace_dec_int);
+DECLARE_TEMPLATE(trace_dec_num);
+
+#define DECLARE_OP_TEMPLATES(OP, name, operator, make, int_make) \
+    DECLARE_TEMPLATE(trace_##name##_int); DECLARE_TEMPLATE(trace_##name##_num);
+NUM_ARITH_OPS(DECLARE_OP_TEMPLATES)
+NUM_COMPARE_OPS(DECLARE_OP_TEMPLATES)
+
+typedef struct /* trace_template_t */ {
+    const uint8_t *start, *end;
+} trace_template_t;
+
+#define OP_TEMPLATE_ROW(OP, name, operator, make, int_make)         \
+    [OP_##OP] = {                                                   \
+        [NUMBER] = {jit_tpl_trace_##name##_num, jit_tpl_trace_##name##_num_end}, \
+        [INT] = {jit_tpl_trace_##name##_int, jit_tpl_trace_##name##_int_end},    \
+    },
+
+// binary op bodies by operand type, a NULL start means the op is not traced
+static const trace_template_t op_templates[Op_unary][2] = {
+    NUM_ARITH_OPS(OP_TEMPLATE_ROW)
+    NUM_COMPARE_OPS(OP_TEMPLATE_ROW)
+};
+
+#undef DECLARE_OP_TEMPLATES
+#undef OP_TEMPLATE_ROW
+
+#define UNKNOWN_TYPE ((Type)-1)
+
+// state of the iteration being recorded
+typedef struct /* recorder_t */ {
+    jit_buffer_t b;
+    const block_t *block;
+
+    // concrete values of the replayed iteration
+    type_t *locals;
+    type_t *stack;
+    size_t depth, max_depth;
+
+    // type every local and stack value is known to have at this point of the trace
+    Type *local_types;
+    Type *stack_types;
+} recorder_t;
+
+static bool record_push(recorder_t *r, type_t value, Type known) {
+    if (r->depth == TRACE_MAX_LENGTH) return false;
+    r->stack_types[r->depth] = known;
+    r->stack[r->depth++] = value;
+    if (r->depth > r->max_depth) r->max_depth = r->depth;
+    return true;
+}
+
+static bool valid_local(const recorder_t *r, int32_t local) {
+    return local >= 0 && (size_t)local < r->block->local_count;
+}
+
+// an operand of a traced binary op: its value, the type known for it and where that knowledge lives
+typedef struct /* operand_t */ {
+    type_t value;
+    Type known;
+    Type *known_at;
+} operand_t;
+
+static operand_t stack_operand(recorder_t *r, size_t from_top) {
+    size_t i = r->depth - from_top;
+    return (operand_t){r->stack[i], r->stack_types[i], &r->stack_types[i]};
+}
+
+static operand_t local_operand(recorder_t *r, int32_t local) {
+    return (operand_t){r->locals[local], r->local_types[local], &r->local_types[local]};
+}
+
+static operand_t const_operand(recorder_t *r, int32_t index) {
+    type_t value = r->block->constants[index];
+    return (operand_t){value, type_of(value), NULL};
+}
+
+/*
+    Emits the guard and the typed body of a binary op whose operands are already in rsi/rdi.
+    Returns false if the op or the seen types cannot be traced, else sets *result to the
+    value vm_run would compute.
+*/
+static bool record_op(recorder_t *r, Op op, operand_t l, operand_t rr, int32_t slot, type_t *result) {
+    Type type = type_of(l.value);
+    if (op >= Op_unary || !op_templates[op][0].start) return false;
+    if ((type != NUMBER && type != INT) || type_of(rr.value) != type) return false;
+
+    if (l.known != type || rr.known != type) {
+        size_t at = type == INT ? EMIT(&r->b, trace_guard_int) : EMIT(&r->b, trace_guard_num);
+        EXIT_TO(&r->b, type == INT ? HOLE(at, trace_guard_int, exit) : HOLE(at, trace_guard_num, exit), slot);
+        if (l.known_at) *l.known_at = type;
+        if (rr.known_at) *rr.known_at = type;
+    }
+
+    const trace_template_t *t = &op_templates[op][type];
+    emit(&r->b, t->start, t->end);
+    *result = operation(op, l.value, rr.value);
+    return true;
+}
+
+/*
+    Emits the native code of a conditional jump that went `taken` while recording, the
+    condition is in al (compare) or on the stack (JUMP_FALSE). The other way side exits.
+    Returns the offset of the instruction the iteration continues at.
+*/
+static size_t record_branch(recorder_t *r, bool in_al, bool cond, size_t next, size_t target, const int32_t *slot_at) {
+    size_t at;
+    if (cond) {
+        // the fall through was recorded, exit when the condition is false
+        if (in_al) {
+            at = EMIT(&r->b, branch_false);
+            EXIT_TO(&r->b, HOLE(at, branch_false, target), slot_at[target]);
+        } else {
+            at = EMIT(&r->b, jump_false);
+            EXIT_TO(&r->b, HOLE(at, jump_false, target), slot_at[target]);
+        }
+        return next;
+    }
+    if (in_al) {
+        at = EMIT(&r->b, trace_branch_true);
+        EXIT_TO(&r->b, HOLE(at, trace_branch_true, target), slot_at[next]);
+    } else {
+        at = EMIT(&r->b, trace_jump_true);
+        EXIT_TO(&r->b, HOLE(at, trace_jump_true, target), slot_at[next]);
+    }
+    return target;
+}
+
+static void emit_local_address(recorder_t *r, int32_t local) {
+    size_t at = EMIT(&r->b, trace_local_address);
+    patch_i32(&r->b, HOLE(at, trace_local_address, disp), local * (int32_t)sizeof(type_t));
+}
+
+// replays and compiles INC_LOCAL/DEC_LOCAL (step 1/-1) of local, false to give up
+static bool record_increment(recorder_t *r, int32_t local, int step, int32_t slot) {
+    jit_buffer_t *b = &r->b;
+    if (!valid_local(r, local)) return false;
+    Type type = type_of(r->locals[local]);
+    if (type != NUMBER && type != INT) return false;
+
+    emit_local_address(r, local);
+    if (r->local_types[local] != type) {
+        size_t at = type == INT ? EMIT(b, trace_guard_local_int) : EMIT(b, trace_guard_local_num);
+        EXIT_TO(b, type == INT ? HOLE(at, trace_guard_local_int, exit) : HOLE(at, trace_guard_local_num, exit), slot);
+        r->local_types[local] = type;
+    }
+    if (step > 0) type == INT ? EMIT(b, trace_inc_int) : EMIT(b, trace_inc_num);
+    else type == INT ? EMIT(b, trace_dec_int) : EMIT(b, trace_dec_num);
+    r->locals[local] = increment(r->locals[local], step);
+    return true;
+}
+
+// replays and compiles the instruction at code[ip], returns the next one or SIZE_MAX to give up
+static size_t record_instruction(recorder_t *r, const uint8_t *code, size_t ip, const int32_t *slot_at) {
+    jit_buffer_t *b = &r->b;
+    int32_t slot = slot_at[ip];
+    size_t next = ip + bytecode_length(code, ip);
+    size_t at;
+
+    switch (code[ip]) {
+        case PUSH_CONST: {
+            int32_t index = operand_i32(code, ip + 1);
+            at = EMIT(b, push_const);
+            patch_ptr(b, HOLE(at, push_const, ptr), &r->block->constants[index]);
+            return record_push(r, r->block->constants[index], type_of(r->block->constants[index])) ? next : SIZE_MAX;
+        }
+        case PUSH_LOCAL: {
+            int32_t local = operand_i32(code, ip + 1);
+            if (!valid_local(r, local)) return SIZE_MAX;
+            at = EMIT(b, push_local);
+            patch_i32(b, HOLE(at, push_local, disp), local * (int32_t)sizeof(type_t));
+            return record_push(r, r->locals[local], r->local_types[local]) ? next : SIZE_MAX;
+        }
+        case STORE_LOCAL: {
+            int32_t local = operand_i32(code, ip + 1);
+            if (!valid_local(r, local) || r->depth == 0) return SIZE_MAX;
+            at = EMIT(b, store_local);
+            patch_i32(b, HOLE(at, store_local, disp), local * (int32_t)sizeof(type_t));
+            r->depth--;
+            r->locals[local] = r->stack[r->depth];
+            r->local_types[local] = r->stack_types[r->depth];
+            return next;
+        }
+        case POP:
+            if (r->depth == 0) return SIZE_MAX;
+            EMIT(b, pop);
+            r->depth--;
+            return next;
+        case JUMP:
+            // backward jumps are handled by the caller
+            return operand_i32(code, ip + 1);
+        case JUMP_FALSE:
+            if (r->depth == 0) return SIZE_MAX;
+            r->depth--;
+            return record_branch(r, false, as_bool(r->stack[r->depth]), next, operand_i32(code, ip + 1), slot_at);
+        case INC_LOCAL:
+        case DEC_LOCAL:
+            return record_increment(r, operand_i32(code, ip + 1), code[ip] == INC_LOCAL ? 1 : -1, slot) ? next : SIZE_MAX;
+        case INC_LOCAL_CMP_JUMP:
+        case DEC_LOCAL_CMP_JUMP: {
+            // the step's guard is the only check: the compare sees a local of a known type and a constant
+            type_t result;
+            int32_t local = operand_i32(code, ip + 1), index = operand_i32(code, ip + 5);
+            if (!record_increment(r, local, code[ip] == INC_LOCAL_CMP_JUMP ? 1 : -1, slot)) return SIZE_MAX;
+            at = EMIT(b, operands_local_const);
+            patch_i32(b, HOLE(at, operands_local_const, disp), local * (int32_t)sizeof(type_t));
+            patch_ptr(b, HOLE(at, operands_local_const, ptr), &r->block->constants[index]);
+            operand_t bound = const_operand(r, index);
+            if (bound.known != r->local_types[local]) return SIZE_MAX;
+            if (!record_op(r, code[ip + 9], local_operand(r, local), bound, slot, &result)) return SIZE_MAX;
+
+            // jumps back while the compare holds, the other way round from JUMP_FALSE
+            return record_branch(r, true, as_bool(result), operand_i32(code, ip + 10), next, slot_at);
+        }
+        case CALL_OP:
+        case CALL_OP_INT:
+        case CALL_OP_NUMBER: {
+            type_t result;
+            if (r->depth < 2) return SIZE_MAX;
+            EMIT(b, operands_stack);
+            if (!record_op(r, code[ip + 1], stack_operand(r, 2), stack_operand(r, 1), slot, &result)) return SIZE_MAX;
+            if (code[ip + 1] >= OP_EQ) EMIT(b, store_bool);
+            EMIT(b, pop);
+            r->depth -= 2;
+            return record_push(r, result, type_of(result)) ? next : SIZE_MAX;
+        }
+        case CALL_OP_LOCAL:
+        case CALL_OP_CONST: {
+            type_t result;
+            int32_t operand = operand_i32(code, ip + 1);
+            if (r->depth < 1) return SIZE_MAX;
+            operand_t right;
+            if (code[ip] == CALL_OP_LOCAL) {
+                if (!valid_local(r, operand)) return SIZE_MAX;
+                at = EMIT(b, operands_local);
+                patch_i32(b, HOLE(at, operands_local, disp), operand * (int32_t)sizeof(type_t));
+                right = local_operand(r, operand);
+            } else {
+                at = EMIT(b, operands_const);
+                patch_ptr(b, HOLE(at, operands_const, ptr), &r->block->constants[operand]);
+                right = const_operand(r, operand);
+            }
+            if (!record_op(r, code[ip + 5], stack_operand(r, 1), right, slot, &result)) return SIZE_MAX;
+            if (code[ip + 5] >= OP_EQ) EMIT(b, store_bool);
+            r->depth--;
+            return record_push(r, result, type_of(result)) ? next : SIZE_MAX;
+        }
+        case CALL_OP_LOCAL_CONST:
+        case CMP_LOCAL_CONST_JUMP_FALSE: {
+            type_t result;
+            int32_t local = operand_i32(code, ip + 1), index = operand_i32(code, ip + 5);
+            if (!valid_local(r, local)) return SIZE_MAX;
+            at = EMIT(b, operands_local_const);
+            patch_i32(b, HOLE(at, operands_local_const, disp), local * (int32_t)sizeof(type_t));
+            patch_ptr(b, HOLE(at, operands_local_const, ptr), &r->block->constants[index]);
+            if (!record_op(r, code[ip + 9], local_operand(r, local), const_operand(r, index), slot, &result)) return SIZE_MAX;
+
+            if (code[ip] == CMP_LOCAL_CONST_JUMP_FALSE)
+                return record_branch(r, true, as_bool(result), next, operand_i32(code, ip + 10), slot_at);
+            if (code[ip + 9] >= OP_EQ) EMIT(b, store_bool);
+            EMIT(b, grow);
+            return record_push(r, result, type_of(result)) ? next : SIZE_MAX;
+        }
+        case CMP_JUMP_FALSE: {
+            type_t result;
+            if (r->depth < 2) return SIZE_MAX;
+            EMIT(b, operands_stack);
+            if (!record_op(r, code[ip + 1], stack_operand(r, 2), stack_operand(r, 1), slot, &result)) return SIZE_MAX;
+            EMIT(b, pop2);
+            r->depth -= 2;
+            return record_branch(r, true, as_bool(result), next, operand_i32(code, ip + 2), slot_at);
+        }
+        default:
+            return SIZE_MAX;
+    }
+}
+
+jit_trace_t* trace_record(block_t *block, size_t jump_slot, const type_t *locals) {
+    // the same instructions translate_block laid out in block->code
+    size_t size;
+    uint8_t *optimized = peephole_optimize(block->instructions, block->instruction_size, &size);
+    uint8_t *code = optimized ? optimized : block->instructions;
+    if (!optimized) size = block->instruction_size;
+
+    int32_t *slot_at = malloc((size + 1) * sizeof(int32_t));
+    recorder_t r = {
+        .block = block,
+        .locals = malloc((block->local_count + 1) * sizeof(type_t)),
+        .stack = malloc(TRACE_MAX_LENGTH * sizeof(type_t)),
+        .local_types = malloc((block->local_count + 1) * sizeof(Type)),
+        .stack_types = malloc(TRACE_MAX_LENGTH * sizeof(Type)),
+    };
+    if (!slot_at || !r.locals || !r.stack || !r.local_types || !r.stack_types) jit_out_of_memory();
+
+    memcpy(r.locals, locals, block->local_count * sizeof(type_t));
+    for (size_t i = 0; i < block->local_count; i++) r.local_types[i] = UNKNOWN_TYPE;
+
+    size_t jump_ip = SIZE_MAX;
+    int32_t slot = 0;
+    for (size_t ip = 0; ip < size; ip += bytecode_length(code, ip)) {
+        slot_at[ip] = slot;
+        if ((size_t)slot == jump_slot) jump_ip = ip;
+        slot += slot_count(code, ip);
+    }
+    slot_at[size] = slot;
+
+    jit_trace_t *trace = NULL;
+    if (jump_ip == SIZE_MAX || (size_t)slot + 1 != block->code_size) goto done;
+    if (code[jump_ip] != JUMP && code[jump_ip] != INC_LOCAL_CMP_JUMP && code[jump_ip] != DEC_LOCAL_CMP_JUMP) goto done;
+
+    // a counted loop's back edge goes to the body, recording starts there
+    size_t header = operand_i32(code, bytecode_jump_operand(code, jump_ip));
+    size_t at = EMIT(&r.b, trace_check_stack);
+    size_t check_disp = HOLE(at, trace_check_stack, disp);
+    EXIT_TO(&r.b, HOLE(at, trace_check_stack, exit), slot_at[header]);
+
+    size_t ip = header;
+    for (size_t length = 0;; length++) {
+        if (length == TRACE_MAX_LENGTH || ip >= size) goto done;
+
+        size_t next = record_instruction(&r, code, ip, slot_at);
+        if (next == SIZE_MAX) goto done;
+
+        // back at the header closes the trace, any other backward jump is an inner loop
+        if (next == header) break;
+        if (next <= ip) goto done;
+        ip = next;
+    }
+    if (r.depth != 0) goto done;
+
+    at = EMIT(&r.b, jump);
+    patch_rel32(&r.b, HOLE(at, jump, target), 0);
+    patch_i32(&r.b, check_disp, (int32_t)(r.max_depth * sizeof(type_t)));
+    emit_exit_stubs(&r.b, block->code_size);
+
+    size_t mapped_size;
+    uint8_t *native = jit_map(&r.b, &mapped_size);
+    if (!native) goto done;
+
+    trace = malloc(sizeof(jit_trace_t));
+    if (!trace) jit_out_of_memory();
+    *trace = (jit_trace_t){.code = native, .mapped_size = mapped_size, .next = block->traces};
+    block->traces = trace;
+
+done:
+    jit_buffer_free(&r.b);
+    free(r.locals);
+    free(r.stack);
+    free(r.local_types);
+    free(r.stack_types);
+    free(slot_at);
+    free(optimized);
+    return trace;
+}
+
+#endif // VM_JIT
+
+void block_free_traces(block_t *block) {
+    while (block->traces) {
+        jit_trace_t *next = block->traces->next;
+        munmap(block->traces->code, block->traces->mapped_size);
+        free(block->traces);
+        block->traces = next;
+    }
+}
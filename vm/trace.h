@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "jit.h"
+
+
+/*
+    Tracing JIT (built along with the baseline JIT, see jit.h)
+
+    A backward JUMP, or the INC_LOCAL_CMP_JUMP/DEC_LOCAL_CMP_JUMP back edge of a counted loop,
+    counts the iterations of its loop in its [loop] slot (see "Threaded code" in vm.h). Once that reaches trace_threshold (vm_t), trace_record replays one iteration
+    from the loop header on copies of the locals and the stack, recording the path it takes
+    and the types it sees, and compiles the recording as it goes:
+
+        - operands are guarded for the type that was seen, once: a value produced or already
+          checked earlier in the iteration is not checked again, and only that type's code
+          is emitted (no NUMBER/INT dispatch like the baseline templates)
+        - a conditional jump becomes a check that the recorded way is taken
+        - any check that fails side exits to vm_run at the slot where execution leaves
+          the trace, with the vm stack and locals exactly as vm_run expects them there
+
+    The trace ends with a jump back to its own start, a loop that stays on the recorded path
+    never leaves native code. vm_run enters it from the backward JUMP (a counted back edge
+    steps and compares first, the trace starts at the loop body it jumps to).
+
+    Recording gives up on anything without a template (calls, PUSH/STORE, ops other than the
+    NUMBER/INT arithmetic and compares), on mixed operand types, on an inner loop and after
+    TRACE_MAX_LENGTH instructions. The JUMP then stops counting for good.
+*/
+
+#define TRACE_DEFAULT_THRESHOLD 100  // iterations before a loop is traced
+#define TRACE_MAX_LENGTH 512        // instructions recorded for one iteration
+
+typedef struct jit_trace_s {
+    uint8_t *code;
+    size_t mapped_size;
+    struct jit_trace_s *next; // the other traces of the block
+} jit_trace_t;
+
+#ifdef VM_JIT
+
+// records the loop closed by the JUMP at block->code[jump_slot] from the state at its header,
+// the trace is owned by the block. NULL if the loop cannot be traced.
+jit_trace_t* trace_record(block_t *block, size_t jump_slot, const type_t *locals);
+
+#endif // VM_JIT
+
+// releases the traces of the block, the JUMPs that enter them must not run anymore
+void block_free_traces(block_t *block);
+
+
+
+#endif // TRACE_H
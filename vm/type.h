@@ -24,11 +24,96 @@ typedef union /* type_u */ {
     const char* str_literal_u;
 } type_u;
 
+
+/*
+    Value representation
+
+    By default a value is a tagged struct (16 bytes). Building with -DNAN_BOXING packs every
+    value into 8 bytes instead:
+
+        double          stored as is (any bit pattern below NANBOX_BOXED_MIN)
+        anything else   0xFFF8 | tag (bits 47-50) | payload (bits 0-46)
+
+    where the tag is the value's Type (never NUMBER). INT payloads are 47-bit two's
+    complement, pointers and string literals must fit in 47 bits (user space on x86-64).
+    Computed NaNs are canonicalized by make_number so they can never look like a tag.
+
+    Code outside this header must only touch values through type_of/as_ and make_ below.
+*/
+
+#ifdef NAN_BOXING
+
+typedef uint64_t type_t;
+
+#define NANBOX_BASE         0xFFF8000000000000ULL
+#define NANBOX_BOXED_MIN    0xFFF8800000000000ULL
+#define NANBOX_TAG_SHIFT    47
+#define NANBOX_PAYLOAD_MASK 0x00007FFFFFFFFFFFULL
+
+// the INTs a value holds as they are
+#define INT_VALUE_MIN       (-((int64_t)1 << 46))
+#define INT_VALUE_MAX       (((int64_t)1 << 46) - 1)
+
+_Static_assert(sizeof(type_t) == 8, "NaN boxed values must be 8 bytes");
+
+static inline type_t nanbox(Type tag, uint64_t payload) {
+    return NANBOX_BASE | ((uint64_t)tag << NANBOX_TAG_SHIFT) | (payload & NANBOX_PAYLOAD_MASK);
+}
+
+static inline Type type_of(type_t v) {
+    return v >= NANBOX_BOXED_MIN ? (Type)((v >> NANBOX_TAG_SHIFT) & 0xF) : NUMBER;
+}
+
+static inline double as_number(type_t v) {
+    union { uint64_t u; double d; } pun = {.u = v};
+    return pun.d;
+}
+
+static inline int64_t as_int(type_t v) {
+    return (int64_t)(v << (64 - NANBOX_TAG_SHIFT)) >> (64 - NANBOX_TAG_SHIFT);
+}
+
+static inline bool as_bool(type_t v) { return v & 1; }
+static inline void* as_ptr(type_t v) { return (void*)(uintptr_t)(v & NANBOX_PAYLOAD_MASK); }
+static inline const char* as_str_literal(type_t v) { return (const char*)as_ptr(v); }
+
+static inline type_t make_number(double d) {
+    union { double d; uint64_t u; } pun = {.d = d};
+    return pun.u >= NANBOX_BOXED_MIN ? NANBOX_BASE : pun.u;
+}
+
+static inline type_t make_int(int64_t i) { return nanbox(INT, (uint64_t)i); }
+static inline type_t make_bool(bool b) { return nanbox(BOOL, b); }
+static inline type_t make_ptr(Type type, void *p) { return nanbox(type, (uintptr_t)p); }
+static inline type_t make_str_literal(const char *s) { return nanbox(STRING_LITERAL, (uintptr_t)s); }
+static inline type_t make_none(void) { return nanbox(NONE, 0); }
+
+#else
+
 typedef struct /* type_t */ {
     Type type;
     type_u value;
 } type_t;
 
+#define INT_VALUE_MIN       INT64_MIN
+#define INT_VALUE_MAX       INT64_MAX
+
+static inline Type type_of(type_t v) { return v.type; }
+static inline double as_number(type_t v) { return v.value.float_u; }
+static inline int64_t as_int(type_t v) { return v.value.int_u; }
+static inline bool as_bool(type_t v) { return v.value.bool_u; }
+static inline void* as_ptr(type_t v) { return v.value.ptr_u; }
+static inline const char* as_str_literal(type_t v) { return v.value.str_literal_u; }
+
+static inline type_t make_number(double d) { return (type_t){.type = NUMBER, .value = {.float_u = d}}; }
+static inline type_t make_int(int64_t i) { return (type_t){.type = INT, .value = {.int_u = i}}; }
+static inline type_t make_bool(bool b) { return (type_t){.type = BOOL, .value = {.bool_u = b}}; }
+static inline type_t make_ptr(Type type, void *p) { return (type_t){.type = type, .value = {.ptr_u = p}}; }
+static inline type_t make_str_literal(const char *s) { return (type_t){.type = STRING_LITERAL, .value = {.str_literal_u = s}}; }
+static inline type_t make_none(void) { return (type_t){.type = NONE, .value = {0}}; }
+
+#endif // NAN_BOXING
+
 
 
-#endif // TYPE_H
\ No newline at end of file
+#endif // TYPE_H
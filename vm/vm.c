@@ -1,6 +1,13 @@
-
 #include "vm.h"
+#include "peephole.h"
+#include "reg.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
+#include "compact.h"
 #include "stdlib.h"
+#include <sys/mman.h>
+#include <unistd.h>
 
 
 static inline uint8_t read_u8(uint8_t *code, size_t *ip) {
@@ -14,19 +21,519 @@ static inline int read_i32(uint8_t *code, size_t *ip) {
     return v;
 }
 
-void vm_run(vm_t *vm, block_t *main_block) {
-    block_t *block = main_block;
-    type_t main_locals[block->local_count];
-    frame_t main_frame = {.block = block, .locals = main_locals, .ip = 0};
+// where the operands of a specialized handler come from, see the handlers in vm_run
+enum {
+    NUM_FORM_STACK,             // quickened CALL_OP
+    NUM_FORM_LOCAL,             // CALL_OP_LOCAL
+    NUM_FORM_CONST,             // CALL_OP_CONST
+    NUM_FORM_LOCAL_CONST,       // CALL_OP_LOCAL_CONST
+    NUM_FORM_JUMP,              // CMP_JUMP_FALSE
+    NUM_FORM_LOCAL_CONST_JUMP,  // CMP_LOCAL_CONST_JUMP_FALSE
 
-    frame_slice_t stack_frames;
-    frame_init(&stack_frames, block->local_count, NULL);
-    frame_push(&stack_frames, main_frame);
+    NUM_FORMS,
+};
 
-    type_t *locals = main_locals;
-    size_t ip = 0;
+#define TH_NUM_BINARY(OP, name, operator, make, int_make) \
+    TH_##OP##_NUM, TH_##OP##_LOCAL_NUM, TH_##OP##_CONST_NUM, TH_##OP##_LOCAL_CONST_NUM,
+#define TH_NUM_JUMP(OP, name, operator, make, int_make) \
+    TH_##OP##_JUMP_NUM, TH_##OP##_LOCAL_CONST_JUMP_NUM,
+#define TH_NUM_TYPED(OP, name, operator, make, int_make) \
+    TH_##OP##_INT, TH_##OP##_NUMBER,
+#define TH_NUM_COUNTED(OP, name, operator, make, int_make) \
+    TH_##OP##_INC_JUMP_NUM, TH_##OP##_DEC_JUMP_NUM,
+
+// threaded code handlers that have no bytecode of their own,
+// CALL_FUNC and TAIL_CALL are split by function location (in CF_ order) so vm_run never switches on it.
+enum {
+    TH_CALL_FUNC_CONSTANT = BYTECODE_COUNT,
+    TH_CALL_FUNC_LOCAL,
+    TH_CALL_FUNC_GLOBAL,
+    TH_TAIL_CALL_CONSTANT,
+    TH_TAIL_CALL_LOCAL,
+    TH_TAIL_CALL_GLOBAL,
+
+    // backward JUMP, counts loop iterations (see trace.h)
+    TH_LOOP_JUMP,
+
+    // quickened CALL_OP (see op_call_op in vm_run) and NUMBER/INT specialized superinstructions
+    TH_CALL_OP_GENERIC,
+    NUM_ARITH_OPS(TH_NUM_BINARY)
+    NUM_COMPARE_OPS(TH_NUM_BINARY)
+    NUM_COMPARE_OPS(TH_NUM_JUMP)
+
+    // CALL_OP_INT/CALL_OP_NUMBER, no type checks
+    NUM_ARITH_OPS(TH_NUM_TYPED)
+    NUM_COMPARE_OPS(TH_NUM_TYPED)
+
+    // INC_LOCAL_CMP_JUMP/DEC_LOCAL_CMP_JUMP, NUMBER/INT specialized and entering a trace
+    NUM_COMPARE_OPS(TH_NUM_COUNTED)
+    TH_INC_TRACE_JUMP,
+    TH_DEC_TRACE_JUMP,
+
+    TH_COUNT,
+};
+
+#define NUM_ARITH_ROW(OP, name, operator, make, int_make) \
+    [OP_##OP] = {TH_##OP##_NUM, TH_##OP##_LOCAL_NUM, TH_##OP##_CONST_NUM, TH_##OP##_LOCAL_CONST_NUM},
+#define NUM_COMPARE_ROW(OP, name, operator, make, int_make) \
+    [OP_##OP] = {TH_##OP##_NUM, TH_##OP##_LOCAL_NUM, TH_##OP##_CONST_NUM, TH_##OP##_LOCAL_CONST_NUM, \
+                 TH_##OP##_JUMP_NUM, TH_##OP##_LOCAL_CONST_JUMP_NUM},
+
+// NUMBER/INT specialized handler of an op in each form, 0 if there is none
+static const int num_handler[Op_unary][NUM_FORMS] = {
+    NUM_ARITH_OPS(NUM_ARITH_ROW)
+    NUM_COMPARE_OPS(NUM_COMPARE_ROW)
+};
+
+#define NUM_TYPED_ROW(OP, name, operator, make, int_make) \
+    [OP_##OP] = {TH_##OP##_INT, TH_##OP##_NUMBER},
+
+// unchecked handler of an op for CALL_OP_INT and CALL_OP_NUMBER, 0 if there is none
+static const int typed_handler[Op_unary][2] = {
+    NUM_ARITH_OPS(NUM_TYPED_ROW)
+    NUM_COMPARE_OPS(NUM_TYPED_ROW)
+};
+
+#define NUM_COUNTED_ROW(OP, name, operator, make, int_make) \
+    [OP_##OP] = {TH_##OP##_INC_JUMP_NUM, TH_##OP##_DEC_JUMP_NUM},
+
+// specialized handler of a compare for INC_LOCAL_CMP_JUMP and DEC_LOCAL_CMP_JUMP, 0 if there is none
+static const int counted_handler[Op_unary][2] = {
+    NUM_COMPARE_OPS(NUM_COUNTED_ROW)
+};
+
+static const int superinstruction_form[BYTECODE_COUNT] = {
+    [CALL_OP_LOCAL] = NUM_FORM_LOCAL,
+    [CALL_OP_CONST] = NUM_FORM_CONST,
+    [CALL_OP_LOCAL_CONST] = NUM_FORM_LOCAL_CONST,
+    [CMP_JUMP_FALSE] = NUM_FORM_JUMP,
+    [CMP_LOCAL_CONST_JUMP_FALSE] = NUM_FORM_LOCAL_CONST_JUMP,
+};
+
+#ifdef VM_PROFILE
+#define NUM_BINARY_NAMES(OP, name, operator, make, int_make) \
+    [TH_##OP##_NUM] = #OP "_NUM", [TH_##OP##_LOCAL_NUM] = #OP "_LOCAL_NUM", \
+    [TH_##OP##_CONST_NUM] = #OP "_CONST_NUM", [TH_##OP##_LOCAL_CONST_NUM] = #OP "_LOCAL_CONST_NUM",
+#define NUM_JUMP_NAMES(OP, name, operator, make, int_make) \
+    [TH_##OP##_JUMP_NUM] = #OP "_JUMP_NUM", [TH_##OP##_LOCAL_CONST_JUMP_NUM] = #OP "_LOCAL_CONST_JUMP_NUM",
+#define NUM_TYPED_NAMES(OP, name, operator, make, int_make) \
+    [TH_##OP##_INT] = #OP "_INT", [TH_##OP##_NUMBER] = #OP "_NUMBER",
+#define NUM_COUNTED_NAMES(OP, name, operator, make, int_make) \
+    [TH_##OP##_INC_JUMP_NUM] = #OP "_INC_JUMP_NUM", [TH_##OP##_DEC_JUMP_NUM] = #OP "_DEC_JUMP_NUM",
+
+// names of the dispatch table entries for the profile report (see profile.h)
+static const char *const handler_names[TH_COUNT] = {
+    [HALT] = "HALT",
+    [PUSH_CONST] = "PUSH_CONST",
+    [PUSH_LOCAL] = "PUSH_LOCAL",
+    [STORE_LOCAL] = "STORE_LOCAL",
+    [PUSH] = "PUSH",
+    [STORE] = "STORE",
+    [POP] = "POP",
+    [CALL_OP] = "CALL_OP",
+    [JUMP] = "JUMP",
+    [JUMP_FALSE] = "JUMP_FALSE",
+    [CALL_C_FUNC] = "CALL_C_FUNC",
+    [CALL_FUNC] = "CALL_FUNC",
+    [TAIL_CALL] = "TAIL_CALL",
+    [RETURN] = "RETURN",
+    [INC_LOCAL] = "INC_LOCAL",
+    [DEC_LOCAL] = "DEC_LOCAL",
+    [CALL_OP_LOCAL] = "CALL_OP_LOCAL",
+    [CALL_OP_CONST] = "CALL_OP_CONST",
+    [CALL_OP_LOCAL_CONST] = "CALL_OP_LOCAL_CONST",
+    [CMP_JUMP_FALSE] = "CMP_JUMP_FALSE",
+    [CMP_LOCAL_CONST_JUMP_FALSE] = "CMP_LOCAL_CONST_JUMP_FALSE",
+    [CALL_OP_INT] = "CALL_OP_INT",
+    [CALL_OP_NUMBER] = "CALL_OP_NUMBER",
+    [INC_LOCAL_CMP_JUMP] = "INC_LOCAL_CMP_JUMP",
+    [DEC_LOCAL_CMP_JUMP] = "DEC_LOCAL_CMP_JUMP",
+
+    [TH_CALL_FUNC_CONSTANT] = "CALL_FUNC_CONSTANT",
+    [TH_CALL_FUNC_LOCAL] = "CALL_FUNC_LOCAL",
+    [TH_CALL_FUNC_GLOBAL] = "CALL_FUNC_GLOBAL",
+    [TH_TAIL_CALL_CONSTANT] = "TAIL_CALL_CONSTANT",
+    [TH_TAIL_CALL_LOCAL] = "TAIL_CALL_LOCAL",
+    [TH_TAIL_CALL_GLOBAL] = "TAIL_CALL_GLOBAL",
+    [TH_LOOP_JUMP] = "LOOP_JUMP",
+
+    [TH_CALL_OP_GENERIC] = "CALL_OP_GENERIC",
+    NUM_ARITH_OPS(NUM_BINARY_NAMES)
+    NUM_COMPARE_OPS(NUM_BINARY_NAMES)
+    NUM_COMPARE_OPS(NUM_JUMP_NAMES)
+    NUM_ARITH_OPS(NUM_TYPED_NAMES)
+    NUM_COMPARE_OPS(NUM_TYPED_NAMES)
+    NUM_COMPARE_OPS(NUM_COUNTED_NAMES)
+    [TH_INC_TRACE_JUMP] = "INC_TRACE_JUMP",
+    [TH_DEC_TRACE_JUMP] = "DEC_TRACE_JUMP",
+};
+
+#undef NUM_BINARY_NAMES
+#undef NUM_JUMP_NAMES
+#undef NUM_TYPED_NAMES
+#undef NUM_COUNTED_NAMES
+#endif // VM_PROFILE
+
+#undef TH_NUM_BINARY
+#undef TH_NUM_JUMP
+#undef TH_NUM_TYPED
+#undef TH_NUM_COUNTED
+#undef NUM_ARITH_ROW
+#undef NUM_COMPARE_ROW
+#undef NUM_TYPED_ROW
+#undef NUM_COUNTED_ROW
+
+static void translate_error(block_t *block, size_t ip, const char *msg) {
+    fprintf(stderr, "Invalid bytecode at offset %zu in block %p: %s\n", ip, (void*)block, msg);
+    exit(EXIT_FAILURE);
+}
+
+static type_t* translate_constant(block_t *block, size_t ip, int index) {
+    if (index < 0 || (size_t)index >= block->constant_count)
+        translate_error(block, ip, "constant index out of range");
+    return &block->constants[index];
+}
+
+static vm_slot_t* translate_target(block_t *block, size_t ip, vm_slot_t *code, const int32_t *slot_of, size_t size, int target) {
+    if (target < 0 || (size_t)target > size || slot_of[target] < 0)
+        translate_error(block, ip, "jump target is not an instruction");
+    return code + slot_of[target];
+}
+
+// translates block->instructions into block->code (see "Threaded code" in vm.h).
+// handlers is vm_run's dispatch table, indexed by Bytecode and the TH_ values above.
+static void translate_block(block_t *block, void *const *handlers) {
+    block_expand_compact(block);
+
+    size_t size;
+    uint8_t *optimized = peephole_optimize(block->instructions, block->instruction_size, &size);
+    uint8_t *instructions = optimized ? optimized : block->instructions;
+    if (!optimized) size = block->instruction_size;
+
+    // first pass: slot index of every instruction start, -1 inside operands
+    int32_t *slot_of = malloc((size + 1) * sizeof(int32_t));
+    if (!slot_of) {
+        fprintf(stderr, "Failed to allocate memory for threaded code\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i <= size; i++) slot_of[i] = -1;
+
+    size_t slots = 0;
+    for (size_t ip = 0; ip < size;) {
+        if (instructions[ip] >= BYTECODE_COUNT || !handlers[instructions[ip]])
+            translate_error(block, ip, "unsupported opcode");
+
+        size_t len = bytecode_checked_length(instructions, ip, size);
+        if (!len) translate_error(block, ip, "truncated instruction");
+
+        slot_of[ip] = (int32_t)slots;
+        slots += slot_count(instructions, ip);
+        ip += len;
+    }
+    slot_of[size] = (int32_t)slots;
+    slots++; // trailing HALT
 
-    static void *dispatch_table[] = {
+    vm_slot_t *code = malloc(slots * sizeof(vm_slot_t));
+    if (!code) {
+        fprintf(stderr, "Failed to allocate memory for threaded code\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // second pass: handler addresses and decoded operands
+    vm_slot_t *out = code;
+    for (size_t ip = 0; ip < size;) {
+        size_t start = ip;
+        uint8_t op = read_u8(instructions, &ip);
+
+        switch (op) {
+            case PUSH_CONST:
+                (out++)->handler = handlers[op];
+                (out++)->constant = translate_constant(block, start, read_i32(instructions, &ip));
+                break;
+            case JUMP: {
+                vm_slot_t *handler = out++;
+                (out++)->target = translate_target(block, start, code, slot_of, size, read_i32(instructions, &ip));
+                (out++)->count = 0;
+                handler->handler = handlers[out[-2].target <= handler ? TH_LOOP_JUMP : JUMP];
+                break;
+            }
+            case JUMP_FALSE:
+                (out++)->handler = handlers[op];
+                (out++)->target = translate_target(block, start, code, slot_of, size, read_i32(instructions, &ip));
+                break;
+            case CALL_FUNC:
+            case TAIL_CALL: {
+                uint8_t location = read_u8(instructions, &ip);
+                int first = op == TAIL_CALL ? TH_TAIL_CALL_CONSTANT : TH_CALL_FUNC_CONSTANT;
+                switch (location) {
+                    case CF_CONSTANT:
+                        (out++)->handler = handlers[first + CF_CONSTANT];
+                        (out++)->constant = translate_constant(block, start, read_i32(instructions, &ip));
+                        break;
+                    case CF_LOCAL:
+                        (out++)->handler = handlers[first + CF_LOCAL];
+                        (out++)->operand = read_i32(instructions, &ip);
+                        break;
+                    case CF_GLOBAL:
+                        (out++)->handler = handlers[first + CF_GLOBAL];
+                        (out++)->operand = read_i32(instructions, &ip);
+                        (out++)->operand = read_i32(instructions, &ip);
+                        break;
+                    default:
+                        translate_error(block, start, "unknown function location");
+                }
+                // inline cache, filled by the first call
+                (out++)->operand = read_i32(instructions, &ip); // argc
+                (out++)->block = NULL;
+                (out++)->operand = 0;
+                (out++)->operand = 0;
+                break;
+            }
+            case CALL_OP:
+                (out++)->handler = handlers[op];
+                (out++)->operand = read_u8(instructions, &ip);
+                break;
+            case CALL_OP_INT:
+            case CALL_OP_NUMBER: {
+                uint8_t binary_op = read_u8(instructions, &ip);
+                if (binary_op >= Op_unary) translate_error(block, start, "typed CALL_OP needs a binary op");
+                int typed = typed_handler[binary_op][op == CALL_OP_NUMBER];
+                (out++)->handler = handlers[typed ? typed : CALL_OP];
+                (out++)->operand = binary_op;
+                break;
+            }
+            case CALL_OP_LOCAL:
+            case CALL_OP_CONST:
+            case CALL_OP_LOCAL_CONST:
+            case CMP_JUMP_FALSE:
+            case CMP_LOCAL_CONST_JUMP_FALSE: {
+                // operands are laid out in slot order: [local][const] op [target]
+                int form = superinstruction_form[op];
+                vm_slot_t *handler = out++;
+
+                if (op == CALL_OP_LOCAL || op == CALL_OP_LOCAL_CONST || op == CMP_LOCAL_CONST_JUMP_FALSE)
+                    (out++)->operand = read_i32(instructions, &ip);
+                if (op == CALL_OP_CONST || op == CALL_OP_LOCAL_CONST || op == CMP_LOCAL_CONST_JUMP_FALSE)
+                    (out++)->constant = translate_constant(block, start, read_i32(instructions, &ip));
+
+                uint8_t binary_op = read_u8(instructions, &ip);
+                if (binary_op >= Op_unary) translate_error(block, start, "superinstruction needs a binary op");
+                (out++)->operand = binary_op;
+
+                if (form == NUM_FORM_JUMP || form == NUM_FORM_LOCAL_CONST_JUMP)
+                    (out++)->target = translate_target(block, start, code, slot_of, size, read_i32(instructions, &ip));
+
+                int specialized = num_handler[binary_op][form];
+                handler->handler = handlers[specialized ? specialized : op];
+                break;
+            }
+            case INC_LOCAL_CMP_JUMP:
+            case DEC_LOCAL_CMP_JUMP: {
+                vm_slot_t *handler = out++;
+                (out++)->operand = read_i32(instructions, &ip);
+                (out++)->constant = translate_constant(block, start, read_i32(instructions, &ip));
+                uint8_t binary_op = read_u8(instructions, &ip);
+                if (binary_op >= Op_unary) translate_error(block, start, "counted loop needs a binary op");
+                (out++)->operand = binary_op;
+                (out++)->target = translate_target(block, start, code, slot_of, size, read_i32(instructions, &ip));
+                (out++)->count = 0;
+
+                int specialized = counted_handler[binary_op][op == DEC_LOCAL_CMP_JUMP];
+                handler->handler = handlers[specialized ? specialized : op];
+                break;
+            }
+            default: {
+                (out++)->handler = handlers[op];
+                size_t operands = slot_count(instructions, start) - 1;
+                while (operands--) (out++)->operand = read_i32(instructions, &ip);
+                break;
+            }
+        }
+    }
+    (out++)->handler = handlers[HALT];
+
+    free(slot_of);
+    free(optimized);
+    block->code = code;
+    block->code_size = slots;
+    block_analyze_locals(block);
+}
+
+static inline int32_t local_operand(const uint8_t *code, size_t at) {
+    return BYTES4_TO_INT(code[at], code[at + 1], code[at + 2], code[at + 3]);
+}
+
+// the local read by the instruction at code[ip], -1 if it reads none
+static int32_t local_read(const uint8_t *code, size_t ip) {
+    switch (code[ip]) {
+        case PUSH_LOCAL: case INC_LOCAL: case DEC_LOCAL:
+        case CALL_OP_LOCAL: case CALL_OP_LOCAL_CONST: case CMP_LOCAL_CONST_JUMP_FALSE:
+        case INC_LOCAL_CMP_JUMP: case DEC_LOCAL_CMP_JUMP:
+            return local_operand(code, ip + 1);
+        case CALL_FUNC: case TAIL_CALL:
+            return code[ip + 1] == CF_LOCAL ? local_operand(code, ip + 2) : -1;
+        default:
+            return -1;
+    }
+}
+
+// true if some path from the entry reads local before a STORE_LOCAL writes it (or the code is malformed),
+// a call counts as a read: the callee may PUSH any local of this frame while it is suspended
+static bool read_before_write(const uint8_t *code, size_t size, int32_t local, bool *visited, size_t *worklist) {
+    memset(visited, 0, (size + 1) * sizeof(bool));
+    size_t pending = 0;
+    worklist[pending++] = 0;
+    visited[0] = true;
+
+    while (pending) {
+        size_t ip = worklist[--pending];
+        if (ip == size) continue;
+
+        size_t len = bytecode_checked_length(code, ip, size);
+        if (!len) return true;
+        if (local_read(code, ip) == local || code[ip] == CALL_FUNC || code[ip] == TAIL_CALL) return true;
+        if (code[ip] == STORE_LOCAL && local_operand(code, ip + 1) == local) continue;
+
+        size_t successors[2];
+        int count = 0;
+        if (code[ip] != JUMP && code[ip] != RETURN && code[ip] != HALT) successors[count++] = ip + len;
+
+        size_t operand = bytecode_jump_operand(code, ip);
+        if (operand) {
+            int32_t target = local_operand(code, operand);
+            if (target < 0 || (size_t)target > size) return true;
+            successors[count++] = target;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (visited[successors[i]]) continue;
+            visited[successors[i]] = true;
+            worklist[pending++] = successors[i];
+        }
+    }
+    return false;
+}
+
+void block_analyze_locals(block_t *block) {
+    size_t size = block->instruction_size;
+    bool *visited = malloc((size + 1) * sizeof(bool));
+    size_t *worklist = malloc((size + 1) * sizeof(size_t));
+    if (!visited || !worklist) {
+        fprintf(stderr, "Failed to allocate memory for threaded code\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t n = block->local_count;
+    while (n > 0 && !read_before_write(block->instructions, size, (int32_t)(n - 1), visited, worklist)) n--;
+    block->zero_locals = n;
+
+    free(visited);
+    free(worklist);
+}
+
+void block_free_code(block_t *block) {
+    block_free_jit(block);
+    block_free_traces(block);
+    block->calls = 0;
+    free(block->code);
+    block->code = NULL;
+    block->code_size = 0;
+    block_free_reg_code(block);
+
+    // instructions expanded from the compact encoding belong to the block
+    if (block->compact && block->instructions) {
+        free(block->instructions);
+        block->instructions = NULL;
+        block->instruction_size = 0;
+    }
+}
+
+void vm_stack_overflow(void) {
+    fprintf(stderr, "Stack overflow\n");
+    exit(EXIT_FAILURE);
+}
+
+void vm_init(vm_t *vm, size_t stack_capacity, size_t frame_capacity) {
+    if (stack_capacity == 0) stack_capacity = VM_STACK_DEFAULT_CAPACITY;
+    if (frame_capacity == 0) frame_capacity = VM_FRAME_DEFAULT_CAPACITY;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = (stack_capacity * sizeof(type_t) + page - 1) / page * page;
+
+    uint8_t *region = mmap(NULL, bytes + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED || mprotect(region + bytes, page, PROT_NONE) != 0) {
+        fprintf(stderr, "Failed to allocate memory for stack\n");
+        exit(EXIT_FAILURE);
+    }
+
+    vm->stack = (vm_stack_t){
+        .data = (type_t*)region,
+        .size = 0,
+        .capacity = bytes / sizeof(type_t),
+        .mapped_size = bytes + page,
+    };
+
+    vm->frames = malloc(frame_capacity * sizeof(frame_t));
+    if (!vm->frames) {
+        fprintf(stderr, "Failed to allocate memory for call frames\n");
+        exit(EXIT_FAILURE);
+    }
+    vm->frame_capacity = frame_capacity;
+    vm->frame_top = NULL;
+    vm->jit_threshold = JIT_DEFAULT_THRESHOLD;
+    vm->trace_threshold = TRACE_DEFAULT_THRESHOLD;
+}
+
+void vm_free(vm_t *vm) {
+    if (vm->stack.data) munmap(vm->stack.data, vm->stack.mapped_size);
+    vm->stack = (vm_stack_t){0};
+    free(vm->frames);
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
+}
+
+// fills the inline cache of a call site (see "Threaded code" in vm.h) for callee
+static block_t* resolve_call(vm_slot_t *cache, type_t callee, void *const *handlers) {
+    if (type_of(callee) != FUNCTION) {
+        fprintf(stderr, "Cannot call a value of type %d\n", type_of(callee));
+        exit(EXIT_FAILURE);
+    }
+
+    block_t *func = as_ptr(callee);
+    if (!func->code) translate_block(func, handlers);
+
+    int32_t argc = cache[0].operand;
+    if (argc < 0 || (size_t)argc > func->local_count) {
+        fprintf(stderr, "Block %p called with %d arguments but has %zu locals\n", (void*)func, argc, func->local_count);
+        exit(EXIT_FAILURE);
+    }
+
+    cache[1].block = func;
+    cache[2].operand = (int32_t)(func->local_count - argc);
+    cache[3].operand = func->zero_locals > (size_t)argc ? (int32_t)(func->zero_locals - argc) : 0;
+    return func;
+}
+
+#define NUM_BINARY_LABELS(OP, name, operator, make, int_make)                                 \
+    [TH_##OP##_NUM] = &&op_##name##_num,                                            \
+    [TH_##OP##_LOCAL_NUM] = &&op_##name##_local_num,                                \
+    [TH_##OP##_CONST_NUM] = &&op_##name##_const_num,                                \
+    [TH_##OP##_LOCAL_CONST_NUM] = &&op_##name##_local_const_num,
+
+#define NUM_JUMP_LABELS(OP, name, operator, make, int_make)                                   \
+    [TH_##OP##_JUMP_NUM] = &&op_##name##_jump_num,                                  \
+    [TH_##OP##_LOCAL_CONST_JUMP_NUM] = &&op_##name##_local_const_jump_num,
+
+#define NUM_TYPED_LABELS(OP, name, operator, make, int_make)                                  \
+    [TH_##OP##_INT] = &&op_##name##_int,                                            \
+    [TH_##OP##_NUMBER] = &&op_##name##_number,
+
+#define NUM_COUNTED_LABELS(OP, name, operator, make, int_make)                                \
+    [TH_##OP##_INC_JUMP_NUM] = &&op_##name##_inc_jump_num,                          \
+    [TH_##OP##_DEC_JUMP_NUM] = &&op_##name##_dec_jump_num,
+
+void vm_run(vm_t *vm, block_t *main_block) {
+    static void *dispatch_table[TH_COUNT] = {
         [HALT] = &&op_halt,
         [PUSH_CONST] = &&op_push_const,
         [PUSH_LOCAL] = &&op_push_local,
@@ -38,147 +545,505 @@ void vm_run(vm_t *vm, block_t *main_block) {
         [JUMP] = &&op_jump,
         [JUMP_FALSE] = &&op_jump_false,
         [CALL_C_FUNC] = &&op_call_c_func,
-        [CALL_FUNC] = &&op_call_func,
+        [CALL_FUNC] = &&op_call_func_constant,
+        [TAIL_CALL] = &&op_tail_call_constant,
         [RETURN] = &&op_return,
         [INC_LOCAL] = &&op_inc_local,
         [DEC_LOCAL] = &&op_dec_local,
+        [CALL_OP_LOCAL] = &&op_call_op_local,
+        [CALL_OP_CONST] = &&op_call_op_const,
+        [CALL_OP_LOCAL_CONST] = &&op_call_op_local_const,
+        [CMP_JUMP_FALSE] = &&op_cmp_jump_false,
+        [CMP_LOCAL_CONST_JUMP_FALSE] = &&op_cmp_local_const_jump_false,
+        [CALL_OP_INT] = &&op_call_op,
+        [CALL_OP_NUMBER] = &&op_call_op,
+        [INC_LOCAL_CMP_JUMP] = &&op_inc_local_cmp_jump,
+        [DEC_LOCAL_CMP_JUMP] = &&op_dec_local_cmp_jump,
+
+        [TH_CALL_FUNC_CONSTANT] = &&op_call_func_constant,
+        [TH_CALL_FUNC_LOCAL] = &&op_call_func_local,
+        [TH_CALL_FUNC_GLOBAL] = &&op_call_func_global,
+        [TH_TAIL_CALL_CONSTANT] = &&op_tail_call_constant,
+        [TH_TAIL_CALL_LOCAL] = &&op_tail_call_local,
+        [TH_TAIL_CALL_GLOBAL] = &&op_tail_call_global,
+        [TH_LOOP_JUMP] = &&op_loop_jump,
+
+        [TH_CALL_OP_GENERIC] = &&op_call_op_generic,
+        NUM_ARITH_OPS(NUM_BINARY_LABELS)
+        NUM_COMPARE_OPS(NUM_BINARY_LABELS)
+        NUM_COMPARE_OPS(NUM_JUMP_LABELS)
+        NUM_ARITH_OPS(NUM_TYPED_LABELS)
+        NUM_COMPARE_OPS(NUM_TYPED_LABELS)
+        NUM_COMPARE_OPS(NUM_COUNTED_LABELS)
+#ifdef VM_JIT
+        [TH_INC_TRACE_JUMP] = &&op_inc_trace_jump,
+        [TH_DEC_TRACE_JUMP] = &&op_dec_trace_jump,
+#endif
     };
 
-    #define DISPATCH() goto *dispatch_table[block->instructions[ip++]]
+    // counts an entry into func and compiles it once it is hot
+    #ifdef VM_JIT
+    #define JIT_COUNT(func)                                                                     \
+        if (__builtin_expect(++(func)->calls == vm->jit_threshold, 0) && vm->jit_threshold)    \
+            jit_compile(func, &&op_jit_enter)
+    #else
+    #define JIT_COUNT(func) (void)0
+    #endif
+
+    block_t *block = main_block;
+    if (!block->code) translate_block(block, dispatch_table);
+    JIT_COUNT(block);
+
+    type_t main_locals[block->local_count];
+
+    frame_t *frames = vm->frames, *frames_end = vm->frames + vm->frame_capacity;
+    frame_t *fp = frames; // current frame
+    *fp = (frame_t){.block = block, .locals = main_locals, .ip = 0};
+    vm_set_frame_top(vm, fp);
+
+    type_t *locals = main_locals;
+    vm_slot_t *pc = block->code;
+
+    // shared by the CALL_FUNC/TAIL_CALL handlers
+    type_t callee;
+    // shared by the counted loop handlers, 1 for INC_LOCAL_CMP_JUMP and -1 for DEC_LOCAL_CMP_JUMP
+    int step;
+
+    #define OPERAND() ((pc++)->operand)
+    #ifdef VM_PROFILE
+    vm_profile_t profile;
+    bool profiling = profile_enabled();
+    if (profiling) {
+        profile_init(&profile);
+        for (size_t i = 0; i < TH_COUNT; i++) profile_handler(&profile, dispatch_table[i], handler_names[i]);
+        #ifdef VM_JIT
+        profile_handler(&profile, &&op_jit_enter, "JIT_ENTER");
+        profile_handler(&profile, &&op_trace_jump, "TRACE_JUMP");
+        #endif
+    }
+
+    #define DISPATCH() do {                                                     \
+        if (profiling) profile_dispatch(&profile, pc->handler, block);           \
+        goto *(pc++)->handler;                                                  \
+    } while (0)
+    #else
+    #define DISPATCH() goto *(pc++)->handler
+    #endif
 
     DISPATCH();
 
     op_halt:
+    #ifdef VM_PROFILE
+        if (profiling) {
+            profile_report(&profile, stderr);
+            profile_free(&profile);
+        }
+    #endif
+        vm_set_frame_top(vm, NULL);
         return;
 
     op_push_const:
-        stack_push(&vm->stack, block->constants[read_i32(block->instructions, &ip)]);
+        vm_stack_push(&vm->stack, *(pc++)->constant);
         DISPATCH();
 
     op_push_local:
-        stack_push(&vm->stack, locals[read_i32(block->instructions, &ip)]);
+        vm_stack_push(&vm->stack, locals[OPERAND()]);
         DISPATCH();
 
     op_store_local:
-        locals[read_i32(block->instructions, &ip)] = stack_pop(&vm->stack);
+        locals[OPERAND()] = vm_stack_pop(&vm->stack);
         DISPATCH();
 
     op_push: {
-        type_t *ptr = stack_frames.data[read_i32(block->instructions, &ip)].locals;
-        stack_push(&vm->stack, ptr[read_i32(block->instructions, &ip)]);
+        type_t *ptr = frames[OPERAND()].locals;
+        vm_stack_push(&vm->stack, ptr[OPERAND()]);
         DISPATCH();
     }
 
     op_store: {
-        type_t *ptr = stack_frames.data[read_i32(block->instructions, &ip)].locals;
-        ptr[read_i32(block->instructions, &ip)] = stack_pop(&vm->stack);
+        type_t *ptr = frames[OPERAND()].locals;
+        ptr[OPERAND()] = vm_stack_pop(&vm->stack);
         DISPATCH();
     }
 
     op_pop:
-        stack_pop(&vm->stack);
+        vm_stack_pop(&vm->stack);
         DISPATCH();
 
+    // Quickening: the first execution of a CALL_OP rewrites its own handler slot into a
+    // type specialized one when both operands are NUMBER or both INT. The specialized handlers
+    // guard the operand types and on a miss deopt the site for good to op_call_op_generic.
     op_call_op: {
-        uint8_t op = read_u8(block->instructions, &ip);
-        type_t r = stack_pop(&vm->stack);
+        Op op = pc->operand;
+        if (op < Op_unary && num_handler[op][NUM_FORM_STACK]) {
+            type_t *top = &vm->stack.data[vm->stack.size - 2];
+            if ((type_of(top[0]) == NUMBER && type_of(top[1]) == NUMBER) ||
+                (type_of(top[0]) == INT && type_of(top[1]) == INT)) {
+                pc[-1].handler = dispatch_table[num_handler[op][NUM_FORM_STACK]];
+                goto *pc[-1].handler;
+            }
+        }
+        pc[-1].handler = &&op_call_op_generic;
+        goto op_call_op_generic;
+    }
+
+    op_call_op_deopt:
+        pc[-1].handler = &&op_call_op_generic;
+        // fall through
+    op_call_op_generic: {
+        Op op = OPERAND();
+        type_t r = vm_stack_pop(&vm->stack);
         type_t result;
         if (op > Op_unary) result = operation_unary(op, r);
         else {
-            type_t l = stack_pop(&vm->stack);
+            type_t l = vm_stack_pop(&vm->stack);
             result = operation(op, l, r);
         }
-        stack_push(&vm->stack, result);
+        vm_stack_push(&vm->stack, result);
+        DISPATCH();
+    }
+
+    // generic superinstructions, also the fallback of the specialized ones on a type miss
+    op_call_op_local: {
+        type_t *top = &vm->stack.data[vm->stack.size - 1];
+        type_t r = locals[OPERAND()];
+        *top = operation(OPERAND(), *top, r);
+        DISPATCH();
+    }
+
+    op_call_op_const: {
+        type_t *top = &vm->stack.data[vm->stack.size - 1];
+        type_t r = *(pc++)->constant;
+        *top = operation(OPERAND(), *top, r);
+        DISPATCH();
+    }
+
+    op_call_op_local_const: {
+        type_t l = locals[OPERAND()];
+        type_t r = *(pc++)->constant;
+        vm_stack_push(&vm->stack, operation(OPERAND(), l, r));
+        DISPATCH();
+    }
+
+    op_cmp_jump_false: {
+        Op op = OPERAND();
+        vm_slot_t *target = (pc++)->target;
+        type_t r = vm_stack_pop(&vm->stack);
+        type_t l = vm_stack_pop(&vm->stack);
+        if (!as_bool(operation(op, l, r))) pc = target;
+        DISPATCH();
+    }
+
+    op_cmp_local_const_jump_false: {
+        type_t l = locals[OPERAND()];
+        type_t r = *(pc++)->constant;
+        Op op = OPERAND();
+        vm_slot_t *target = (pc++)->target;
+        if (!as_bool(operation(op, l, r))) pc = target;
         DISPATCH();
     }
 
+    // NUMBER/INT specialized handlers, pc points at the first operand slot on entry
+    #define NUM_BINARY_HANDLERS(OP, name, operator, make, int_make)                                 \
+    op_##name##_num: {                                                                              \
+        type_t *top = &vm->stack.data[vm->stack.size - 2];                                          \
+        NUM_FAST_PATH(top[0], top[0], top[1], operator, make, int_make, op_call_op_deopt);          \
+        vm->stack.size--;                                                                           \
+        pc++;                                                                                       \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    op_##name##_local_num: {                                                                        \
+        type_t *top = &vm->stack.data[vm->stack.size - 1];                                          \
+        type_t r = locals[pc[0].operand];                                                           \
+        NUM_FAST_PATH(*top, *top, r, operator, make, int_make, op_call_op_local);                   \
+        pc += 2;                                                                                    \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    op_##name##_const_num: {                                                                        \
+        type_t *top = &vm->stack.data[vm->stack.size - 1];                                          \
+        type_t r = *pc[0].constant;                                                                 \
+        NUM_FAST_PATH(*top, *top, r, operator, make, int_make, op_call_op_const);                   \
+        pc += 2;                                                                                    \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    op_##name##_local_const_num: {                                                                  \
+        type_t l = locals[pc[0].operand], r = *pc[1].constant, result;                              \
+        NUM_FAST_PATH(result, l, r, operator, make, int_make, op_call_op_local_const);              \
+        vm_stack_push(&vm->stack, result);                                                          \
+        pc += 3;                                                                                    \
+        DISPATCH();                                                                                 \
+    }
+
+    #define NUM_JUMP_HANDLERS(OP, name, operator, make, int_make)                                   \
+    op_##name##_jump_num: {                                                                         \
+        type_t *top = &vm->stack.data[vm->stack.size - 2];                                          \
+        bool cond;                                                                                  \
+        NUM_FAST_CONDITION(cond, top[0], top[1], operator, op_cmp_jump_false);                      \
+        vm->stack.size -= 2;                                                                        \
+        pc = cond ? pc + 2 : pc[1].target;                                                          \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    op_##name##_local_const_jump_num: {                                                             \
+        type_t l = locals[pc[0].operand], r = *pc[1].constant;                                      \
+        bool cond;                                                                                  \
+        NUM_FAST_CONDITION(cond, l, r, operator, op_cmp_local_const_jump_false);                    \
+        pc = cond ? pc + 4 : pc[3].target;                                                          \
+        DISPATCH();                                                                                 \
+    }
+
+    // CALL_OP_INT/CALL_OP_NUMBER, the types are known so nothing is checked
+    #define NUM_TYPED_HANDLERS(OP, name, operator, make, int_make)                                  \
+    op_##name##_int: {                                                                              \
+        type_t *top = &vm->stack.data[vm->stack.size - 2];                                          \
+        top[0] = int_make(as_int(top[0]), operator, as_int(top[1]));                                \
+        vm->stack.size--;                                                                           \
+        pc++;                                                                                       \
+        DISPATCH();                                                                                 \
+    }                                                                                               \
+    op_##name##_number: {                                                                           \
+        type_t *top = &vm->stack.data[vm->stack.size - 2];                                          \
+        top[0] = make(as_number(top[0]) operator as_number(top[1]));                                \
+        vm->stack.size--;                                                                           \
+        pc++;                                                                                       \
+        DISPATCH();                                                                                 \
+    }
+
+    NUM_ARITH_OPS(NUM_BINARY_HANDLERS)
+    NUM_COMPARE_OPS(NUM_BINARY_HANDLERS)
+    NUM_COMPARE_OPS(NUM_JUMP_HANDLERS)
+    // INC_LOCAL_CMP_JUMP/DEC_LOCAL_CMP_JUMP, a miss only redoes the compare
+    #define NUM_COUNTED_HANDLERS(OP, name, operator, make, int_make)                                \
+    op_##name##_inc_jump_num:                                                                       \
+        step = 1;                                                                                   \
+        goto op_##name##_counted_num;                                                               \
+    op_##name##_dec_jump_num:                                                                       \
+        step = -1;                                                                                  \
+    op_##name##_counted_num: {                                                                      \
+        type_t *local = &locals[pc[0].operand];                                                     \
+        bool cond;                                                                                  \
+        *local = increment(*local, step);                                                           \
+        NUM_FAST_CONDITION(cond, *local, *pc[1].constant, operator, counted_compare);               \
+        if (cond) goto counted_loop;                                                                \
+        pc += 5;                                                                                    \
+        DISPATCH();                                                                                 \
+    }
+
+    NUM_ARITH_OPS(NUM_TYPED_HANDLERS)
+    NUM_COMPARE_OPS(NUM_TYPED_HANDLERS)
+    NUM_COMPARE_OPS(NUM_COUNTED_HANDLERS)
+
+    #undef NUM_BINARY_HANDLERS
+    #undef NUM_JUMP_HANDLERS
+    #undef NUM_TYPED_HANDLERS
+    #undef NUM_COUNTED_HANDLERS
+
     op_jump:
-        ip = read_i32(block->instructions, &ip);
+        pc = pc->target;
+        DISPATCH();
+
+    // pc is at [target][loop], a hot loop gets a trace or, if it cannot be traced, stops counting
+    op_loop_jump:
+#ifdef VM_JIT
+        if (__builtin_expect(++pc[1].count == vm->trace_threshold, 0) && vm->trace_threshold) {
+            jit_trace_t *trace = trace_record(block, pc - 1 - block->code, locals);
+            if (trace) pc[1].trace = trace;
+            pc[-1].handler = trace ? &&op_trace_jump : &&op_jump;
+        }
+#endif
+        pc = pc->target;
         DISPATCH();
 
+#ifdef VM_JIT
+    op_trace_jump:
+        pc = block->code + jit_enter(locals, &vm->stack, pc[1].trace->code);
+        DISPATCH();
+#endif
+
     op_jump_false: {
-        int target = read_i32(block->instructions, &ip);
-        if (!stack_pop(&vm->stack).value.bool_u) ip = target;
+        vm_slot_t *target = (pc++)->target;
+        if (!as_bool(vm_stack_pop(&vm->stack))) pc = target;
         DISPATCH();
     }
 
     op_call_c_func: {
-        BuiltinFunc func = read_i32(block->instructions, &ip);
-        int argc = read_i32(block->instructions, &ip);
-        type_t *argv = &vm->stack.data[vm->stack.size - argc];
-        type_t result = builtin_func(func, argc, argv);
-        while (argc--) stack_pop(&vm->stack);
-        stack_push(&vm->stack, result);
+        BuiltinFunc builtin = OPERAND();
+        int c_argc = OPERAND();
+        type_t *argv = &vm->stack.data[vm->stack.size - c_argc];
+        type_t result = builtin_func(builtin, c_argc, argv);
+        vm_stack_pop_n(&vm->stack, c_argc);
+        vm_stack_push(&vm->stack, result);
         DISPATCH();
     }
 
-    op_call_func: {
-        uint8_t func_location = read_u8(block->instructions, &ip);
-        type_t obj_type;
+    op_call_func_constant:
+        callee = *(pc++)->constant;
+        goto call_func;
 
-        switch (func_location) {
-            case CF_CONSTANT:
-                obj_type = block->constants[read_i32(block->instructions, &ip)];
-                break;
-            case CF_LOCAL:
-                obj_type = locals[read_i32(block->instructions, &ip)];
-                break;
-            case CF_GLOBAL: {
-                type_t *ptr = stack_frames.data[read_i32(block->instructions, &ip)].locals;
-                obj_type = ptr[read_i32(block->instructions, &ip)];
-                break;
-            }
-            default:
-                fprintf(stderr, "Unknown function location: %d\n", func_location);
-                exit(EXIT_FAILURE);
-        }
+    op_call_func_local:
+        callee = locals[OPERAND()];
+        goto call_func;
+
+    op_call_func_global: {
+        type_t *ptr = frames[OPERAND()].locals;
+        callee = ptr[OPERAND()];
+        goto call_func;
+    }
 
-        block_t *func = obj_type.value.ptr_u;
-        int argc = read_i32(block->instructions, &ip);
+    // pc is at the call site's inline cache: [argc][block][locals to push][locals to zero]
+    #define CALL_SITE_RESOLVE()                                                                         \
+        block_t *func = pc[1].block;                                                                    \
+        if (__builtin_expect(type_of(callee) != FUNCTION || as_ptr(callee) != func || !func->code, 0))  \
+            func = resolve_call(pc, callee, dispatch_table);                                            \
+        int32_t argc = pc[0].operand, push = pc[2].operand, zero = pc[3].operand;                       \
+        pc += 4
 
-        frame_t *caller = &stack_frames.data[stack_frames.size - 1];
-        caller->ip = ip;
-        caller->block = block;
-        caller->locals = locals;
-        caller->stack_base = vm->stack.size - argc;
+    call_func: {
+        CALL_SITE_RESOLVE();
+        if (__builtin_expect(fp + 1 == frames_end, 0)) vm_stack_overflow();
+        JIT_COUNT(func);
 
-        stack_push_n(&vm->stack, func->local_count - argc);
+        // locals of the caller never change while it runs, only where to resume does
+        size_t base = vm->stack.size - argc;
+        fp->ip = pc - block->code;
+        fp->stack_base = base;
 
-        frame_t callee = {
-            .block = func,
-            .locals = vm->stack.data + caller->stack_base,
-            .ip = 0,
-            .stack_base = caller->stack_base
-        };
+        vm_stack_push_n(&vm->stack, push);
+        locals = vm->stack.data + base;
+        if (zero) memset(&locals[argc], 0, zero * sizeof(type_t));
 
-        frame_push(&stack_frames, callee);
+        *++fp = (frame_t){.block = func, .locals = locals, .ip = 0, .stack_base = base};
+        vm_set_frame_top(vm, fp);
 
         block = func;
-        locals = callee.locals;
-        ip = 0;
+        pc = func->code;
         DISPATCH();
     }
 
+    op_tail_call_constant:
+        callee = *(pc++)->constant;
+        goto tail_call;
+
+    op_tail_call_local:
+        callee = locals[OPERAND()];
+        goto tail_call;
+
+    op_tail_call_global: {
+        type_t *ptr = frames[OPERAND()].locals;
+        callee = ptr[OPERAND()];
+        goto tail_call;
+    }
+
+    tail_call: {
+        // the outermost frame's locals are not on the vm stack, there is nothing to reuse
+        if (fp == frames) goto call_func;
+        CALL_SITE_RESOLVE();
+        JIT_COUNT(func);
+
+        // the arguments replace the current window, fp is reused in place
+        size_t base = locals - vm->stack.data;
+        memmove(locals, &vm->stack.data[vm->stack.size - argc], argc * sizeof(type_t));
+        vm->stack.size = base + argc;
+
+        vm_stack_push_n(&vm->stack, push);
+        if (zero) memset(&locals[argc], 0, zero * sizeof(type_t));
+
+        fp->block = func;
+        block = func;
+        pc = func->code;
+        DISPATCH();
+    }
+
+    #undef CALL_SITE_RESOLVE
+    #undef JIT_COUNT
+
     op_return: {
-        frame_pop(&stack_frames);
-        int frame_index = stack_frames.size - 1;
-        frame_t *caller_frame = &stack_frames.data[frame_index];
+        fp--;
+        vm_set_frame_top(vm, fp);
+
+        // the return value replaces the callee's window
+        vm->stack.data[fp->stack_base] = vm->stack.data[vm->stack.size - 1];
+        vm->stack.size = fp->stack_base + 1;
+
+        block = fp->block;
+        locals = fp->locals;
+        pc = block->code + fp->ip;
+        DISPATCH();
+    }
 
-        type_t return_value = stack_pop(&vm->stack);
-        stack_pop_n(&vm->stack, vm->stack.size - caller_frame->stack_base);
-        stack_push(&vm->stack, return_value);
+    op_inc_local: {
+        type_t *local = &locals[OPERAND()];
+        *local = increment(*local, 1);
+        DISPATCH();
+    }
 
-        ip = caller_frame->ip;
-        block = caller_frame->block;
-        locals = caller_frame->locals;
+    op_dec_local: {
+        type_t *local = &locals[OPERAND()];
+        *local = increment(*local, -1);
         DISPATCH();
     }
 
-    op_inc_local:
-        locals[read_i32(block->instructions, &ip)].value.float_u += 1;
+    // a counted loop's back edge, pc is at [local][constant][op][target][loop]
+    op_inc_local_cmp_jump:
+        step = 1;
+        goto counted_step;
+
+    op_dec_local_cmp_jump:
+        step = -1;
+        // fall through
+    counted_step:
+        locals[pc[0].operand] = increment(locals[pc[0].operand], step);
+        // fall through
+    counted_compare:
+        if (!as_bool(operation(pc[2].operand, locals[pc[0].operand], *pc[1].constant))) {
+            pc += 5;
+            DISPATCH();
+        }
+        // fall through
+    counted_loop:
+        // counts like a backward JUMP, a loop that cannot be traced tries again when the count wraps
+#ifdef VM_JIT
+        if (__builtin_expect(++pc[4].count == vm->trace_threshold, 0) && vm->trace_threshold) {
+            jit_trace_t *trace = trace_record(block, pc - 1 - block->code, locals);
+            if (trace) {
+                pc[4].trace = trace;
+                pc[-1].handler = step > 0 ? &&op_inc_trace_jump : &&op_dec_trace_jump;
+            }
+        }
+#endif
+        pc = pc[3].target;
         DISPATCH();
 
-    op_dec_local:
-        locals[read_i32(block->instructions, &ip)].value.float_u -= 1;
+#ifdef VM_JIT
+    // a traced counted loop: the step and the compare here, the iterations in the trace
+    op_inc_trace_jump:
+        step = 1;
+        goto counted_trace;
+
+    op_dec_trace_jump:
+        step = -1;
+        // fall through
+    counted_trace:
+        locals[pc[0].operand] = increment(locals[pc[0].operand], step);
+        if (!as_bool(operation(pc[2].operand, locals[pc[0].operand], *pc[1].constant))) {
+            pc += 5;
+            DISPATCH();
+        }
+        pc = block->code + jit_enter(locals, &vm->stack, pc[4].trace->code);
         DISPATCH();
+#endif
+
+#ifdef VM_JIT
+    // a compiled instruction: run native code until it exits, then the exit slot's own handler,
+    // the current one if vm_run rewrote it since (quickening, a trace installed by a loop)
+    op_jit_enter: {
+        jit_code_t *jit = block->jit;
+        size_t slot = jit_enter(locals, &vm->stack, jit->native[pc - 1 - block->code]);
+        void *handler = block->code[slot].handler;
+        pc = block->code + slot + 1;
+        goto *(handler == &&op_jit_enter ? jit->handlers[slot] : handler);
+    }
+#endif
+
+    #undef OPERAND
+    #undef DISPATCH
 }
@@ -1,7 +1,8 @@
 #ifndef VM_H
 #define VM_H
 
-#include "../data-structures/stack.h"
+#include <stdlib.h>
+#include <string.h>
 #include "builtin.h"
 
 
@@ -40,37 +41,278 @@
 
     CALL_FUNC
         [CALL_FUNC][byte (0 for constant 1 for local 2 for global)] [i32 stack_frames_index only if byte == 2] [i32 index][i32 argc]
+
+    INC_LOCAL/DEC_LOCAL
+        [INC_LOCAL][i32 index]
+
+    CALL_OP_INT/CALL_OP_NUMBER (binary op only)
+        [CALL_OP_INT][u8 op]
+        CALL_OP whose operands are both INT (both NUMBER) whenever it runs, which whoever
+        emits it guarantees: the ops of NUM_ARITH_OPS and NUM_COMPARE_OPS run without
+        checking the types, any other op like CALL_OP.
+
+    TAIL_CALL (CALL_FUNC then RETURN, the peephole pass fuses them)
+        [TAIL_CALL][byte location] [i32 stack_frames_index only if byte == 2] [i32 index][i32 argc]
+        the callee reuses the caller's frame and stack window. In the outermost frame it is
+        an ordinary CALL_FUNC and execution continues after it.
+
+    Superinstructions (binary op only, the left operand comes first):
+
+    CALL_OP_LOCAL                   PUSH_LOCAL, CALL_OP
+        [CALL_OP_LOCAL][i32 local_index][u8 op]
+
+    CALL_OP_CONST                   PUSH_CONST, CALL_OP
+        [CALL_OP_CONST][i32 const_index][u8 op]
+
+    CALL_OP_LOCAL_CONST             PUSH_LOCAL, PUSH_CONST, CALL_OP
+        [CALL_OP_LOCAL_CONST][i32 local_index][i32 const_index][u8 op]
+
+    CMP_JUMP_FALSE                  CALL_OP, JUMP_FALSE
+        [CMP_JUMP_FALSE][u8 op][i32 offset]
+
+    CMP_LOCAL_CONST_JUMP_FALSE      PUSH_LOCAL, PUSH_CONST, CALL_OP, JUMP_FALSE
+        [CMP_LOCAL_CONST_JUMP_FALSE][i32 local_index][i32 const_index][u8 op][i32 offset]
+
+    INC_LOCAL_CMP_JUMP              INC_LOCAL x, JUMP back to a CMP_LOCAL_CONST_JUMP_FALSE on x
+    DEC_LOCAL_CMP_JUMP              that leaves the loop right after the JUMP (same for DEC_LOCAL)
+        [INC_LOCAL_CMP_JUMP][i32 local_index][i32 const_index][u8 op][i32 offset]
+        increments (decrements) the local, then jumps to offset, the loop body right after
+        the header, while `local op constant` holds, and falls out of the loop otherwise.
+
+    compact.h describes a denser encoding of the same instructions (1 byte operands).
+*/
+
+/*
+    Threaded code:
+
+    vm_run never executes `instructions` directly. The first time a block is entered it is
+    translated into `code`, an array of slots where every instruction starts with the address
+    of its handler, followed by its operands already decoded:
+
+        PUSH_CONST      [handler][type_t *constant]
+        JUMP            [handler][vm_slot_t *target][loop]
+        INC_LOCAL_CMP_JUMP  [handler][i32 local][type_t *constant][op][vm_slot_t *target][loop]
+        JUMP_FALSE      [handler][vm_slot_t *target]
+        CALL_FUNC       [handler][type_t *constant][cache]              (CF_CONSTANT)
+                        [handler][i32 index][cache]                     (CF_LOCAL)
+                        [handler][i32 frame][i32 index][cache]          (CF_GLOBAL)
+        TAIL_CALL       same as CALL_FUNC
+        other           [handler][i32 operand]...   (same operands as the bytecode)
+
+    with constant indices turned into type_t pointers and jump offsets into slot pointers
+    for the superinstructions as well.
+
+    [loop] of a backward JUMP counts the iterations of its loop and later points to the
+    loop's trace (see trace.h), a forward JUMP leaves it alone. INC_LOCAL_CMP_JUMP and
+    DEC_LOCAL_CMP_JUMP always close a loop and count it the same way.
+
+    [cache] is the call site's monomorphic inline cache, [i32 argc][block_t *block]
+    [i32 locals to push][i32 locals to zero]. A call whose callee is the cached FUNCTION
+    goes straight to building the frame; on a miss (or the first call, or after
+    block_free_code on the callee) the callee is checked, translated and cached again. Before translating, the peephole pass fuses common
+    sequences into superinstructions on a private copy of `instructions`.
+
+    The translated code is appended with a HALT so a jump to `instruction_size` stays valid.
+    It is owned by the block, call block_free_code() to release it (also needed after
+    changing `instructions` of a block that already ran).
 */
 
-typedef struct /* block_t */ {
+typedef union vm_slot_u {
+    void *handler;
+    type_t *constant;
+    union vm_slot_u *target;
+    struct block_s *block;
+    struct jit_trace_s *trace;
+    int32_t operand;
+    uint32_t count;
+} vm_slot_t;
+
+typedef struct block_s {
     uint8_t *instructions;
     size_t instruction_size;
+    // compact encoding given instead of instructions (see compact.h)
+    const uint8_t *compact;
+    size_t compact_size;
     type_t *constants;
     size_t constant_count;
     size_t local_count;
+
+    vm_slot_t *code;
+    size_t code_size;
+
+    struct reg_code_s *reg_code; // register VM translation, see reg.h
+
+    struct jit_code_s *jit;         // native code, see jit.h
+    struct jit_trace_s *traces;     // native loops, see trace.h
+    uint32_t calls;         // times vm_run entered the block, for the jit threshold
+
+    // locals from this index up are written before they are read, and before any call (a
+    // callee may PUSH them), on every path, so a call only zeroes [argc, zero_locals).
+    // Set by block_analyze_locals.
+    size_t zero_locals;
 } block_t;
 
+// size in bytes of the instruction starting at code[ip] (opcode and operands)
+static inline size_t bytecode_length(const uint8_t *code, size_t ip) {
+    switch (code[ip]) {
+        case HALT: case POP: case RETURN:
+            return 1;
+        case CALL_OP: case CALL_OP_INT: case CALL_OP_NUMBER:
+            return 2;
+        case PUSH_CONST: case PUSH_LOCAL: case STORE_LOCAL:
+        case JUMP: case JUMP_FALSE: case INC_LOCAL: case DEC_LOCAL:
+            return 5;
+        case PUSH: case STORE: case CALL_C_FUNC:
+            return 9;
+        case CALL_FUNC: case TAIL_CALL:
+            return code[ip + 1] == CF_GLOBAL ? 14 : 10;
+        case CALL_OP_LOCAL: case CALL_OP_CONST: case CMP_JUMP_FALSE:
+            return 6;
+        case CALL_OP_LOCAL_CONST:
+            return 10;
+        case CMP_LOCAL_CONST_JUMP_FALSE: case INC_LOCAL_CMP_JUMP: case DEC_LOCAL_CMP_JUMP:
+            return 14;
+        default:
+            return 0;
+    }
+}
+
+// bytecode_length of the instruction at code[ip] of code of size bytes, 0 if it is unknown or
+// cut short (a call's kind byte is only read when it is there)
+static inline size_t bytecode_checked_length(const uint8_t *code, size_t ip, size_t size) {
+    if (ip >= size) return 0;
+    size_t len;
+    if (code[ip] == CALL_FUNC || code[ip] == TAIL_CALL) len = ip + 1 < size && code[ip + 1] == CF_GLOBAL ? 14 : 10;
+    else len = bytecode_length(code, ip);
+    return len <= size - ip ? len : 0;
+}
+
+// offset of the i32 jump target of the instruction at code[ip], 0 if it does not jump
+static inline size_t bytecode_jump_operand(const uint8_t *code, size_t ip) {
+    switch (code[ip]) {
+        case JUMP: case JUMP_FALSE: return ip + 1;
+        case CMP_JUMP_FALSE: return ip + 2;
+        case CMP_LOCAL_CONST_JUMP_FALSE: case INC_LOCAL_CMP_JUMP: case DEC_LOCAL_CMP_JUMP: return ip + 10;
+        default: return 0;
+    }
+}
+
+// number of threaded code slots of the instruction at code[ip]
+static inline size_t slot_count(const uint8_t *code, size_t ip) {
+    switch (code[ip]) {
+        case CALL_FUNC: case TAIL_CALL: return code[ip + 1] == CF_GLOBAL ? 7 : 6;
+        case CALL_C_FUNC: case PUSH: case STORE: return 3;
+        case HALT: case POP: case RETURN: return 1;
+        case JUMP: return 3;
+        case CALL_OP_LOCAL: case CALL_OP_CONST: case CMP_JUMP_FALSE: return 3;
+        case CALL_OP_LOCAL_CONST: return 4;
+        case CMP_LOCAL_CONST_JUMP_FALSE: return 5;
+        case INC_LOCAL_CMP_JUMP: case DEC_LOCAL_CMP_JUMP: return 6;
+        default: return 2;
+    }
+}
+
 typedef struct /* frame_t */ {
     block_t *block;
     type_t *locals;
-    size_t ip;
+    size_t ip; // slot index into block->code
     size_t stack_base;
 } frame_t;
 
-SLICE_TYPE(stack_slice_t, type_t)
-FUNCS_IMPL_INIT_PUSH_POP_FREE(stack, stack_slice_t, type_t)
 
-SLICE_TYPE(frame_slice_t, frame_t)
-FUNCS_IMPL_INIT_PUSH_POP_FREE(frame, frame_slice_t, frame_t)
+/*
+    VM stack
+
+    One region reserved when the vm is created and never resized or moved, so frame locals
+    pointing into it stay valid for the whole run. vm_init maps it with a PROT_NONE guard page
+    right above the top. Growing past the capacity is a "Stack overflow" error.
+
+    push/push_n check the capacity (one never-taken branch), pop/pop_n do not check anything:
+    well-formed bytecode never pops below the window of its frame.
+*/
+
+#define VM_STACK_DEFAULT_CAPACITY (1 << 20) // values, 8 or 16 MB depending on NAN_BOXING
+#define VM_FRAME_DEFAULT_CAPACITY (1 << 18) // call depth
+
+typedef struct /* vm_stack_t */ {
+    type_t *data;
+    size_t size;
+    size_t capacity;
+    size_t mapped_size; // bytes mapped including the guard page
+} vm_stack_t;
+
+void vm_stack_overflow(void) __attribute__((noreturn, cold));
+
+static inline void vm_stack_reserve(vm_stack_t *stack, size_t n) {
+    if (__builtin_expect(n > stack->capacity - stack->size, 0)) vm_stack_overflow();
+}
+
+static inline void vm_stack_push(vm_stack_t *stack, type_t item) {
+    vm_stack_reserve(stack, 1);
+    stack->data[stack->size++] = item;
+}
+
+// grows the stack by n values without initializing them
+static inline void vm_stack_push_n(vm_stack_t *stack, size_t n) {
+    vm_stack_reserve(stack, n);
+    stack->size += n;
+}
+
+static inline type_t vm_stack_pop(vm_stack_t *stack) {
+    return stack->data[--stack->size];
+}
+
+static inline void vm_stack_pop_n(vm_stack_t *stack, size_t n) {
+    stack->size -= n;
+}
+
+/*
+    Call frames
+
+    Frames live in one array reserved by vm_init next to the stack, frames[0] is the block
+    vm_run (or vm_run_reg) was given and frame i + 1 is the callee of frame i. PUSH/STORE and
+    CALL_FUNC CF_GLOBAL index this array directly. A call only writes the callee's frame_t
+    and the caller's resume ip, nothing is allocated per call or per run.
+    Calling deeper than frame_capacity is a "Stack overflow" error.
+
+    frame_top is the innermost frame of the running vm_run/vm_run_reg (NULL outside of them),
+    stored on every call and return so the sampling profiler (sample.h) can walk the frames
+    from a signal handler. Its ip is stale, the ip of every frame below it is where it resumes.
+*/
 
 typedef struct /* vm_t */ {
-    stack_slice_t stack;
+    vm_stack_t stack;
+
+    frame_t *frames;
+    size_t frame_capacity;
+    frame_t *volatile frame_top;
+
+    uint32_t jit_threshold;     // calls before vm_run compiles a block (see jit.h), 0 never
+    uint32_t trace_threshold;   // iterations before vm_run traces a loop (see trace.h), 0 never
 } vm_t;
 
+// publishes fp as the innermost frame, after everything written to the frames before it
+static inline void vm_set_frame_top(vm_t *vm, frame_t *fp) {
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    vm->frame_top = fp;
+}
+
+// reserves the stack and the frames (0 for VM_STACK_DEFAULT_CAPACITY/VM_FRAME_DEFAULT_CAPACITY),
+// the thresholds start at JIT_DEFAULT_THRESHOLD and TRACE_DEFAULT_THRESHOLD
+void vm_init(vm_t *vm, size_t stack_capacity, size_t frame_capacity);
+void vm_free(vm_t *vm);
+
+// sets block->zero_locals, called by the translators before a block first runs
+void block_analyze_locals(block_t *block);
+
 // for now the vm_run return void,
 // in the future it might return int for exit code or a value (like type_t/u for example).
 void vm_run(vm_t *vm, block_t *block);
 
+// releases the threaded code vm_run (and vm_run_reg) built for the block, including its
+// native code, the block itself is left untouched.
+void block_free_code(block_t *block);
+
 
 
 #endif // VM_H